@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <memory>
 #include <string>
 
 #include "Arguments.hh"
@@ -25,9 +27,59 @@ Options:\n\
   --color: Highlight differing bytes even if the output is not a TTY.\n\
   --no-color: Don't highlight differing bytes even if the output is a TTY.\n\
   --start-address=ADDR: Address the first byte as ADDR (hex) instead of 0.\n\
+  --threads=N: Use N threads to find differing regions of large files.\n\
+      (Default is the number of CPU cores)\n\
+  --aligned: Match blocks of data between the files instead of comparing\n\
+      bytes at the same offsets, so insertions, deletions and moved data are\n\
+      shown as such instead of as changes to all following data.\n\
+  --block-size=N: In aligned mode, the size of the blocks to match. Smaller\n\
+      blocks find shorter matches but use more memory. (Default 64)\n\
 \n");
 }
 
+// Holds the contents of an input file. Regular files are mapped into memory
+// (where supported) instead of read, so very large files can be compared.
+class InputData {
+public:
+  explicit InputData(const string& filename) {
+    if (filename == "-") {
+      this->contents = read_all(stdin);
+      return;
+    }
+#ifndef PHOSG_WINDOWS
+    if (S_ISREG(phosg::stat(filename).st_mode)) {
+      this->mapped = make_unique<MappedFile>(filename, true);
+      return;
+    }
+#endif
+    this->contents = load_file(filename);
+  }
+
+  const void* data() const {
+#ifndef PHOSG_WINDOWS
+    if (this->mapped) {
+      return this->mapped->data();
+    }
+#endif
+    return this->contents.data();
+  }
+
+  size_t size() const {
+#ifndef PHOSG_WINDOWS
+    if (this->mapped) {
+      return this->mapped->size();
+    }
+#endif
+    return this->contents.size();
+  }
+
+private:
+  string contents;
+#ifndef PHOSG_WINDOWS
+  unique_ptr<MappedFile> mapped;
+#endif
+};
+
 int main(int argc, char** argv) {
   Arguments args(argv, argc);
   if (args.get<bool>("help")) {
@@ -52,9 +104,17 @@ int main(int argc, char** argv) {
   size_t context_lines = args.get<size_t>("context", 3);
   uint64_t base_offset = args.get<uint64_t>("start-address", 0, phosg::Arguments::IntFormat::HEX);
 
-  string data1 = (filename1 == "-") ? read_all(stdin) : load_file(filename1);
-  string data2 = (filename2 == "-") ? read_all(stdin) : load_file(filename2);
+  size_t num_threads = args.get<size_t>("threads", 0);
+  bool aligned = args.get<bool>("aligned");
+  size_t block_size = args.get<size_t>("block-size", 0x40);
+
+  InputData data1(filename1);
+  InputData data2(filename2);
 
-  print_binary_diff(stdout, data1.data(), data1.size(), data2.data(), data2.size(), use_color, context_lines, base_offset);
+  if (aligned) {
+    print_aligned_binary_diff(stdout, data1.data(), data1.size(), data2.data(), data2.size(), use_color, context_lines, base_offset, block_size);
+  } else {
+    print_binary_diff(stdout, data1.data(), data1.size(), data2.data(), data2.size(), use_color, context_lines, base_offset, num_threads);
+  }
   return 0;
 }
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "Filesystem.hh"
+#include "Strings.hh"
+
+using namespace std;
+using namespace phosg;
+
+void print_usage() {
+  fwrite_fmt(stderr, "\
+Usage: decode-log [options] [infile]\n\
+\n\
+Converts a binary log written with AsyncLogOptions::binary_output to text.\n\
+If infile is - or not specified, read from standard input. The decoded log is\n\
+written to standard output.\n\
+\n\
+Options:\n\
+  --help: You're reading it now.\n\
+\n");
+}
+
+int main(int argc, char** argv) {
+  const char* src_filename = nullptr;
+  for (int x = 1; x < argc; x++) {
+    if (!strcmp(argv[x], "--help")) {
+      print_usage();
+      return 1;
+    } else if ((argv[x][0] == '-') && argv[x][1]) {
+      fwrite_fmt(stderr, "unknown argument: {}\n", argv[x]);
+      return 1;
+    } else if (!src_filename) {
+      src_filename = argv[x];
+    } else {
+      fwrite_fmt(stderr, "too many positional arguments given\n");
+      return 1;
+    }
+  }
+
+  auto src = fopen_shared(src_filename ? src_filename : "-", "rb", stdin);
+
+  BinaryLogDecoder decoder;
+  string pending;
+  string output;
+  char buf[0x10000];
+  for (;;) {
+    size_t bytes_read = fread(buf, 1, sizeof(buf), src.get());
+    if (bytes_read == 0) {
+      break;
+    }
+    pending.append(buf, bytes_read);
+    try {
+      pending.erase(0, decoder.decode(pending.data(), pending.size(), output));
+    } catch (const exception& e) {
+      fwrite_fmt(stderr, "cannot decode input: {}\n", e.what());
+      return 2;
+    }
+    fwritex(stdout, output);
+    output.clear();
+  }
+
+  if (!pending.empty()) {
+    fwrite_fmt(stderr, "warning: input ends with an incomplete record ({} bytes)\n", pending.size());
+  }
+  return 0;
+}
@@ -1,53 +1,551 @@
 #include "Encoding.hh"
 
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+#include <bit>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(PHOSG_ENABLE_NEON)
+#include <arm_neon.h>
+#endif
 
 using namespace std;
 
 namespace phosg {
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PHOSG_HAVE_X86_DISPATCH
+#elif defined(__aarch64__) && defined(PHOSG_ENABLE_NEON)
+// The NEON paths have not yet been tested on real hardware, so they're only
+// built if PHOSG_ENABLE_NEON is defined (cmake -DPHOSG_ENABLE_NEON=1)
+#define PHOSG_HAVE_NEON
+#endif
+
+// All of the bulk endian conversion functions are byte shuffles, so they share
+// one vector kernel and differ only in the shuffle mask. An index of 0xFF in a
+// mask produces a zero byte on both x86 and ARM. The masks for the load and
+// store functions assume the native byte order is little-endian; the masks for
+// the bswap functions don't depend on it. Bytes past the end of each block's
+// output are copied unchanged in the same-size masks, so that the kernel can
+// work in place (see shuffle_elements).
+static const uint8_t BSWAP16_MASK[16] = {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14};
+static const uint8_t BSWAP24_MASK[16] = {2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15};
+static const uint8_t BSWAP32_MASK[16] = {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12};
+static const uint8_t BSWAP48_MASK[16] = {5, 4, 3, 2, 1, 0, 11, 10, 9, 8, 7, 6, 12, 13, 14, 15};
+static const uint8_t BSWAP64_MASK[16] = {7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8};
+static const uint8_t LOAD_U24B_MASK[16] = {2, 1, 0, 0xFF, 5, 4, 3, 0xFF, 8, 7, 6, 0xFF, 11, 10, 9, 0xFF};
+static const uint8_t LOAD_U24L_MASK[16] = {0, 1, 2, 0xFF, 3, 4, 5, 0xFF, 6, 7, 8, 0xFF, 9, 10, 11, 0xFF};
+static const uint8_t LOAD_U48B_MASK[16] = {5, 4, 3, 2, 1, 0, 0xFF, 0xFF, 11, 10, 9, 8, 7, 6, 0xFF, 0xFF};
+static const uint8_t LOAD_U48L_MASK[16] = {0, 1, 2, 3, 4, 5, 0xFF, 0xFF, 6, 7, 8, 9, 10, 11, 0xFF, 0xFF};
+static const uint8_t STORE_U24B_MASK[16] = {2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, 0xFF, 0xFF, 0xFF, 0xFF};
+static const uint8_t STORE_U24L_MASK[16] = {0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 0xFF, 0xFF, 0xFF, 0xFF};
+static const uint8_t STORE_U48B_MASK[16] = {5, 4, 3, 2, 1, 0, 13, 12, 11, 10, 9, 8, 0xFF, 0xFF, 0xFF, 0xFF};
+static const uint8_t STORE_U48L_MASK[16] = {0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, 0xFF, 0xFF, 0xFF, 0xFF};
+
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+__attribute__((target("ssse3"))) static void shuffle_blocks_ssse3(
+    uint8_t* dest, size_t dest_step, const uint8_t* src, size_t src_step, size_t num_blocks, const uint8_t* mask) {
+  const __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask));
+  for (size_t z = 0; z < num_blocks; z++, dest += dest_step, src += src_step) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_shuffle_epi8(v, m));
+  }
+}
+#endif
+
+// Converts as many blocks of block_count elements as it can with the vector
+// kernel, and returns the number of elements converted; the caller converts
+// the rest. Each block reads and writes 16 bytes regardless of the element
+// widths, so this stops at the last block for which that stays within both
+// arrays. The extra bytes written after each block are then overwritten by
+// the next block or by the caller.
+static size_t shuffle_elements([[maybe_unused]] uint8_t* dest, [[maybe_unused]] size_t dest_width,
+    [[maybe_unused]] const uint8_t* src, [[maybe_unused]] size_t src_width, [[maybe_unused]] size_t count,
+    [[maybe_unused]] size_t block_count, [[maybe_unused]] const uint8_t* mask) {
+#if defined(PHOSG_HAVE_X86_DISPATCH) || defined(PHOSG_HAVE_NEON)
+  size_t dest_size = count * dest_width;
+  size_t src_size = count * src_width;
+  if ((dest_size < 16) || (src_size < 16)) {
+    return 0;
+  }
+  size_t dest_step = dest_width * block_count;
+  size_t src_step = src_width * block_count;
+  size_t num_blocks = min((dest_size - 16) / dest_step, (src_size - 16) / src_step) + 1;
+#endif
+
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+  if (!x86_features().ssse3) {
+    return 0;
+  }
+  shuffle_blocks_ssse3(dest, dest_step, src, src_step, num_blocks, mask);
+  return num_blocks * block_count;
+#elif defined(PHOSG_HAVE_NEON)
+  if (!IS_BIG_ENDIAN || (dest_width == src_width)) {
+    const uint8x16_t m = vld1q_u8(mask);
+    for (size_t z = 0; z < num_blocks; z++, dest += dest_step, src += src_step) {
+      vst1q_u8(dest, vqtbl1q_u8(vld1q_u8(src), m));
+    }
+    return num_blocks * block_count;
+  }
+  return 0;
+#else
+  return 0;
+#endif
+}
+
+void bswap16_array(void* vdest, const void* vsrc, size_t count) {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(vsrc);
+  for (size_t z = shuffle_elements(dest, 2, src, 2, count, 8, BSWAP16_MASK); z < count; z++) {
+    uint16_t v;
+    memcpy(&v, src + z * 2, 2);
+    v = bswap16(v);
+    memcpy(dest + z * 2, &v, 2);
+  }
+}
+
+void bswap24_array(void* vdest, const void* vsrc, size_t count) {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(vsrc);
+  for (size_t z = shuffle_elements(dest, 3, src, 3, count, 5, BSWAP24_MASK); z < count; z++) {
+    // The middle byte doesn't move
+    uint8_t first = src[z * 3];
+    dest[z * 3 + 1] = src[z * 3 + 1];
+    dest[z * 3] = src[z * 3 + 2];
+    dest[z * 3 + 2] = first;
+  }
+}
+
+void bswap32_array(void* vdest, const void* vsrc, size_t count) {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(vsrc);
+  for (size_t z = shuffle_elements(dest, 4, src, 4, count, 4, BSWAP32_MASK); z < count; z++) {
+    uint32_t v;
+    memcpy(&v, src + z * 4, 4);
+    v = bswap32(v);
+    memcpy(dest + z * 4, &v, 4);
+  }
+}
+
+void bswap48_array(void* vdest, const void* vsrc, size_t count) {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(vsrc);
+  for (size_t z = shuffle_elements(dest, 6, src, 6, count, 2, BSWAP48_MASK); z < count; z++) {
+    uint8_t v[6];
+    memcpy(v, src + z * 6, 6);
+    for (size_t x = 0; x < 6; x++) {
+      dest[z * 6 + x] = v[5 - x];
+    }
+  }
+}
+
+void bswap64_array(void* vdest, const void* vsrc, size_t count) {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(vsrc);
+  for (size_t z = shuffle_elements(dest, 8, src, 8, count, 2, BSWAP64_MASK); z < count; z++) {
+    uint64_t v;
+    memcpy(&v, src + z * 8, 8);
+    v = bswap64(v);
+    memcpy(dest + z * 8, &v, 8);
+  }
+}
+
+void load_u24b_array(uint32_t* dest, const void* vsrc, size_t count) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(vsrc);
+  for (size_t z = shuffle_elements(reinterpret_cast<uint8_t*>(dest), 4, src, 3, count, 4, LOAD_U24B_MASK); z < count; z++) {
+    const uint8_t* s = src + z * 3;
+    dest[z] = (s[0] << 16) | (s[1] << 8) | s[2];
+  }
+}
+
+void load_u24l_array(uint32_t* dest, const void* vsrc, size_t count) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(vsrc);
+  for (size_t z = shuffle_elements(reinterpret_cast<uint8_t*>(dest), 4, src, 3, count, 4, LOAD_U24L_MASK); z < count; z++) {
+    const uint8_t* s = src + z * 3;
+    dest[z] = (s[2] << 16) | (s[1] << 8) | s[0];
+  }
+}
+
+void load_u48b_array(uint64_t* dest, const void* vsrc, size_t count) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(vsrc);
+  for (size_t z = shuffle_elements(reinterpret_cast<uint8_t*>(dest), 8, src, 6, count, 2, LOAD_U48B_MASK); z < count; z++) {
+    uint64_t v = 0;
+    for (size_t x = 0; x < 6; x++) {
+      v = (v << 8) | src[z * 6 + x];
+    }
+    dest[z] = v;
+  }
+}
+
+void load_u48l_array(uint64_t* dest, const void* vsrc, size_t count) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(vsrc);
+  for (size_t z = shuffle_elements(reinterpret_cast<uint8_t*>(dest), 8, src, 6, count, 2, LOAD_U48L_MASK); z < count; z++) {
+    uint64_t v = 0;
+    for (size_t x = 0; x < 6; x++) {
+      v = (v << 8) | src[z * 6 + 5 - x];
+    }
+    dest[z] = v;
+  }
+}
+
+void store_u24b_array(void* vdest, const uint32_t* src, size_t count) {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  for (size_t z = shuffle_elements(dest, 3, reinterpret_cast<const uint8_t*>(src), 4, count, 4, STORE_U24B_MASK); z < count; z++) {
+    dest[z * 3] = src[z] >> 16;
+    dest[z * 3 + 1] = src[z] >> 8;
+    dest[z * 3 + 2] = src[z];
+  }
+}
+
+void store_u24l_array(void* vdest, const uint32_t* src, size_t count) {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  for (size_t z = shuffle_elements(dest, 3, reinterpret_cast<const uint8_t*>(src), 4, count, 4, STORE_U24L_MASK); z < count; z++) {
+    dest[z * 3] = src[z];
+    dest[z * 3 + 1] = src[z] >> 8;
+    dest[z * 3 + 2] = src[z] >> 16;
+  }
+}
+
+void store_u48b_array(void* vdest, const uint64_t* src, size_t count) {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  for (size_t z = shuffle_elements(dest, 6, reinterpret_cast<const uint8_t*>(src), 8, count, 2, STORE_U48B_MASK); z < count; z++) {
+    for (size_t x = 0; x < 6; x++) {
+      dest[z * 6 + x] = src[z] >> (40 - 8 * x);
+    }
+  }
+}
+
+void store_u48l_array(void* vdest, const uint64_t* src, size_t count) {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  for (size_t z = shuffle_elements(dest, 6, reinterpret_cast<const uint8_t*>(src), 8, count, 2, STORE_U48L_MASK); z < count; z++) {
+    for (size_t x = 0; x < 6; x++) {
+      dest[z * 6 + x] = src[z] >> (8 * x);
+    }
+  }
+}
+
 const char* DEFAULT_ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 const char* URLSAFE_ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
 
-string base64_encode(const void* vdata, size_t size, const char* alphabet) {
-  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+// The lookup tables needed to encode and decode with one alphabet. The tables
+// for the two predefined alphabets are built once; those for any other
+// alphabet are built on each call to the one-shot functions, or once per
+// Base64Encoder or Base64Decoder.
+struct Base64Alphabet {
+  static constexpr int8_t INVALID = -1;
+  static constexpr int8_t PADDING = -2;
 
-  if (!alphabet) {
-    alphabet = DEFAULT_ALPHABET;
+  const char* forward;
+  // Maps each character to its 6-bit value, or INVALID or PADDING
+  int8_t inverse[0x100];
+  // True if the alphabet begins with A-Z, a-z, and 0-9, as both predefined
+  // alphabets do. The x86 vector paths compute the mapping arithmetically
+  // instead of with a 64-entry lookup, so they only support these alphabets;
+  // the last two characters may be anything except letters, digits, and '='.
+  bool standard_layout;
+
+  explicit Base64Alphabet(const char* forward) : forward(forward) {
+    memset(this->inverse, INVALID, sizeof(this->inverse));
+    for (uint8_t x = 0; x < 0x40; x++) {
+      this->inverse[static_cast<uint8_t>(forward[x])] = x;
+    }
+    this->inverse[static_cast<uint8_t>('=')] = PADDING;
+
+    uint8_t c62 = forward[62];
+    uint8_t c63 = forward[63];
+    this->standard_layout = !memcmp(forward, DEFAULT_ALPHABET, 62) &&
+        !isalnum(c62) && !isalnum(c63) && (c62 != '=') && (c63 != '=') && (c62 != c63);
   }
 
-  string ret;
+  static const Base64Alphabet* predefined(const char* alphabet) {
+    if (!alphabet || !strcmp(alphabet, DEFAULT_ALPHABET)) {
+      static const Base64Alphabet default_alphabet(DEFAULT_ALPHABET);
+      return &default_alphabet;
+    }
+    if (!strcmp(alphabet, URLSAFE_ALPHABET)) {
+      static const Base64Alphabet urlsafe_alphabet(URLSAFE_ALPHABET);
+      return &urlsafe_alphabet;
+    }
+    return nullptr;
+  }
+
+  static shared_ptr<const Base64Alphabet> get(const char* alphabet) {
+    const Base64Alphabet* a = Base64Alphabet::predefined(alphabet);
+    if (a) {
+      // The predefined alphabets are never destroyed, so don't own them
+      return shared_ptr<const Base64Alphabet>(shared_ptr<const void>(), a);
+    }
+    return make_shared<const Base64Alphabet>(alphabet);
+  }
+};
+
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+
+// The vector functions below each process as many whole blocks as they can,
+// and return the number of input bytes consumed. The caller handles the rest
+// with the scalar implementation. The decoders stop early at the first block
+// that contains padding or an invalid character, so the scalar decoder will
+// find it and throw the appropriate exception.
+
+// Converts 6-bit values to characters. For standard-layout alphabets, each
+// range of values (0-25, 26-51, 52-61, 62, and 63) maps to a contiguous range
+// of characters, so this computes an index into shift_lut for each range, and
+// adds the value from shift_lut to the input.
+__attribute__((target("ssse3"))) static inline __m128i base64_values_to_chars_ssse3(__m128i values, __m128i shift_lut) {
+  __m128i lut_indexes = _mm_subs_epu8(values, _mm_set1_epi8(51));
+  lut_indexes = _mm_or_si128(lut_indexes, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), values), _mm_set1_epi8(13)));
+  return _mm_add_epi8(values, _mm_shuffle_epi8(shift_lut, lut_indexes));
+}
+
+__attribute__((target("avx2"))) static inline __m256i base64_values_to_chars_avx2(__m256i values, __m256i shift_lut) {
+  __m256i lut_indexes = _mm256_subs_epu8(values, _mm256_set1_epi8(51));
+  lut_indexes = _mm256_or_si256(lut_indexes, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), values), _mm256_set1_epi8(13)));
+  return _mm256_add_epi8(values, _mm256_shuffle_epi8(shift_lut, lut_indexes));
+}
+
+__attribute__((target("ssse3"))) static __m128i base64_shift_lut_ssse3(const Base64Alphabet& a) {
+  return _mm_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      static_cast<char>(a.forward[62] - 62), static_cast<char>(a.forward[63] - 63), 'A', 0, 0);
+}
+
+__attribute__((target("ssse3"))) static size_t base64_encode_ssse3(char* out, const uint8_t* data, size_t size, const Base64Alphabet& a) {
+  const __m128i shuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  const __m128i shift_lut = base64_shift_lut_ssse3(a);
+  size_t offset = 0;
+  // Each iteration reads 16 bytes, but only encodes the first 12
+  for (; offset + 16 <= size; offset += 12, out += 16) {
+    // Copy each 3-byte group into a 4-byte lane as [b1, b0, b2, b1], then
+    // shift each 6-bit field into its own byte
+    __m128i in = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset)), shuffle);
+    __m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+    __m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+    __m128i chars = base64_values_to_chars_ssse3(_mm_or_si128(hi, lo), shift_lut);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), chars);
+  }
+  return offset;
+}
+
+__attribute__((target("avx2"))) static size_t base64_encode_avx2(char* out, const uint8_t* data, size_t size, const Base64Alphabet& a) {
+  const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+  const __m256i shift_lut = _mm256_broadcastsi128_si256(base64_shift_lut_ssse3(a));
+  size_t offset = 0;
+  // Same as the SSSE3 version, but with 12 input bytes in each 128-bit lane
+  for (; offset + 28 <= size; offset += 24, out += 32) {
+    __m256i in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset + 12)), 1);
+    in = _mm256_shuffle_epi8(in, shuffle);
+    __m256i hi = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040));
+    __m256i lo = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010));
+    __m256i chars = base64_values_to_chars_avx2(_mm256_or_si256(hi, lo), shift_lut);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), chars);
+  }
+  return offset + base64_encode_ssse3(out, data + offset, size - offset, a);
+}
+
+// Writes the first 12 bytes of v, which hold the 12 bytes decoded from one
+// 16-character block
+static inline void base64_store_decoded_block(uint8_t* out, __m128i v) {
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(out), v);
+  uint32_t last = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+  memcpy(out + 8, &last, sizeof(last));
+}
+
+__attribute__((target("ssse3"))) static size_t base64_decode_ssse3(uint8_t* out, const uint8_t* data, size_t size, const Base64Alphabet& a) {
+  const char c62 = a.forward[62];
+  const char c63 = a.forward[63];
+  const __m128i compact = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  size_t offset = 0;
+  for (; offset + 16 <= size; offset += 16, out += 12) {
+    // Find which range each character is in, and add the corresponding offset
+    // to get its value. Characters 0x80 and above are negative in these
+    // comparisons, so they aren't in any range.
+    __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), in));
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), in));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), in));
+    __m128i is62 = _mm_cmpeq_epi8(in, _mm_set1_epi8(c62));
+    __m128i is63 = _mm_cmpeq_epi8(in, _mm_set1_epi8(c63));
+    __m128i valid = _mm_or_si128(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, is62)), is63);
+    if (_mm_movemask_epi8(valid) != 0xFFFF) {
+      break;
+    }
+    __m128i shift = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')), _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+        _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+            _mm_or_si128(_mm_and_si128(is62, _mm_set1_epi8(62 - c62)), _mm_and_si128(is63, _mm_set1_epi8(63 - c63)))));
+    __m128i values = _mm_add_epi8(in, shift);
+
+    // Merge pairs of 6-bit values into 12-bit values, then pairs of those into
+    // 24-bit values, then drop the high byte of each 32-bit lane
+    __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    base64_store_decoded_block(out, _mm_shuffle_epi8(packed, compact));
+  }
+  return offset;
+}
+
+__attribute__((target("avx2"))) static size_t base64_decode_avx2(uint8_t* out, const uint8_t* data, size_t size, const Base64Alphabet& a) {
+  const char c62 = a.forward[62];
+  const char c63 = a.forward[63];
+  const __m256i compact = _mm256_broadcastsi128_si256(
+      _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  size_t offset = 0;
+  for (; offset + 32 <= size; offset += 32, out += 24) {
+    __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset));
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), in));
+    __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), in));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), in));
+    __m256i is62 = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(c62));
+    __m256i is63 = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(c63));
+    __m256i valid = _mm256_or_si256(_mm256_or_si256(_mm256_or_si256(upper, lower), _mm256_or_si256(digit, is62)), is63);
+    if (static_cast<uint32_t>(_mm256_movemask_epi8(valid)) != 0xFFFFFFFF) {
+      break;
+    }
+    __m256i shift = _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-'A')), _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+        _mm256_or_si256(_mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+            _mm256_or_si256(_mm256_and_si256(is62, _mm256_set1_epi8(62 - c62)), _mm256_and_si256(is63, _mm256_set1_epi8(63 - c63)))));
+    __m256i values = _mm256_add_epi8(in, shift);
+    __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+    __m256i packed = _mm256_shuffle_epi8(_mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000)), compact);
+    base64_store_decoded_block(out, _mm256_castsi256_si128(packed));
+    base64_store_decoded_block(out + 12, _mm256_extracti128_si256(packed, 1));
+  }
+  return offset + base64_decode_ssse3(out, data + offset, size - offset, a);
+}
 
-  // encode blocks of 3 bytes first
+#elif defined(PHOSG_HAVE_NEON)
+
+// vld3/vst4 (and vld4/vst3 for decoding) do the deinterleaving, and the
+// 64-byte table lookup instructions do the mapping, so unlike the x86 versions
+// these work with any alphabet. See the x86 versions for the return values.
+
+static size_t base64_encode_neon(char* out, const uint8_t* data, size_t size, const Base64Alphabet& a) {
+  const uint8_t* forward = reinterpret_cast<const uint8_t*>(a.forward);
+  const uint8x16x4_t table = {{vld1q_u8(forward), vld1q_u8(forward + 16), vld1q_u8(forward + 32), vld1q_u8(forward + 48)}};
+  const uint8x16_t mask = vdupq_n_u8(0x3F);
+  size_t offset = 0;
+  for (; offset + 48 <= size; offset += 48, out += 64) {
+    uint8x16x3_t in = vld3q_u8(data + offset);
+    uint8x16x4_t chars;
+    chars.val[0] = vqtbl4q_u8(table, vshrq_n_u8(in.val[0], 2));
+    chars.val[1] = vqtbl4q_u8(table, vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), mask));
+    chars.val[2] = vqtbl4q_u8(table, vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), mask));
+    chars.val[3] = vqtbl4q_u8(table, vandq_u8(in.val[2], mask));
+    vst4q_u8(reinterpret_cast<uint8_t*>(out), chars);
+  }
+  return offset;
+}
+
+static size_t base64_decode_neon(uint8_t* out, const uint8_t* data, size_t size, const Base64Alphabet& a) {
+  // INVALID and PADDING are 0xFF and 0xFE here, so any value with either of
+  // the high two bits set is an error. Characters 0x80 and above aren't in
+  // either table, so they're checked separately.
+  const uint8_t* inverse = reinterpret_cast<const uint8_t*>(a.inverse);
+  const uint8x16x4_t table_lo = {{vld1q_u8(inverse), vld1q_u8(inverse + 16), vld1q_u8(inverse + 32), vld1q_u8(inverse + 48)}};
+  const uint8x16x4_t table_hi = {{vld1q_u8(inverse + 64), vld1q_u8(inverse + 80), vld1q_u8(inverse + 96), vld1q_u8(inverse + 112)}};
+  size_t offset = 0;
+  for (; offset + 64 <= size; offset += 64, out += 48) {
+    uint8x16x4_t in = vld4q_u8(data + offset);
+    uint8x16x4_t values;
+    uint8x16_t errors = vdupq_n_u8(0);
+    for (size_t z = 0; z < 4; z++) {
+      uint8x16_t v = vqtbl4q_u8(table_lo, in.val[z]);
+      values.val[z] = vqtbx4q_u8(v, table_hi, vsubq_u8(in.val[z], vdupq_n_u8(0x40)));
+      errors = vorrq_u8(errors, vorrq_u8(values.val[z], vandq_u8(in.val[z], vdupq_n_u8(0x80))));
+    }
+    if (vmaxvq_u8(errors) >= 0x40) {
+      break;
+    }
+    uint8x16x3_t bytes;
+    bytes.val[0] = vorrq_u8(vshlq_n_u8(values.val[0], 2), vshrq_n_u8(values.val[1], 4));
+    bytes.val[1] = vorrq_u8(vshlq_n_u8(values.val[1], 4), vshrq_n_u8(values.val[2], 2));
+    bytes.val[2] = vorrq_u8(vshlq_n_u8(values.val[2], 6), values.val[3]);
+    vst3q_u8(out, bytes);
+  }
+  return offset;
+}
+
+#endif
+
+size_t base64_encoded_size(size_t size) {
+  return ((size + 2) / 3) * 4;
+}
+
+static size_t base64_encode_into(void* vdest, const void* vdata, size_t size, const Base64Alphabet* a) {
+  char* out = reinterpret_cast<char*>(vdest);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  const char* forward = a->forward;
+
+  size_t offset = 0;
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+  if (a->standard_layout) {
+    if (x86_features().avx2) {
+      offset = base64_encode_avx2(out, data, size, *a);
+    } else if (x86_features().ssse3) {
+      offset = base64_encode_ssse3(out, data, size, *a);
+    }
+  }
+#elif defined(PHOSG_HAVE_NEON)
+  offset = base64_encode_neon(out, data, size, *a);
+#endif
+  out += (offset / 3) * 4;
+
+  // encode the remaining blocks of 3 bytes
   size_t end_offset = (size / 3) * 3;
-  for (size_t offset = 0; offset < end_offset; offset += 3) {
+  for (; offset < end_offset; offset += 3, out += 4) {
     // aaaaaabb bbbbcccc ccdddddd
     uint8_t c1 = data[offset];
     uint8_t c2 = data[offset + 1];
     uint8_t c3 = data[offset + 2];
-    ret.push_back(alphabet[(c1 >> 2) & 0x3F]);
-    ret.push_back(alphabet[((c1 << 4) & 0x30) | ((c2 >> 4) & 0x0F)]);
-    ret.push_back(alphabet[((c2 << 2) & 0x3C) | ((c3 >> 6) & 0x03)]);
-    ret.push_back(alphabet[c3 & 0x3F]);
+    out[0] = forward[(c1 >> 2) & 0x3F];
+    out[1] = forward[((c1 << 4) & 0x30) | ((c2 >> 4) & 0x0F)];
+    out[2] = forward[((c2 << 2) & 0x3C) | ((c3 >> 6) & 0x03)];
+    out[3] = forward[c3 & 0x3F];
   }
 
   if (size - end_offset == 2) {
     // aaaaaabb bbbbcccc ========
     uint8_t c1 = data[end_offset];
     uint8_t c2 = data[end_offset + 1];
-    ret.push_back(alphabet[(c1 >> 2) & 0x3F]);
-    ret.push_back(alphabet[((c1 << 4) & 0x30) | ((c2 >> 4) & 0x0F)]);
-    ret.push_back(alphabet[((c2 << 2) & 0x3C)]);
-    ret.push_back('=');
+    out[0] = forward[(c1 >> 2) & 0x3F];
+    out[1] = forward[((c1 << 4) & 0x30) | ((c2 >> 4) & 0x0F)];
+    out[2] = forward[((c2 << 2) & 0x3C)];
+    out[3] = '=';
+    out += 4;
   } else if (size - end_offset == 1) {
     // aaaaaabb ======== ========
     uint8_t c1 = data[end_offset];
-    ret.push_back(alphabet[(c1 >> 2) & 0x3F]);
-    ret.push_back(alphabet[((c1 << 4) & 0x30)]);
-    ret.push_back('=');
-    ret.push_back('=');
+    out[0] = forward[(c1 >> 2) & 0x3F];
+    out[1] = forward[((c1 << 4) & 0x30)];
+    out[2] = '=';
+    out[3] = '=';
+    out += 4;
   }
 
+  return out - reinterpret_cast<char*>(vdest);
+}
+
+size_t base64_encode_into(void* dest, const void* data, size_t size, const char* alphabet) {
+  const Base64Alphabet* a = Base64Alphabet::predefined(alphabet);
+  if (a) {
+    return base64_encode_into(dest, data, size, a);
+  }
+  Base64Alphabet custom_alphabet(alphabet);
+  return base64_encode_into(dest, data, size, &custom_alphabet);
+}
+
+string base64_encode(const void* data, size_t size, const char* alphabet) {
+  string ret(base64_encoded_size(size), '\0');
+  base64_encode_into(ret.data(), data, size, alphabet);
   return ret;
 }
 
@@ -55,68 +553,819 @@ string base64_encode(const string& data, const char* alphabet) {
   return base64_encode(data.data(), data.size(), alphabet);
 }
 
-string base64_decode(const void* vdata, size_t size, const char* alphabet) {
-  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
-
-  if (!alphabet) {
-    alphabet = DEFAULT_ALPHABET;
+size_t base64_decoded_size(const void* vdata, size_t size) {
+  const char* data = reinterpret_cast<const char*>(vdata);
+  if (size & 3) {
+    throw invalid_argument("size must be a multiple of 4 bytes");
+  }
+  size_t ret = (size >> 2) * 3;
+  if (size && (data[size - 1] == '=')) {
+    ret--;
+    if (data[size - 2] == '=') {
+      ret--;
+    }
   }
+  return ret;
+}
+
+static size_t base64_decode_into(void* vdest, const void* vdata, size_t size, const Base64Alphabet* a) {
+  uint8_t* out = reinterpret_cast<uint8_t*>(vdest);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
 
   // the length must be a multiple of 4
   if (size & 3) {
     throw invalid_argument("size must be a multiple of 4 bytes");
   }
 
-  // compute the inverse alphabet for easier decoding
-  // TODO: make this not happen every time, at least for the default alphabets
-  string inverse_alphabet(0x100, -1);
-  for (uint8_t x = 0; x < 0x40; x++) {
-    inverse_alphabet[alphabet[x]] = static_cast<char>(x);
+  const int8_t* inverse = a->inverse;
+
+  size_t offset = 0;
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+  if (a->standard_layout) {
+    if (x86_features().avx2) {
+      offset = base64_decode_avx2(out, data, size, *a);
+    } else if (x86_features().ssse3) {
+      offset = base64_decode_ssse3(out, data, size, *a);
+    }
   }
-  inverse_alphabet['='] = -0x80;
+#elif defined(PHOSG_HAVE_NEON)
+  offset = base64_decode_neon(out, data, size, *a);
+#endif
+  out += (offset >> 2) * 3;
 
-  // decode blocks of 4 bytes first
-  string ret;
-  size_t end_offset = size & (~3);
-  for (size_t offset = 0; offset < end_offset; offset += 4) {
+  // decode the remaining blocks of 4 characters
+  for (; offset < size; offset += 4) {
     // aaaaaabb bbbbcccc ccdddddd
-    uint8_t c1 = inverse_alphabet[data[offset]];
-    uint8_t c2 = inverse_alphabet[data[offset + 1]];
-    uint8_t c3 = inverse_alphabet[data[offset + 2]];
-    uint8_t c4 = inverse_alphabet[data[offset + 3]];
-
-    // TODO: this is pretty ugly; clean it up
-    if (c4 == 0x80) {
-      if (offset != end_offset - 4) {
-        throw invalid_argument("string contains padding not at the end");
+    int8_t c1 = inverse[data[offset]];
+    int8_t c2 = inverse[data[offset + 1]];
+    int8_t c3 = inverse[data[offset + 2]];
+    int8_t c4 = inverse[data[offset + 3]];
+
+    // INVALID and PADDING are both negative, so this checks all four at once
+    if ((c1 | c2 | c3 | c4) >= 0) {
+      out[0] = (c1 << 2) | ((c2 >> 4) & 0x03);
+      out[1] = (c2 << 4) | ((c3 >> 2) & 0x0F);
+      out[2] = (c3 << 6) | c4;
+      out += 3;
+      continue;
+    }
+
+    if (c4 != Base64Alphabet::PADDING) {
+      throw invalid_argument("string contains non-base64 characters");
+    }
+    if (offset != size - 4) {
+      throw invalid_argument("string contains padding not at the end");
+    }
+    if ((c1 < 0) || (c2 < 0) || (c3 == Base64Alphabet::INVALID)) {
+      throw invalid_argument("string contains non-base64 characters");
+    }
+    *(out++) = ((c1 << 2) & 0xFC) | ((c2 >> 4) & 0x03);
+    if (c3 != Base64Alphabet::PADDING) {
+      *(out++) = ((c2 << 4) & 0xF0) | ((c3 >> 2) & 0x0F);
+    }
+  }
+
+  return out - reinterpret_cast<uint8_t*>(vdest);
+}
+
+size_t base64_decode_into(void* dest, const void* data, size_t size, const char* alphabet) {
+  const Base64Alphabet* a = Base64Alphabet::predefined(alphabet);
+  if (a) {
+    return base64_decode_into(dest, data, size, a);
+  }
+  Base64Alphabet custom_alphabet(alphabet);
+  return base64_decode_into(dest, data, size, &custom_alphabet);
+}
+
+string base64_decode(const void* data, size_t size, const char* alphabet) {
+  string ret(base64_decoded_size(data, size), '\0');
+  ret.resize(base64_decode_into(ret.data(), data, size, alphabet));
+  return ret;
+}
+
+string base64_decode(const string& data, const char* alphabet) {
+  return base64_decode(data.data(), data.size(), alphabet);
+}
+
+Base64Encoder::Base64Encoder(const char* alphabet)
+    : alphabet(Base64Alphabet::get(alphabet)),
+      pending_size(0) {}
+
+void Base64Encoder::update(string& out, const void* vdata, size_t size) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+
+  // Complete the pending block first, if there is one
+  if (this->pending_size) {
+    while ((this->pending_size < 3) && size) {
+      this->pending[this->pending_size++] = *(data++);
+      size--;
+    }
+    if (this->pending_size < 3) {
+      return;
+    }
+    size_t out_offset = out.size();
+    out.resize(out_offset + 4);
+    base64_encode_into(out.data() + out_offset, this->pending, 3, this->alphabet.get());
+    this->pending_size = 0;
+  }
+
+  size_t block_bytes = size - (size % 3);
+  size_t out_offset = out.size();
+  out.resize(out_offset + base64_encoded_size(block_bytes));
+  base64_encode_into(out.data() + out_offset, data, block_bytes, this->alphabet.get());
+
+  this->pending_size = size - block_bytes;
+  memcpy(this->pending, data + block_bytes, this->pending_size);
+}
+
+void Base64Encoder::update(string& out, string_view data) {
+  this->update(out, data.data(), data.size());
+}
+
+void Base64Encoder::finish(string& out) {
+  size_t out_offset = out.size();
+  out.resize(out_offset + base64_encoded_size(this->pending_size));
+  base64_encode_into(out.data() + out_offset, this->pending, this->pending_size, this->alphabet.get());
+  this->pending_size = 0;
+}
+
+Base64Decoder::Base64Decoder(const char* alphabet)
+    : alphabet(Base64Alphabet::get(alphabet)),
+      pending_size(0),
+      padding_seen(false) {}
+
+void Base64Decoder::update(string& out, const void* vdata, size_t size) {
+  const char* data = reinterpret_cast<const char*>(vdata);
+  if (size && this->padding_seen) {
+    throw invalid_argument("string contains padding not at the end");
+  }
+
+  // Each decoded group of 4 characters is checked for padding at the end;
+  // any group with padding must be the last one
+  auto decode_blocks = [&](const char* blocks, size_t blocks_size) -> void {
+    size_t out_offset = out.size();
+    out.resize(out_offset + base64_decoded_size(blocks, blocks_size));
+    out.resize(out_offset + base64_decode_into(out.data() + out_offset, blocks, blocks_size, this->alphabet.get()));
+    this->padding_seen = blocks_size && (blocks[blocks_size - 1] == '=');
+  };
+
+  if (this->pending_size) {
+    while ((this->pending_size < 4) && size) {
+      this->pending[this->pending_size++] = *(data++);
+      size--;
+    }
+    if (this->pending_size < 4) {
+      return;
+    }
+    decode_blocks(this->pending, 4);
+    this->pending_size = 0;
+    if (size && this->padding_seen) {
+      throw invalid_argument("string contains padding not at the end");
+    }
+  }
+
+  size_t blocks_size = size & (~3);
+  if (blocks_size) {
+    decode_blocks(data, blocks_size);
+  }
+  this->pending_size = size - blocks_size;
+  if (this->pending_size && this->padding_seen) {
+    throw invalid_argument("string contains padding not at the end");
+  }
+  memcpy(this->pending, data + blocks_size, this->pending_size);
+}
+
+void Base64Decoder::update(string& out, string_view data) {
+  this->update(out, data.data(), data.size());
+}
+
+void Base64Decoder::finish() {
+  bool incomplete = (this->pending_size != 0);
+  this->pending_size = 0;
+  this->padding_seen = false;
+  if (incomplete) {
+    throw invalid_argument("size must be a multiple of 4 bytes");
+  }
+}
+
+// Builds a table mapping each character in alphabet to its index, and all
+// other characters to -1. Unlike base64, the other codecs don't have enough
+// predefined alphabets to be worth caching these.
+static void make_inverse_alphabet(int8_t* inverse, const char* alphabet, size_t alphabet_size) {
+  memset(inverse, -1, 0x100);
+  for (size_t z = 0; z < alphabet_size; z++) {
+    inverse[static_cast<uint8_t>(alphabet[z])] = z;
+  }
+}
+
+static const char* HEX_UPPERCASE_DIGITS = "0123456789ABCDEF";
+static const char* HEX_LOWERCASE_DIGITS = "0123456789abcdef";
+
+static inline int8_t hex_digit_value(uint8_t ch) {
+  if (ch >= '0' && ch <= '9') {
+    return ch - '0';
+  }
+  ch |= 0x20;
+  if (ch >= 'a' && ch <= 'f') {
+    return ch - 'a' + 10;
+  }
+  return -1;
+}
+
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+
+// As for base64, these return the number of input bytes consumed, and the
+// decoders stop at the first block containing an invalid character.
+
+__attribute__((target("ssse3"))) static size_t hex_encode_ssse3(char* out, const uint8_t* data, size_t size, const char* digits) {
+  const __m128i table = _mm_loadu_si128(reinterpret_cast<const __m128i*>(digits));
+  const __m128i low_mask = _mm_set1_epi8(0x0F);
+  size_t offset = 0;
+  for (; offset + 16 <= size; offset += 16, out += 32) {
+    __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+    __m128i hi = _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(in, 4), low_mask));
+    __m128i lo = _mm_shuffle_epi8(table, _mm_and_si128(in, low_mask));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  return offset;
+}
+
+__attribute__((target("avx2"))) static size_t hex_encode_avx2(char* out, const uint8_t* data, size_t size, const char* digits) {
+  const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(digits)));
+  const __m256i low_mask = _mm256_set1_epi8(0x0F);
+  size_t offset = 0;
+  for (; offset + 32 <= size; offset += 32, out += 64) {
+    __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset));
+    __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(in, 4), low_mask));
+    __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(in, low_mask));
+    // The unpacks work within each 128-bit lane, so a holds the output for
+    // bytes 0-7 and 16-23, and b holds it for 8-15 and 24-31
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 32), _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  return offset + hex_encode_ssse3(out, data + offset, size - offset, digits);
+}
+
+__attribute__((target("ssse3"))) static size_t hex_decode_ssse3(uint8_t* out, const uint8_t* data, size_t size) {
+  size_t offset = 0;
+  for (; offset + 16 <= size; offset += 16, out += 8) {
+    // Setting bit 5 makes uppercase letters lowercase, and doesn't affect
+    // digits. Characters 0x80 and above are negative in these comparisons, so
+    // they aren't in either range.
+    __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+    __m128i folded = _mm_or_si128(in, _mm_set1_epi8(0x20));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), in));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), folded));
+    if (_mm_movemask_epi8(_mm_or_si128(digit, letter)) != 0xFFFF) {
+      break;
+    }
+    __m128i values = _mm_or_si128(
+        _mm_and_si128(digit, _mm_sub_epi8(in, _mm_set1_epi8('0'))),
+        _mm_and_si128(letter, _mm_sub_epi8(folded, _mm_set1_epi8('a' - 10))));
+    // Combine each pair of 4-bit values into one byte in each 16-bit lane,
+    // then pack the lanes into bytes
+    __m128i bytes = _mm_maddubs_epi16(values, _mm_set1_epi16(0x0110));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(bytes, bytes));
+  }
+  return offset;
+}
+
+__attribute__((target("avx2"))) static size_t hex_decode_avx2(uint8_t* out, const uint8_t* data, size_t size) {
+  size_t offset = 0;
+  for (; offset + 32 <= size; offset += 32, out += 16) {
+    __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset));
+    __m256i folded = _mm256_or_si256(in, _mm256_set1_epi8(0x20));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), in));
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(folded, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), folded));
+    if (static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(digit, letter))) != 0xFFFFFFFF) {
+      break;
+    }
+    __m256i values = _mm256_or_si256(
+        _mm256_and_si256(digit, _mm256_sub_epi8(in, _mm256_set1_epi8('0'))),
+        _mm256_and_si256(letter, _mm256_sub_epi8(folded, _mm256_set1_epi8('a' - 10))));
+    __m256i bytes = _mm256_maddubs_epi16(values, _mm256_set1_epi16(0x0110));
+    // The pack works within each 128-bit lane, so the results are in the
+    // first and third 64-bit lanes
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(bytes, bytes), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(packed));
+  }
+  return offset + hex_decode_ssse3(out, data + offset, size - offset);
+}
+
+#elif defined(PHOSG_HAVE_NEON)
+
+static size_t hex_encode_neon(char* out, const uint8_t* data, size_t size, const char* digits) {
+  const uint8x16_t table = vld1q_u8(reinterpret_cast<const uint8_t*>(digits));
+  size_t offset = 0;
+  for (; offset + 16 <= size; offset += 16, out += 32) {
+    uint8x16_t in = vld1q_u8(data + offset);
+    uint8x16x2_t chars = {{vqtbl1q_u8(table, vshrq_n_u8(in, 4)), vqtbl1q_u8(table, vandq_u8(in, vdupq_n_u8(0x0F)))}};
+    vst2q_u8(reinterpret_cast<uint8_t*>(out), chars);
+  }
+  return offset;
+}
+
+static size_t hex_decode_neon(uint8_t* out, const uint8_t* data, size_t size) {
+  size_t offset = 0;
+  for (; offset + 32 <= size; offset += 32, out += 16) {
+    uint8x16x2_t in = vld2q_u8(data + offset);
+    uint8x16_t values[2];
+    uint8x16_t valid = vdupq_n_u8(0xFF);
+    for (size_t z = 0; z < 2; z++) {
+      uint8x16_t digit = vsubq_u8(in.val[z], vdupq_n_u8('0'));
+      uint8x16_t letter = vsubq_u8(vorrq_u8(in.val[z], vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+      uint8x16_t is_digit = vcltq_u8(digit, vdupq_n_u8(10));
+      uint8x16_t is_letter = vcltq_u8(letter, vdupq_n_u8(6));
+      values[z] = vbslq_u8(is_digit, digit, vaddq_u8(letter, vdupq_n_u8(10)));
+      valid = vandq_u8(valid, vorrq_u8(is_digit, is_letter));
+    }
+    if (vminvq_u8(valid) != 0xFF) {
+      break;
+    }
+    vst1q_u8(out, vorrq_u8(vshlq_n_u8(values[0], 4), values[1]));
+  }
+  return offset;
+}
+
+#endif
+
+size_t hex_encode_into(void* vdest, const void* vdata, size_t size, bool lowercase) {
+  char* out = reinterpret_cast<char*>(vdest);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  const char* digits = lowercase ? HEX_LOWERCASE_DIGITS : HEX_UPPERCASE_DIGITS;
+
+  size_t offset = 0;
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+  if (x86_features().avx2) {
+    offset = hex_encode_avx2(out, data, size, digits);
+  } else if (x86_features().ssse3) {
+    offset = hex_encode_ssse3(out, data, size, digits);
+  }
+#elif defined(PHOSG_HAVE_NEON)
+  offset = hex_encode_neon(out, data, size, digits);
+#endif
+  out += offset * 2;
+
+  for (; offset < size; offset++, out += 2) {
+    out[0] = digits[data[offset] >> 4];
+    out[1] = digits[data[offset] & 0x0F];
+  }
+  return size * 2;
+}
+
+string hex_encode(const void* data, size_t size, bool lowercase) {
+  string ret(size * 2, '\0');
+  hex_encode_into(ret.data(), data, size, lowercase);
+  return ret;
+}
+
+string hex_encode(const string& data, bool lowercase) {
+  return hex_encode(data.data(), data.size(), lowercase);
+}
+
+size_t hex_decode_into(void* vdest, const void* vdata, size_t size) {
+  uint8_t* out = reinterpret_cast<uint8_t*>(vdest);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  if (size & 1) {
+    throw invalid_argument("size must be a multiple of 2 bytes");
+  }
+
+  size_t offset = 0;
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+  if (x86_features().avx2) {
+    offset = hex_decode_avx2(out, data, size);
+  } else if (x86_features().ssse3) {
+    offset = hex_decode_ssse3(out, data, size);
+  }
+#elif defined(PHOSG_HAVE_NEON)
+  offset = hex_decode_neon(out, data, size);
+#endif
+  out += offset / 2;
+
+  for (; offset < size; offset += 2) {
+    int8_t hi = hex_digit_value(data[offset]);
+    int8_t lo = hex_digit_value(data[offset + 1]);
+    if ((hi | lo) < 0) {
+      throw invalid_argument("string contains non-hex characters");
+    }
+    *(out++) = (hi << 4) | lo;
+  }
+  return size / 2;
+}
+
+string hex_decode(const void* data, size_t size) {
+  string ret(size / 2, '\0');
+  hex_decode_into(ret.data(), data, size);
+  return ret;
+}
+
+string hex_decode(const string& data) {
+  return hex_decode(data.data(), data.size());
+}
+
+const char* BASE32_DEFAULT_ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+const char* BASE32_HEX_ALPHABET = "0123456789ABCDEFGHIJKLMNOPQRSTUV";
+
+size_t base32_encoded_size(size_t size) {
+  return ((size + 4) / 5) * 8;
+}
+
+size_t base32_decoded_size(const void* vdata, size_t size) {
+  const char* data = reinterpret_cast<const char*>(vdata);
+  if (size & 7) {
+    throw invalid_argument("size must be a multiple of 8 bytes");
+  }
+  if (size == 0) {
+    return 0;
+  }
+  size_t padding = 0;
+  while ((padding < 8) && (data[size - padding - 1] == '=')) {
+    padding++;
+  }
+  // Each character holds 5 bits, and partial bytes at the end are dropped
+  return (size - 8) / 8 * 5 + ((8 - padding) * 5) / 8;
+}
+
+size_t base32_encode_into(void* vdest, const void* vdata, size_t size, const char* alphabet) {
+  char* out = reinterpret_cast<char*>(vdest);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  if (!alphabet) {
+    alphabet = BASE32_DEFAULT_ALPHABET;
+  }
+
+  // Each block of 5 bytes is treated as a 40-bit big-endian integer, which is
+  // split into 8 5-bit fields
+  size_t offset = 0;
+  for (; offset + 5 <= size; offset += 5, out += 8) {
+    uint64_t value = (static_cast<uint64_t>(data[offset]) << 32) |
+        (static_cast<uint64_t>(data[offset + 1]) << 24) | (static_cast<uint64_t>(data[offset + 2]) << 16) |
+        (static_cast<uint64_t>(data[offset + 3]) << 8) | static_cast<uint64_t>(data[offset + 4]);
+    for (size_t z = 0; z < 8; z++) {
+      out[z] = alphabet[(value >> (35 - 5 * z)) & 0x1F];
+    }
+  }
+
+  // The final partial block is zero-extended, and only the characters that
+  // contain any of its bits are written; the rest are padding
+  size_t remaining = size - offset;
+  if (remaining) {
+    uint64_t value = 0;
+    for (size_t z = 0; z < remaining; z++) {
+      value |= static_cast<uint64_t>(data[offset + z]) << (32 - 8 * z);
+    }
+    size_t num_chars = (remaining * 8 + 4) / 5;
+    for (size_t z = 0; z < 8; z++) {
+      out[z] = (z < num_chars) ? alphabet[(value >> (35 - 5 * z)) & 0x1F] : '=';
+    }
+    out += 8;
+  }
+
+  return out - reinterpret_cast<char*>(vdest);
+}
+
+string base32_encode(const void* data, size_t size, const char* alphabet) {
+  string ret(base32_encoded_size(size), '\0');
+  base32_encode_into(ret.data(), data, size, alphabet);
+  return ret;
+}
+
+string base32_encode(const string& data, const char* alphabet) {
+  return base32_encode(data.data(), data.size(), alphabet);
+}
+
+size_t base32_decode_into(void* vdest, const void* vdata, size_t size, const char* alphabet) {
+  uint8_t* out = reinterpret_cast<uint8_t*>(vdest);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  if (size & 7) {
+    throw invalid_argument("size must be a multiple of 8 bytes");
+  }
+  if (!alphabet) {
+    alphabet = BASE32_DEFAULT_ALPHABET;
+  }
+  int8_t inverse[0x100];
+  make_inverse_alphabet(inverse, alphabet, 32);
+
+  for (size_t offset = 0; offset < size; offset += 8) {
+    uint64_t value = 0;
+    size_t num_chars = 0;
+    for (; num_chars < 8; num_chars++) {
+      int8_t v = inverse[data[offset + num_chars]];
+      if (v < 0) {
+        break;
       }
-      if (c3 == 0x80) {
-        if ((c1 >= 0x40) || (c2 >= 0x40)) {
-          throw invalid_argument("string contains non-base64 characters");
-        }
-        ret.push_back(((c1 << 2) & 0xFC) | ((c2 >> 4) & 0x03));
-      } else {
-        if ((c1 >= 0x40) || (c2 >= 0x40) || (c2 >= 0x40)) {
-          throw invalid_argument("string contains non-base64 characters");
+      value = (value << 5) | v;
+    }
+
+    if (num_chars < 8) {
+      for (size_t z = num_chars; z < 8; z++) {
+        if (data[offset + z] != '=') {
+          throw invalid_argument("string contains non-base32 characters");
         }
-        ret.push_back(((c1 << 2) & 0xFC) | ((c2 >> 4) & 0x03));
-        ret.push_back(((c2 << 4) & 0xF0) | ((c3 >> 2) & 0x0F));
       }
-    } else {
-      if ((c1 >= 0x40) || (c2 >= 0x40) || (c3 >= 0x40) || (c4 >= 0x40)) {
-        throw invalid_argument("string contains non-base64 characters");
+      if (offset != size - 8) {
+        throw invalid_argument("string contains padding not at the end");
       }
-      ret.push_back((c1 << 2) | ((c2 >> 4) & 0x03));
-      ret.push_back((c2 << 4) | ((c3 >> 2) & 0x0F));
-      ret.push_back((c3 << 6) | c4);
+      // Only these lengths can be produced by encoding a partial block
+      if ((num_chars != 2) && (num_chars != 4) && (num_chars != 5) && (num_chars != 7)) {
+        throw invalid_argument("string contains incorrect padding");
+      }
+      value <<= 5 * (8 - num_chars);
+    }
+
+    size_t num_bytes = (num_chars * 5) / 8;
+    for (size_t z = 0; z < num_bytes; z++) {
+      *(out++) = value >> (32 - 8 * z);
     }
   }
 
+  return out - reinterpret_cast<uint8_t*>(vdest);
+}
+
+string base32_decode(const void* data, size_t size, const char* alphabet) {
+  string ret(base32_decoded_size(data, size), '\0');
+  ret.resize(base32_decode_into(ret.data(), data, size, alphabet));
   return ret;
 }
 
-string base64_decode(const string& data, const char* alphabet) {
-  return base64_decode(data.data(), data.size(), alphabet);
+string base32_decode(const string& data, const char* alphabet) {
+  return base32_decode(data.data(), data.size(), alphabet);
+}
+
+const char* Z85_ALPHABET = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#";
+
+size_t z85_encoded_size(size_t size) {
+  if (size & 3) {
+    throw invalid_argument("size must be a multiple of 4 bytes");
+  }
+  return (size / 4) * 5;
+}
+
+size_t z85_decoded_size(size_t size) {
+  if (size % 5) {
+    throw invalid_argument("size must be a multiple of 5 bytes");
+  }
+  return (size / 5) * 4;
+}
+
+size_t z85_encode_into(void* vdest, const void* vdata, size_t size) {
+  char* out = reinterpret_cast<char*>(vdest);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  size_t ret = z85_encoded_size(size);
+
+  // Each block of 4 bytes is a big-endian integer, written as 5 base-85
+  // digits with the most significant first. The divisions are by constants,
+  // so the compiler turns them into multiplications.
+  for (size_t offset = 0; offset < size; offset += 4, out += 5) {
+    uint32_t value = reinterpret_cast<const be_uint32_t*>(data + offset)->load();
+    out[4] = Z85_ALPHABET[value % 85];
+    value /= 85;
+    out[3] = Z85_ALPHABET[value % 85];
+    value /= 85;
+    out[2] = Z85_ALPHABET[value % 85];
+    value /= 85;
+    out[1] = Z85_ALPHABET[value % 85];
+    out[0] = Z85_ALPHABET[value / 85];
+  }
+  return ret;
+}
+
+string z85_encode(const void* data, size_t size) {
+  string ret(z85_encoded_size(size), '\0');
+  z85_encode_into(ret.data(), data, size);
+  return ret;
+}
+
+string z85_encode(const string& data) {
+  return z85_encode(data.data(), data.size());
+}
+
+size_t z85_decode_into(void* vdest, const void* vdata, size_t size) {
+  uint8_t* out = reinterpret_cast<uint8_t*>(vdest);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  size_t ret = z85_decoded_size(size);
+  int8_t inverse[0x100];
+  make_inverse_alphabet(inverse, Z85_ALPHABET, 85);
+
+  for (size_t offset = 0; offset < size; offset += 5, out += 4) {
+    uint64_t value = 0;
+    for (size_t z = 0; z < 5; z++) {
+      int8_t v = inverse[data[offset + z]];
+      if (v < 0) {
+        throw invalid_argument("string contains non-Z85 characters");
+      }
+      value = value * 85 + v;
+    }
+    if (value > 0xFFFFFFFF) {
+      throw invalid_argument("string contains a block that is out of range");
+    }
+    reinterpret_cast<be_uint32_t*>(out)->store(value);
+  }
+  return ret;
+}
+
+string z85_decode(const void* data, size_t size) {
+  string ret(z85_decoded_size(size), '\0');
+  z85_decode_into(ret.data(), data, size);
+  return ret;
+}
+
+string z85_decode(const string& data) {
+  return z85_decode(data.data(), data.size());
+}
+
+size_t uleb128_size(uint64_t v) {
+  return (bit_width(v | 1) + 6) / 7;
+}
+
+size_t encode_uleb128(void* vdest, uint64_t v) {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  size_t size = 0;
+  for (; v >= 0x80; v >>= 7) {
+    dest[size++] = v | 0x80;
+  }
+  dest[size++] = v;
+  return size;
+}
+
+// Extracts a LEB128 value of 1 to 8 bytes from the beginning of word (loaded
+// in little-endian order), by removing the continuation bits and closing the
+// gaps: first within each 16-bit lane, then each 32-bit lane, then the whole
+// word. This has no branches, unlike decoding one byte at a time.
+static inline uint64_t uleb128_value_from_word(uint64_t word, size_t length) {
+  uint64_t x = word & (0x7F7F7F7F7F7F7F7F >> (64 - 8 * length));
+  x = ((x & 0x7F007F007F007F00) >> 1) | (x & 0x007F007F007F007F);
+  x = ((x & 0x3FFF00003FFF0000) >> 2) | (x & 0x00003FFF00003FFF);
+  x = ((x & 0x0FFFFFFF00000000) >> 4) | (x & 0x000000000FFFFFFF);
+  return x;
+}
+
+// Decodes one LEB128 value a byte at a time. This is only used when the
+// value is longer than 8 bytes or is too close to the end of the data to load
+// a whole word.
+static size_t decode_uleb128_bytewise(uint64_t* value, const uint8_t* data, size_t size) {
+  uint64_t v = 0;
+  for (size_t z = 0; z < MAX_ULEB128_SIZE; z++) {
+    if (z >= size) {
+      throw out_of_range("LEB128 value extends beyond end of data");
+    }
+    uint8_t b = data[z];
+    if ((z == MAX_ULEB128_SIZE - 1) && (b > 1)) {
+      throw invalid_argument("LEB128 value does not fit in 64 bits");
+    }
+    v |= static_cast<uint64_t>(b & 0x7F) << (7 * z);
+    if (!(b & 0x80)) {
+      *value = v;
+      return z + 1;
+    }
+  }
+  throw invalid_argument("LEB128 value is too long");
+}
+
+size_t decode_uleb128(uint64_t* value, const void* vdata, size_t size) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  if (size >= 8) {
+    uint64_t word = reinterpret_cast<const le_uint64_t*>(data)->load();
+    uint64_t terminators = ~word & 0x8080808080808080;
+    if (terminators) {
+      size_t length = (countr_zero(terminators) >> 3) + 1;
+      *value = uleb128_value_from_word(word, length);
+      return length;
+    }
+  }
+  return decode_uleb128_bytewise(value, data, size);
+}
+
+size_t decode_uleb128_array(uint64_t* dest, size_t count, const void* vdata, size_t size) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  size_t offset = 0;
+  size_t z = 0;
+  while (z < count) {
+    // Small values (e.g. deltas in sorted indexes) are common, so first check
+    // if the next 16 values are all one byte long
+    if ((count - z >= 16) && (size - offset >= 16)) {
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+      bool all_short = !_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset)));
+#elif defined(PHOSG_HAVE_NEON)
+      bool all_short = (vmaxvq_u8(vld1q_u8(data + offset)) < 0x80);
+#else
+      bool all_short = false;
+#endif
+      if (all_short) {
+        for (size_t x = 0; x < 16; x++) {
+          dest[z + x] = data[offset + x];
+        }
+        z += 16;
+        offset += 16;
+        continue;
+      }
+    }
+
+    // Otherwise, decode every value that ends within the next 8 bytes, using
+    // the positions of the bytes without continuation bits
+    if (size - offset >= 8) {
+      uint64_t word = reinterpret_cast<const le_uint64_t*>(data + offset)->load();
+      uint64_t terminators = ~word & 0x8080808080808080;
+      if (terminators) {
+        size_t start_bit = 0;
+        for (; terminators && (z < count); terminators &= (terminators - 1)) {
+          size_t end_bit = countr_zero(terminators) + 1;
+          dest[z++] = uleb128_value_from_word(word >> start_bit, (end_bit - start_bit) >> 3);
+          start_bit = end_bit;
+        }
+        offset += start_bit >> 3;
+        continue;
+      }
+    }
+
+    offset += decode_uleb128_bytewise(&dest[z++], data + offset, size - offset);
+  }
+  return offset;
+}
+
+size_t prefix_varint_size(uint64_t v) {
+  size_t bits = bit_width(v | 1);
+  return (bits > 56) ? 9 : ((bits + 6) / 7);
+}
+
+size_t encode_prefix_varint(void* vdest, uint64_t v) {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  size_t size = prefix_varint_size(v);
+  if (size == 9) {
+    dest[0] = 0;
+    reinterpret_cast<le_uint64_t*>(dest + 1)->store(v);
+  } else {
+    // The low (size - 1) bits are zero and the next bit is 1, so the number
+    // of trailing zeroes in the first byte is the number of extra bytes
+    uint64_t encoded = ((v << 1) | 1) << (size - 1);
+    for (size_t z = 0; z < size; z++) {
+      dest[z] = encoded >> (8 * z);
+    }
+  }
+  return size;
+}
+
+// Decodes one prefix varint. If there are at least 8 bytes available, this
+// has only one branch (for 9-byte values).
+static inline size_t decode_prefix_varint_inline(uint64_t* value, const uint8_t* data, size_t size) {
+  if (size == 0) {
+    throw out_of_range("prefix varint extends beyond end of data");
+  }
+  size_t length = data[0] ? (countr_zero(data[0]) + 1) : 9;
+  if (length > size) {
+    throw out_of_range("prefix varint extends beyond end of data");
+  }
+  if (length == 9) {
+    *value = reinterpret_cast<const le_uint64_t*>(data + 1)->load();
+    return 9;
+  }
+
+  uint64_t word;
+  if (size >= 8) {
+    word = reinterpret_cast<const le_uint64_t*>(data)->load();
+  } else {
+    word = 0;
+    for (size_t z = 0; z < length; z++) {
+      word |= static_cast<uint64_t>(data[z]) << (8 * z);
+    }
+  }
+  *value = (word & (0xFFFFFFFFFFFFFFFF >> (64 - 8 * length))) >> length;
+  return length;
+}
+
+size_t decode_prefix_varint(uint64_t* value, const void* data, size_t size) {
+  return decode_prefix_varint_inline(value, reinterpret_cast<const uint8_t*>(data), size);
+}
+
+size_t decode_prefix_varint_array(uint64_t* dest, size_t count, const void* vdata, size_t size) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  size_t offset = 0;
+  size_t z = 0;
+  while (z < count) {
+    // As for LEB128, check for 16 one-byte values (with the low bit set)
+    if ((count - z >= 16) && (size - offset >= 16)) {
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+      bool all_short = (_mm_movemask_epi8(_mm_slli_epi16(v, 7)) == 0xFFFF);
+#elif defined(PHOSG_HAVE_NEON)
+      bool all_short = (vminvq_u8(vshlq_n_u8(vld1q_u8(data + offset), 7)) == 0x80);
+#else
+      bool all_short = false;
+#endif
+      if (all_short) {
+        for (size_t x = 0; x < 16; x++) {
+          dest[z + x] = data[offset + x] >> 1;
+        }
+        z += 16;
+        offset += 16;
+        continue;
+      }
+    }
+    offset += decode_prefix_varint_inline(&dest[z++], data + offset, size - offset);
+  }
+  return offset;
 }
 
 string rot13(const void* vdata, size_t size) {
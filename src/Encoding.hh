@@ -4,11 +4,18 @@
 #define __STDC_FORMAT_MACROS
 #endif
 
+#include <string.h>
+
+#include <algorithm>
 #include <cinttypes>
 #include <cstdint>
-
 #include <format>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 
 #include "Platform.hh"
 #include "Types.hh"
@@ -209,6 +216,9 @@ private:
   StoredT value;
 
 public:
+  using exposed_type = ExposedT;
+  using stored_type = StoredT;
+
   converted_endian() = default;
   converted_endian(ExposedT v) : value(OnStoreSt::fn(v)) {}
   converted_endian(const converted_endian& other) = default;
@@ -396,14 +406,324 @@ constexpr bool is_converted_endian_float_sc_v =
 template <typename T>
 constexpr bool is_converted_endian_sc_v = is_converted_endian_int_sc_v<T> || is_converted_endian_float_sc_v<T>;
 
+// Bulk byte-swapping functions, which are much faster than calling bswap32
+// (etc.) on each element of a large array. Each of these reads count values
+// of the given width from src and writes them byte-swapped to dest. The 24-
+// and 48-bit versions work on packed arrays of 3- or 6-byte values. src and
+// dest need not be aligned, and may be the same pointer (to swap in place),
+// but must not otherwise overlap.
+void bswap16_array(void* dest, const void* src, size_t count);
+void bswap24_array(void* dest, const void* src, size_t count);
+void bswap32_array(void* dest, const void* src, size_t count);
+void bswap48_array(void* dest, const void* src, size_t count);
+void bswap64_array(void* dest, const void* src, size_t count);
+
+// Calls the above function for values of Size bytes
+template <size_t Size>
+void bswap_array_sized(void* dest, const void* src, size_t count) {
+  if constexpr (Size == 1) {
+    if (dest != src) {
+      memcpy(dest, src, count);
+    }
+  } else if constexpr (Size == 2) {
+    bswap16_array(dest, src, count);
+  } else if constexpr (Size == 3) {
+    bswap24_array(dest, src, count);
+  } else if constexpr (Size == 4) {
+    bswap32_array(dest, src, count);
+  } else if constexpr (Size == 6) {
+    bswap48_array(dest, src, count);
+  } else if constexpr (Size == 8) {
+    bswap64_array(dest, src, count);
+  } else {
+    static_assert(Size == 0, "unsupported size for bswap_array_sized");
+  }
+}
+
+template <typename T>
+void bswap_array(T* dest, const T* src, size_t count) {
+  static_assert(std::is_arithmetic_v<T>, "bswap_array can only be used with integer or floating-point types");
+  bswap_array_sized<sizeof(T)>(dest, src, count);
+}
+
+template <typename T>
+void bswap_array(T* data, size_t count) {
+  bswap_array(data, data, count);
+}
+
+// Converts count values from an array of converted_endian values (e.g.
+// be_uint32_t) to an array of native values, or vice versa. These are
+// equivalent to calling load() or store() on each element, but they convert
+// the entire array at once with the bulk functions above.
+template <typename ExposedT, typename StoredT, typename OnStoreSt, typename OnLoadSt>
+void load_array(ExposedT* dest, const converted_endian<ExposedT, StoredT, OnStoreSt, OnLoadSt>* src, size_t count) {
+  static_assert(sizeof(ExposedT) == sizeof(StoredT));
+  if constexpr (std::is_same_v<OnLoadSt, ident_st<StoredT, ExposedT>>) {
+    memcpy(dest, src, count * sizeof(ExposedT));
+  } else if constexpr (std::is_same_v<OnLoadSt, bswap_st<StoredT, ExposedT>>) {
+    bswap_array_sized<sizeof(StoredT)>(dest, src, count);
+  } else {
+    for (size_t z = 0; z < count; z++) {
+      dest[z] = src[z].load();
+    }
+  }
+}
+
+template <typename ExposedT, typename StoredT, typename OnStoreSt, typename OnLoadSt>
+void store_array(converted_endian<ExposedT, StoredT, OnStoreSt, OnLoadSt>* dest, const ExposedT* src, size_t count) {
+  static_assert(sizeof(ExposedT) == sizeof(StoredT));
+  if constexpr (std::is_same_v<OnStoreSt, ident_st<ExposedT, StoredT>>) {
+    memcpy(dest, src, count * sizeof(ExposedT));
+  } else if constexpr (std::is_same_v<OnStoreSt, bswap_st<ExposedT, StoredT>>) {
+    bswap_array_sized<sizeof(StoredT)>(dest, src, count);
+  } else {
+    for (size_t z = 0; z < count; z++) {
+      dest[z].store(src[z]);
+    }
+  }
+}
+
+// Converts arrays of packed 24-bit or 48-bit integers (3 or 6 bytes each, as
+// read by StringReader::get_u24b and similar) to or from arrays of 32-bit or
+// 64-bit native integers. The high bits of the native values are zero when
+// loading, and ignored when storing.
+void load_u24b_array(uint32_t* dest, const void* src, size_t count);
+void load_u24l_array(uint32_t* dest, const void* src, size_t count);
+void load_u48b_array(uint64_t* dest, const void* src, size_t count);
+void load_u48l_array(uint64_t* dest, const void* src, size_t count);
+void store_u24b_array(void* dest, const uint32_t* src, size_t count);
+void store_u24l_array(void* dest, const uint32_t* src, size_t count);
+void store_u48b_array(void* dest, const uint64_t* src, size_t count);
+void store_u48l_array(void* dest, const uint64_t* src, size_t count);
+
+// A read-only view of an existing array of converted_endian values, such as
+// a buffer of be_uint32_t read from a file. Indexing and iterating over it
+// convert one element at a time; copy_to, to_vector, and for_each_block
+// convert in blocks with load_array, which is much faster for large arrays.
+// The view doesn't own the data, which must outlive it.
+template <typename EndianT>
+class converted_endian_span {
+public:
+  using value_type = typename EndianT::exposed_type;
+  using const_iterator = const EndianT*;
+
+  // The number of values converted per call to the for_each_block callback
+  static constexpr size_t BLOCK_SIZE = 0x400;
+
+  converted_endian_span() : items(nullptr), count(0) {}
+  converted_endian_span(const EndianT* items, size_t count) : items(items), count(count) {}
+  converted_endian_span(const void* data, size_t count)
+      : items(reinterpret_cast<const EndianT*>(data)),
+        count(count) {}
+
+  inline size_t size() const {
+    return this->count;
+  }
+  inline size_t size_bytes() const {
+    return this->count * sizeof(EndianT);
+  }
+  inline bool empty() const {
+    return this->count == 0;
+  }
+  inline const EndianT* data() const {
+    return this->items;
+  }
+  inline const_iterator begin() const {
+    return this->items;
+  }
+  inline const_iterator end() const {
+    return this->items + this->count;
+  }
+
+  inline value_type operator[](size_t index) const {
+    return this->items[index].load();
+  }
+  value_type at(size_t index) const {
+    if (index >= this->count) {
+      throw std::out_of_range("index out of range");
+    }
+    return this->items[index].load();
+  }
+
+  // Like std::span::subspan, but throws out_of_range if offset is beyond the
+  // end, and clamps count to the end of the view
+  converted_endian_span subspan(size_t offset, size_t count = static_cast<size_t>(-1)) const {
+    if (offset > this->count) {
+      throw std::out_of_range("subspan offset out of range");
+    }
+    return converted_endian_span(this->items + offset, std::min<size_t>(count, this->count - offset));
+  }
+
+  // Converts all the values into dest, which must have room for size() values
+  void copy_to(value_type* dest) const {
+    load_array(dest, this->items, this->count);
+  }
+  std::vector<value_type> to_vector() const {
+    std::vector<value_type> ret(this->count);
+    this->copy_to(ret.data());
+    return ret;
+  }
+
+  // Calls fn(const value_type* values, size_t count) for each consecutive
+  // block of up to BLOCK_SIZE converted values, in order. This converts the
+  // values into a buffer on the stack, so it doesn't allocate memory.
+  template <typename FnT>
+  void for_each_block(FnT&& fn) const {
+    value_type block[BLOCK_SIZE];
+    for (size_t offset = 0; offset < this->count; offset += BLOCK_SIZE) {
+      size_t block_count = std::min<size_t>(BLOCK_SIZE, this->count - offset);
+      load_array(block, this->items + offset, block_count);
+      fn(static_cast<const value_type*>(block), block_count);
+    }
+  }
+
+private:
+  const EndianT* items;
+  size_t count;
+};
+
 extern const char* DEFAULT_ALPHABET;
 extern const char* URLSAFE_ALPHABET;
 
+// The alphabet for all of these functions must be 64 characters long, and
+// may be DEFAULT_ALPHABET, URLSAFE_ALPHABET, or any other set of characters
+// (except '=', which is always padding). nullptr means DEFAULT_ALPHABET. The
+// conversions are vectorized for any alphabet on ARM, but on x86 only for
+// alphabets that match DEFAULT_ALPHABET except in the last two characters.
 std::string base64_encode(const void* data, size_t size, const char* alphabet = nullptr);
 std::string base64_encode(const std::string& data, const char* alphabet = nullptr);
 std::string base64_decode(const void* data, size_t size, const char* alphabet = nullptr);
 std::string base64_decode(const std::string& data, const char* alphabet = nullptr);
 
+// These functions encode or decode into a caller-provided buffer, and return
+// the number of bytes written. The buffer must be at least
+// base64_encoded_size(size) or base64_decoded_size(data, size) bytes long.
+// base64_decoded_size throws if size isn't a multiple of 4; it doesn't check
+// whether the data is valid, but base64_decode_into does.
+size_t base64_encoded_size(size_t size);
+size_t base64_decoded_size(const void* data, size_t size);
+size_t base64_encode_into(void* dest, const void* data, size_t size, const char* alphabet = nullptr);
+size_t base64_decode_into(void* dest, const void* data, size_t size, const char* alphabet = nullptr);
+
+// These classes encode or decode data that arrives in chunks of any size,
+// producing the same result as base64_encode or base64_decode would for all
+// the chunks concatenated together. update() appends as much output as it
+// can to out, and keeps up to 2 (encoding) or 3 (decoding) input bytes until
+// the next call. Call finish() after the last chunk; for the encoder, this
+// appends the final block and padding. For the decoder, it throws if the
+// input wasn't a multiple of 4 characters long. Both objects can be reused
+// after finish() is called.
+struct Base64Alphabet;
+
+class Base64Encoder {
+public:
+  explicit Base64Encoder(const char* alphabet = nullptr);
+  void update(std::string& out, const void* data, size_t size);
+  void update(std::string& out, std::string_view data);
+  void finish(std::string& out);
+
+private:
+  std::shared_ptr<const Base64Alphabet> alphabet;
+  uint8_t pending[3];
+  size_t pending_size;
+};
+
+class Base64Decoder {
+public:
+  explicit Base64Decoder(const char* alphabet = nullptr);
+  void update(std::string& out, const void* data, size_t size);
+  void update(std::string& out, std::string_view data);
+  void finish();
+
+private:
+  std::shared_ptr<const Base64Alphabet> alphabet;
+  char pending[4];
+  size_t pending_size;
+  bool padding_seen;
+};
+
+// Hexadecimal encoding, with 2 characters per byte. Encoding produces
+// uppercase digits unless lowercase is true; decoding accepts either (or a
+// mix), and throws invalid_argument if size is odd or any character isn't a
+// hex digit. The _into functions write exactly 2 * size or size / 2 bytes and
+// return that count.
+std::string hex_encode(const void* data, size_t size, bool lowercase = false);
+std::string hex_encode(const std::string& data, bool lowercase = false);
+size_t hex_encode_into(void* dest, const void* data, size_t size, bool lowercase = false);
+std::string hex_decode(const void* data, size_t size);
+std::string hex_decode(const std::string& data);
+size_t hex_decode_into(void* dest, const void* data, size_t size);
+
+// Base32 encoding (RFC 4648), with padding. The alphabet must be 32
+// characters long; nullptr means BASE32_DEFAULT_ALPHABET. The _into and _size
+// functions work the same way as for base64.
+extern const char* BASE32_DEFAULT_ALPHABET;
+extern const char* BASE32_HEX_ALPHABET;
+
+std::string base32_encode(const void* data, size_t size, const char* alphabet = nullptr);
+std::string base32_encode(const std::string& data, const char* alphabet = nullptr);
+std::string base32_decode(const void* data, size_t size, const char* alphabet = nullptr);
+std::string base32_decode(const std::string& data, const char* alphabet = nullptr);
+size_t base32_encoded_size(size_t size);
+size_t base32_decoded_size(const void* data, size_t size);
+size_t base32_encode_into(void* dest, const void* data, size_t size, const char* alphabet = nullptr);
+size_t base32_decode_into(void* dest, const void* data, size_t size, const char* alphabet = nullptr);
+
+// Z85 encoding (ZeroMQ RFC 32), which has 5 characters per 4 bytes and no
+// padding. The input size must be a multiple of 4 when encoding, or of 5 when
+// decoding; all of these functions throw invalid_argument if it isn't.
+extern const char* Z85_ALPHABET;
+
+std::string z85_encode(const void* data, size_t size);
+std::string z85_encode(const std::string& data);
+std::string z85_decode(const void* data, size_t size);
+std::string z85_decode(const std::string& data);
+size_t z85_encoded_size(size_t size);
+size_t z85_decoded_size(size_t size);
+size_t z85_encode_into(void* dest, const void* data, size_t size);
+size_t z85_decode_into(void* dest, const void* data, size_t size);
+
+// Variable-length integer encodings. In LEB128 (as used by protobuf, DWARF,
+// and WebAssembly), each byte holds 7 bits of the value, least-significant
+// first, and the high bit is set on every byte except the last. Prefix
+// varints hold the same number of bits per byte, but the number of trailing
+// zero bits in the first byte is the number of bytes that follow it (and a
+// first byte of zero means 8 bytes follow, with the value in little-endian
+// order), so they can be decoded without looping over the bytes. Zigzag
+// encoding maps signed values to unsigned values so that numbers close to
+// zero (positive or negative) have short encodings in either format.
+//
+// The encode functions write up to MAX_ULEB128_SIZE or MAX_PREFIX_VARINT_SIZE
+// bytes to dest, and return the number of bytes written. The decode functions
+// read one value from data, put it in *value, and return the number of bytes
+// it occupied. They throw out_of_range if the value extends beyond size bytes,
+// or invalid_argument if a LEB128 value doesn't fit in 64 bits.
+constexpr size_t MAX_ULEB128_SIZE = 10;
+constexpr size_t MAX_PREFIX_VARINT_SIZE = 9;
+
+inline uint64_t zigzag_encode(int64_t v) {
+  return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+inline int64_t zigzag_decode(uint64_t v) {
+  return static_cast<int64_t>((v >> 1) ^ (~(v & 1) + 1));
+}
+
+size_t uleb128_size(uint64_t v);
+size_t encode_uleb128(void* dest, uint64_t v);
+size_t decode_uleb128(uint64_t* value, const void* data, size_t size);
+size_t prefix_varint_size(uint64_t v);
+size_t encode_prefix_varint(void* dest, uint64_t v);
+size_t decode_prefix_varint(uint64_t* value, const void* data, size_t size);
+
+// Decodes count consecutive values into dest, and returns the number of bytes
+// they occupied. These check for runs of one-byte values (less than 0x80) 16
+// bytes at a time, so they're much faster than calling the single-value decode
+// functions in a loop when most values are that small. For values of mixed
+// lengths, they're only slightly faster than the loop. They throw the same
+// exceptions as the single-value functions.
+size_t decode_uleb128_array(uint64_t* dest, size_t count, const void* data, size_t size);
+size_t decode_prefix_varint_array(uint64_t* dest, size_t count, const void* data, size_t size);
+
 std::string rot13(const void* data, size_t size);
 
 } // namespace phosg
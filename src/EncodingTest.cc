@@ -1,11 +1,28 @@
 #include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "Encoding.hh"
+#include "Strings.hh"
 #include "UnitTest.hh"
 
+using namespace std;
 using namespace phosg;
 
+// Returns data that contains every byte value and doesn't repeat with a short
+// period, for checking the vector paths against the scalar ones
+static string test_data(size_t size) {
+  string data;
+  for (size_t z = 0; z < size; z++) {
+    data.push_back(z * 0x9D + (z >> 3));
+  }
+  return data;
+}
+
 int main(int, char**) {
   expect_eq(0x0000, (sign_extend<uint16_t, uint8_t>(0x00)));
   expect_eq(0x0001, (sign_extend<uint16_t, uint8_t>(0x01)));
@@ -127,7 +144,150 @@ int main(int, char**) {
     expect_eq("04030201", std::format("{:08X}", data.le32));
   }
 
-  // TODO: test custom alphabets
+  {
+    fwrite_fmt(stdout, "-- bulk endian conversion\n");
+    // The vector paths handle 16 bytes at a time, so test counts around that
+    string data = test_data(0x400);
+    for (size_t count = 0; count < 70; count++) {
+      vector<uint16_t> src16(count);
+      vector<uint32_t> src32(count);
+      vector<uint64_t> src64(count);
+      memcpy(src16.data(), data.data(), count * 2);
+      memcpy(src32.data(), data.data(), count * 4);
+      memcpy(src64.data(), data.data(), count * 8);
+      vector<uint16_t> dest16(count);
+      vector<uint32_t> dest32(count);
+      vector<uint64_t> dest64(count);
+      bswap_array(dest16.data(), src16.data(), count);
+      bswap_array(dest32.data(), src32.data(), count);
+      bswap_array(dest64.data(), src64.data(), count);
+      for (size_t z = 0; z < count; z++) {
+        expect_eq(bswap16(src16[z]), dest16[z]);
+        expect_eq(bswap32(src32[z]), dest32[z]);
+        expect_eq(bswap64(src64[z]), dest64[z]);
+      }
+      // In place, which should undo the first swap
+      bswap_array(dest16.data(), count);
+      bswap_array(dest32.data(), count);
+      bswap_array(dest64.data(), count);
+      expect(dest16 == src16);
+      expect(dest32 == src32);
+      expect(dest64 == src64);
+
+      // 24-bit and 48-bit values, compared against StringReader
+      StringReader r(data);
+      vector<uint32_t> u24b(count), u24l(count);
+      vector<uint64_t> u48b(count), u48l(count);
+      load_u24b_array(u24b.data(), data.data(), count);
+      load_u24l_array(u24l.data(), data.data(), count);
+      load_u48b_array(u48b.data(), data.data(), count);
+      load_u48l_array(u48l.data(), data.data(), count);
+      for (size_t z = 0; z < count; z++) {
+        expect_eq(r.pget_u24b(z * 3), u24b[z]);
+        expect_eq(r.pget_u24l(z * 3), u24l[z]);
+        expect_eq(r.pget_u48b(z * 6), u48b[z]);
+        expect_eq(r.pget_u48l(z * 6), u48l[z]);
+      }
+      string swapped24(count * 3, '\0');
+      string swapped48(count * 6, '\0');
+      bswap24_array(swapped24.data(), data.data(), count);
+      bswap48_array(swapped48.data(), data.data(), count);
+      vector<uint32_t> swapped_u24l(count);
+      vector<uint64_t> swapped_u48l(count);
+      load_u24l_array(swapped_u24l.data(), swapped24.data(), count);
+      load_u48l_array(swapped_u48l.data(), swapped48.data(), count);
+      expect(swapped_u24l == u24b);
+      expect(swapped_u48l == u48b);
+      bswap24_array(swapped24.data(), swapped24.data(), count);
+      bswap48_array(swapped48.data(), swapped48.data(), count);
+      expect_eq(data.substr(0, count * 3), swapped24);
+      expect_eq(data.substr(0, count * 6), swapped48);
+
+      // Storing should ignore the high bits
+      for (auto& v : u24b) {
+        v |= 0xAB000000;
+      }
+      for (auto& v : u48l) {
+        v |= 0xABCD000000000000;
+      }
+      string stored(count * 6, '\0');
+      store_u24b_array(stored.data(), u24b.data(), count);
+      expect_eq(data.substr(0, count * 3), stored.substr(0, count * 3));
+      store_u24l_array(stored.data(), u24l.data(), count);
+      expect_eq(data.substr(0, count * 3), stored.substr(0, count * 3));
+      store_u48b_array(stored.data(), u48b.data(), count);
+      expect_eq(data.substr(0, count * 6), stored);
+      store_u48l_array(stored.data(), u48l.data(), count);
+      expect_eq(data.substr(0, count * 6), stored);
+    }
+
+    // load_array and store_array, with both byte orders and floats
+    be_uint32_t be_values[37];
+    le_uint16_t le_values[37];
+    be_double be_doubles[37];
+    for (size_t z = 0; z < 37; z++) {
+      be_values[z] = z * 0x01020304;
+      le_values[z] = z * 0x0102;
+      be_doubles[z] = z * 1.5;
+    }
+    uint32_t values[37];
+    uint16_t values16[37];
+    double doubles[37];
+    load_array(values, be_values, 37);
+    load_array(values16, le_values, 37);
+    load_array(doubles, be_doubles, 37);
+    for (size_t z = 0; z < 37; z++) {
+      expect_eq(z * 0x01020304, values[z]);
+      expect_eq(z * 0x0102, values16[z]);
+      expect_eq(z * 1.5, doubles[z]);
+    }
+    be_uint32_t be_values2[37];
+    be_double be_doubles2[37];
+    store_array(be_values2, values, 37);
+    store_array(be_doubles2, doubles, 37);
+    expect(!memcmp(be_values, be_values2, sizeof(be_values)));
+    expect(!memcmp(be_doubles, be_doubles2, sizeof(be_doubles)));
+
+    // converted_endian_span, with enough values for multiple blocks
+    vector<be_uint32_t> be_vector(2500);
+    for (size_t z = 0; z < be_vector.size(); z++) {
+      be_vector[z] = z * 7;
+    }
+    converted_endian_span<be_uint32_t> span(be_vector.data(), be_vector.size());
+    expect_eq(2500, span.size());
+    expect_eq(10000, span.size_bytes());
+    expect(!span.empty());
+    expect_eq(7, span[1]);
+    expect_eq(14, span.at(2));
+    expect_raises(out_of_range, [&]() -> void { span.at(2500); });
+    vector<uint32_t> converted = span.to_vector();
+    size_t sum = 0;
+    for (uint32_t v : span) {
+      sum += v;
+    }
+    size_t block_sum = 0;
+    size_t next_index = 0;
+    span.for_each_block([&](const uint32_t* values, size_t count) -> void {
+      expect_le(count, span.BLOCK_SIZE);
+      for (size_t z = 0; z < count; z++) {
+        expect_eq(converted[next_index], values[z]);
+        block_sum += values[z];
+        next_index++;
+      }
+    });
+    expect_eq(2500, next_index);
+    expect_eq(sum, block_sum);
+    for (size_t z = 0; z < converted.size(); z++) {
+      expect_eq(z * 7, converted[z]);
+    }
+    auto sub = span.subspan(2490);
+    expect_eq(10, sub.size());
+    expect_eq(2490 * 7, sub[0]);
+    expect_eq(3, span.subspan(100, 3).size());
+    expect_eq(0, span.subspan(2500).size());
+    expect_raises(out_of_range, [&]() -> void { span.subspan(2501); });
+  }
+
   expect_eq("", base64_encode("", 0));
   expect_eq("MQ==", base64_encode("1", 1));
   expect_eq("MTE=", base64_encode("11", 2));
@@ -143,6 +303,181 @@ int main(int, char**) {
   expect_eq("1112", base64_decode("MTExMg==", 8));
   expect_eq("11122", base64_decode("MTExMjI=", 8));
   expect_eq("111222", base64_decode("MTExMjIy", 8));
+  expect_raises(invalid_argument, [&]() -> void { base64_decode("MTE", 3); });
+  expect_raises(invalid_argument, [&]() -> void { base64_decode("MT!x", 4); });
+  expect_raises(invalid_argument, [&]() -> void { base64_decode("MQ==MTEx", 8); });
+  expect_raises(invalid_argument, [&]() -> void { base64_decode("M===", 4); });
+
+  {
+    fwrite_fmt(stdout, "-- base64 long inputs and custom alphabets\n");
+    // The vector paths handle blocks of 12 to 48 input bytes, so test lengths
+    // around those
+    string data = test_data(400);
+    const char* custom_alphabet = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz._";
+    for (const char* alphabet : {DEFAULT_ALPHABET, URLSAFE_ALPHABET, custom_alphabet}) {
+      for (size_t size = 0; size < data.size(); size += ((size < 100) ? 1 : 37)) {
+        string encoded = base64_encode(data.data(), size, alphabet);
+        expect_eq(base64_encoded_size(size), encoded.size());
+        expect_eq(base64_decoded_size(encoded.data(), encoded.size()), size);
+        for (char ch : encoded) {
+          expect(ch == '=' || strchr(alphabet, ch));
+        }
+        expect_eq(string(data.data(), size), base64_decode(encoded, alphabet));
+      }
+    }
+    expect_eq("AAECA_8", base64_encode("\x00\x01\x02\x03\xFF", 5, URLSAFE_ALPHABET).substr(0, 7));
+    expect_eq("AAECA/8", base64_encode("\x00\x01\x02\x03\xFF", 5).substr(0, 7));
+    expect_eq("0042", base64_encode("\x00\x01\x02", 3, custom_alphabet));
+
+    // Invalid characters must be detected even in the middle of a long string
+    string encoded = base64_encode(data);
+    for (size_t z : {0, 15, 16, 40, 63, 300, 531}) {
+      string bad = encoded;
+      bad[z] = '!';
+      expect_raises(invalid_argument, [&]() -> void { base64_decode(bad); });
+      bad[z] = '\x80';
+      expect_raises(invalid_argument, [&]() -> void { base64_decode(bad); });
+      bad[z] = '=';
+      expect_raises(invalid_argument, [&]() -> void { base64_decode(bad); });
+    }
+    // A URL-safe string isn't valid in the default alphabet
+    string urlsafe_encoded = base64_encode(data, URLSAFE_ALPHABET);
+    expect_raises(invalid_argument, [&]() -> void { base64_decode(urlsafe_encoded); });
+
+    char buf[0x400];
+    size_t encoded_size = base64_encode_into(buf, data.data(), 100);
+    expect_eq(base64_encode(data.data(), 100), string(buf, encoded_size));
+    char decoded_buf[0x400];
+    string decoded(decoded_buf, base64_decode_into(decoded_buf, buf, encoded_size));
+    expect_eq(data.substr(0, 100), decoded);
+  }
+
+  {
+    fwrite_fmt(stdout, "-- Base64Encoder/Base64Decoder\n");
+    string data;
+    for (size_t z = 0; z < 1000; z++) {
+      data.push_back(z * 0x3B);
+    }
+    const char* custom_alphabet = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz._";
+    for (const char* alphabet : {DEFAULT_ALPHABET, custom_alphabet}) {
+      string expected = base64_encode(data, alphabet);
+      for (size_t chunk_size : {1, 2, 3, 5, 64, 100, 1000}) {
+        Base64Encoder enc(alphabet);
+        string encoded;
+        for (size_t offset = 0; offset < data.size(); offset += chunk_size) {
+          enc.update(encoded, string_view(data).substr(offset, chunk_size));
+        }
+        enc.finish(encoded);
+        expect_eq(expected, encoded);
+
+        Base64Decoder dec(alphabet);
+        string decoded;
+        for (size_t offset = 0; offset < encoded.size(); offset += chunk_size) {
+          dec.update(decoded, string_view(encoded).substr(offset, chunk_size));
+        }
+        dec.finish();
+        expect_eq(data, decoded);
+      }
+    }
+
+    Base64Decoder dec;
+    string decoded;
+    dec.update(decoded, "MQ");
+    dec.update(decoded, "==");
+    expect_eq("1", decoded);
+    expect_raises(invalid_argument, [&]() -> void { dec.update(decoded, "MTEx"); });
+    dec.finish();
+    dec.update(decoded, "MTE");
+    expect_raises(invalid_argument, [&]() -> void { dec.finish(); });
+  }
+
+  {
+    fwrite_fmt(stdout, "-- hex\n");
+    expect_eq("", hex_encode("", 0));
+    expect_eq("00017FFF", hex_encode("\x00\x01\x7F\xFF", 4));
+    expect_eq("00017fff", hex_encode("\x00\x01\x7F\xFF", 4, true));
+    expect_eq(string("\x00\x01\x7F\xFF\xAB", 5), hex_decode("00017FffaB"));
+    expect_raises(invalid_argument, [&]() -> void { hex_decode("0"); });
+    expect_raises(invalid_argument, [&]() -> void { hex_decode("0G"); });
+    expect_raises(invalid_argument, [&]() -> void { hex_decode("@0"); });
+
+    // The vector paths handle blocks of 16 or 32 bytes, so test lengths around
+    // those, and invalid characters at various positions
+    string data = test_data(300);
+    for (size_t size = 0; size < data.size(); size++) {
+      string encoded = hex_encode(data.data(), size);
+      string expected;
+      for (size_t z = 0; z < size; z++) {
+        expected += std::format("{:02X}", static_cast<uint8_t>(data[z]));
+      }
+      expect_eq(expected, encoded);
+      expect_eq(string(data.data(), size), hex_decode(encoded));
+      string lower_encoded = hex_encode(data.data(), size, true);
+      expect_eq(tolower(expected), lower_encoded);
+      expect_eq(string(data.data(), size), hex_decode(lower_encoded));
+    }
+    string encoded = hex_encode(data);
+    for (size_t z : {0, 15, 16, 31, 40, 63, 64, 300, 599}) {
+      for (char ch : {'g', 'G', '/', ':', '@', '`', '\x80', '\xC1', ' '}) {
+        string bad = encoded;
+        bad[z] = ch;
+        expect_raises(invalid_argument, [&]() -> void { hex_decode(bad); });
+      }
+    }
+  }
+
+  {
+    fwrite_fmt(stdout, "-- base32\n");
+    // Test vectors from RFC 4648
+    static const vector<pair<string, string>> cases = {
+        {"", ""},
+        {"f", "MY======"},
+        {"fo", "MZXQ===="},
+        {"foo", "MZXW6==="},
+        {"foob", "MZXW6YQ="},
+        {"fooba", "MZXW6YTB"},
+        {"foobar", "MZXW6YTBOI======"},
+    };
+    for (const auto& [decoded, encoded] : cases) {
+      expect_eq(encoded, base32_encode(decoded));
+      expect_eq(decoded, base32_decode(encoded));
+      expect_eq(decoded.size(), base32_decoded_size(encoded.data(), encoded.size()));
+    }
+    expect_eq("CPNMUOJ1E8======", base32_encode("foobar", BASE32_HEX_ALPHABET));
+    expect_eq("foobar", base32_decode("CPNMUOJ1E8======", BASE32_HEX_ALPHABET));
+    expect_raises(invalid_argument, [&]() -> void { base32_decode("MZXW6YT"); });
+    expect_raises(invalid_argument, [&]() -> void { base32_decode("MZXW6Y1B"); });
+    expect_raises(invalid_argument, [&]() -> void { base32_decode("MY======MZXW6YTB"); });
+    expect_raises(invalid_argument, [&]() -> void { base32_decode("MZX====="); });
+    expect_raises(invalid_argument, [&]() -> void { base32_decode("MY=====A"); });
+
+    string data;
+    for (size_t z = 0; z < 100; z++) {
+      data.push_back(z * 0x3B);
+      string encoded = base32_encode(data);
+      expect_eq(base32_encoded_size(data.size()), encoded.size());
+      expect_eq(data, base32_decode(encoded));
+    }
+  }
+
+  {
+    fwrite_fmt(stdout, "-- Z85\n");
+    // Test vector from the Z85 specification
+    expect_eq("HelloWorld", z85_encode("\x86\x4F\xD2\x6F\xB5\x59\xF7\x5B", 8));
+    expect_eq(string("\x86\x4F\xD2\x6F\xB5\x59\xF7\x5B", 8), z85_decode("HelloWorld"));
+    expect_eq("%nSc0", z85_encode("\xFF\xFF\xFF\xFF", 4));
+    expect_eq("00000", z85_encode(string(4, '\0')));
+    expect_raises(invalid_argument, [&]() -> void { z85_encode("abc", 3); });
+    expect_raises(invalid_argument, [&]() -> void { z85_decode("Hello"s + "Worl"); });
+    expect_raises(invalid_argument, [&]() -> void { z85_decode("Hell~"); });
+    // %nSc1 is 2^32, which doesn't fit in a block
+    expect_raises(invalid_argument, [&]() -> void { z85_decode("%nSc1"); });
+
+    string data = test_data(400);
+    string encoded = z85_encode(data);
+    expect_eq(z85_encoded_size(data.size()), encoded.size());
+    expect_eq(data, z85_decode(encoded));
+  }
 
   expect_eq("The brick quown jox fumps over the dazy log", rot13("Gur oevpx dhbja wbk shzcf bire gur qnml ybt", 43));
 
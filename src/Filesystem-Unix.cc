@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -148,6 +149,50 @@ bool scoped_fd::is_open() {
   return this->fd >= 0;
 }
 
+MappedFile::MappedFile(int fd, bool sequential) : addr(nullptr), length(fstat(fd).st_size) {
+  if (this->length == 0) {
+    return;
+  }
+  this->addr = mmap(nullptr, this->length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (this->addr == MAP_FAILED) {
+    this->addr = nullptr;
+    throw io_error(fd);
+  }
+  if (sequential) {
+    // This is only a hint, so we ignore failures
+    madvise(this->addr, this->length, MADV_SEQUENTIAL);
+  }
+}
+
+MappedFile::MappedFile(const string& filename, bool sequential)
+    : MappedFile(scoped_fd(filename, O_RDONLY), sequential) {}
+
+MappedFile::MappedFile(MappedFile&& other) : addr(other.addr), length(other.length) {
+  other.addr = nullptr;
+  other.length = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) {
+  this->unmap();
+  this->addr = other.addr;
+  this->length = other.length;
+  other.addr = nullptr;
+  other.length = 0;
+  return *this;
+}
+
+MappedFile::~MappedFile() {
+  this->unmap();
+}
+
+void MappedFile::unmap() {
+  if (this->addr) {
+    munmap(this->addr, this->length);
+    this->addr = nullptr;
+    this->length = 0;
+  }
+}
+
 static FILE* fdopen_binary_raw(int fd, const string& mode) {
   string new_mode = mode;
   if (new_mode.find('b') == string::npos) {
@@ -42,6 +42,33 @@ private:
   int fd;
 };
 
+// Maps an entire file into memory, read-only. The mapping is released when
+// the MappedFile is destroyed. Empty files produce a valid MappedFile with
+// data() == nullptr and size() == 0.
+class MappedFile {
+public:
+  explicit MappedFile(int fd, bool sequential = false);
+  explicit MappedFile(const std::string& filename, bool sequential = false);
+  MappedFile(const MappedFile&) = delete;
+  MappedFile(MappedFile&&);
+  MappedFile& operator=(const MappedFile&) = delete;
+  MappedFile& operator=(MappedFile&&);
+  ~MappedFile();
+
+  inline const void* data() const {
+    return this->addr;
+  }
+  inline size_t size() const {
+    return this->length;
+  }
+
+private:
+  void unmap();
+
+  void* addr;
+  size_t length;
+};
+
 std::unique_ptr<FILE, void (*)(FILE*)> fdopen_unique(int fd, const std::string& mode = "rb");
 std::shared_ptr<FILE> fdopen_shared(int fd, const std::string& mode = "rb");
 std::unique_ptr<FILE, void (*)(FILE*)> fmemopen_unique(const void* buf, size_t size);
@@ -171,6 +171,26 @@ uint8_t fgetcx(FILE* f) {
   return ret;
 }
 
+int fseek64(FILE* f, int64_t offset, int whence) {
+#if defined(PHOSG_WINDOWS)
+  return _fseeki64(f, offset, whence);
+#elif defined(__GLIBC__)
+  return fseeko64(f, offset, whence);
+#else
+  return fseeko(f, offset, whence);
+#endif
+}
+
+int64_t ftell64(FILE* f) {
+#if defined(PHOSG_WINDOWS)
+  return _ftelli64(f);
+#elif defined(__GLIBC__)
+  return ftello64(f);
+#else
+  return ftello(f);
+#endif
+}
+
 std::string fgets(FILE* f) {
   deque<std::string> blocks;
   for (;;) {
@@ -199,9 +219,9 @@ std::string fgets(FILE* f) {
 
 string load_file(const string& filename) {
   auto f = fopen_unique(filename, "rb");
-  fseek(f.get(), 0, SEEK_END);
-  ssize_t file_size = ftell(f.get());
-  fseek(f.get(), 0, SEEK_SET);
+  fseek64(f.get(), 0, SEEK_END);
+  int64_t file_size = ftell64(f.get());
+  fseek64(f.get(), 0, SEEK_SET);
   return freadx(f.get(), file_size);
 }
 
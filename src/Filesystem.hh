@@ -59,6 +59,12 @@ std::string freadx(FILE* f, size_t size);
 void fwritex(FILE* f, const std::string& data);
 uint8_t fgetcx(FILE* f);
 
+// Like fseek and ftell, but with 64-bit offsets on all platforms. (fseek and
+// ftell use long, which is only 32 bits on Windows and 32-bit targets.) The
+// return values are the same as for fseek and ftell.
+int fseek64(FILE* f, int64_t offset, int whence);
+int64_t ftell64(FILE* f);
+
 std::string fgets(FILE* f);
 
 template <typename T>
@@ -99,9 +105,9 @@ void save_object_file(const std::string& filename, const T& obj) {
 template <typename T>
 std::vector<T> load_vector_file(const std::string& filename) {
   auto f = fopen_unique(filename, "rb");
-  fseek(f.get(), 0, SEEK_END);
-  size_t file_size = ftell(f.get());
-  fseek(f.get(), 0, SEEK_SET);
+  fseek64(f.get(), 0, SEEK_END);
+  size_t file_size = ftell64(f.get());
+  fseek64(f.get(), 0, SEEK_SET);
   size_t item_count = file_size / sizeof(T);
   size_t read_size = item_count * sizeof(T);
 
@@ -41,6 +41,21 @@ int main(int, char**) {
 #ifndef PHOSG_WINDOWS
       expect_eq(data.size() + 5, (size_t)stat(symlink_name).st_size);
       expect_eq(data.substr(0, 5) + data, load_file(symlink_name));
+
+      {
+        MappedFile m(filename, true);
+        expect_eq(data.size() + 5, m.size());
+        expect_eq(data.substr(0, 5) + data, string(reinterpret_cast<const char*>(m.data()), m.size()));
+        MappedFile m2(std::move(m));
+        expect_eq(nullptr, m.data());
+        expect_eq(data.size() + 5, m2.size());
+      }
+      save_file(filename, "");
+      {
+        MappedFile m(filename);
+        expect_eq(0, m.size());
+        expect_eq(nullptr, m.data());
+      }
 #endif
 
     } catch (...) {
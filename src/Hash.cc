@@ -3,64 +3,256 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
+#ifndef PHOSG_WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
+#include <algorithm>
+#include <array>
+#include <exception>
 #include <format>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <arm_neon.h>
+#endif
 
 #include "Encoding.hh"
 #include "Filesystem.hh"
 #include "Strings.hh"
+#include "Tools.hh"
 
 using namespace std;
 
 namespace phosg {
 
-// clang-format off
-static const uint32_t crc32_table[0x100] = {
-  0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
-  0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
-  0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
-  0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
-  0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
-  0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
-  0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
-  0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
-  0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
-  0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
-  0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
-  0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
-  0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
-  0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
-  0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
-  0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
-  0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
-  0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
-  0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
-  0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
-  0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
-  0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
-  0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
-  0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
-  0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
-  0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
-  0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
-  0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
-  0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
-  0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
-  0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
-  0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D,
-};
-// clang-format on
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PHOSG_HAVE_X86_DISPATCH
+#endif
+
+// These are only needed if the target doesn't have the ARMv8 CRC32
+// instructions; see crc32() below
+#if !(defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+
+// The tables allow crc32_slice8 to process 8 bytes at a time with 8
+// independent lookups instead of a chain of 8 dependent lookups. See
+// CRCTables in Hash.hh.
+static constexpr const auto& crc32_tables = crc_tables<uint32_t, 0x04C11DB7, true>;
+static_assert(crc32_tables.tables[0][0x01] == 0x77073096);
+static_assert(crc32_tables.tables[0][0xFF] == 0x2D02EF8D);
+
+// The internal functions below take and return the CRC state, which is the
+// bitwise inverse of the public checksum value
+
+static uint32_t crc32_bytewise(const uint8_t* data, size_t size, uint32_t cs) {
+  const auto& table = crc32_tables.tables[0];
+  for (size_t offset = 0; offset < size; offset++) {
+    cs = (cs >> 8) ^ table[(cs ^ data[offset]) & 0xFF];
+  }
+  return cs;
+}
+
+static uint32_t crc32_slice8(const uint8_t* data, size_t size, uint32_t cs) {
+  const auto& t = crc32_tables.tables;
+  size_t offset = 0;
+  for (; offset + 8 <= size; offset += 8) {
+    uint64_t v = reinterpret_cast<const le_uint64_t*>(data + offset)->load() ^ cs;
+    cs = t[7][v & 0xFF] ^ t[6][(v >> 8) & 0xFF] ^ t[5][(v >> 16) & 0xFF] ^ t[4][(v >> 24) & 0xFF] ^
+        t[3][(v >> 32) & 0xFF] ^ t[2][(v >> 40) & 0xFF] ^ t[1][(v >> 48) & 0xFF] ^ t[0][v >> 56];
+  }
+  return crc32_bytewise(data + offset, size - offset, cs);
+}
+
+#endif
+
+#ifdef PHOSG_HAVE_X86_DISPATCH
+
+// Multiplies both halves of v by the corresponding folding constants in k and
+// adds the next block of data
+__attribute__((target("pclmul"))) static inline __m128i crc32_fold(__m128i v, __m128i k, __m128i next) {
+  __m128i lo = _mm_clmulepi64_si128(v, k, 0x00);
+  __m128i hi = _mm_clmulepi64_si128(v, k, 0x11);
+  return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+// Folds 64-byte blocks of the input into a 128-bit remainder using carry-less
+// multiplication, then reduces it to 32 bits. This is the algorithm from
+// Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+// Instruction" paper, using the bit-reflected constants for the CRC-32
+// polynomial given there. size must be at least 64 and a multiple of 16.
+__attribute__((target("pclmul,sse4.1"))) static uint32_t crc32_pclmul(const uint8_t* data, size_t size, uint32_t cs) {
+  const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596, 0x0154442BD4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009E, 0x01751997D0);
+  const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163CD6124);
+  const __m128i poly = _mm_set_epi64x(0x01F7011641, 0x01DB710641);
+  const __m128i low32_mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  __m128i x1 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), _mm_cvtsi32_si128(cs));
+  __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10));
+  __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20));
+  __m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30));
+  size_t offset = 0x40;
+
+  // Fold four blocks at a time, which keeps four independent multiplications
+  // in flight
+  for (; offset + 0x40 <= size; offset += 0x40) {
+    x1 = crc32_fold(x1, k1k2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset)));
+    x2 = crc32_fold(x2, k1k2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset + 0x10)));
+    x3 = crc32_fold(x3, k1k2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset + 0x20)));
+    x4 = crc32_fold(x4, k1k2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset + 0x30)));
+  }
+
+  // Fold the four remainders into one, then fold any remaining 16-byte blocks
+  x1 = crc32_fold(x1, k3k4, x2);
+  x1 = crc32_fold(x1, k3k4, x3);
+  x1 = crc32_fold(x1, k3k4, x4);
+  for (; offset + 0x10 <= size; offset += 0x10) {
+    x1 = crc32_fold(x1, k3k4, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset)));
+  }
+
+  // Fold 128 bits to 64 bits
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32_mask), k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett-reduce to 32 bits
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32_mask), poly, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, low32_mask), poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return _mm_extract_epi32(x1, 1);
+}
+
+#endif
 
 uint32_t crc32(const void* vdata, size_t size, uint32_t cs) {
   const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
-
   cs = ~cs;
-  for (size_t offset = 0; offset < size; offset++) {
-    uint8_t table_offset = cs ^ data[offset];
-    cs = (cs >> 8) ^ crc32_table[table_offset];
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  // ARMv8 has instructions for exactly this CRC, so use them directly when
+  // the target guarantees they're available
+  size_t offset = 0;
+  for (; offset + 8 <= size; offset += 8) {
+    cs = __crc32d(cs, reinterpret_cast<const le_uint64_t*>(data + offset)->load());
+  }
+  for (; offset < size; offset++) {
+    cs = __crc32b(cs, data[offset]);
   }
   return ~cs;
+
+#else
+#ifdef PHOSG_HAVE_X86_DISPATCH
+  static const bool use_pclmul = x86_features().pclmul && x86_features().sse41;
+  if (use_pclmul && (size >= 0x40)) {
+    size_t folded_size = size & ~static_cast<size_t>(0x0F);
+    cs = crc32_pclmul(data, folded_size, cs);
+    data += folded_size;
+    size -= folded_size;
+  }
+#endif
+  return ~crc32_slice8(data, size, cs);
+#endif
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t size2) {
+  return CRC32IEEE::combine(crc1, crc2, size2);
+}
+
+#ifdef PHOSG_HAVE_X86_DISPATCH
+
+// The crc32 instruction has a latency of 3 cycles, but a new one can start
+// every cycle. So, for long inputs, this checksums three adjacent blocks at a
+// time, then combines the results by shifting the first two forward. Since the
+// block size is fixed, that shift is a multiplication by a constant, which
+// can be done with table lookups like a normal CRC update.
+constexpr size_t CRC32C_INTERLEAVE_BLOCK_SIZE = 0x400;
+
+struct CRC32CBlockShiftTables {
+  uint32_t tables[4][0x100];
+
+  constexpr CRC32CBlockShiftTables() : tables() {
+    for (size_t n = 0; n < 4; n++) {
+      for (uint32_t x = 0; x < 0x100; x++) {
+        this->tables[n][x] = CRC32C::shift(x << (n * 8), CRC32C_INTERLEAVE_BLOCK_SIZE);
+      }
+    }
+  }
+
+  inline uint32_t shift(uint32_t reg) const {
+    return this->tables[0][reg & 0xFF] ^ this->tables[1][(reg >> 8) & 0xFF] ^
+        this->tables[2][(reg >> 16) & 0xFF] ^ this->tables[3][reg >> 24];
+  }
+};
+static constexpr CRC32CBlockShiftTables crc32c_block_shift_tables;
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(const uint8_t* data, size_t size, uint32_t reg) {
+  constexpr size_t block_size = CRC32C_INTERLEAVE_BLOCK_SIZE;
+  while (size >= block_size * 3) {
+    uint64_t reg0 = reg, reg1 = 0, reg2 = 0;
+    for (size_t offset = 0; offset < block_size; offset += 8) {
+      reg0 = _mm_crc32_u64(reg0, reinterpret_cast<const le_uint64_t*>(data + offset)->load());
+      reg1 = _mm_crc32_u64(reg1, reinterpret_cast<const le_uint64_t*>(data + block_size + offset)->load());
+      reg2 = _mm_crc32_u64(reg2, reinterpret_cast<const le_uint64_t*>(data + 2 * block_size + offset)->load());
+    }
+    reg = crc32c_block_shift_tables.shift(crc32c_block_shift_tables.shift(reg0) ^ reg1) ^ reg2;
+    data += block_size * 3;
+    size -= block_size * 3;
+  }
+
+  uint64_t reg64 = reg;
+  for (; size >= 8; data += 8, size -= 8) {
+    reg64 = _mm_crc32_u64(reg64, reinterpret_cast<const le_uint64_t*>(data)->load());
+  }
+  reg = reg64;
+  for (; size > 0; data++, size--) {
+    reg = _mm_crc32_u8(reg, *data);
+  }
+  return reg;
+}
+
+#endif
+
+uint32_t crc32c(const void* vdata, size_t size, uint32_t cs) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  uint32_t reg = ~cs;
+  size_t offset = 0;
+  for (; offset + 8 <= size; offset += 8) {
+    reg = __crc32cd(reg, reinterpret_cast<const le_uint64_t*>(data + offset)->load());
+  }
+  for (; offset < size; offset++) {
+    reg = __crc32cb(reg, data[offset]);
+  }
+  return ~reg;
+
+#else
+#ifdef PHOSG_HAVE_X86_DISPATCH
+  static const bool use_sse42 = x86_features().sse42;
+  if (use_sse42) {
+    return ~crc32c_sse42(data, size, ~cs);
+  }
+#endif
+  return CRC32C::compute(data, size, cs);
+#endif
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t size2) {
+  return CRC32C::combine(crc1, crc2, size2);
+}
+
+uint64_t crc64(const void* data, size_t size, uint64_t cs) {
+  return CRC64XZ::compute(data, size, cs);
 }
 
 uint32_t fnv1a32(const void* data, size_t size, uint32_t hash) {
@@ -91,40 +283,149 @@ uint64_t fnv1a64(const string& data, uint64_t hash) {
   return fnv1a64(data.data(), data.size(), hash);
 }
 
-MD5::MD5(const void* data, size_t size) {
-  this->a0 = 0x67452301;
-  this->b0 = 0xEFCDAB89;
-  this->c0 = 0x98BADCFE;
-  this->d0 = 0x10325476;
-
-  auto process_block = [this](const void* block) -> void {
-    // clang-format off
-    static const uint32_t shifts[64] = {
-        7, 12, 17, 22,  7, 12, 17, 22,  7, 12, 17, 22,  7, 12, 17, 22,
-        5,  9, 14, 20,  5,  9, 14, 20,  5,  9, 14, 20,  5,  9, 14, 20,
-        4, 11, 16, 23,  4, 11, 16, 23,  4, 11, 16, 23,  4, 11, 16, 23,
-        6, 10, 15, 21,  6, 10, 15, 21,  6, 10, 15, 21,  6, 10, 15, 21};
-    static const uint32_t sine_table[64] = {
-        0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE,
-        0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
-        0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE,
-        0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
-        0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA,
-        0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
-        0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED,
-        0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
-        0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C,
-        0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
-        0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05,
-        0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
-        0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039,
-        0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
-        0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1,
-        0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391};
-    // clang-format on
-    const le_uint32_t* fields = reinterpret_cast<const le_uint32_t*>(block);
-
-    uint32_t a = this->a0, b = this->b0, c = this->c0, d = this->d0;
+BlockHasher::BlockHasher(ProcessBlocksFn process_blocks, bool big_endian_length)
+    : process_blocks(process_blocks),
+      big_endian_length(big_endian_length),
+      h(),
+      buffer_size(0),
+      total_size(0) {}
+
+void BlockHasher::update(const void* vdata, size_t size) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  this->total_size += size;
+
+  // If there's a partial block from the last call, complete it first
+  if (this->buffer_size) {
+    size_t bytes_to_copy = min<size_t>(size, sizeof(this->buffer) - this->buffer_size);
+    memcpy(this->buffer + this->buffer_size, data, bytes_to_copy);
+    this->buffer_size += bytes_to_copy;
+    data += bytes_to_copy;
+    size -= bytes_to_copy;
+    if (this->buffer_size < sizeof(this->buffer)) {
+      return;
+    }
+    this->process_blocks(this->h, this->buffer, 1);
+    this->buffer_size = 0;
+  }
+
+  // Process all complete blocks directly from the input, then save the rest
+  size_t num_blocks = size / sizeof(this->buffer);
+  if (num_blocks) {
+    this->process_blocks(this->h, data, num_blocks);
+  }
+  size_t processed_size = num_blocks * sizeof(this->buffer);
+  memcpy(this->buffer, data + processed_size, size - processed_size);
+  this->buffer_size = size - processed_size;
+}
+
+void BlockHasher::update(const string& data) {
+  this->update(data.data(), data.size());
+}
+
+// Calls hasher.update() with everything remaining in the file, in large
+// chunks. Used by the update_file and update_fd functions of all hashers.
+template <typename HasherT>
+static void update_from_file(HasherT& hasher, FILE* f) {
+  string buffer(0x100000, '\0');
+  for (;;) {
+    size_t bytes_read = ::fread(buffer.data(), 1, buffer.size(), f);
+    if (bytes_read == 0) {
+      if (ferror(f)) {
+        throw io_error(fileno(f));
+      }
+      break;
+    }
+    hasher.update(buffer.data(), bytes_read);
+  }
+}
+
+#ifndef PHOSG_WINDOWS
+template <typename HasherT>
+static void update_from_fd(HasherT& hasher, int fd) {
+  string buffer(0x100000, '\0');
+  for (;;) {
+    ssize_t bytes_read = ::read(fd, buffer.data(), buffer.size());
+    if (bytes_read < 0) {
+      throw io_error(fd);
+    } else if (bytes_read == 0) {
+      break;
+    }
+    hasher.update(buffer.data(), bytes_read);
+  }
+}
+#endif
+
+void BlockHasher::update_file(FILE* f) {
+  update_from_file(*this, f);
+}
+
+#ifndef PHOSG_WINDOWS
+void BlockHasher::update_fd(int fd) {
+  update_from_fd(*this, fd);
+}
+#endif
+
+// Writes the final block(s) of a message to dest (which must have room for
+// two blocks) and returns how many blocks were written. tail is the part of
+// the message after the last complete block (less than 0x40 bytes), and the
+// trailer is a single 1 bit, then zeroes until the end of the second-to-last
+// 8 bytes of a block, then the message length in bits. This could result in
+// either one or two blocks.
+static size_t write_hash_trailer(
+    uint8_t* dest, const uint8_t* tail, size_t tail_size, uint64_t total_size, bool big_endian_length) {
+  size_t num_blocks = (tail_size >= 0x38) ? 2 : 1;
+  size_t length_offset = num_blocks * 0x40 - 8;
+  memcpy(dest, tail, tail_size);
+  dest[tail_size] = 0x80;
+  memset(dest + tail_size + 1, 0, length_offset - tail_size - 1);
+  if (big_endian_length) {
+    *reinterpret_cast<be_uint64_t*>(dest + length_offset) = total_size << 3;
+  } else {
+    *reinterpret_cast<le_uint64_t*>(dest + length_offset) = total_size << 3;
+  }
+  return num_blocks;
+}
+
+void BlockHasher::finish() {
+  uint8_t trailer[0x80];
+  size_t num_blocks = write_hash_trailer(trailer, this->buffer, this->buffer_size, this->total_size, this->big_endian_length);
+  this->process_blocks(this->h, trailer, num_blocks);
+  this->buffer_size = 0;
+}
+
+// clang-format off
+static const uint32_t md5_shifts[64] = {
+    7, 12, 17, 22,  7, 12, 17, 22,  7, 12, 17, 22,  7, 12, 17, 22,
+    5,  9, 14, 20,  5,  9, 14, 20,  5,  9, 14, 20,  5,  9, 14, 20,
+    4, 11, 16, 23,  4, 11, 16, 23,  4, 11, 16, 23,  4, 11, 16, 23,
+    6, 10, 15, 21,  6, 10, 15, 21,  6, 10, 15, 21,  6, 10, 15, 21};
+static const uint32_t md5_sine_table[64] = {
+    0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE,
+    0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+    0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE,
+    0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+    0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA,
+    0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+    0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED,
+    0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+    0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C,
+    0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+    0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05,
+    0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+    0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039,
+    0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+    0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1,
+    0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391};
+// clang-format on
+
+static const uint32_t md5_initial_state[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+
+static void md5_process_blocks(uint32_t* h, const uint8_t* data, size_t num_blocks) {
+
+  for (; num_blocks > 0; num_blocks--, data += 0x40) {
+    const le_uint32_t* fields = reinterpret_cast<const le_uint32_t*>(data);
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
     for (size_t x = 0; x < 64; x++) {
       uint32_t f, g;
       if (x < 16) {
@@ -141,36 +442,37 @@ MD5::MD5(const void* data, size_t size) {
         g = (7 * x) & 15;
       }
       uint32_t dt = d;
-      uint32_t b_addend = a + f + sine_table[x] + fields[g];
+      uint32_t b_addend = a + f + md5_sine_table[x] + fields[g];
       d = c;
       c = b;
-      b = b + ((b_addend << shifts[x]) | (b_addend >> (32 - shifts[x])));
+      b = b + ((b_addend << md5_shifts[x]) | (b_addend >> (32 - md5_shifts[x])));
       a = dt;
     }
-    this->a0 += a;
-    this->b0 += b;
-    this->c0 += c;
-    this->d0 += d;
-  };
-
-  // Process all possible blocks from the input until just before the end
-  size_t processed_offset;
-  for (processed_offset = 0; processed_offset + 0x3F < size; processed_offset += 0x40) {
-    process_block(reinterpret_cast<const uint8_t*>(data) + processed_offset);
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
   }
+}
 
-  // Make a copy of the last (possibly incomplete) block, append the trailer,
-  // and process what remains. This could result in either one or two blocks.
-  StringWriter w;
-  w.write(reinterpret_cast<const char*>(data) + processed_offset, size - processed_offset);
-  {
-    w.put_u8(0x80);
-    w.extend_to((w.size() > 0x38) ? 0x80 : 0x40, '\0');
-    w.pput_u64l(w.size() - 8, size << 3);
-  }
-  for (size_t z = 0; z < w.size(); z += 0x40) {
-    process_block(w.str().data() + z);
-  }
+MD5Hasher::MD5Hasher() : BlockHasher(md5_process_blocks, false) {
+  memcpy(this->h, md5_initial_state, sizeof(md5_initial_state));
+}
+
+MD5 MD5Hasher::finalize() {
+  this->finish();
+  MD5 ret;
+  ret.a0 = this->h[0];
+  ret.b0 = this->h[1];
+  ret.c0 = this->h[2];
+  ret.d0 = this->h[3];
+  return ret;
+}
+
+MD5::MD5(const void* data, size_t size) {
+  MD5Hasher hasher;
+  hasher.update(data, size);
+  *this = hasher.finalize();
 }
 
 MD5::MD5(const std::string& data) : MD5(data.data(), data.size()) {}
@@ -185,19 +487,14 @@ string MD5::bin() const {
 }
 
 string MD5::hex() const {
-  return format("{:08X}{:08X}{:08X}{:08X}", bswap32(this->a0), bswap32(this->b0), bswap32(this->c0), bswap32(this->d0));
+  le_uint32_t words[4] = {this->a0, this->b0, this->c0, this->d0};
+  return hex_encode(words, sizeof(words));
 }
 
-SHA1::SHA1(const void* data, size_t size) {
-  this->h[0] = 0x67452301;
-  this->h[1] = 0xEFCDAB89;
-  this->h[2] = 0x98BADCFE;
-  this->h[3] = 0x10325476;
-  this->h[4] = 0xC3D2E1F0;
-
-  auto process_block = [this](const void* block) -> void {
+static void sha1_process_blocks(uint32_t* h, const uint8_t* data, size_t num_blocks) {
+  for (; num_blocks > 0; num_blocks--, data += 0x40) {
     uint32_t extended_fields[80];
-    memcpy(extended_fields, block, 0x40);
+    memcpy(extended_fields, data, 0x40);
 #ifdef PHOSG_LITTLE_ENDIAN
     for (size_t x = 0; x < 16; x++) {
       extended_fields[x] = bswap32(extended_fields[x]);
@@ -209,7 +506,7 @@ SHA1::SHA1(const void* data, size_t size) {
       extended_fields[x] = (z << 1) | ((z >> 31) & 1);
     }
 
-    uint32_t a = this->h[0], b = this->h[1], c = this->h[2], d = this->h[3], e = this->h[4];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
     for (size_t x = 0; x < 80; x++) {
       uint32_t f, k;
       if (x < 20) {
@@ -234,31 +531,146 @@ SHA1::SHA1(const void* data, size_t size) {
       a = new_a;
     }
 
-    this->h[0] += a;
-    this->h[1] += b;
-    this->h[2] += c;
-    this->h[3] += d;
-    this->h[4] += e;
-  };
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+}
+
+using ProcessBlocksFn = void (*)(uint32_t* h, const uint8_t* data, size_t num_blocks);
 
-  // Process all possible blocks from the input until just before the end
-  size_t processed_offset;
-  for (processed_offset = 0; processed_offset + 0x3F < size; processed_offset += 0x40) {
-    process_block(reinterpret_cast<const uint8_t*>(data) + processed_offset);
+#ifdef PHOSG_HAVE_X86_DISPATCH
+
+// Does rounds 4G through 4G+3 of SHA-1 using the SHA-NI instructions, and
+// computes the message schedule for later rounds using the current group's
+// message words. msgs holds the message schedule for 4 consecutive groups.
+template <size_t G>
+__attribute__((target("sha,sse4.1,ssse3"))) static inline void sha1_shani_rounds(
+    __m128i& abcd, __m128i& e0, __m128i& e1, __m128i* msgs) {
+  __m128i msg = msgs[G & 3];
+  if constexpr (G == 0) {
+    e0 = _mm_add_epi32(e0, msg);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+  } else if constexpr (G & 1) {
+    e1 = _mm_sha1nexte_epu32(e1, msg);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, G / 5);
+  } else {
+    e0 = _mm_sha1nexte_epu32(e0, msg);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, G / 5);
+  }
+  if constexpr ((G >= 3) && (G <= 18)) {
+    msgs[(G - 3) & 3] = _mm_sha1msg2_epu32(msgs[(G - 3) & 3], msg);
+  }
+  if constexpr ((G >= 2) && (G <= 17)) {
+    msgs[(G - 2) & 3] = _mm_xor_si128(msgs[(G - 2) & 3], msg);
   }
+  if constexpr ((G >= 1) && (G <= 16)) {
+    msgs[(G - 1) & 3] = _mm_sha1msg1_epu32(msgs[(G - 1) & 3], msg);
+  }
+  if constexpr (G < 19) {
+    sha1_shani_rounds<G + 1>(abcd, e0, e1, msgs);
+  }
+}
 
-  // Make a copy of the last (possibly incomplete) block, append the trailer,
-  // and process what remains. This could result in either one or two blocks.
-  StringWriter w;
-  w.write(reinterpret_cast<const char*>(data) + processed_offset, size - processed_offset);
-  {
-    w.put_u8(0x80);
-    w.extend_to((w.size() > 0x38) ? 0x80 : 0x40, '\0');
-    w.pput_u64b(w.size() - 8, size << 3);
+__attribute__((target("sha,sse4.1,ssse3"))) static void sha1_process_blocks_shani(
+    uint32_t* h, const uint8_t* data, size_t num_blocks) {
+  const __m128i byteswap_mask = _mm_set_epi64x(0x0001020304050607, 0x08090A0B0C0D0E0F);
+  __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h)), 0x1B);
+  __m128i e0 = _mm_set_epi32(h[4], 0, 0, 0);
+
+  for (; num_blocks > 0; num_blocks--, data += 0x40) {
+    __m128i abcd_save = abcd;
+    __m128i e0_save = e0;
+    __m128i e1;
+    __m128i msgs[4];
+    for (size_t x = 0; x < 4; x++) {
+      msgs[x] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + x * 0x10)), byteswap_mask);
+    }
+    sha1_shani_rounds<0>(abcd, e0, e1, msgs);
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(h), _mm_shuffle_epi32(abcd, 0x1B));
+  h[4] = _mm_extract_epi32(e0, 3);
+}
+
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define PHOSG_HAVE_ARM_SHA
+
+static void sha1_process_blocks_arm(uint32_t* h, const uint8_t* data, size_t num_blocks) {
+  static const uint32_t round_constants[4] = {0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6};
+  uint32x4_t abcd = vld1q_u32(h);
+  uint32_t e = h[4];
+
+  for (; num_blocks > 0; num_blocks--, data += 0x40) {
+    uint32x4_t abcd_save = abcd;
+    uint32_t e_save = e;
+    uint32x4_t msgs[4];
+    for (size_t x = 0; x < 4; x++) {
+      msgs[x] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + x * 0x10)));
+    }
+    for (size_t g = 0; g < 20; g++) {
+      if (g >= 4) {
+        msgs[g & 3] = vsha1su1q_u32(vsha1su0q_u32(msgs[g & 3], msgs[(g + 1) & 3], msgs[(g + 2) & 3]), msgs[(g + 3) & 3]);
+      }
+      uint32x4_t wk = vaddq_u32(msgs[g & 3], vdupq_n_u32(round_constants[g / 5]));
+      uint32_t next_e = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+      if (g < 5) {
+        abcd = vsha1cq_u32(abcd, e, wk);
+      } else if ((g < 10) || (g >= 15)) {
+        abcd = vsha1pq_u32(abcd, e, wk);
+      } else {
+        abcd = vsha1mq_u32(abcd, e, wk);
+      }
+      e = next_e;
+    }
+    abcd = vaddq_u32(abcd, abcd_save);
+    e += e_save;
   }
-  for (size_t z = 0; z < w.size(); z += 0x40) {
-    process_block(w.str().data() + z);
+
+  vst1q_u32(h, abcd);
+  h[4] = e;
+}
+
+#endif
+
+static ProcessBlocksFn sha1_best_process_blocks() {
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+  const auto& features = x86_features();
+  if (features.sha && features.sse41 && features.ssse3) {
+    return sha1_process_blocks_shani;
   }
+#elif defined(PHOSG_HAVE_ARM_SHA)
+  return sha1_process_blocks_arm;
+#endif
+  return sha1_process_blocks;
+}
+
+SHA1Hasher::SHA1Hasher() : BlockHasher(sha1_best_process_blocks(), true) {
+  this->h[0] = 0x67452301;
+  this->h[1] = 0xEFCDAB89;
+  this->h[2] = 0x98BADCFE;
+  this->h[3] = 0x10325476;
+  this->h[4] = 0xC3D2E1F0;
+}
+
+SHA1 SHA1Hasher::finalize() {
+  this->finish();
+  SHA1 ret;
+  memcpy(ret.h, this->h, sizeof(ret.h));
+  return ret;
+}
+
+SHA1::SHA1(const void* data, size_t size) {
+  SHA1Hasher hasher;
+  hasher.update(data, size);
+  *this = hasher.finalize();
 }
 
 SHA1::SHA1(const std::string& data) : SHA1(data.data(), data.size()) {}
@@ -274,37 +686,32 @@ std::string SHA1::bin() const {
 }
 
 std::string SHA1::hex() const {
-  return format("{:08X}{:08X}{:08X}{:08X}{:08X}", this->h[0], this->h[1], this->h[2], this->h[3], this->h[4]);
+  be_uint32_t words[5] = {this->h[0], this->h[1], this->h[2], this->h[3], this->h[4]};
+  return hex_encode(words, sizeof(words));
 }
 
 static inline uint32_t rotate_right(uint32_t x, uint8_t bits) {
   return (x >> bits) | (x << (32 - bits));
 }
 
-SHA256::SHA256(const void* data, size_t size) {
-  this->h[0] = 0x6A09E667;
-  this->h[1] = 0xBB67AE85;
-  this->h[2] = 0x3C6EF372;
-  this->h[3] = 0xA54FF53A;
-  this->h[4] = 0x510E527F;
-  this->h[5] = 0x9B05688C;
-  this->h[6] = 0x1F83D9AB;
-  this->h[7] = 0x5BE0CD19;
-
-  // clang-format off
-  static const uint32_t k[64] = {
-    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
-    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
-    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
-    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
-    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
-    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
-    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
-    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
-  };
-  // clang-format on
+static const uint32_t sha256_initial_state[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+
+// clang-format off
+static const uint32_t sha256_k[64] = {
+  0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+  0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+  0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+  0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+  0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+  0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+  0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+  0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+// clang-format on
 
-  auto process_block = [this](const void* data) {
+static void sha256_process_blocks(uint32_t* h, const uint8_t* data, size_t num_blocks) {
+  for (; num_blocks > 0; num_blocks--, data += 0x40) {
     uint32_t w[64];
     memcpy(w, data, 0x40);
 #ifdef PHOSG_LITTLE_ENDIAN
@@ -321,13 +728,13 @@ SHA256::SHA256(const void* data, size_t size) {
 
     uint32_t z[8];
     for (size_t x = 0; x < 8; x++) {
-      z[x] = this->h[x];
+      z[x] = h[x];
     }
 
     for (size_t x = 0; x < 64; x++) {
       uint32_t s1 = rotate_right(z[4], 6) ^ rotate_right(z[4], 11) ^ rotate_right(z[4], 25);
       uint32_t s0 = rotate_right(z[0], 2) ^ rotate_right(z[0], 13) ^ rotate_right(z[0], 22);
-      uint32_t temp1 = z[7] + s1 + ((z[4] & z[5]) ^ ((~z[4]) & z[6])) + k[x] + w[x];
+      uint32_t temp1 = z[7] + s1 + ((z[4] & z[5]) ^ ((~z[4]) & z[6])) + sha256_k[x] + w[x];
       uint32_t temp2 = s0 + ((z[0] & z[1]) ^ (z[0] & z[2]) ^ (z[1] & z[2]));
       z[7] = z[6];
       z[6] = z[5];
@@ -340,28 +747,110 @@ SHA256::SHA256(const void* data, size_t size) {
     }
 
     for (size_t x = 0; x < 8; x++) {
-      this->h[x] += z[x];
+      h[x] += z[x];
     }
-  };
+  }
+}
 
-  // Process all possible blocks from the input until just before the end
-  size_t processed_offset;
-  for (processed_offset = 0; processed_offset + 0x3F < size; processed_offset += 0x40) {
-    process_block(reinterpret_cast<const uint8_t*>(data) + processed_offset);
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+
+__attribute__((target("sha,sse4.1,ssse3"))) static void sha256_process_blocks_shani(
+    uint32_t* h, const uint8_t* data, size_t num_blocks) {
+  const __m128i byteswap_mask = _mm_set_epi64x(0x0C0D0E0F08090A0B, 0x0405060700010203);
+
+  // The SHA-NI instructions expect the state as {A, B, E, F} and {C, D, G, H}
+  __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h)), 0xB1);
+  __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h + 4)), 0x1B);
+  __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+  __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+  for (; num_blocks > 0; num_blocks--, data += 0x40) {
+    __m128i abef_save = abef;
+    __m128i cdgh_save = cdgh;
+    __m128i msgs[4];
+    for (size_t x = 0; x < 4; x++) {
+      msgs[x] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + x * 0x10)), byteswap_mask);
+    }
+    for (size_t g = 0; g < 16; g++) {
+      if (g >= 4) {
+        __m128i& msg = msgs[g & 3];
+        msg = _mm_sha256msg1_epu32(msg, msgs[(g + 1) & 3]);
+        msg = _mm_add_epi32(msg, _mm_alignr_epi8(msgs[(g + 3) & 3], msgs[(g + 2) & 3], 4));
+        msg = _mm_sha256msg2_epu32(msg, msgs[(g + 3) & 3]);
+      }
+      __m128i wk = _mm_add_epi32(msgs[g & 3], _mm_loadu_si128(reinterpret_cast<const __m128i*>(&sha256_k[g * 4])));
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0E));
+    }
+    abef = _mm_add_epi32(abef, abef_save);
+    cdgh = _mm_add_epi32(cdgh, cdgh_save);
   }
 
-  // Make a copy of the last (possibly incomplete) block, append the trailer,
-  // and process what remains. This could result in either one or two blocks.
-  StringWriter w;
-  w.write(reinterpret_cast<const char*>(data) + processed_offset, size - processed_offset);
-  {
-    w.put_u8(0x80);
-    w.extend_to((w.size() > 0x38) ? 0x80 : 0x40, '\0');
-    w.pput_u64b(w.size() - 8, size << 3);
+  __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+  __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(h), _mm_blend_epi16(feba, dchg, 0xF0));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(h + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+#elif defined(PHOSG_HAVE_ARM_SHA)
+
+static void sha256_process_blocks_arm(uint32_t* h, const uint8_t* data, size_t num_blocks) {
+  uint32x4_t abcd = vld1q_u32(h);
+  uint32x4_t efgh = vld1q_u32(h + 4);
+
+  for (; num_blocks > 0; num_blocks--, data += 0x40) {
+    uint32x4_t abcd_save = abcd;
+    uint32x4_t efgh_save = efgh;
+    uint32x4_t msgs[4];
+    for (size_t x = 0; x < 4; x++) {
+      msgs[x] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + x * 0x10)));
+    }
+    for (size_t g = 0; g < 16; g++) {
+      if (g >= 4) {
+        msgs[g & 3] = vsha256su1q_u32(vsha256su0q_u32(msgs[g & 3], msgs[(g + 1) & 3]), msgs[(g + 2) & 3], msgs[(g + 3) & 3]);
+      }
+      uint32x4_t wk = vaddq_u32(msgs[g & 3], vld1q_u32(&sha256_k[g * 4]));
+      uint32x4_t prev_abcd = abcd;
+      abcd = vsha256hq_u32(abcd, efgh, wk);
+      efgh = vsha256h2q_u32(efgh, prev_abcd, wk);
+    }
+    abcd = vaddq_u32(abcd, abcd_save);
+    efgh = vaddq_u32(efgh, efgh_save);
   }
-  for (size_t z = 0; z < w.size(); z += 0x40) {
-    process_block(w.str().data() + z);
+
+  vst1q_u32(h, abcd);
+  vst1q_u32(h + 4, efgh);
+}
+
+#endif
+
+static ProcessBlocksFn sha256_best_process_blocks() {
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+  const auto& features = x86_features();
+  if (features.sha && features.sse41 && features.ssse3) {
+    return sha256_process_blocks_shani;
   }
+#elif defined(PHOSG_HAVE_ARM_SHA)
+  return sha256_process_blocks_arm;
+#endif
+  return sha256_process_blocks;
+}
+
+SHA256Hasher::SHA256Hasher() : BlockHasher(sha256_best_process_blocks(), true) {
+  memcpy(this->h, sha256_initial_state, sizeof(sha256_initial_state));
+}
+
+SHA256 SHA256Hasher::finalize() {
+  this->finish();
+  SHA256 ret;
+  memcpy(ret.h, this->h, sizeof(ret.h));
+  return ret;
+}
+
+SHA256::SHA256(const void* data, size_t size) {
+  SHA256Hasher hasher;
+  hasher.update(data, size);
+  *this = hasher.finalize();
 }
 
 SHA256::SHA256(const string& data) : SHA256(data.data(), data.size()) {}
@@ -380,8 +869,950 @@ std::string SHA256::bin() const {
 }
 
 std::string SHA256::hex() const {
-  return format("{:08X}{:08X}{:08X}{:08X}{:08X}{:08X}{:08X}{:08X}",
-      this->h[0], this->h[1], this->h[2], this->h[3], this->h[4], this->h[5], this->h[6], this->h[7]);
+  be_uint32_t words[8];
+  for (size_t z = 0; z < 8; z++) {
+    words[z] = this->h[z];
+  }
+  return hex_encode(words, sizeof(words));
+}
+
+#ifdef PHOSG_HAVE_X86_DISPATCH
+
+// Multi-buffer hashing: each of the 8 32-bit lanes of an AVX2 register holds
+// the state of a different message, so a kernel processes one block from each
+// of 8 messages at once. State is stored transposed (state[word][lane]).
+static constexpr size_t MULTI_HASH_LANES = 8;
+using MultiBlocksFn = void (*)(uint32_t (*state)[MULTI_HASH_LANES], const uint8_t* const* blocks);
+
+// Helpers for the kernels below. Shifts take their counts in a register so
+// that they work with non-constant counts (as in MD5).
+__attribute__((target("avx2"))) static inline __m256i avx2_rotl32(__m256i v, int bits) {
+  return _mm256_or_si256(_mm256_sll_epi32(v, _mm_cvtsi32_si128(bits)), _mm256_srl_epi32(v, _mm_cvtsi32_si128(32 - bits)));
+}
+__attribute__((target("avx2"))) static inline __m256i avx2_rotr32(__m256i v, int bits) {
+  return avx2_rotl32(v, 32 - bits);
+}
+__attribute__((target("avx2"))) static inline __m256i avx2_shr32(__m256i v, int bits) {
+  return _mm256_srl_epi32(v, _mm_cvtsi32_si128(bits));
+}
+__attribute__((target("avx2"))) static inline __m256i avx2_load(const uint32_t* data) {
+  return _mm256_load_si256(reinterpret_cast<const __m256i*>(data));
+}
+__attribute__((target("avx2"))) static inline void avx2_store(uint32_t* data, __m256i v) {
+  _mm256_store_si256(reinterpret_cast<__m256i*>(data), v);
+}
+
+__attribute__((target("avx2"))) static void md5_process_8_blocks_avx2(
+    uint32_t (*state)[MULTI_HASH_LANES], const uint8_t* const* blocks) {
+  alignas(32) uint32_t fields[16][MULTI_HASH_LANES];
+  for (size_t lane = 0; lane < MULTI_HASH_LANES; lane++) {
+    const le_uint32_t* block_fields = reinterpret_cast<const le_uint32_t*>(blocks[lane]);
+    for (size_t x = 0; x < 16; x++) {
+      fields[x][lane] = block_fields[x];
+    }
+  }
+
+  __m256i a0 = avx2_load(state[0]), b0 = avx2_load(state[1]), c0 = avx2_load(state[2]), d0 = avx2_load(state[3]);
+  __m256i a = a0, b = b0, c = c0, d = d0;
+  for (size_t x = 0; x < 64; x++) {
+    __m256i f;
+    size_t g;
+    if (x < 16) {
+      f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d));
+      g = x;
+    } else if (x < 32) {
+      f = _mm256_or_si256(_mm256_and_si256(b, d), _mm256_andnot_si256(d, c));
+      g = ((5 * x) + 1) & 15;
+    } else if (x < 48) {
+      f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+      g = ((3 * x) + 5) & 15;
+    } else {
+      f = _mm256_xor_si256(c, _mm256_or_si256(b, _mm256_xor_si256(d, _mm256_set1_epi32(-1))));
+      g = (7 * x) & 15;
+    }
+    __m256i b_addend = _mm256_add_epi32(_mm256_add_epi32(a, f),
+        _mm256_add_epi32(_mm256_set1_epi32(md5_sine_table[x]), avx2_load(fields[g])));
+    a = d;
+    d = c;
+    c = b;
+    b = _mm256_add_epi32(b, avx2_rotl32(b_addend, md5_shifts[x]));
+  }
+  avx2_store(state[0], _mm256_add_epi32(a0, a));
+  avx2_store(state[1], _mm256_add_epi32(b0, b));
+  avx2_store(state[2], _mm256_add_epi32(c0, c));
+  avx2_store(state[3], _mm256_add_epi32(d0, d));
+}
+
+__attribute__((target("avx2"))) static void sha256_process_8_blocks_avx2(
+    uint32_t (*state)[MULTI_HASH_LANES], const uint8_t* const* blocks) {
+  alignas(32) uint32_t fields[16][MULTI_HASH_LANES];
+  for (size_t lane = 0; lane < MULTI_HASH_LANES; lane++) {
+    const be_uint32_t* block_fields = reinterpret_cast<const be_uint32_t*>(blocks[lane]);
+    for (size_t x = 0; x < 16; x++) {
+      fields[x][lane] = block_fields[x];
+    }
+  }
+
+  // The message schedule only needs the last 16 words, so w is a ring buffer
+  __m256i w[16];
+  for (size_t x = 0; x < 16; x++) {
+    w[x] = avx2_load(fields[x]);
+  }
+  __m256i z[8];
+  for (size_t x = 0; x < 8; x++) {
+    z[x] = avx2_load(state[x]);
+  }
+
+  for (size_t x = 0; x < 64; x++) {
+    if (x >= 16) {
+      __m256i w15 = w[(x - 15) & 15];
+      __m256i w2 = w[(x - 2) & 15];
+      __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(avx2_rotr32(w15, 7), avx2_rotr32(w15, 18)), avx2_shr32(w15, 3));
+      __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(avx2_rotr32(w2, 17), avx2_rotr32(w2, 19)), avx2_shr32(w2, 10));
+      w[x & 15] = _mm256_add_epi32(_mm256_add_epi32(w[x & 15], s0), _mm256_add_epi32(w[(x - 7) & 15], s1));
+    }
+    __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(avx2_rotr32(z[4], 6), avx2_rotr32(z[4], 11)), avx2_rotr32(z[4], 25));
+    __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(avx2_rotr32(z[0], 2), avx2_rotr32(z[0], 13)), avx2_rotr32(z[0], 22));
+    __m256i ch = _mm256_xor_si256(_mm256_and_si256(z[4], z[5]), _mm256_andnot_si256(z[4], z[6]));
+    __m256i maj = _mm256_xor_si256(_mm256_and_si256(z[0], _mm256_xor_si256(z[1], z[2])), _mm256_and_si256(z[1], z[2]));
+    __m256i temp1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(z[7], s1), _mm256_add_epi32(ch, w[x & 15])),
+        _mm256_set1_epi32(sha256_k[x]));
+    __m256i temp2 = _mm256_add_epi32(s0, maj);
+    z[7] = z[6];
+    z[6] = z[5];
+    z[5] = z[4];
+    z[4] = _mm256_add_epi32(z[3], temp1);
+    z[3] = z[2];
+    z[2] = z[1];
+    z[1] = z[0];
+    z[0] = _mm256_add_epi32(temp1, temp2);
+  }
+
+  for (size_t x = 0; x < 8; x++) {
+    avx2_store(state[x], _mm256_add_epi32(avx2_load(state[x]), z[x]));
+  }
+}
+
+// Hashes all of the messages with a multi-block kernel, assigning the next
+// message to each lane as soon as the lane finishes its previous message, so
+// messages of different lengths keep all lanes busy
+template <size_t StateWords>
+static void multi_hash(
+    vector<array<uint32_t, StateWords>>& results,
+    const vector<string_view>& messages,
+    const uint32_t* initial_state,
+    bool big_endian_length,
+    MultiBlocksFn process_blocks) {
+  struct Lane {
+    size_t message_index = SIZE_MAX; // SIZE_MAX = idle
+    const uint8_t* data = nullptr;
+    size_t num_data_blocks = 0;
+    size_t num_blocks = 0;
+    size_t block_index = 0;
+    uint8_t trailer[0x80];
+  };
+
+  // Idle lanes hash this block; their results are ignored
+  static const uint8_t idle_block[0x40] = {};
+
+  alignas(32) uint32_t state[StateWords][MULTI_HASH_LANES];
+  Lane lanes[MULTI_HASH_LANES];
+  size_t next_message_index = 0;
+  auto start_next_message = [&](size_t lane_index) -> void {
+    Lane& lane = lanes[lane_index];
+    if (next_message_index >= messages.size()) {
+      lane.message_index = SIZE_MAX;
+      return;
+    }
+    lane.message_index = next_message_index++;
+    const auto& message = messages[lane.message_index];
+    lane.data = reinterpret_cast<const uint8_t*>(message.data());
+    lane.num_data_blocks = message.size() / 0x40;
+    size_t tail_offset = lane.num_data_blocks * 0x40;
+    lane.num_blocks = lane.num_data_blocks + write_hash_trailer(
+        lane.trailer, lane.data + tail_offset, message.size() - tail_offset, message.size(), big_endian_length);
+    lane.block_index = 0;
+    for (size_t x = 0; x < StateWords; x++) {
+      state[x][lane_index] = initial_state[x];
+    }
+  };
+
+  size_t active_lanes = 0;
+  for (size_t z = 0; z < MULTI_HASH_LANES; z++) {
+    start_next_message(z);
+    active_lanes += (lanes[z].message_index != SIZE_MAX);
+  }
+
+  const uint8_t* blocks[MULTI_HASH_LANES];
+  while (active_lanes) {
+    for (size_t z = 0; z < MULTI_HASH_LANES; z++) {
+      const Lane& lane = lanes[z];
+      if (lane.message_index == SIZE_MAX) {
+        blocks[z] = idle_block;
+      } else if (lane.block_index < lane.num_data_blocks) {
+        blocks[z] = lane.data + lane.block_index * 0x40;
+      } else {
+        blocks[z] = lane.trailer + (lane.block_index - lane.num_data_blocks) * 0x40;
+      }
+    }
+    process_blocks(state, blocks);
+
+    for (size_t z = 0; z < MULTI_HASH_LANES; z++) {
+      Lane& lane = lanes[z];
+      if ((lane.message_index == SIZE_MAX) || (++lane.block_index < lane.num_blocks)) {
+        continue;
+      }
+      auto& result = results[lane.message_index];
+      for (size_t x = 0; x < StateWords; x++) {
+        result[x] = state[x][z];
+      }
+      start_next_message(z);
+      active_lanes -= (lane.message_index == SIZE_MAX);
+    }
+  }
+}
+
+static vector<MD5> md5_multi_avx2(const vector<string_view>& messages) {
+  vector<array<uint32_t, 4>> results(messages.size());
+  multi_hash<4>(results, messages, md5_initial_state, false, md5_process_8_blocks_avx2);
+  vector<MD5> ret(messages.size());
+  for (size_t z = 0; z < messages.size(); z++) {
+    ret[z].a0 = results[z][0];
+    ret[z].b0 = results[z][1];
+    ret[z].c0 = results[z][2];
+    ret[z].d0 = results[z][3];
+  }
+  return ret;
+}
+
+static vector<SHA256> sha256_multi_avx2(const vector<string_view>& messages) {
+  vector<array<uint32_t, 8>> results(messages.size());
+  multi_hash<8>(results, messages, sha256_initial_state, true, sha256_process_8_blocks_avx2);
+  vector<SHA256> ret(messages.size());
+  for (size_t z = 0; z < messages.size(); z++) {
+    memcpy(ret[z].h, results[z].data(), sizeof(ret[z].h));
+  }
+  return ret;
+}
+
+#endif
+
+vector<MD5> md5_multi(const vector<string_view>& messages) {
+#ifdef PHOSG_HAVE_X86_DISPATCH
+  if (x86_features().avx2) {
+    return md5_multi_avx2(messages);
+  }
+#endif
+  vector<MD5> ret(messages.size());
+  for (size_t z = 0; z < messages.size(); z++) {
+    ret[z] = MD5(messages[z].data(), messages[z].size());
+  }
+  return ret;
+}
+
+vector<SHA256> sha256_multi(const vector<string_view>& messages) {
+#ifdef PHOSG_HAVE_X86_DISPATCH
+  // SHA-NI processes one message faster than AVX2 processes 8, so only use
+  // the multi-buffer kernel if SHA-NI isn't available
+  const auto& features = x86_features();
+  if (features.avx2 && !features.sha) {
+    return sha256_multi_avx2(messages);
+  }
+#endif
+  vector<SHA256> ret(messages.size());
+  for (size_t z = 0; z < messages.size(); z++) {
+    ret[z] = SHA256(messages[z].data(), messages[z].size());
+  }
+  return ret;
+}
+
+// Calls fn(chunk_index) for each chunk on multiple threads. If any call
+// throws, the remaining chunks are skipped and the exception is rethrown here.
+static void for_each_chunk_parallel(size_t num_chunks, size_t num_threads, const function<void(size_t)>& fn) {
+  if (num_threads == 0) {
+    num_threads = thread::hardware_concurrency();
+  }
+  num_threads = clamp<size_t>(num_threads, 1, max<size_t>(num_chunks, 1));
+
+  mutex exc_lock;
+  exception_ptr exc;
+  parallel_range<size_t>([&](size_t chunk_index, size_t) -> bool {
+    try {
+      fn(chunk_index);
+      return false;
+    } catch (...) {
+      lock_guard g(exc_lock);
+      if (!exc) {
+        exc = current_exception();
+      }
+      return true;
+    }
+  },
+      0, num_chunks, num_threads, nullptr);
+  if (exc) {
+    rethrow_exception(exc);
+  }
+}
+
+static size_t num_chunks_for_size(size_t size, size_t chunk_size) {
+  if (chunk_size == 0) {
+    throw invalid_argument("chunk size must not be zero");
+  }
+  return (size + chunk_size - 1) / chunk_size;
+}
+
+static SHA256 sha256_tree_leaf(const void* data, size_t size) {
+  static const uint8_t prefix = 0x00;
+  SHA256Hasher h;
+  h.update(&prefix, 1);
+  h.update(data, size);
+  return h.finalize();
+}
+
+// Combines pairs of nodes until only the root is left. When a level has an
+// odd number of nodes, the last one moves up to the next level unchanged,
+// which produces the same tree as RFC 6962's definition.
+static SHA256 sha256_tree_root(vector<SHA256>&& nodes) {
+  if (nodes.empty()) {
+    return SHA256("", 0);
+  }
+  while (nodes.size() > 1) {
+    size_t num_parents = (nodes.size() + 1) / 2;
+    for (size_t z = 0; z < nodes.size() / 2; z++) {
+      static const uint8_t prefix = 0x01;
+      SHA256Hasher h;
+      h.update(&prefix, 1);
+      h.update(nodes[2 * z].bin());
+      h.update(nodes[2 * z + 1].bin());
+      nodes[z] = h.finalize();
+    }
+    if (nodes.size() & 1) {
+      nodes[num_parents - 1] = nodes.back();
+    }
+    nodes.resize(num_parents);
+  }
+  return nodes[0];
+}
+
+static uint32_t crc32_combine_chunks(const vector<uint32_t>& chunk_crcs, size_t size, size_t chunk_size) {
+  uint32_t ret = 0;
+  for (size_t z = 0; z < chunk_crcs.size(); z++) {
+    ret = crc32_combine(ret, chunk_crcs[z], min<size_t>(chunk_size, size - z * chunk_size));
+  }
+  return ret;
+}
+
+SHA256 sha256_tree(const void* vdata, size_t size, size_t chunk_size, size_t num_threads) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  vector<SHA256> leaves(num_chunks_for_size(size, chunk_size));
+  for_each_chunk_parallel(leaves.size(), num_threads, [&](size_t z) -> void {
+    size_t offset = z * chunk_size;
+    leaves[z] = sha256_tree_leaf(data + offset, min<size_t>(chunk_size, size - offset));
+  });
+  return sha256_tree_root(std::move(leaves));
+}
+
+uint32_t crc32_parallel(const void* vdata, size_t size, size_t chunk_size, size_t num_threads) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  vector<uint32_t> chunk_crcs(num_chunks_for_size(size, chunk_size));
+  for_each_chunk_parallel(chunk_crcs.size(), num_threads, [&](size_t z) -> void {
+    size_t offset = z * chunk_size;
+    chunk_crcs[z] = crc32(data + offset, min<size_t>(chunk_size, size - offset));
+  });
+  return crc32_combine_chunks(chunk_crcs, size, chunk_size);
+}
+
+#ifndef PHOSG_WINDOWS
+
+// Calls fn(chunk_index, data, size) for each chunk of the file, on multiple
+// threads. Each call to fn gets the chunk's contents in a buffer that's only
+// valid during that call.
+static void for_each_file_chunk_parallel(
+    int fd, size_t file_size, size_t chunk_size, size_t num_threads,
+    const function<void(size_t, const void*, size_t)>& fn) {
+  size_t num_chunks = num_chunks_for_size(file_size, chunk_size);
+  for_each_chunk_parallel(num_chunks, num_threads, [&](size_t z) -> void {
+    // Allocated per chunk rather than per thread, since the allocation is
+    // cheap relative to reading and hashing a chunk
+    size_t offset = z * chunk_size;
+    string buffer = preadx(fd, min<size_t>(chunk_size, file_size - offset), offset);
+    fn(z, buffer.data(), buffer.size());
+  });
+}
+
+SHA256 sha256_tree_fd(int fd, size_t chunk_size, size_t num_threads) {
+  size_t file_size = fstat(fd).st_size;
+  vector<SHA256> leaves(num_chunks_for_size(file_size, chunk_size));
+  for_each_file_chunk_parallel(fd, file_size, chunk_size, num_threads, [&](size_t z, const void* data, size_t size) -> void {
+    leaves[z] = sha256_tree_leaf(data, size);
+  });
+  return sha256_tree_root(std::move(leaves));
+}
+
+SHA256 sha256_tree_file(const string& filename, size_t chunk_size, size_t num_threads) {
+  scoped_fd fd(filename, O_RDONLY);
+  return sha256_tree_fd(fd, chunk_size, num_threads);
+}
+
+uint32_t crc32_fd(int fd, size_t chunk_size, size_t num_threads) {
+  size_t file_size = fstat(fd).st_size;
+  vector<uint32_t> chunk_crcs(num_chunks_for_size(file_size, chunk_size));
+  for_each_file_chunk_parallel(fd, file_size, chunk_size, num_threads, [&](size_t z, const void* data, size_t size) -> void {
+    chunk_crcs[z] = crc32(data, size);
+  });
+  return crc32_combine_chunks(chunk_crcs, file_size, chunk_size);
+}
+
+uint32_t crc32_file(const string& filename, size_t chunk_size, size_t num_threads) {
+  scoped_fd fd(filename, O_RDONLY);
+  return crc32_fd(fd, chunk_size, num_threads);
+}
+
+#endif
+
+// XXH3 is ported from the reference implementation in xxHash. The long-input
+// loop uses AVX2 when available; everything else is scalar.
+
+constexpr uint64_t XXH_PRIME32_1 = 0x9E3779B1;
+constexpr uint64_t XXH_PRIME32_2 = 0x85EBCA77;
+constexpr uint64_t XXH_PRIME32_3 = 0xC2B2AE3D;
+constexpr uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87;
+constexpr uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4F;
+constexpr uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9;
+constexpr uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63;
+constexpr uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5;
+constexpr uint64_t XXH_PRIME_MX1 = 0x165667919E3779F9;
+constexpr uint64_t XXH_PRIME_MX2 = 0x9FB21C651E98DF25;
+
+// Long inputs are processed in 64-byte stripes; each stripe uses the secret
+// starting 8 bytes after the previous stripe's, so a block (after which the
+// accumulators are scrambled) is 16 stripes long with the default secret size
+constexpr size_t XXH3_SECRET_SIZE = 0xC0;
+constexpr size_t XXH3_STRIPE_SIZE = 0x40;
+constexpr size_t XXH3_STRIPES_PER_BLOCK = (XXH3_SECRET_SIZE - XXH3_STRIPE_SIZE) / 8;
+constexpr size_t XXH3_MIDSIZE_MAX = 240;
+
+// clang-format off
+static const uint8_t xxh3_default_secret[XXH3_SECRET_SIZE] = {
+    0xB8, 0xFE, 0x6C, 0x39, 0x23, 0xA4, 0x4B, 0xBE, 0x7C, 0x01, 0x81, 0x2C, 0xF7, 0x21, 0xAD, 0x1C,
+    0xDE, 0xD4, 0x6D, 0xE9, 0x83, 0x90, 0x97, 0xDB, 0x72, 0x40, 0xA4, 0xA4, 0xB7, 0xB3, 0x67, 0x1F,
+    0xCB, 0x79, 0xE6, 0x4E, 0xCC, 0xC0, 0xE5, 0x78, 0x82, 0x5A, 0xD0, 0x7D, 0xCC, 0xFF, 0x72, 0x21,
+    0xB8, 0x08, 0x46, 0x74, 0xF7, 0x43, 0x24, 0x8E, 0xE0, 0x35, 0x90, 0xE6, 0x81, 0x3A, 0x26, 0x4C,
+    0x3C, 0x28, 0x52, 0xBB, 0x91, 0xC3, 0x00, 0xCB, 0x88, 0xD0, 0x65, 0x8B, 0x1B, 0x53, 0x2E, 0xA3,
+    0x71, 0x64, 0x48, 0x97, 0xA2, 0x0D, 0xF9, 0x4E, 0x38, 0x19, 0xEF, 0x46, 0xA9, 0xDE, 0xAC, 0xD8,
+    0xA8, 0xFA, 0x76, 0x3F, 0xE3, 0x9C, 0x34, 0x3F, 0xF9, 0xDC, 0xBB, 0xC7, 0xC7, 0x0B, 0x4F, 0x1D,
+    0x8A, 0x51, 0xE0, 0x4B, 0xCD, 0xB4, 0x59, 0x31, 0xC8, 0x9F, 0x7E, 0xC9, 0xD9, 0x78, 0x73, 0x64,
+    0xEA, 0xC5, 0xAC, 0x83, 0x34, 0xD3, 0xEB, 0xC3, 0xC5, 0x81, 0xA0, 0xFF, 0xFA, 0x13, 0x63, 0xEB,
+    0x17, 0x0D, 0xDD, 0x51, 0xB7, 0xF0, 0xDA, 0x49, 0xD3, 0x16, 0x55, 0x26, 0x29, 0xD4, 0x68, 0x9E,
+    0x2B, 0x16, 0xBE, 0x58, 0x7D, 0x47, 0xA1, 0xFC, 0x8F, 0xF8, 0xB8, 0xD1, 0x7A, 0xD0, 0x31, 0xCE,
+    0x45, 0xCB, 0x3A, 0x8F, 0x95, 0x16, 0x04, 0x28, 0xAF, 0xD7, 0xFB, 0xCA, 0xBB, 0x4B, 0x40, 0x7E,
+};
+
+static const uint64_t xxh3_initial_acc[8] = {
+    XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+    XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1};
+// clang-format on
+
+static inline uint32_t xxh_read32(const uint8_t* data) {
+  return reinterpret_cast<const le_uint32_t*>(data)->load();
+}
+
+static inline uint64_t xxh_read64(const uint8_t* data) {
+  return reinterpret_cast<const le_uint64_t*>(data)->load();
+}
+
+static inline uint64_t rotate_left64(uint64_t x, uint8_t bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+static inline XXH128 mul_64_to_128(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+  return XXH128{static_cast<uint64_t>(product), static_cast<uint64_t>(product >> 64)};
+#else
+  uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+  uint64_t hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+  uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32);
+  uint64_t hi_hi = (a >> 32) * (b >> 32);
+  uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+  return XXH128{(cross << 32) | (lo_lo & 0xFFFFFFFF), (hi_lo >> 32) + (cross >> 32) + hi_hi};
+#endif
+}
+
+static inline uint64_t mul_128_fold_64(uint64_t a, uint64_t b) {
+  XXH128 product = mul_64_to_128(a, b);
+  return product.low ^ product.high;
+}
+
+static inline uint64_t xxh64_avalanche(uint64_t h) {
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+static inline uint64_t xxh3_avalanche(uint64_t h) {
+  h ^= h >> 37;
+  h *= XXH_PRIME_MX1;
+  h ^= h >> 32;
+  return h;
+}
+
+static inline uint64_t xxh3_rrmxmx(uint64_t h, uint64_t size) {
+  h ^= rotate_left64(h, 49) ^ rotate_left64(h, 24);
+  h *= XXH_PRIME_MX2;
+  h ^= (h >> 35) + size;
+  h *= XXH_PRIME_MX2;
+  return h ^ (h >> 28);
+}
+
+static inline uint64_t xxh3_mix16(const uint8_t* data, const uint8_t* secret, uint64_t seed) {
+  return mul_128_fold_64(
+      xxh_read64(data) ^ (xxh_read64(secret) + seed),
+      xxh_read64(data + 8) ^ (xxh_read64(secret + 8) - seed));
+}
+
+static inline XXH128 xxh3_mix32(XXH128 acc, const uint8_t* data1, const uint8_t* data2, const uint8_t* secret, uint64_t seed) {
+  acc.low += xxh3_mix16(data1, secret, seed);
+  acc.low ^= xxh_read64(data2) + xxh_read64(data2 + 8);
+  acc.high += xxh3_mix16(data2, secret + 16, seed);
+  acc.high ^= xxh_read64(data1) + xxh_read64(data1 + 8);
+  return acc;
+}
+
+static uint64_t xxh3_64_short(const uint8_t* data, size_t size, const uint8_t* secret, uint64_t seed) {
+  if (size > 16) {
+    uint64_t acc = size * XXH_PRIME64_1;
+    if (size <= 128) {
+      size_t x = (size - 1) / 32;
+      do {
+        acc += xxh3_mix16(data + 16 * x, secret + 32 * x, seed);
+        acc += xxh3_mix16(data + size - 16 * (x + 1), secret + 32 * x + 16, seed);
+      } while (x-- != 0);
+      return xxh3_avalanche(acc);
+    }
+    for (size_t x = 0; x < 8; x++) {
+      acc += xxh3_mix16(data + 16 * x, secret + 16 * x, seed);
+    }
+    acc = xxh3_avalanche(acc);
+    uint64_t acc_end = xxh3_mix16(data + size - 16, secret + 136 - 17, seed);
+    for (size_t x = 8; x < size / 16; x++) {
+      acc_end += xxh3_mix16(data + 16 * x, secret + 16 * (x - 8) + 3, seed);
+    }
+    return xxh3_avalanche(acc + acc_end);
+
+  } else if (size > 8) {
+    uint64_t input_lo = xxh_read64(data) ^ ((xxh_read64(secret + 24) ^ xxh_read64(secret + 32)) + seed);
+    uint64_t input_hi = xxh_read64(data + size - 8) ^ ((xxh_read64(secret + 40) ^ xxh_read64(secret + 48)) - seed);
+    return xxh3_avalanche(size + bswap64(input_lo) + input_hi + mul_128_fold_64(input_lo, input_hi));
+
+  } else if (size >= 4) {
+    seed ^= static_cast<uint64_t>(bswap32(seed)) << 32;
+    uint64_t input = xxh_read32(data + size - 4) + (static_cast<uint64_t>(xxh_read32(data)) << 32);
+    return xxh3_rrmxmx(input ^ ((xxh_read64(secret + 8) ^ xxh_read64(secret + 16)) - seed), size);
+
+  } else if (size > 0) {
+    uint32_t combined = (static_cast<uint32_t>(data[0]) << 16) | (static_cast<uint32_t>(data[size >> 1]) << 24) | data[size - 1] | (size << 8);
+    return xxh64_avalanche(combined ^ ((xxh_read32(secret) ^ xxh_read32(secret + 4)) + seed));
+
+  } else {
+    return xxh64_avalanche(seed ^ xxh_read64(secret + 56) ^ xxh_read64(secret + 64));
+  }
+}
+
+static XXH128 xxh3_128_short(const uint8_t* data, size_t size, const uint8_t* secret, uint64_t seed) {
+  if (size > 16) {
+    XXH128 acc{size * XXH_PRIME64_1, 0};
+    if (size <= 128) {
+      size_t x = (size - 1) / 32;
+      do {
+        acc = xxh3_mix32(acc, data + 16 * x, data + size - 16 * (x + 1), secret + 32 * x, seed);
+      } while (x-- != 0);
+    } else {
+      for (size_t offset = 32; offset < 160; offset += 32) {
+        acc = xxh3_mix32(acc, data + offset - 32, data + offset - 16, secret + offset - 32, seed);
+      }
+      acc.low = xxh3_avalanche(acc.low);
+      acc.high = xxh3_avalanche(acc.high);
+      for (size_t offset = 160; offset <= size; offset += 32) {
+        acc = xxh3_mix32(acc, data + offset - 32, data + offset - 16, secret + offset - 160 + 3, seed);
+      }
+      acc = xxh3_mix32(acc, data + size - 16, data + size - 32, secret + 136 - 17 - 16, 0 - seed);
+    }
+    uint64_t high = (acc.low * XXH_PRIME64_1) + (acc.high * XXH_PRIME64_4) + ((size - seed) * XXH_PRIME64_2);
+    return XXH128{xxh3_avalanche(acc.low + acc.high), 0 - xxh3_avalanche(high)};
+
+  } else if (size > 8) {
+    uint64_t input_lo = xxh_read64(data);
+    uint64_t input_hi = xxh_read64(data + size - 8);
+    XXH128 m = mul_64_to_128(
+        input_lo ^ input_hi ^ ((xxh_read64(secret + 32) ^ xxh_read64(secret + 40)) - seed), XXH_PRIME64_1);
+    m.low += static_cast<uint64_t>(size - 1) << 54;
+    input_hi ^= (xxh_read64(secret + 48) ^ xxh_read64(secret + 56)) + seed;
+    m.high += input_hi + (input_hi & 0xFFFFFFFF) * (XXH_PRIME32_2 - 1);
+    m.low ^= bswap64(m.high);
+    XXH128 h = mul_64_to_128(m.low, XXH_PRIME64_2);
+    h.high += m.high * XXH_PRIME64_2;
+    return XXH128{xxh3_avalanche(h.low), xxh3_avalanche(h.high)};
+
+  } else if (size >= 4) {
+    seed ^= static_cast<uint64_t>(bswap32(seed)) << 32;
+    uint64_t input = xxh_read32(data) + (static_cast<uint64_t>(xxh_read32(data + size - 4)) << 32);
+    uint64_t keyed = input ^ ((xxh_read64(secret + 16) ^ xxh_read64(secret + 24)) + seed);
+    XXH128 m = mul_64_to_128(keyed, XXH_PRIME64_1 + (size << 2));
+    m.high += m.low << 1;
+    m.low ^= m.high >> 3;
+    m.low ^= m.low >> 35;
+    m.low *= XXH_PRIME_MX2;
+    m.low ^= m.low >> 28;
+    return XXH128{m.low, xxh3_avalanche(m.high)};
+
+  } else if (size > 0) {
+    uint32_t combined_lo = (static_cast<uint32_t>(data[0]) << 16) | (static_cast<uint32_t>(data[size >> 1]) << 24) | data[size - 1] | (size << 8);
+    uint32_t combined_hi = bswap32(combined_lo);
+    combined_hi = (combined_hi << 13) | (combined_hi >> 19);
+    return XXH128{
+        xxh64_avalanche(combined_lo ^ ((xxh_read32(secret) ^ xxh_read32(secret + 4)) + seed)),
+        xxh64_avalanche(combined_hi ^ ((xxh_read32(secret + 8) ^ xxh_read32(secret + 12)) - seed))};
+
+  } else {
+    return XXH128{
+        xxh64_avalanche(seed ^ xxh_read64(secret + 64) ^ xxh_read64(secret + 72)),
+        xxh64_avalanche(seed ^ xxh_read64(secret + 80) ^ xxh_read64(secret + 88))};
+  }
+}
+
+static void xxh3_accumulate_scalar(uint64_t* acc, const uint8_t* data, const uint8_t* secret, size_t num_stripes) {
+  for (size_t z = 0; z < num_stripes; z++) {
+    const uint8_t* stripe = data + z * XXH3_STRIPE_SIZE;
+    const uint8_t* stripe_secret = secret + z * 8;
+    for (size_t x = 0; x < 8; x++) {
+      uint64_t value = xxh_read64(stripe + x * 8);
+      uint64_t keyed = value ^ xxh_read64(stripe_secret + x * 8);
+      acc[x ^ 1] += value;
+      acc[x] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+    }
+  }
+}
+
+#ifdef PHOSG_HAVE_X86_DISPATCH
+__attribute__((target("avx2"))) static void xxh3_accumulate_avx2(
+    uint64_t* acc, const uint8_t* data, const uint8_t* secret, size_t num_stripes) {
+  __m256i acc0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc));
+  __m256i acc1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + 4));
+  for (size_t z = 0; z < num_stripes; z++) {
+    const uint8_t* stripe = data + z * XXH3_STRIPE_SIZE;
+    const uint8_t* stripe_secret = secret + z * 8;
+    __m256i value0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(stripe));
+    __m256i value1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(stripe + 0x20));
+    __m256i keyed0 = _mm256_xor_si256(value0, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(stripe_secret)));
+    __m256i keyed1 = _mm256_xor_si256(value1, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(stripe_secret + 0x20)));
+    // mul_epu32 multiplies the low 32 bits of each 64-bit lane, and the
+    // shuffle swaps adjacent 64-bit lanes
+    acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(
+                                      _mm256_shuffle_epi32(value0, 0x4E),
+                                      _mm256_mul_epu32(keyed0, _mm256_srli_epi64(keyed0, 32))));
+    acc1 = _mm256_add_epi64(acc1, _mm256_add_epi64(
+                                      _mm256_shuffle_epi32(value1, 0x4E),
+                                      _mm256_mul_epu32(keyed1, _mm256_srli_epi64(keyed1, 32))));
+  }
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc), acc0);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + 4), acc1);
+}
+#endif
+
+static void xxh3_accumulate(uint64_t* acc, const uint8_t* data, const uint8_t* secret, size_t num_stripes) {
+#ifdef PHOSG_HAVE_X86_DISPATCH
+  if (x86_features().avx2) {
+    xxh3_accumulate_avx2(acc, data, secret, num_stripes);
+    return;
+  }
+#endif
+  xxh3_accumulate_scalar(acc, data, secret, num_stripes);
+}
+
+static void xxh3_scramble(uint64_t* acc, const uint8_t* secret) {
+  const uint8_t* scramble_secret = secret + XXH3_SECRET_SIZE - XXH3_STRIPE_SIZE;
+  for (size_t x = 0; x < 8; x++) {
+    uint64_t v = acc[x];
+    v ^= v >> 47;
+    v ^= xxh_read64(scramble_secret + x * 8);
+    acc[x] = v * XXH_PRIME32_1;
+  }
+}
+
+// Accumulates num_stripes stripes of data, starting at stripe number
+// *block_stripes within the current block, and scrambling at the end of each
+// block. Returns a pointer to the end of the processed data.
+static const uint8_t* xxh3_consume_stripes(
+    uint64_t* acc, size_t* block_stripes, const uint8_t* data, size_t num_stripes, const uint8_t* secret) {
+  size_t stripes_to_block_end = XXH3_STRIPES_PER_BLOCK - *block_stripes;
+  while (num_stripes >= stripes_to_block_end) {
+    xxh3_accumulate(acc, data, secret + *block_stripes * 8, stripes_to_block_end);
+    xxh3_scramble(acc, secret);
+    data += stripes_to_block_end * XXH3_STRIPE_SIZE;
+    num_stripes -= stripes_to_block_end;
+    stripes_to_block_end = XXH3_STRIPES_PER_BLOCK;
+    *block_stripes = 0;
+  }
+  if (num_stripes) {
+    xxh3_accumulate(acc, data, secret + *block_stripes * 8, num_stripes);
+    data += num_stripes * XXH3_STRIPE_SIZE;
+    *block_stripes += num_stripes;
+  }
+  return data;
+}
+
+// The last stripe of a long input always ends exactly at the end of the input
+// (so it may overlap the previous stripe), and uses an unaligned part of the
+// secret
+static void xxh3_accumulate_last_stripe(uint64_t* acc, const uint8_t* stripe, const uint8_t* secret) {
+  xxh3_accumulate(acc, stripe, secret + XXH3_SECRET_SIZE - XXH3_STRIPE_SIZE - 7, 1);
+}
+
+static void xxh3_hash_long(uint64_t* acc, const uint8_t* data, size_t size, const uint8_t* secret) {
+  memcpy(acc, xxh3_initial_acc, sizeof(xxh3_initial_acc));
+  size_t block_stripes = 0;
+  xxh3_consume_stripes(acc, &block_stripes, data, (size - 1) / XXH3_STRIPE_SIZE, secret);
+  xxh3_accumulate_last_stripe(acc, data + size - XXH3_STRIPE_SIZE, secret);
+}
+
+static uint64_t xxh3_merge_accs(const uint64_t* acc, const uint8_t* secret, uint64_t start) {
+  for (size_t x = 0; x < 4; x++) {
+    start += mul_128_fold_64(acc[2 * x] ^ xxh_read64(secret + 16 * x), acc[2 * x + 1] ^ xxh_read64(secret + 16 * x + 8));
+  }
+  return xxh3_avalanche(start);
+}
+
+static uint64_t xxh3_64_merge_long(const uint64_t* acc, const uint8_t* secret, uint64_t size) {
+  return xxh3_merge_accs(acc, secret + 11, size * XXH_PRIME64_1);
+}
+
+static XXH128 xxh3_128_merge_long(const uint64_t* acc, const uint8_t* secret, uint64_t size) {
+  return XXH128{
+      xxh3_merge_accs(acc, secret + 11, size * XXH_PRIME64_1),
+      xxh3_merge_accs(acc, secret + XXH3_SECRET_SIZE - 0x40 - 11, ~(size * XXH_PRIME64_2))};
+}
+
+// Long inputs use a secret derived from the seed, instead of using the seed
+// directly like the short-input functions do
+static void xxh3_init_secret(uint8_t* secret, uint64_t seed) {
+  for (size_t offset = 0; offset < XXH3_SECRET_SIZE; offset += 0x10) {
+    *reinterpret_cast<le_uint64_t*>(secret + offset) = xxh_read64(xxh3_default_secret + offset) + seed;
+    *reinterpret_cast<le_uint64_t*>(secret + offset + 8) = xxh_read64(xxh3_default_secret + offset + 8) - seed;
+  }
+}
+
+uint64_t xxh3_64(const void* vdata, size_t size, uint64_t seed) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  if (size <= XXH3_MIDSIZE_MAX) {
+    return xxh3_64_short(data, size, xxh3_default_secret, seed);
+  }
+  uint8_t custom_secret[XXH3_SECRET_SIZE];
+  const uint8_t* secret = xxh3_default_secret;
+  if (seed) {
+    xxh3_init_secret(custom_secret, seed);
+    secret = custom_secret;
+  }
+  uint64_t acc[8];
+  xxh3_hash_long(acc, data, size, secret);
+  return xxh3_64_merge_long(acc, secret, size);
+}
+
+uint64_t xxh3_64(string_view data, uint64_t seed) {
+  return xxh3_64(data.data(), data.size(), seed);
+}
+
+XXH128 xxh3_128(const void* vdata, size_t size, uint64_t seed) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  if (size <= XXH3_MIDSIZE_MAX) {
+    return xxh3_128_short(data, size, xxh3_default_secret, seed);
+  }
+  uint8_t custom_secret[XXH3_SECRET_SIZE];
+  const uint8_t* secret = xxh3_default_secret;
+  if (seed) {
+    xxh3_init_secret(custom_secret, seed);
+    secret = custom_secret;
+  }
+  uint64_t acc[8];
+  xxh3_hash_long(acc, data, size, secret);
+  return xxh3_128_merge_long(acc, secret, size);
+}
+
+XXH128 xxh3_128(string_view data, uint64_t seed) {
+  return xxh3_128(data.data(), data.size(), seed);
+}
+
+string XXH128::bin() const {
+  be_uint64_t ret[2] = {this->high, this->low};
+  return string(reinterpret_cast<const char*>(ret), sizeof(ret));
+}
+
+string XXH128::hex() const {
+  be_uint64_t words[2] = {this->high, this->low};
+  return hex_encode(words, sizeof(words));
+}
+
+XXH3Hasher::XXH3Hasher(uint64_t seed)
+    : seed(seed),
+      buffer_size(0),
+      block_stripes(0),
+      total_size(0) {
+  memcpy(this->acc, xxh3_initial_acc, sizeof(this->acc));
+  xxh3_init_secret(this->secret, seed);
+}
+
+void XXH3Hasher::update(const void* vdata, size_t size) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  const uint8_t* data_end = data + size;
+  this->total_size += size;
+
+  // Short inputs are hashed all at once by the digest functions, so don't
+  // process anything until there's more than a buffer's worth of data
+  if (size <= sizeof(this->buffer) - this->buffer_size) {
+    memcpy(this->buffer + this->buffer_size, data, size);
+    this->buffer_size += size;
+    return;
+  }
+
+  if (this->buffer_size) {
+    size_t bytes_to_copy = sizeof(this->buffer) - this->buffer_size;
+    memcpy(this->buffer + this->buffer_size, data, bytes_to_copy);
+    data += bytes_to_copy;
+    xxh3_consume_stripes(this->acc, &this->block_stripes, this->buffer, sizeof(this->buffer) / XXH3_STRIPE_SIZE, this->secret);
+    this->buffer_size = 0;
+  }
+
+  // Always leave at least one byte in the buffer, since the last stripe is
+  // processed differently. If we process stripes directly from the input,
+  // keep a copy of the last one, since the final stripe may overlap it.
+  if (static_cast<size_t>(data_end - data) > sizeof(this->buffer)) {
+    size_t num_stripes = (data_end - 1 - data) / XXH3_STRIPE_SIZE;
+    data = xxh3_consume_stripes(this->acc, &this->block_stripes, data, num_stripes, this->secret);
+    memcpy(this->buffer + sizeof(this->buffer) - XXH3_STRIPE_SIZE, data - XXH3_STRIPE_SIZE, XXH3_STRIPE_SIZE);
+  }
+  memcpy(this->buffer, data, data_end - data);
+  this->buffer_size = data_end - data;
+}
+
+void XXH3Hasher::update(string_view data) {
+  this->update(data.data(), data.size());
+}
+
+void XXH3Hasher::update_file(FILE* f) {
+  update_from_file(*this, f);
+}
+
+#ifndef PHOSG_WINDOWS
+void XXH3Hasher::update_fd(int fd) {
+  update_from_fd(*this, fd);
+}
+#endif
+
+void XXH3Hasher::digest_long(uint64_t* acc) const {
+  memcpy(acc, this->acc, sizeof(this->acc));
+  if (this->buffer_size >= XXH3_STRIPE_SIZE) {
+    size_t block_stripes = this->block_stripes;
+    xxh3_consume_stripes(acc, &block_stripes, this->buffer, (this->buffer_size - 1) / XXH3_STRIPE_SIZE, this->secret);
+    xxh3_accumulate_last_stripe(acc, this->buffer + this->buffer_size - XXH3_STRIPE_SIZE, this->secret);
+  } else {
+    // The last stripe starts in the previously-processed data, which is still
+    // at the end of the buffer
+    uint8_t last_stripe[XXH3_STRIPE_SIZE];
+    size_t prev_bytes = XXH3_STRIPE_SIZE - this->buffer_size;
+    memcpy(last_stripe, this->buffer + sizeof(this->buffer) - prev_bytes, prev_bytes);
+    memcpy(last_stripe + prev_bytes, this->buffer, this->buffer_size);
+    xxh3_accumulate_last_stripe(acc, last_stripe, this->secret);
+  }
+}
+
+uint64_t XXH3Hasher::digest_64() const {
+  if (this->total_size <= XXH3_MIDSIZE_MAX) {
+    return xxh3_64_short(this->buffer, this->total_size, xxh3_default_secret, this->seed);
+  }
+  uint64_t acc[8];
+  this->digest_long(acc);
+  return xxh3_64_merge_long(acc, this->secret, this->total_size);
+}
+
+XXH128 XXH3Hasher::digest_128() const {
+  if (this->total_size <= XXH3_MIDSIZE_MAX) {
+    return xxh3_128_short(this->buffer, this->total_size, xxh3_default_secret, this->seed);
+  }
+  uint64_t acc[8];
+  this->digest_long(acc);
+  return xxh3_128_merge_long(acc, this->secret, this->total_size);
+}
+
+HashImplementations hash_implementations() {
+  HashImplementations ret;
+  ret.crc32 = "portable";
+  ret.crc32c = "portable";
+  ret.xxh3 = "portable";
+  ret.md5 = "portable";
+  ret.md5_multi = "portable";
+  ret.sha1 = (sha1_best_process_blocks() == sha1_process_blocks) ? "portable" : "sha-ni";
+  ret.sha256 = (sha256_best_process_blocks() == sha256_process_blocks) ? "portable" : "sha-ni";
+  ret.sha256_multi = ret.sha256;
+
+#if defined(__aarch64__)
+#if defined(__ARM_FEATURE_CRC32)
+  ret.crc32 = "armv8-crc";
+  ret.crc32c = "armv8-crc";
+#endif
+#if defined(PHOSG_HAVE_ARM_SHA)
+  ret.sha1 = "armv8-sha";
+  ret.sha256 = "armv8-sha";
+  ret.sha256_multi = "armv8-sha";
+#endif
+
+#elif defined(PHOSG_HAVE_X86_DISPATCH)
+  const auto& features = x86_features();
+  if (features.pclmul && features.sse41) {
+    ret.crc32 = "pclmul";
+  }
+  if (features.sse42) {
+    ret.crc32c = "sse4.2";
+  }
+  if (features.avx2) {
+    ret.xxh3 = "avx2";
+    ret.md5_multi = "avx2";
+    if (!features.sha) {
+      ret.sha256_multi = "avx2";
+    }
+  }
+#endif
+
+  return ret;
+}
+
+HashKernels hash_kernels() {
+  HashKernels ret;
+  ret.sha1_portable = sha1_process_blocks;
+  ret.sha1_accelerated = nullptr;
+  ret.sha256_portable = sha256_process_blocks;
+  ret.sha256_accelerated = nullptr;
+  ret.md5_multi_avx2 = nullptr;
+  ret.sha256_multi_avx2 = nullptr;
+
+#if defined(PHOSG_HAVE_X86_DISPATCH)
+  const auto& features = x86_features();
+  if (features.sha && features.sse41 && features.ssse3) {
+    ret.sha1_accelerated = sha1_process_blocks_shani;
+    ret.sha256_accelerated = sha256_process_blocks_shani;
+  }
+  if (features.avx2) {
+    ret.md5_multi_avx2 = md5_multi_avx2;
+    ret.sha256_multi_avx2 = sha256_multi_avx2;
+  }
+#elif defined(PHOSG_HAVE_ARM_SHA)
+  ret.sha1_accelerated = sha1_process_blocks_arm;
+  ret.sha256_accelerated = sha256_process_blocks_arm;
+#endif
+
+  return ret;
 }
 
 } // namespace phosg
@@ -1,12 +1,174 @@
 #pragma once
 
+#include <stdio.h>
+
+#include <functional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include <cstdint>
 
+#include "Encoding.hh"
+#include "Platform.hh"
+
 namespace phosg {
 
 uint32_t crc32(const void* vdata, size_t size, uint32_t cs = 0);
+// Returns the crc32 of the concatenation of two messages, given the crc32 of
+// each message and the size of the second message. This allows parts of a
+// message to be checksummed independently (e.g. in parallel).
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+// Generic CRC implementation, for any CRC up to 64 bits wide whose width is a
+// multiple of 8. The parameters are as in the Catalogue of Parametrised CRC
+// Algorithms: Poly is in normal (MSB-first) form, Reflected means both input
+// and output are reflected, and XorOut is applied to the final register. All
+// tables are generated at compile time. Like crc32(), compute() can continue
+// a previous computation by passing the previous result as crc.
+//
+// This processes 8 bytes per step using slicing-by-8; dedicated functions
+// like crc32() and crc32c() may use hardware instructions and be faster.
+
+template <typename T>
+constexpr T reflect_bits(T v) {
+  T ret = 0;
+  for (size_t z = 0; z < sizeof(T) * 8; z++) {
+    ret = (ret << 1) | ((v >> z) & 1);
+  }
+  return ret;
+}
+
+template <typename T, T Poly, bool Reflected>
+struct CRCTables {
+  static constexpr size_t BITS = sizeof(T) * 8;
+  static constexpr T REFLECTED_POLY = reflect_bits(Poly);
+
+  // tables[0] is the usual bytewise table; tables[n][x] is the register value
+  // after processing byte x followed by n zero bytes. powers_of_x[k] is
+  // x^(2^k) modulo the polynomial, in reflected form.
+  T tables[8][0x100];
+  T powers_of_x[67];
+
+  // Multiplies two polynomials modulo Poly. Both are in reflected form, in
+  // which the high bit is the x^0 term.
+  static constexpr T multiply(T a, T b) {
+    T product = 0;
+    for (T mask = static_cast<T>(1) << (BITS - 1); mask; mask >>= 1) {
+      if (a & mask) {
+        product ^= b;
+      }
+      b = (b & 1) ? ((b >> 1) ^ REFLECTED_POLY) : (b >> 1);
+    }
+    return product;
+  }
+
+  constexpr CRCTables() : tables(), powers_of_x() {
+    for (size_t x = 0; x < 0x100; x++) {
+      T v;
+      if constexpr (Reflected) {
+        v = x;
+        for (size_t bit = 0; bit < 8; bit++) {
+          v = (v & 1) ? ((v >> 1) ^ REFLECTED_POLY) : (v >> 1);
+        }
+      } else {
+        v = static_cast<T>(x) << (BITS - 8);
+        for (size_t bit = 0; bit < 8; bit++) {
+          v = ((v >> (BITS - 1)) & 1) ? static_cast<T>((v << 1) ^ Poly) : static_cast<T>(v << 1);
+        }
+      }
+      this->tables[0][x] = v;
+    }
+    for (size_t n = 1; n < 8; n++) {
+      for (size_t x = 0; x < 0x100; x++) {
+        T prev = this->tables[n - 1][x];
+        if constexpr (Reflected) {
+          this->tables[n][x] = static_cast<T>(prev >> 8) ^ this->tables[0][prev & 0xFF];
+        } else {
+          this->tables[n][x] = static_cast<T>(prev << 8) ^ this->tables[0][prev >> (BITS - 8)];
+        }
+      }
+    }
+    this->powers_of_x[0] = static_cast<T>(1) << (BITS - 2); // x^1
+    for (size_t k = 1; k < 67; k++) {
+      this->powers_of_x[k] = multiply(this->powers_of_x[k - 1], this->powers_of_x[k - 1]);
+    }
+  }
+};
+
+template <typename T, T Poly, bool Reflected>
+inline constexpr CRCTables<T, Poly, Reflected> crc_tables{};
+
+template <typename T, T Poly, T Init, bool Reflected, T XorOut>
+struct CRC {
+  using Tables = CRCTables<T, Poly, Reflected>;
+  static constexpr size_t BITS = Tables::BITS;
+  // The checksum of an empty input; compute() starts from this by default
+  static constexpr T START = Init ^ XorOut;
+
+  static T compute(const void* vdata, size_t size, T crc = START) {
+    const auto& t = crc_tables<T, Poly, Reflected>.tables;
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+    T reg = crc ^ XorOut;
+    size_t offset = 0;
+    if constexpr (Reflected) {
+      for (; offset + 8 <= size; offset += 8) {
+        uint64_t v = reinterpret_cast<const le_uint64_t*>(data + offset)->load() ^ reg;
+        reg = t[7][v & 0xFF] ^ t[6][(v >> 8) & 0xFF] ^ t[5][(v >> 16) & 0xFF] ^ t[4][(v >> 24) & 0xFF] ^
+            t[3][(v >> 32) & 0xFF] ^ t[2][(v >> 40) & 0xFF] ^ t[1][(v >> 48) & 0xFF] ^ t[0][v >> 56];
+      }
+      for (; offset < size; offset++) {
+        reg = static_cast<T>(reg >> 8) ^ t[0][(reg ^ data[offset]) & 0xFF];
+      }
+    } else {
+      for (; offset + 8 <= size; offset += 8) {
+        uint64_t v = reinterpret_cast<const be_uint64_t*>(data + offset)->load() ^ (static_cast<uint64_t>(reg) << (64 - BITS));
+        reg = t[7][v >> 56] ^ t[6][(v >> 48) & 0xFF] ^ t[5][(v >> 40) & 0xFF] ^ t[4][(v >> 32) & 0xFF] ^
+            t[3][(v >> 24) & 0xFF] ^ t[2][(v >> 16) & 0xFF] ^ t[1][(v >> 8) & 0xFF] ^ t[0][v & 0xFF];
+      }
+      for (; offset < size; offset++) {
+        reg = static_cast<T>(reg << 8) ^ t[0][((reg >> (BITS - 8)) ^ data[offset]) & 0xFF];
+      }
+    }
+    return reg ^ XorOut;
+  }
+
+  // Returns the CRC register value after processing size zero bytes,
+  // starting from reg. This is a multiplication by x^(8 * size) modulo Poly.
+  static constexpr T shift(T reg, uint64_t size) {
+    const auto& tables = crc_tables<T, Poly, Reflected>;
+    if constexpr (!Reflected) {
+      reg = reflect_bits(reg);
+    }
+    for (size_t k = 3; size; size >>= 1, k++) {
+      if (size & 1) {
+        reg = Tables::multiply(tables.powers_of_x[k], reg);
+      }
+    }
+    return Reflected ? reg : reflect_bits(reg);
+  }
+
+  // Returns the CRC of the concatenation of two inputs, given the CRC of each
+  // input and the size of the second one
+  static constexpr T combine(T crc1, T crc2, uint64_t size2) {
+    return shift(crc1 ^ XorOut ^ Init, size2) ^ crc2;
+  }
+};
+
+using CRC16IBM3740 = CRC<uint16_t, 0x1021, 0xFFFF, false, 0x0000>; // a.k.a. CRC-16/CCITT-FALSE
+using CRC32IEEE = CRC<uint32_t, 0x04C11DB7, 0xFFFFFFFF, true, 0xFFFFFFFF>; // same as crc32()
+using CRC32C = CRC<uint32_t, 0x1EDC6F41, 0xFFFFFFFF, true, 0xFFFFFFFF>; // Castagnoli; same as crc32c()
+using CRC64XZ = CRC<uint64_t, 0x42F0E1EBA9EA3693, 0xFFFFFFFFFFFFFFFF, true, 0xFFFFFFFFFFFFFFFF>; // same as crc64()
+using CRC64ECMA182 = CRC<uint64_t, 0x42F0E1EBA9EA3693, 0x0000000000000000, false, 0x0000000000000000>;
+
+// CRC-32C (Castagnoli), as used by iSCSI, ext4, Btrfs, etc. This uses the
+// SSE4.2 or ARMv8 CRC instructions if available.
+uint32_t crc32c(const void* data, size_t size, uint32_t cs = 0);
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+// CRC-64/XZ (the reflected form of the ECMA-182 polynomial), as used by xz
+// and Go's hash/crc64 with the ECMA table
+uint64_t crc64(const void* data, size_t size, uint64_t cs = 0);
 
 constexpr uint32_t FNV1A32_START = 0x811C9DC5;
 
@@ -18,9 +180,87 @@ constexpr uint64_t FNV1A64_START = 0xCBF29CE484222325;
 uint64_t fnv1a64(const void* data, size_t size, uint64_t hash = FNV1A64_START);
 uint64_t fnv1a64(const std::string& data, uint64_t hash = FNV1A64_START);
 
+// XXH3 (from xxHash), a fast non-cryptographic hash. The results are the same
+// as those of XXH3_64bits_withSeed and XXH3_128bits_withSeed in the reference
+// implementation. This is much faster than FNV-1a on anything but very short
+// inputs and has much better distribution, so prefer it for hash tables. Like
+// FNV-1a, it is not suitable when an attacker could benefit from collisions.
+
+struct XXH128 {
+  uint64_t low;
+  uint64_t high;
+
+  bool operator==(const XXH128& other) const = default;
+
+  // These return the canonical (big-endian) form, high half first
+  std::string bin() const;
+  std::string hex() const;
+};
+
+uint64_t xxh3_64(const void* data, size_t size, uint64_t seed = 0);
+uint64_t xxh3_64(std::string_view data, uint64_t seed = 0);
+XXH128 xxh3_128(const void* data, size_t size, uint64_t seed = 0);
+XXH128 xxh3_128(std::string_view data, uint64_t seed = 0);
+
+// Streaming version of xxh3_64 and xxh3_128. Unlike the other hashers below,
+// the digest functions don't modify the state, so they can be called at any
+// time and update() can be called again afterward.
+class XXH3Hasher {
+public:
+  explicit XXH3Hasher(uint64_t seed = 0);
+
+  void update(const void* data, size_t size);
+  void update(std::string_view data);
+  void update_file(FILE* f);
+#ifndef PHOSG_WINDOWS
+  void update_fd(int fd);
+#endif
+
+  uint64_t digest_64() const;
+  XXH128 digest_128() const;
+
+  inline uint64_t size() const {
+    return this->total_size;
+  }
+
+protected:
+  // Copies the accumulators and processes everything that's still buffered
+  void digest_long(uint64_t* acc) const;
+
+  uint64_t seed;
+  uint64_t acc[8];
+  uint8_t secret[0xC0];
+  uint8_t buffer[0x100];
+  size_t buffer_size;
+  size_t block_stripes;
+  uint64_t total_size;
+};
+
+// Hash functor for std::unordered_map and std::unordered_set with string keys.
+// This uses xxh3_64 and is transparent, so a map using it with std::equal_to<>
+// can be searched with a std::string_view or const char* without constructing
+// a std::string.
+struct StringHash {
+  using is_transparent = void;
+
+  inline size_t operator()(std::string_view s) const {
+    return xxh3_64(s.data(), s.size());
+  }
+};
+
+// Like StringHash for std::string and std::string_view keys. For all other
+// types, it's the same as std::hash.
+template <typename T>
+struct FastHash : std::hash<T> {};
+template <>
+struct FastHash<std::string> : StringHash {};
+template <>
+struct FastHash<std::string_view> : StringHash {};
+
 struct MD5 {
   uint32_t a0, b0, c0, d0;
 
+  MD5() = default;
   MD5(const void* data, size_t size);
   MD5(const std::string& data);
 
@@ -31,6 +271,7 @@ struct MD5 {
 struct SHA1 {
   uint32_t h[5];
 
+  SHA1() = default;
   SHA1(const void* data, size_t size);
   SHA1(const std::string& data);
 
@@ -41,6 +282,7 @@ struct SHA1 {
 struct SHA256 {
   uint32_t h[8];
 
+  SHA256() = default;
   SHA256(const void* data, size_t size);
   SHA256(const std::string& data);
 
@@ -48,4 +290,133 @@ struct SHA256 {
   std::string hex() const;
 };
 
+// Streaming versions of the above hashes, for when the input isn't all in
+// memory at once. Call update() any number of times, then call finalize()
+// once to get the result; the hasher can't be used after that. Memory usage
+// is constant regardless of the input size.
+class BlockHasher {
+public:
+  void update(const void* data, size_t size);
+  void update(const std::string& data);
+  // Hashes everything remaining in the file (until EOF), reading it in large
+  // chunks. Throws io_error if a read fails.
+  void update_file(FILE* f);
+#ifndef PHOSG_WINDOWS
+  void update_fd(int fd);
+#endif
+
+  inline uint64_t size() const {
+    return this->total_size;
+  }
+
+protected:
+  using ProcessBlocksFn = void (*)(uint32_t* h, const uint8_t* data, size_t num_blocks);
+
+  BlockHasher(ProcessBlocksFn process_blocks, bool big_endian_length);
+  ~BlockHasher() = default;
+
+  // Appends the padding and the message length, then processes the final
+  // block(s). After this, h contains the hash.
+  void finish();
+
+  ProcessBlocksFn process_blocks;
+  bool big_endian_length;
+  uint32_t h[8];
+  uint8_t buffer[0x40];
+  size_t buffer_size;
+  uint64_t total_size;
+};
+
+class MD5Hasher : public BlockHasher {
+public:
+  MD5Hasher();
+  MD5 finalize();
+};
+
+class SHA1Hasher : public BlockHasher {
+public:
+  SHA1Hasher();
+  SHA1 finalize();
+};
+
+class SHA256Hasher : public BlockHasher {
+public:
+  SHA256Hasher();
+  SHA256 finalize();
+};
+
+// Hash many independent messages, returning the results in the same order.
+// On x86 CPUs with AVX2, these hash 8 messages at a time (one in each SIMD
+// lane), which is several times faster than hashing them one at a time when
+// the messages are short. (sha256_multi hashes them one at a time if the CPU
+// has SHA-NI, since that's faster.)
+std::vector<MD5> md5_multi(const std::vector<std::string_view>& messages);
+std::vector<SHA256> sha256_multi(const std::vector<std::string_view>& messages);
+
+// Describes which implementation each of the above functions uses on this
+// CPU, for diagnostics and benchmarking. Each field is a short name like
+// "sha-ni" or "avx2"; "portable" means no hardware acceleration is used.
+struct HashImplementations {
+  const char* crc32;
+  const char* crc32c;
+  const char* xxh3;
+  const char* md5;
+  const char* md5_multi;
+  const char* sha1;
+  const char* sha256;
+  const char* sha256_multi;
+};
+
+HashImplementations hash_implementations();
+
+// The individual implementations behind the functions above, so tests can
+// check the accelerated versions against the portable ones on the same input.
+// The process_blocks functions update a SHA-1 (5-word) or SHA-256 (8-word)
+// state with num_blocks consecutive 64-byte blocks. The multi functions are
+// like md5_multi and sha256_multi, but always use the AVX2 multi-buffer
+// kernels. Each accelerated function is nullptr if this CPU (or the build
+// target) doesn't support it.
+struct HashKernels {
+  using ProcessBlocksFn = void (*)(uint32_t* h, const uint8_t* data, size_t num_blocks);
+  using MD5MultiFn = std::vector<MD5> (*)(const std::vector<std::string_view>& messages);
+  using SHA256MultiFn = std::vector<SHA256> (*)(const std::vector<std::string_view>& messages);
+
+  ProcessBlocksFn sha1_portable;
+  ProcessBlocksFn sha1_accelerated;
+  ProcessBlocksFn sha256_portable;
+  ProcessBlocksFn sha256_accelerated;
+  MD5MultiFn md5_multi_avx2;
+  SHA256MultiFn sha256_multi_avx2;
+};
+
+HashKernels hash_kernels();
+
+// Parallel hashing of large inputs. The input is split into chunk_size-byte
+// chunks, which are hashed on num_threads threads (0 = one per CPU core).
+//
+// sha256_tree combines the chunk hashes into a binary Merkle tree, as in RFC
+// 6962: each leaf is SHA256(0x00 + chunk), and each interior node is
+// SHA256(0x01 + left + right). Note that the result depends on chunk_size, and
+// is not the same as the SHA256 of the entire input.
+//
+// crc32_parallel combines the chunks' checksums with crc32_combine, so its
+// result is the same as that of crc32.
+//
+// The _fd variants read the entire file with pread, so the file position isn't
+// used or changed.
+constexpr size_t PARALLEL_HASH_DEFAULT_CHUNK_SIZE = 0x100000;
+
+SHA256 sha256_tree(
+    const void* data, size_t size, size_t chunk_size = PARALLEL_HASH_DEFAULT_CHUNK_SIZE, size_t num_threads = 0);
+uint32_t crc32_parallel(
+    const void* data, size_t size, size_t chunk_size = PARALLEL_HASH_DEFAULT_CHUNK_SIZE, size_t num_threads = 0);
+#ifndef PHOSG_WINDOWS
+SHA256 sha256_tree_fd(int fd, size_t chunk_size = PARALLEL_HASH_DEFAULT_CHUNK_SIZE, size_t num_threads = 0);
+SHA256 sha256_tree_file(
+    const std::string& filename, size_t chunk_size = PARALLEL_HASH_DEFAULT_CHUNK_SIZE, size_t num_threads = 0);
+uint32_t crc32_fd(int fd, size_t chunk_size = PARALLEL_HASH_DEFAULT_CHUNK_SIZE, size_t num_threads = 0);
+uint32_t crc32_file(
+    const std::string& filename, size_t chunk_size = PARALLEL_HASH_DEFAULT_CHUNK_SIZE, size_t num_threads = 0);
+#endif
+
 } // namespace phosg
@@ -0,0 +1,222 @@
+#include <stdio.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PHOSG_HAVE_RDTSC
+#endif
+
+#include "Arguments.hh"
+#include "Hash.hh"
+#include "Strings.hh"
+
+using namespace std;
+using namespace phosg;
+
+void print_usage() {
+  fwrite_fmt(stderr, "\
+Usage: hash-benchmark [options]\n\
+\n\
+Measures the throughput of each hash and checksum function in phosg over a\n\
+range of message sizes, and shows which implementation each one uses on this\n\
+CPU. For each size, the function is run repeatedly on the same buffer until\n\
+the minimum time has elapsed. Cycle counts are in TSC cycles, which may not\n\
+match the core clock if frequency scaling is active, and are only shown on\n\
+x86.\n\
+\n\
+Options:\n\
+  --help: You're reading it now.\n\
+  --hashes=NAME1,NAME2,...: Only benchmark these functions. (Default: all)\n\
+  --list: List the functions that can be benchmarked and exit.\n\
+  --min-size=N: Smallest message size to test. (Default 16)\n\
+  --max-size=N: Largest message size to test. Sizes are multiplied by 4 from\n\
+      the minimum up to this size. (Default 1073741824 = 1GB)\n\
+  --min-time=USECS: Run each function for at least this long at each size.\n\
+      (Default 200000 = 0.2 seconds)\n\
+  --threads=N: Number of threads for the parallel functions. (Default is the\n\
+      number of CPU cores)\n\
+\n");
+}
+
+struct Benchmark {
+  string name;
+  string implementation;
+  // Hashes the data, and returns the number of bytes hashed (which may be
+  // more than size for the multi-buffer functions). The result is written to
+  // a volatile sink so the call can't be optimized out.
+  function<size_t(const void* data, size_t size)> fn;
+};
+
+static volatile uint64_t result_sink = 0;
+
+static vector<Benchmark> all_benchmarks(size_t num_threads) {
+  // The multi-buffer functions are given this many copies of the message
+  constexpr size_t multi_count = 64;
+
+  auto impls = hash_implementations();
+  vector<Benchmark> ret;
+  ret.emplace_back(Benchmark{"crc32", impls.crc32, [](const void* data, size_t size) -> size_t {
+                               result_sink = crc32(data, size);
+                               return size;
+                             }});
+  ret.emplace_back(Benchmark{"crc32c", impls.crc32c, [](const void* data, size_t size) -> size_t {
+                               result_sink = crc32c(data, size);
+                               return size;
+                             }});
+  ret.emplace_back(Benchmark{"crc64", "portable", [](const void* data, size_t size) -> size_t {
+                               result_sink = crc64(data, size);
+                               return size;
+                             }});
+  ret.emplace_back(Benchmark{"crc32_parallel", impls.crc32, [num_threads](const void* data, size_t size) -> size_t {
+                               result_sink = crc32_parallel(data, size, PARALLEL_HASH_DEFAULT_CHUNK_SIZE, num_threads);
+                               return size;
+                             }});
+  ret.emplace_back(Benchmark{"fnv1a32", "portable", [](const void* data, size_t size) -> size_t {
+                               result_sink = fnv1a32(data, size);
+                               return size;
+                             }});
+  ret.emplace_back(Benchmark{"fnv1a64", "portable", [](const void* data, size_t size) -> size_t {
+                               result_sink = fnv1a64(data, size);
+                               return size;
+                             }});
+  ret.emplace_back(Benchmark{"xxh3_64", impls.xxh3, [](const void* data, size_t size) -> size_t {
+                               result_sink = xxh3_64(data, size);
+                               return size;
+                             }});
+  ret.emplace_back(Benchmark{"xxh3_128", impls.xxh3, [](const void* data, size_t size) -> size_t {
+                               result_sink = xxh3_128(data, size).low;
+                               return size;
+                             }});
+  ret.emplace_back(Benchmark{"md5", impls.md5, [](const void* data, size_t size) -> size_t {
+                               result_sink = MD5(data, size).a0;
+                               return size;
+                             }});
+  ret.emplace_back(Benchmark{"md5_multi", impls.md5_multi, [](const void* data, size_t size) -> size_t {
+                               vector<string_view> messages(multi_count, string_view(reinterpret_cast<const char*>(data), size));
+                               result_sink = md5_multi(messages).back().a0;
+                               return size * multi_count;
+                             }});
+  ret.emplace_back(Benchmark{"sha1", impls.sha1, [](const void* data, size_t size) -> size_t {
+                               result_sink = SHA1(data, size).h[0];
+                               return size;
+                             }});
+  ret.emplace_back(Benchmark{"sha256", impls.sha256, [](const void* data, size_t size) -> size_t {
+                               result_sink = SHA256(data, size).h[0];
+                               return size;
+                             }});
+  ret.emplace_back(Benchmark{"sha256_multi", impls.sha256_multi, [](const void* data, size_t size) -> size_t {
+                               vector<string_view> messages(multi_count, string_view(reinterpret_cast<const char*>(data), size));
+                               result_sink = sha256_multi(messages).back().h[0];
+                               return size * multi_count;
+                             }});
+  ret.emplace_back(Benchmark{"sha256_tree", impls.sha256, [num_threads](const void* data, size_t size) -> size_t {
+                               result_sink = sha256_tree(data, size, PARALLEL_HASH_DEFAULT_CHUNK_SIZE, num_threads).h[0];
+                               return size;
+                             }});
+  return ret;
+}
+
+struct Measurement {
+  size_t bytes_hashed = 0;
+  uint64_t nsecs = 0;
+  uint64_t cycles = 0;
+};
+
+static Measurement run_benchmark(const Benchmark& b, const void* data, size_t size, uint64_t min_nsecs) {
+  // Double the iteration count until a batch takes at least min_nsecs; only
+  // the last batch is reported, so the first (cold) calls don't count
+  for (size_t iterations = 1;; iterations *= 2) {
+    Measurement m;
+#ifdef PHOSG_HAVE_RDTSC
+    uint64_t start_cycles = __rdtsc();
+#endif
+    auto start_time = chrono::steady_clock::now();
+    for (size_t z = 0; z < iterations; z++) {
+      m.bytes_hashed += b.fn(data, size);
+    }
+    m.nsecs = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time).count();
+#ifdef PHOSG_HAVE_RDTSC
+    m.cycles = __rdtsc() - start_cycles;
+#endif
+    if (m.nsecs >= min_nsecs) {
+      return m;
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  Arguments args(argv, argc);
+  if (args.get<bool>("help")) {
+    print_usage();
+    return 0;
+  }
+
+  size_t num_threads = args.get<size_t>("threads", 0);
+  auto benchmarks = all_benchmarks(num_threads);
+  if (args.get<bool>("list")) {
+    for (const auto& b : benchmarks) {
+      fwrite_fmt(stdout, "{} ({})\n", b.name, b.implementation);
+    }
+    return 0;
+  }
+
+  size_t min_size = args.get<size_t>("min-size", 16);
+  size_t max_size = args.get<size_t>("max-size", 0x40000000);
+  uint64_t min_nsecs = args.get<uint64_t>("min-time", 200000) * 1000;
+  if (min_size == 0 || min_size > max_size) {
+    throw invalid_argument("--min-size must be nonzero and no larger than --max-size");
+  }
+
+  unordered_set<string> selected_names;
+  string hashes_str = args.get<string>("hashes", false);
+  if (!hashes_str.empty()) {
+    for (const auto& name : split(hashes_str, ',')) {
+      selected_names.emplace(name);
+    }
+    for (const auto& name : selected_names) {
+      bool found = false;
+      for (const auto& b : benchmarks) {
+        found |= (b.name == name);
+      }
+      if (!found) {
+        throw invalid_argument("unknown hash function: " + name);
+      }
+    }
+  }
+
+  // The contents don't affect the speed of any of these functions, but use
+  // nonrepeating data anyway
+  string data(max_size, '\0');
+  for (size_t z = 0; z < data.size(); z++) {
+    data[z] = z * 7 + 3 + (z >> 8);
+  }
+
+  fwrite_fmt(stdout, "{:<16} {:<10} {:>12} {:>10} {:>10}\n", "FUNCTION", "IMPL", "SIZE", "GB/s", "CYCLES/B");
+  for (const auto& b : benchmarks) {
+    if (!selected_names.empty() && !selected_names.count(b.name)) {
+      continue;
+    }
+    for (size_t size = min_size;; size *= 4) {
+      auto m = run_benchmark(b, data.data(), size, min_nsecs);
+      double gb_per_sec = static_cast<double>(m.bytes_hashed) / m.nsecs;
+#ifdef PHOSG_HAVE_RDTSC
+      string cycles_str = std::format("{:.3f}", static_cast<double>(m.cycles) / m.bytes_hashed);
+#else
+      string cycles_str = "-";
+#endif
+      fwrite_fmt(stdout, "{:<16} {:<10} {:>12} {:>10.3f} {:>10}\n", b.name, b.implementation, size, gb_per_sec, cycles_str);
+      fflush(stdout);
+      // Stop here instead of in the loop condition, so size can't overflow
+      if (size > max_size / 4) {
+        break;
+      }
+    }
+  }
+  return 0;
+}
@@ -1,6 +1,8 @@
 #include <inttypes.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "Filesystem.hh"
 #include "Hash.hh"
 #include "Strings.hh"
 #include "UnitTest.hh"
@@ -27,6 +29,64 @@ int main(int, char**) {
     expect_eq(0xBF4FB41E, crc32("omg", 3));
     expect_eq(0xBB24C2E5, crc32("omg hax", 7));
     expect_eq(0x414FA339, crc32("The quick brown fox jumps over the lazy dog", 43));
+
+    // Long enough to use the folded and sliced paths, and checked at every
+    // split point so that each path's handling of the tail is covered
+    string data;
+    for (size_t z = 0; z < 1000; z++) {
+      data.push_back(z * 7 + 3);
+    }
+    expect_eq(0x17BC2A46, crc32(data.data(), data.size()));
+    for (size_t split = 0; split <= data.size(); split++) {
+      uint32_t cs = crc32(data.data(), split);
+      expect_eq(0x17BC2A46, crc32(data.data() + split, data.size() - split, cs));
+    }
+  }
+
+  {
+    fwrite_fmt(stdout, "-- generic CRCs\n");
+    // The check values from the Catalogue of Parametrised CRC Algorithms
+    const char* check = "123456789";
+    expect_eq(0xCBF43926, CRC32IEEE::compute(check, 9));
+    expect_eq(0xCBF43926, crc32(check, 9));
+    expect_eq(0xE3069283, CRC32C::compute(check, 9));
+    expect_eq(0xE3069283, crc32c(check, 9));
+    expect_eq(0x995DC9BBDF1939FA, CRC64XZ::compute(check, 9));
+    expect_eq(0x995DC9BBDF1939FA, crc64(check, 9));
+    expect_eq(0x6C40DF5F0B497347, CRC64ECMA182::compute(check, 9));
+    expect_eq(0x29B1, CRC16IBM3740::compute(check, 9));
+    expect_eq(0xF4, (CRC<uint8_t, 0x07, 0x00, false, 0x00>::compute(check, 9))); // CRC-8/SMBUS
+    expect_eq(0, crc32c("", 0));
+    expect_eq(0, crc64("", 0));
+
+    // Long enough to use the interleaved hardware path for crc32c, and
+    // checked at many split points so every path's tail handling is covered
+    string data;
+    for (size_t z = 0; z < 10000; z++) {
+      data.push_back(z * 7 + 3);
+    }
+    uint32_t expected_crc32c = CRC32C::compute(data.data(), data.size());
+    uint64_t expected_crc64 = CRC64XZ::compute(data.data(), data.size());
+    uint64_t expected_crc64_ecma = CRC64ECMA182::compute(data.data(), data.size());
+    uint16_t expected_crc16 = CRC16IBM3740::compute(data.data(), data.size());
+    expect_eq(expected_crc32c, crc32c(data.data(), data.size()));
+    for (size_t split = 0; split <= data.size(); split += 97) {
+      uint32_t crc32c_1 = crc32c(data.data(), split);
+      uint32_t crc32c_2 = crc32c(data.data() + split, data.size() - split);
+      expect_eq(expected_crc32c, crc32c(data.data() + split, data.size() - split, crc32c_1));
+      expect_eq(expected_crc32c, crc32c_combine(crc32c_1, crc32c_2, data.size() - split));
+
+      uint64_t crc64_1 = CRC64XZ::compute(data.data(), split);
+      expect_eq(expected_crc64, CRC64XZ::compute(data.data() + split, data.size() - split, crc64_1));
+      expect_eq(expected_crc64, CRC64XZ::combine(crc64_1, CRC64XZ::compute(data.data() + split, data.size() - split), data.size() - split));
+
+      uint64_t crc64_ecma_1 = CRC64ECMA182::compute(data.data(), split);
+      expect_eq(expected_crc64_ecma, CRC64ECMA182::compute(data.data() + split, data.size() - split, crc64_ecma_1));
+      expect_eq(expected_crc64_ecma, CRC64ECMA182::combine(crc64_ecma_1, CRC64ECMA182::compute(data.data() + split, data.size() - split), data.size() - split));
+
+      uint16_t crc16_1 = CRC16IBM3740::compute(data.data(), split);
+      expect_eq(expected_crc16, CRC16IBM3740::combine(crc16_1, CRC16IBM3740::compute(data.data() + split, data.size() - split), data.size() - split));
+    }
   }
 
   {
@@ -45,6 +105,94 @@ int main(int, char**) {
     expect_eq(0x594B81FB565E8D30, fnv1a64("lollercoaster", 13));
   }
 
+  {
+    fwrite_fmt(stdout, "-- xxh3\n");
+    expect_eq(0x871F40485836E6AB, xxh3_64("omg hax"));
+    expect_eq("AE54AF0F2A506AA1D489AA3DE689AA3C", xxh3_128("omg hax").hex());
+
+    // Each size is the first or last of one of the size classes that are
+    // hashed differently; the expected values are from the reference
+    // implementation
+    struct KnownHash {
+      size_t size;
+      uint64_t expected_64;
+      uint64_t expected_128_high;
+      uint64_t expected_128_low;
+    };
+    // clang-format off
+    static const KnownHash unseeded_hashes[] = {
+        {0, 0x2D06800538D394C2, 0x99AA06D3014798D8, 0x6001C324468D497F},
+        {1, 0x13E608BC156DEFED, 0x22BBB76B211A39BA, 0x13E608BC156DEFED},
+        {3, 0xA9088DDA485B481C, 0xCE31763CBF8245A5, 0xA9088DDA485B481C},
+        {4, 0x6D9253B16C8B1ED3, 0x47197970590746B1, 0x788A609154B0FE20},
+        {8, 0x60539DB630471163, 0xE3BC8A5F46171555, 0x3CD024E3D63A1588},
+        {9, 0xFEFF668361D723A8, 0xC72C88247A9A56D7, 0xEAFAB1C7F123109F},
+        {16, 0xB8C859B0F030B585, 0xCE0B9647AB24F884, 0x60D75C5E47D40A24},
+        {17, 0x714A04408E79B80F, 0xBFD327EDCC2FBD12, 0xEEED7654312A26D7},
+        {128, 0x67425A03650261BF, 0x1B1962A096BAC78B, 0xC580008B6C92AC53},
+        {129, 0xC664BF3311C6ABC4, 0x293E4968C4619023, 0xBD91CE7ACE4D385B},
+        {240, 0x64556DC6B462A6CF, 0xAD46C1021B076BC7, 0x04E0B5F034BEE80B},
+        {241, 0x8BEADD3A8874FE17, 0xAC6C3492C3D6B45D, 0x8BEADD3A8874FE17},
+        {1024, 0x9B81661C641C72B1, 0x18BC0EACA9A33636, 0x9B81661C641C72B1},
+        {3000, 0xC89178BB873C6B3D, 0x2F8842A022466A4F, 0xC89178BB873C6B3D},
+    };
+    static const KnownHash seeded_hashes[] = {
+        {0, 0xCC1CA35A1B089C5C, 0xA4CB05DBBF09907A, 0xAAA287AF24A9BB3A},
+        {1, 0x741A549EC5C1DDF0, 0x7B143CAD9CD83C25, 0x741A549EC5C1DDF0},
+        {3, 0xD1C495B136B5CBB0, 0xE66762957E6B7482, 0xD1C495B136B5CBB0},
+        {4, 0x3C6A3C9ADC39A804, 0x2D6336D7FA8B6EC8, 0x57B5396F621071AF},
+        {8, 0x5C5363C8008E62DA, 0x10D2028395F85118, 0xA0950FA2C2F09247},
+        {9, 0x3F99CFCA83720A42, 0x5D200B74E76721DF, 0x331CC80C9A61D2CD},
+        {16, 0x5FD51FC102AF6F6B, 0xD5F128FEA23F018A, 0xD58C864FDDA70F97},
+        {17, 0x30950A9D13F8427B, 0x28C09305C1703835, 0xB0A2A7D833FEE3AA},
+        {128, 0xFA029FBEB6516B5F, 0x8273175B989733BE, 0x9F4FA928A883C59E},
+        {129, 0x5A0C0CA85E1E65D7, 0x7D66B0D59E3CB9DD, 0x98F3AF4907110D59},
+        {240, 0xAEC1CACDF9EDCFD2, 0x24A07952E69729F4, 0xE379ABB40DC754AE},
+        {241, 0x7C89685CF1ECB411, 0xE7DC75031ACD59E2, 0x7C89685CF1ECB411},
+        {1024, 0x9F2432931EAA1C2C, 0xDBCB6EEDBC8807B4, 0x9F2432931EAA1C2C},
+        {3000, 0x7BBB0926B004C863, 0x7702129AD72BDF0C, 0x7BBB0926B004C863},
+    };
+    // clang-format on
+
+    string data;
+    for (size_t z = 0; z < 3000; z++) {
+      data.push_back(z * 7 + 3);
+    }
+    auto check_hashes = [&](const KnownHash* hashes, size_t count, uint64_t seed) -> void {
+      for (size_t z = 0; z < count; z++) {
+        const auto& h = hashes[z];
+        XXH128 expected_128{h.expected_128_low, h.expected_128_high};
+        expect_eq(h.expected_64, xxh3_64(data.data(), h.size, seed));
+        expect(expected_128 == xxh3_128(data.data(), h.size, seed));
+
+        // The streaming hasher should get the same result regardless of how
+        // the input is split up
+        for (size_t chunk_size : {1, 7, 64, 100, 256, 1000}) {
+          XXH3Hasher hasher(seed);
+          for (size_t offset = 0; offset < h.size; offset += chunk_size) {
+            hasher.update(data.data() + offset, min<size_t>(chunk_size, h.size - offset));
+          }
+          expect_eq(h.size, hasher.size());
+          expect_eq(h.expected_64, hasher.digest_64());
+          expect(expected_128 == hasher.digest_128());
+        }
+      }
+    };
+    check_hashes(unseeded_hashes, sizeof(unseeded_hashes) / sizeof(unseeded_hashes[0]), 0);
+    check_hashes(seeded_hashes, sizeof(seeded_hashes) / sizeof(seeded_hashes[0]), 0x0123456789ABCDEF);
+
+    // Digesting doesn't end the stream
+    XXH3Hasher hasher;
+    hasher.update(data.data(), 1000);
+    expect_eq(xxh3_64(data.data(), 1000), hasher.digest_64());
+    hasher.update(data.data() + 1000, 2000);
+    expect_eq(0xC89178BB873C6B3D, hasher.digest_64());
+
+    expect_eq(xxh3_64("omg hax"), StringHash()("omg hax"));
+    expect_eq(xxh3_64("omg hax"), FastHash<string>()(string("omg hax")));
+    expect_eq(std::hash<uint64_t>()(1234), FastHash<uint64_t>()(1234));
+  }
+
   {
     fwrite_fmt(stdout, "-- md5\n");
     MD5 md5(nullptr, 0);
@@ -104,6 +252,241 @@ int main(int, char**) {
     expect_eq(result, "\x1A\xE1\x80\xD5\xE5\xDB\x7F\xDF\x59\xEA\x73\x91\xB6\x5E\x25\x16\x73\xE1\xB0\x01\xC1\x50\xAA\x3A\x48\xDC\x78\x48\x8B\x4B\x70\xC4");
   }
 
+  {
+    fwrite_fmt(stdout, "-- accelerated SHA block functions\n");
+    // Compare the hardware implementations (if any) with the portable ones,
+    // starting from a non-initial state, for several block counts and for
+    // both aligned and unaligned data
+    auto kernels = hash_kernels();
+    string data;
+    for (size_t z = 0; z < 0x40 * 9 + 1; z++) {
+      data.push_back(z * 0x1F + (z >> 6));
+    }
+    for (size_t offset : {0, 1}) {
+      const uint8_t* blocks = reinterpret_cast<const uint8_t*>(data.data()) + offset;
+      for (size_t num_blocks : {1, 2, 3, 4, 5, 9}) {
+        if (kernels.sha1_accelerated) {
+          uint32_t expected[5] = {0x01234567, 0x89ABCDEF, 0xFEDCBA98, 0x76543210, 0xF0E1D2C3};
+          uint32_t received[5];
+          memcpy(received, expected, sizeof(expected));
+          kernels.sha1_portable(expected, blocks, num_blocks);
+          kernels.sha1_accelerated(received, blocks, num_blocks);
+          for (size_t x = 0; x < 5; x++) {
+            expect_eq(expected[x], received[x]);
+          }
+        }
+        if (kernels.sha256_accelerated) {
+          uint32_t expected[8] = {0x01234567, 0x89ABCDEF, 0xFEDCBA98, 0x76543210, 0xF0E1D2C3, 0xB4A59687, 0x78695A4B, 0x3C2D1E0F};
+          uint32_t received[8];
+          memcpy(received, expected, sizeof(expected));
+          kernels.sha256_portable(expected, blocks, num_blocks);
+          kernels.sha256_accelerated(received, blocks, num_blocks);
+          for (size_t x = 0; x < 8; x++) {
+            expect_eq(expected[x], received[x]);
+          }
+        }
+      }
+    }
+    if (!kernels.sha1_accelerated && !kernels.sha256_accelerated) {
+      fwrite_fmt(stdout, "(no accelerated implementations on this CPU)\n");
+    }
+  }
+
+  {
+    fwrite_fmt(stdout, "-- streaming hashers\n");
+    string data;
+    for (size_t z = 0; z < 1000; z++) {
+      data.push_back(z * 7 + 3);
+    }
+    const char* expected_md5 = "10046F077F2082AC19676B8079F1CB1A";
+    const char* expected_sha1 = "4231A8A50A10FA9758DB8EC71FDEF855B751048A";
+    const char* expected_sha256 = "1E9BC38CBF860B9EC31918B065F9B52476C549A782E0E7990BED8CE3868D2371";
+    check_string(__FILE__, __LINE__, expected_md5, MD5(data).hex());
+    check_string(__FILE__, __LINE__, expected_sha1, SHA1(data).hex());
+    check_string(__FILE__, __LINE__, expected_sha256, SHA256(data).hex());
+
+    // Chunk sizes that do and don't line up with the block size, including
+    // chunks that span block boundaries and chunks larger than a block
+    for (size_t chunk_size : {1, 7, 0x38, 0x40, 0x41, 0x100, 1000}) {
+      MD5Hasher md5;
+      SHA1Hasher sha1;
+      SHA256Hasher sha256;
+      for (size_t offset = 0; offset < data.size(); offset += chunk_size) {
+        size_t size = min<size_t>(chunk_size, data.size() - offset);
+        md5.update(data.data() + offset, size);
+        sha1.update(data.data() + offset, size);
+        sha256.update(data.data() + offset, size);
+      }
+      expect_eq(data.size(), sha256.size());
+      check_string(__FILE__, __LINE__, expected_md5, md5.finalize().hex());
+      check_string(__FILE__, __LINE__, expected_sha1, sha1.finalize().hex());
+      check_string(__FILE__, __LINE__, expected_sha256, sha256.finalize().hex());
+    }
+
+    // Lengths around the padding boundaries, where the trailer just fits in
+    // the last block or needs another one
+    struct PaddingTestCase {
+      size_t size;
+      const char* md5;
+      const char* sha1;
+      const char* sha256;
+    };
+    static const PaddingTestCase padding_test_cases[] = {
+        {55, "52C0E574E1198DE5FE3F8F11440DCB1B", "DDF57317EF34BFEE3B6DF83D359098930EB278BC",
+            "E7313D333C272E639F790978283F9EB392E843D0F29B7016828BB1DAA4AAC70B"},
+        {56, "46C9907FC908EE68B1E7B8E71286A518", "A0D492BB0FC889D0ECA3BC137066AB6F4F74F369",
+            "4324D65F3C103567F5589C710BC08F8523F929A9272E3AF36FC968E52ABC6C27"},
+        {63, "A62F6D59E837867693F042F5B8F5A236", "C55856749BEF509BDFE6BFEBFC7BF4E793E82132",
+            "81C80242132F230C3BD41B3E63BBCFF16107339549214A99614FF26664625055"},
+        {64, "7160B8FB5E9E4023D549C3971FBAEEAD", "BEDE92BE29C3874E1B54DDC77988D606FC857A8E",
+            "39E3D7B6B5D075D37D053AD89B24B41BEF4F3C29760C84447CAB3F3BE1882241"},
+        {119, "E84905D4214F4D1CA56C2CDCC152B143", "504E27376A6E0F0DBA8295B85CB25DC4DFA17D23",
+            "9CE7368E4DAF32341631B492E80359DC9F594B48453CD0DD5BF0B19279CC177E"},
+        {120, "E3EB5A6C8669EA01A8C185B8ABC8A5DC", "82134B02FB3F702491BE9BED581EEAB59334ACB2",
+            "7836B787757E95E58B3CA5AEC90B1B004E8DEBA1E50E9675AF9CABF1A13A04B5"},
+    };
+    for (const auto& test_case : padding_test_cases) {
+      check_string(__FILE__, __LINE__, test_case.md5, MD5(data.data(), test_case.size).hex());
+      check_string(__FILE__, __LINE__, test_case.sha1, SHA1(data.data(), test_case.size).hex());
+      check_string(__FILE__, __LINE__, test_case.sha256, SHA256(data.data(), test_case.size).hex());
+      MD5Hasher md5;
+      SHA1Hasher sha1;
+      SHA256Hasher sha256;
+      md5.update(data.substr(0, test_case.size));
+      sha1.update(data.substr(0, test_case.size));
+      sha256.update(data.substr(0, test_case.size));
+      check_string(__FILE__, __LINE__, test_case.md5, md5.finalize().hex());
+      check_string(__FILE__, __LINE__, test_case.sha1, sha1.finalize().hex());
+      check_string(__FILE__, __LINE__, test_case.sha256, sha256.finalize().hex());
+    }
+
+    auto f = fopen_unique("HashTest-data", "w+b");
+    fwritex(f.get(), data);
+    rewind(f.get());
+    SHA256Hasher file_sha256;
+    file_sha256.update_file(f.get());
+    check_string(__FILE__, __LINE__, expected_sha256, file_sha256.finalize().hex());
+    f.reset();
+    unlink("HashTest-data");
+  }
+
+  {
+    fwrite_fmt(stdout, "-- crc32_combine\n");
+    string data;
+    for (size_t z = 0; z < 1000; z++) {
+      data.push_back(z * 7 + 3);
+    }
+    for (size_t split = 0; split <= data.size(); split += 37) {
+      uint32_t crc1 = crc32(data.data(), split);
+      uint32_t crc2 = crc32(data.data() + split, data.size() - split);
+      expect_eq(0x17BC2A46, crc32_combine(crc1, crc2, data.size() - split));
+    }
+  }
+
+  {
+    fwrite_fmt(stdout, "-- parallel hashing\n");
+    string data;
+    for (size_t z = 0; z < 1000; z++) {
+      data.push_back(z * 7 + 3);
+    }
+
+    // The expected values are from an independent implementation of RFC
+    // 6962's Merkle tree hash. With 300-byte chunks the tree is complete, but
+    // with 400-byte chunks the last leaf has no sibling.
+    check_string(__FILE__, __LINE__, "E3B0C44298FC1C149AFBF4C8996FB92427AE41E4649B934CA495991B7852B855",
+        sha256_tree("", 0).hex());
+    check_string(__FILE__, __LINE__, "A74D1A235BC6A9F04CD14CF191FC0B80D5EB4B834610CF492EFF495B2EBBB893",
+        sha256_tree(data.data(), data.size()).hex());
+    check_string(__FILE__, __LINE__, "E3546592D4C870E28B3C21AC07709A9D0A87244AC946E01A6BA2E40D6EC17B7C",
+        sha256_tree(data.data(), data.size(), 300, 4).hex());
+    check_string(__FILE__, __LINE__, "4064D7409F9860E5E40CB698106176F2393926DB440B1355F2A6BD92F03E04B2",
+        sha256_tree(data.data(), data.size(), 400, 4).hex());
+    check_string(__FILE__, __LINE__, "923C8C4792DA341F452946F82D395C94BFFD25862A4D558200CA7F64962EA7A0",
+        sha256_tree(data.data(), data.size(), 64, 3).hex());
+    expect_raises(invalid_argument, [&]() -> void {
+      sha256_tree(data.data(), data.size(), 0);
+    });
+
+    for (size_t chunk_size : {1, 64, 100, 999, 1000, 4096}) {
+      expect_eq(0x17BC2A46, crc32_parallel(data.data(), data.size(), chunk_size, 4));
+    }
+    expect_eq(0, crc32_parallel("", 0));
+
+    auto f = fopen_unique("HashTest-data", "w+b");
+    fwritex(f.get(), data);
+    fflush(f.get());
+    check_string(__FILE__, __LINE__, "E3546592D4C870E28B3C21AC07709A9D0A87244AC946E01A6BA2E40D6EC17B7C",
+        sha256_tree_fd(fileno(f.get()), 300, 4).hex());
+    check_string(__FILE__, __LINE__, "4064D7409F9860E5E40CB698106176F2393926DB440B1355F2A6BD92F03E04B2",
+        sha256_tree_file("HashTest-data", 400).hex());
+    expect_eq(0x17BC2A46, crc32_fd(fileno(f.get()), 100, 4));
+    expect_eq(0x17BC2A46, crc32_file("HashTest-data"));
+    f.reset();
+    unlink("HashTest-data");
+  }
+
+  {
+    fwrite_fmt(stdout, "-- multi-buffer hashing\n");
+    // Messages of many different lengths, so lanes finish at different times
+    // and some lanes are idle at the end
+    vector<string> data;
+    for (size_t size = 0; size < 300; size += (size < 0x90) ? 1 : 37) {
+      string& message = data.emplace_back();
+      for (size_t z = 0; z < size; z++) {
+        message.push_back(z * 13 + size);
+      }
+    }
+    vector<string_view> messages(data.begin(), data.end());
+    auto md5_results = md5_multi(messages);
+    auto sha256_results = sha256_multi(messages);
+    expect_eq(messages.size(), md5_results.size());
+    expect_eq(messages.size(), sha256_results.size());
+    for (size_t z = 0; z < messages.size(); z++) {
+      check_string(__FILE__, __LINE__, MD5(data[z]).hex(), md5_results[z].hex());
+      check_string(__FILE__, __LINE__, SHA256(data[z]).hex(), sha256_results[z].hex());
+    }
+    expect(md5_multi({}).empty());
+    expect(sha256_multi({}).empty());
+  }
+
+  {
+    fwrite_fmt(stdout, "-- multi-buffer kernels\n");
+    // md5_multi and sha256_multi may not use these kernels (e.g. on CPUs with
+    // SHA-NI), so test them directly. The message lengths include all of the
+    // padding boundaries, and the message counts include partial and multiple
+    // rounds of lanes.
+    auto kernels = hash_kernels();
+    string data;
+    for (size_t z = 0; z < 0x500; z++) {
+      data.push_back(z * 0x3D + (z >> 7));
+    }
+    static const size_t lengths[] = {0, 1, 55, 56, 63, 64, 65, 119, 120, 127, 128, 200, 0x400};
+    constexpr size_t num_lengths = sizeof(lengths) / sizeof(lengths[0]);
+    for (size_t count : {1, 2, 7, 8, 9, 16, 17, 40}) {
+      vector<string_view> messages;
+      for (size_t z = 0; z < count; z++) {
+        messages.emplace_back(data.data() + z, lengths[(z * 5) % num_lengths]);
+      }
+      if (kernels.md5_multi_avx2) {
+        auto results = kernels.md5_multi_avx2(messages);
+        expect_eq(count, results.size());
+        for (size_t z = 0; z < count; z++) {
+          check_string(__FILE__, __LINE__, MD5(messages[z].data(), messages[z].size()).hex(), results[z].hex());
+        }
+      }
+      if (kernels.sha256_multi_avx2) {
+        auto results = kernels.sha256_multi_avx2(messages);
+        expect_eq(count, results.size());
+        for (size_t z = 0; z < count; z++) {
+          check_string(__FILE__, __LINE__, SHA256(messages[z].data(), messages[z].size()).hex(), results[z].hex());
+        }
+      }
+    }
+    if (!kernels.md5_multi_avx2) {
+      fwrite_fmt(stdout, "(no multi-buffer kernels on this CPU)\n");
+    }
+  }
+
   fwrite_fmt(stdout, "HashTest: all tests passed\n");
   return 0;
 }
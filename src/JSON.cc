@@ -494,7 +494,7 @@ JSON& JSON::operator=(const JSON& rhs) {
       break;
     }
     case 6: {
-      this->value = unordered_map<string, unique_ptr<JSON>>();
+      this->value = dict_type();
       auto& v = ::get<6>(this->value);
       for (const auto& it : (::get<6>(rhs.value))) {
         v.emplace(it.first, new JSON(*it.second));
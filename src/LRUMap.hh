@@ -6,9 +6,11 @@
 #include <stdexcept>
 #include <unordered_map>
 
+#include "Hash.hh"
+
 namespace phosg {
 
-template <typename KeyT, typename ValueT>
+template <typename KeyT, typename ValueT, typename HashT = FastHash<KeyT>>
 class LRUMap {
 protected:
   struct Item {
@@ -34,7 +36,7 @@ protected:
 
   mutable Item* head;
   mutable Item* tail;
-  std::unordered_map<KeyT, Item> items;
+  std::unordered_map<KeyT, Item, HashT> items;
   size_t total_size;
 
   void link_item(Item* i) const {
@@ -251,7 +253,7 @@ public:
     return ret;
   }
 
-  void swap(LRUMap<KeyT, ValueT>& other) {
+  void swap(LRUMap& other) {
     Item* this_head = this->head;
     Item* this_tail = this->tail;
     size_t this_total_size = this->total_size;
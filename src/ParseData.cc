@@ -2,9 +2,13 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <filesystem>
+#include <format>
+#include <stdexcept>
 #include <string>
 
 #include "Filesystem.hh"
+#include "Process.hh"
 #include "Strings.hh"
 
 using namespace std;
@@ -18,19 +22,38 @@ int main(int argc, char** argv) {
     return 1;
   }
 
-  string src_data;
-  if (!src_filename || !strcmp(src_filename, "-")) {
-    src_data = read_all(stdin);
-  } else {
-    src_data = load_file(src_filename);
+  // The input is parsed in chunks, so this runs in constant memory regardless
+  // of the input size (unless the input includes large files). When writing to
+  // a file, the output goes to a temporary file that replaces the destination
+  // only after the entire input is parsed, so a parse error doesn't leave a
+  // partially-written output file.
+  auto src = fopen_shared(src_filename ? src_filename : "-", "rb", stdin);
+  bool write_to_stdout = !dst_filename || !strcmp(dst_filename, "-");
+  string temp_filename = write_to_stdout ? "-" : std::format("{}.{}.tmp", dst_filename, getpid_cached());
+  auto dst = fopen_shared(temp_filename, "wb", stdout);
+
+  try {
+    DataStringParser parser(ParseDataFlags::ALLOW_FILES);
+    char buf[0x10000];
+    for (;;) {
+      size_t bytes_read = fread(buf, 1, sizeof(buf), src.get());
+      if (bytes_read == 0) {
+        break;
+      }
+      fwritex(dst.get(), parser.parse(string_view(buf, bytes_read)));
+    }
+    fwritex(dst.get(), parser.finish());
+  } catch (const exception&) {
+    if (!write_to_stdout) {
+      dst.reset();
+      filesystem::remove(temp_filename);
+    }
+    throw;
   }
 
-  string result = parse_data_string(src_data, nullptr, ParseDataFlags::ALLOW_FILES);
-
-  if (!dst_filename || !strcmp(dst_filename, "-")) {
-    fwritex(stdout, result);
-  } else {
-    save_file(dst_filename, result);
+  if (!write_to_stdout) {
+    dst.reset();
+    filesystem::rename(temp_filename, dst_filename);
   }
 
   return 0;
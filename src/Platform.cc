@@ -0,0 +1,41 @@
+#include "Platform.hh"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#define PHOSG_HAVE_CPUID
+#endif
+
+namespace phosg {
+
+static X86Features detect_x86_features() {
+  X86Features ret;
+#ifdef PHOSG_HAVE_CPUID
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return ret;
+  }
+  ret.pclmul = ecx & (1 << 1);
+  ret.ssse3 = ecx & (1 << 9);
+  ret.sse41 = ecx & (1 << 19);
+  ret.sse42 = ecx & (1 << 20);
+  // AVX registers are only usable if the OS saves them on context switches
+  bool avx_enabled = false;
+  if ((ecx & (1 << 27)) && (ecx & (1 << 28))) {
+    uint32_t xcr0_low, xcr0_high;
+    __asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+    avx_enabled = ((xcr0_low & 6) == 6);
+  }
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    ret.avx2 = avx_enabled && (ebx & (1 << 5));
+    ret.sha = ebx & (1 << 29);
+  }
+#endif
+  return ret;
+}
+
+const X86Features& x86_features() {
+  static const X86Features features = detect_x86_features();
+  return features;
+}
+
+} // namespace phosg
@@ -70,6 +70,21 @@ constexpr inline bool is_macos() {
 #endif
 // clang-format on
 
+// The optional x86 instruction set extensions that phosg's accelerated
+// functions can use. These are detected once (with cpuid and xgetbv), the
+// first time x86_features() is called. On other architectures, all of the
+// fields are false.
+struct X86Features {
+  bool ssse3 = false;
+  bool sse41 = false;
+  bool sse42 = false;
+  bool pclmul = false;
+  bool avx2 = false;
+  bool sha = false;
+};
+
+const X86Features& x86_features();
+
 #if (SIZE_MAX == 0xFF)
 #define SIZE_T_BITS 8
 #elif (SIZE_MAX == 0xFFFF)
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "Arguments.hh"
+#include "Filesystem.hh"
+#include "Strings.hh"
+
+using namespace std;
+using namespace phosg;
+
+void print_usage() {
+  fwrite_fmt(stderr, "\
+Usage: print-data [options] [infile]\n\
+\n\
+Prints the contents of infile as a hex dump. If infile is - or not specified,\n\
+read from standard input. The input is read and printed incrementally, so\n\
+inputs of any size can be printed, including from pipes.\n\
+\n\
+Options:\n\
+  --help: You're reading it now.\n\
+  --start-address=ADDR: Address the first byte as ADDR (hex) instead of 0.\n\
+  --no-ascii: Don't show the ASCII view.\n\
+  --collapse-zeroes: Don't show lines that contain only zero bytes.\n\
+  --color: Highlight unprintable bytes even if the output is not a TTY.\n\
+  --no-color: Don't highlight unprintable bytes even if the output is a TTY.\n\
+\n");
+}
+
+int main(int argc, char** argv) {
+  Arguments args(argv, argc);
+  if (args.get<bool>("help")) {
+    print_usage();
+    return 0;
+  }
+
+  string src_filename = args.get<string>(1, false);
+  if (src_filename.empty()) {
+    src_filename = "-";
+  }
+  uint64_t start_address = args.get<uint64_t>("start-address", 0, Arguments::IntFormat::HEX);
+
+  uint64_t flags = 0;
+  if (!args.get<bool>("no-ascii")) {
+    flags |= PrintDataFlags::PRINT_ASCII;
+  }
+  if (args.get<bool>("collapse-zeroes")) {
+    flags |= PrintDataFlags::COLLAPSE_ZERO_LINES;
+  }
+  if (args.get<bool>("no-color")) {
+    flags |= PrintDataFlags::DISABLE_COLOR;
+  } else if (args.get<bool>("color") || isatty(fileno(stdout))) {
+    flags |= PrintDataFlags::USE_COLOR;
+  }
+
+  auto src = fopen_shared(src_filename, "rb", stdin);
+
+  // If the input size is known, use it to choose the offset column width, so
+  // the output matches what print_data would produce for the entire input
+  uint64_t expected_end_address = 0;
+#ifndef PHOSG_WINDOWS
+  struct stat st = phosg::fstat(src.get());
+  if (S_ISREG(st.st_mode)) {
+    expected_end_address = start_address + st.st_size;
+  }
+#endif
+
+  auto write_data = [&](const void* data, size_t size) -> void {
+    fwritex(stdout, data, size);
+  };
+  DataFormatter formatter(write_data, start_address, flags, expected_end_address);
+  char buf[0x10000];
+  for (;;) {
+    size_t bytes_read = fread(buf, 1, sizeof(buf), src.get());
+    if (bytes_read == 0) {
+      break;
+    }
+    formatter.write(buf, bytes_read);
+  }
+  formatter.finish();
+
+  return 0;
+}
@@ -1,7 +1,9 @@
 #include "Strings.hh"
 
 #define _STDC_FORMAT_MACROS
+#include <errno.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,17 +11,36 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
 #include <format>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <variant>
 #include <vector>
 
 #include "Platform.hh"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__) && defined(PHOSG_ENABLE_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "Encoding.hh"
 #include "Filesystem.hh"
 #include "Process.hh"
+#include "Time.hh"
+#include "Tools.hh"
 
 using namespace std;
 
@@ -29,24 +50,192 @@ unique_ptr<void, void (*)(void*)> malloc_unique(size_t size) {
   return unique_ptr<void, void (*)(void*)>(malloc(size), free);
 }
 
-string toupper(const string& s) {
-  string ret;
-  ret.reserve(s.size());
-  for (char ch : s) {
-    ret.push_back(::toupper(ch));
+// Helpers for classifying 16 bytes at a time. Comparisons produce 0xFF in
+// each byte where the condition is true and 0x00 where it's false, and
+// byte_vec_mask collects the results into a bitmask with bit N corresponding
+// to byte N.
+#if defined(__SSE2__)
+#define PHOSG_HAVE_BYTE_VEC
+using ByteVec = __m128i;
+
+static inline ByteVec byte_vec_load(const void* data) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+}
+static inline void byte_vec_store(void* data, ByteVec v) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(data), v);
+}
+static inline ByteVec byte_vec_eq(ByteVec v, uint8_t value) {
+  return _mm_cmpeq_epi8(v, _mm_set1_epi8(value));
+}
+// Unsigned comparisons; SSE2 has no unsigned byte compare, but min/max are
+// unsigned, so v <= value iff min(v, value) == v
+static inline ByteVec byte_vec_le(ByteVec v, uint8_t value) {
+  return _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(value)), v);
+}
+static inline ByteVec byte_vec_ge(ByteVec v, uint8_t value) {
+  return _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(value)), v);
+}
+static inline ByteVec byte_vec_in_range(ByteVec v, uint8_t low, uint8_t high) {
+  return byte_vec_le(_mm_sub_epi8(v, _mm_set1_epi8(low)), high - low);
+}
+static inline ByteVec byte_vec_or(ByteVec a, ByteVec b) {
+  return _mm_or_si128(a, b);
+}
+static inline ByteVec byte_vec_and_value(ByteVec a, uint8_t value) {
+  return _mm_and_si128(a, _mm_set1_epi8(value));
+}
+static inline ByteVec byte_vec_xor(ByteVec a, ByteVec b) {
+  return _mm_xor_si128(a, b);
+}
+static inline ByteVec byte_vec_and(ByteVec a, ByteVec b) {
+  return _mm_and_si128(a, b);
+}
+static inline ByteVec byte_vec_sub(ByteVec a, ByteVec b) {
+  return _mm_sub_epi8(a, b);
+}
+static inline ByteVec byte_vec_zero() {
+  return _mm_setzero_si128();
+}
+static inline uint16_t byte_vec_mask(ByteVec v) {
+  return _mm_movemask_epi8(v);
+}
+// Returns the sum of all 16 bytes (as unsigned values)
+static inline size_t byte_vec_sum(ByteVec v) {
+  __m128i sums = _mm_sad_epu8(v, _mm_setzero_si128());
+  return _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__) && defined(PHOSG_ENABLE_NEON)
+#define PHOSG_HAVE_BYTE_VEC
+using ByteVec = uint8x16_t;
+
+static inline ByteVec byte_vec_load(const void* data) {
+  return vld1q_u8(reinterpret_cast<const uint8_t*>(data));
+}
+static inline void byte_vec_store(void* data, ByteVec v) {
+  vst1q_u8(reinterpret_cast<uint8_t*>(data), v);
+}
+static inline ByteVec byte_vec_eq(ByteVec v, uint8_t value) {
+  return vceqq_u8(v, vdupq_n_u8(value));
+}
+static inline ByteVec byte_vec_le(ByteVec v, uint8_t value) {
+  return vcleq_u8(v, vdupq_n_u8(value));
+}
+static inline ByteVec byte_vec_ge(ByteVec v, uint8_t value) {
+  return vcgeq_u8(v, vdupq_n_u8(value));
+}
+static inline ByteVec byte_vec_in_range(ByteVec v, uint8_t low, uint8_t high) {
+  return vcleq_u8(vsubq_u8(v, vdupq_n_u8(low)), vdupq_n_u8(high - low));
+}
+static inline ByteVec byte_vec_or(ByteVec a, ByteVec b) {
+  return vorrq_u8(a, b);
+}
+static inline ByteVec byte_vec_and_value(ByteVec a, uint8_t value) {
+  return vandq_u8(a, vdupq_n_u8(value));
+}
+static inline ByteVec byte_vec_xor(ByteVec a, ByteVec b) {
+  return veorq_u8(a, b);
+}
+static inline ByteVec byte_vec_and(ByteVec a, ByteVec b) {
+  return vandq_u8(a, b);
+}
+static inline ByteVec byte_vec_sub(ByteVec a, ByteVec b) {
+  return vsubq_u8(a, b);
+}
+static inline ByteVec byte_vec_zero() {
+  return vdupq_n_u8(0);
+}
+static inline size_t byte_vec_sum(ByteVec v) {
+  return vaddlvq_u8(v);
+}
+static inline uint16_t byte_vec_mask(ByteVec v) {
+  // NEON has no movemask; keep one distinct bit per byte in each half, then
+  // add up the bits in each half
+  static const uint8_t bits_data[0x10] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t bits = vandq_u8(v, vld1q_u8(bits_data));
+  return vaddv_u8(vget_low_u8(bits)) | (vaddv_u8(vget_high_u8(bits)) << 8);
+}
+#endif
+
+// Flips the case of all bytes in [low, high] (which must be the range of
+// lowercase or uppercase ASCII letters). in and out may be the same.
+static void convert_case(char* out, const char* in, size_t size, uint8_t low, uint8_t high) {
+  size_t z = 0;
+#ifdef PHOSG_HAVE_BYTE_VEC
+  for (; z + 0x10 <= size; z += 0x10) {
+    ByteVec v = byte_vec_load(in + z);
+    byte_vec_store(out + z, byte_vec_xor(v, byte_vec_and_value(byte_vec_in_range(v, low, high), 0x20)));
+  }
+#endif
+  for (; z < size; z++) {
+    uint8_t ch = in[z];
+    out[z] = ((ch >= low) && (ch <= high)) ? (ch ^ 0x20) : ch;
   }
+}
+
+string toupper(string_view s) {
+  string ret(s);
+  toupper_inplace(ret);
   return ret;
 }
 
-string tolower(const string& s) {
-  string ret;
-  ret.reserve(s.size());
-  for (char ch : s) {
-    ret.push_back(::tolower(ch));
-  }
+string tolower(string_view s) {
+  string ret(s);
+  tolower_inplace(ret);
   return ret;
 }
 
+void toupper_inplace(string& s) {
+  convert_case(s.data(), s.data(), s.size(), 'a', 'z');
+}
+
+void tolower_inplace(string& s) {
+  convert_case(s.data(), s.data(), s.size(), 'A', 'Z');
+}
+
+static inline bool is_strip_whitespace(uint8_t ch) {
+  return (ch == ' ') || (ch == '\t') || (ch == '\r') || (ch == '\n');
+}
+
+#ifdef PHOSG_HAVE_BYTE_VEC
+static inline uint16_t whitespace_mask(const char* data) {
+  ByteVec v = byte_vec_load(data);
+  return byte_vec_mask(byte_vec_or(
+      byte_vec_or(byte_vec_eq(v, ' '), byte_vec_eq(v, '\t')),
+      byte_vec_or(byte_vec_eq(v, '\r'), byte_vec_eq(v, '\n'))));
+}
+#endif
+
+size_t count_leading_whitespace(const char* data, size_t size) {
+  size_t z = 0;
+#ifdef PHOSG_HAVE_BYTE_VEC
+  for (; z + 0x10 <= size; z += 0x10) {
+    uint16_t non_whitespace = ~whitespace_mask(data + z);
+    if (non_whitespace) {
+      return z + countr_zero(non_whitespace);
+    }
+  }
+#endif
+  for (; (z < size) && is_strip_whitespace(data[z]); z++) {
+  }
+  return z;
+}
+
+size_t count_trailing_whitespace(const char* data, size_t size) {
+  size_t end = size;
+#ifdef PHOSG_HAVE_BYTE_VEC
+  for (; end >= 0x10; end -= 0x10) {
+    uint16_t non_whitespace = ~whitespace_mask(data + end - 0x10);
+    if (non_whitespace) {
+      return size - end + countl_zero(non_whitespace);
+    }
+  }
+#endif
+  for (; (end > 0) && is_strip_whitespace(data[end - 1]); end--) {
+  }
+  return size - end;
+}
+
 string str_replace_all(const string& s, const char* target, const char* replacement) {
   size_t target_size = strlen(target);
   size_t replacement_size = strlen(replacement);
@@ -66,65 +255,315 @@ string str_replace_all(const string& s, const char* target, const char* replacem
   return ret;
 }
 
-string escape_quotes(const string& s) {
+MultiStringMatcher::MultiStringMatcher(const vector<string>& patterns)
+    : patterns(patterns),
+      num_classes(1) {
+  memset(this->byte_class, 0, sizeof(this->byte_class));
+  for (const auto& pattern : this->patterns) {
+    if (pattern.empty()) {
+      throw invalid_argument("patterns may not be empty");
+    }
+    for (char ch : pattern) {
+      uint16_t& cls = this->byte_class[static_cast<uint8_t>(ch)];
+      if (cls == 0) {
+        cls = static_cast<uint16_t>(this->num_classes++);
+      }
+    }
+  }
+
+  // Build the trie. In this phase, a transition to node 0 means there is no
+  // child for that byte (there are no edges back to the root in a trie)
+  this->nodes.emplace_back(Node{0, 0, SIZE_MAX});
+  this->transitions.resize(this->num_classes, 0);
+  for (size_t pattern_index = 0; pattern_index < this->patterns.size(); pattern_index++) {
+    uint32_t node = 0;
+    for (char ch : this->patterns[pattern_index]) {
+      size_t index = node * this->num_classes + this->byte_class[static_cast<uint8_t>(ch)];
+      uint32_t next = this->transitions[index];
+      if (next == 0) {
+        next = static_cast<uint32_t>(this->nodes.size());
+        this->nodes.emplace_back(Node{this->nodes[node].depth + 1, 0, SIZE_MAX});
+        this->transitions.resize(this->transitions.size() + this->num_classes, 0);
+        this->transitions[index] = next;
+      }
+      node = next;
+    }
+    if (this->nodes[node].pattern_index == SIZE_MAX) {
+      this->nodes[node].pattern_index = pattern_index;
+    }
+  }
+
+  // Compute failure links in breadth-first order, and fill in the missing
+  // transitions from each node's failure node, which is always shallower and
+  // therefore already complete. The root's missing transitions stay at 0.
+  vector<uint32_t> fail_links(this->nodes.size(), 0);
+  vector<uint32_t> queue;
+  queue.reserve(this->nodes.size());
+  for (size_t cls = 0; cls < this->num_classes; cls++) {
+    if (this->transitions[cls] != 0) {
+      queue.emplace_back(this->transitions[cls]);
+    }
+  }
+  for (size_t queue_offset = 0; queue_offset < queue.size(); queue_offset++) {
+    uint32_t node = queue[queue_offset];
+    size_t row = node * this->num_classes;
+    size_t fail_row = fail_links[node] * this->num_classes;
+    for (size_t cls = 0; cls < this->num_classes; cls++) {
+      uint32_t child = this->transitions[row + cls];
+      uint32_t fail_next = this->transitions[fail_row + cls];
+      if (child == 0) {
+        this->transitions[row + cls] = fail_next;
+      } else {
+        fail_links[child] = fail_next;
+        this->nodes[child].output_link = this->longest_output(fail_next);
+        queue.emplace_back(child);
+      }
+    }
+  }
+}
+
+MultiStringMatcher::Match MultiStringMatcher::find(string_view s, size_t start_offset) const {
+  Match ret{string::npos, 0, 0};
+  uint32_t node = 0;
+  for (size_t z = start_offset; z < s.size(); z++) {
+    node = this->next_node(node, s[z]);
+    uint32_t output = this->longest_output(node);
+    if (output != 0) {
+      // A match that ends later but begins at or before the current best
+      // match is either further left or longer, so it replaces the best match
+      size_t size = this->nodes[output].depth;
+      size_t offset = z + 1 - size;
+      if ((ret.offset == string::npos) || (offset <= ret.offset)) {
+        ret = Match{offset, size, this->nodes[output].pattern_index};
+      }
+    }
+    // Any match that ends after z must begin within the current node's depth
+    // of z, so if that's past the best match's start, no later match can
+    // replace it
+    if ((ret.offset != string::npos) && (z + 1 - this->nodes[node].depth > ret.offset)) {
+      break;
+    }
+  }
+  return ret;
+}
+
+bool MultiStringMatcher::contains_any(string_view s) const {
+  uint32_t node = 0;
+  for (char ch : s) {
+    node = this->next_node(node, ch);
+    if (this->longest_output(node) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+vector<MultiStringMatcher::Match> MultiStringMatcher::find_all(string_view s) const {
+  vector<Match> ret;
+  uint32_t node = 0;
+  for (size_t z = 0; z < s.size(); z++) {
+    node = this->next_node(node, s[z]);
+    for (uint32_t output = this->longest_output(node); output != 0; output = this->nodes[output].output_link) {
+      size_t size = this->nodes[output].depth;
+      ret.emplace_back(Match{z + 1 - size, size, this->nodes[output].pattern_index});
+    }
+  }
+  return ret;
+}
+
+vector<MultiStringMatcher::Match> MultiStringMatcher::find_all_non_overlapping(string_view s) const {
+  vector<Match> ret;
+  for (size_t offset = 0; offset < s.size();) {
+    Match m = this->find(s, offset);
+    if (m.offset == string::npos) {
+      break;
+    }
+    ret.emplace_back(m);
+    offset = m.offset + m.size;
+  }
+  return ret;
+}
+
+string MultiStringMatcher::replace_all(string_view s, const vector<string>& replacements) const {
+  if (replacements.size() != this->patterns.size()) {
+    throw invalid_argument("incorrect replacement count");
+  }
+
   string ret;
-  for (size_t x = 0; x < s.size(); x++) {
-    char ch = s[x];
-    if (ch == '\"') {
-      ret += "\\\"";
-    } else if (ch < 0x20 || ch > 0x7E) {
-      ret += std::format("\\x{:02X}", static_cast<uint8_t>(ch));
-    } else {
-      ret += ch;
+  ret.reserve(s.size());
+  for (size_t read_offset = 0; read_offset < s.size();) {
+    Match m = this->find(s, read_offset);
+    if (m.offset == string::npos) {
+      ret.append(s.data() + read_offset, s.size() - read_offset);
+      break;
     }
+    ret.append(s.data() + read_offset, m.offset - read_offset);
+    ret.append(replacements[m.pattern_index]);
+    read_offset = m.offset + m.size;
   }
   return ret;
 }
 
-string escape_controls(const string& s, bool escape_non_ascii) {
+string str_replace_all(const string& s, const vector<pair<string, string>>& replacements) {
+  vector<string> targets;
+  vector<string> replacement_strs;
+  targets.reserve(replacements.size());
+  replacement_strs.reserve(replacements.size());
+  for (const auto& [target, replacement] : replacements) {
+    targets.emplace_back(target);
+    replacement_strs.emplace_back(replacement);
+  }
+  return MultiStringMatcher(targets).replace_all(s, replacement_strs);
+}
+
+// Escapes data by copying runs of bytes that don't need escaping in bulk and
+// calling ClassT::append_escaped for each byte that does. ClassT::needs_escape
+// classifies a single byte, and ClassT::escape_mask (if byte vectors are
+// available) classifies 16 bytes at once, returning a bitmask of the bytes
+// that need escaping. If no bytes need escaping, the input is copied once.
+template <typename ClassT>
+static string escape_runs(string_view s, const ClassT& cls) {
   string ret;
-  for (size_t x = 0; x < s.size(); x++) {
-    char ch = s[x];
+  ret.reserve(s.size());
+  const char* data = s.data();
+  size_t run_start = 0;
+  auto escape_byte = [&](size_t offset) -> void {
+    ret.append(data + run_start, offset - run_start);
+    cls.append_escaped(ret, data[offset]);
+    run_start = offset + 1;
+  };
+
+  size_t z = 0;
+#ifdef PHOSG_HAVE_BYTE_VEC
+  for (; z + 0x10 <= s.size(); z += 0x10) {
+    for (uint16_t mask = cls.escape_mask(byte_vec_load(data + z)); mask; mask &= (mask - 1)) {
+      escape_byte(z + countr_zero(mask));
+    }
+  }
+#endif
+  for (; z < s.size(); z++) {
+    if (cls.needs_escape(data[z])) {
+      escape_byte(z);
+    }
+  }
+  ret.append(data + run_start, s.size() - run_start);
+  return ret;
+}
+
+static inline void append_hex_escape(string& ret, char prefix, uint8_t ch) {
+  static const char* digits = "0123456789ABCDEF";
+  char buf[3] = {prefix, digits[ch >> 4], digits[ch & 0x0F]};
+  ret.append(buf, 3);
+}
+
+struct EscapeQuotesClass {
+  inline bool needs_escape(uint8_t ch) const {
+    return (ch == '\"') || (ch < 0x20) || (ch > 0x7E);
+  }
+#ifdef PHOSG_HAVE_BYTE_VEC
+  inline uint16_t escape_mask(ByteVec v) const {
+    return byte_vec_mask(byte_vec_or(
+        byte_vec_eq(v, '\"'), byte_vec_or(byte_vec_le(v, 0x1F), byte_vec_ge(v, 0x7F))));
+  }
+#endif
+  inline void append_escaped(string& ret, uint8_t ch) const {
     if (ch == '\"') {
       ret += "\\\"";
-    } else if (ch == '\'') {
-      ret += "\\\'";
-    } else if (ch == '\\') {
-      ret += "\\\\";
-    } else if (ch == '\t') {
-      ret += "\\t";
-    } else if (ch == '\r') {
-      ret += "\\r";
-    } else if (ch == '\n') {
-      ret += "\\n";
-    } else if (ch == '\f') {
-      ret += "\\f";
-    } else if (ch == '\b') {
-      ret += "\\b";
-    } else if (ch == '\a') {
-      ret += "\\a";
-    } else if (ch == '\v') {
-      ret += "\\v";
-    } else if (escape_non_ascii ? (ch < 0x20 || ch > 0x7E) : (!(ch & 0x80) && ((ch < 0x20) || ch == 0x7F))) {
-      ret += std::format("\\x{:02X}", static_cast<uint8_t>(ch));
     } else {
-      ret += ch;
+      ret += '\\';
+      append_hex_escape(ret, 'x', ch);
     }
   }
-  return ret;
+};
+
+string escape_quotes(string_view s) {
+  return escape_runs(s, EscapeQuotesClass());
 }
 
-string escape_url(const string& s, bool escape_slash) {
-  string ret;
-  for (char ch : s) {
-    if (isalnum(ch) || (ch == '-') || (ch == '_') || (ch == '.') ||
-        (ch == '~') || (ch == '=') || (ch == '&') || (!escape_slash && (ch == '/'))) {
-      ret += ch;
-    } else {
-      ret += std::format("%{:02X}", ch);
+struct EscapeControlsClass {
+  bool escape_non_ascii;
+
+  inline bool needs_escape(uint8_t ch) const {
+    return (ch == '\"') || (ch == '\'') || (ch == '\\') || (ch < 0x20) || (ch == 0x7F) ||
+        (this->escape_non_ascii && (ch & 0x80));
+  }
+#ifdef PHOSG_HAVE_BYTE_VEC
+  inline uint16_t escape_mask(ByteVec v) const {
+    ByteVec ret = byte_vec_or(
+        byte_vec_or(byte_vec_eq(v, '\"'), byte_vec_eq(v, '\'')),
+        byte_vec_or(byte_vec_eq(v, '\\'), byte_vec_le(v, 0x1F)));
+    ret = byte_vec_or(ret, this->escape_non_ascii ? byte_vec_ge(v, 0x7F) : byte_vec_eq(v, 0x7F));
+    return byte_vec_mask(ret);
+  }
+#endif
+  inline void append_escaped(string& ret, uint8_t ch) const {
+    ret += '\\';
+    switch (ch) {
+      case '\"':
+      case '\'':
+      case '\\':
+        ret += ch;
+        break;
+      case '\t':
+        ret += 't';
+        break;
+      case '\r':
+        ret += 'r';
+        break;
+      case '\n':
+        ret += 'n';
+        break;
+      case '\f':
+        ret += 'f';
+        break;
+      case '\b':
+        ret += 'b';
+        break;
+      case '\a':
+        ret += 'a';
+        break;
+      case '\v':
+        ret += 'v';
+        break;
+      default:
+        append_hex_escape(ret, 'x', ch);
     }
   }
-  return ret;
+};
+
+string escape_controls(string_view s, bool escape_non_ascii) {
+  return escape_runs(s, EscapeControlsClass{escape_non_ascii});
+}
+
+struct EscapeURLClass {
+  bool escape_slash;
+
+  inline bool needs_escape(uint8_t ch) const {
+    return !(((ch >= '0') && (ch <= '9')) || ((ch >= 'A') && (ch <= 'Z')) || ((ch >= 'a') && (ch <= 'z')) ||
+        (ch == '-') || (ch == '_') || (ch == '.') || (ch == '~') || (ch == '=') || (ch == '&') ||
+        (!this->escape_slash && (ch == '/')));
+  }
+#ifdef PHOSG_HAVE_BYTE_VEC
+  inline uint16_t escape_mask(ByteVec v) const {
+    ByteVec safe = byte_vec_or(
+        byte_vec_or(byte_vec_in_range(v, '0', '9'), byte_vec_in_range(v, 'A', 'Z')),
+        byte_vec_or(byte_vec_in_range(v, 'a', 'z'), byte_vec_in_range(v, '-', '.')));
+    safe = byte_vec_or(safe, byte_vec_or(
+        byte_vec_or(byte_vec_eq(v, '_'), byte_vec_eq(v, '~')),
+        byte_vec_or(byte_vec_eq(v, '='), byte_vec_eq(v, '&'))));
+    if (!this->escape_slash) {
+      safe = byte_vec_or(safe, byte_vec_eq(v, '/'));
+    }
+    return ~byte_vec_mask(safe);
+  }
+#endif
+  inline void append_escaped(string& ret, uint8_t ch) const {
+    append_hex_escape(ret, '%', ch);
+  }
+};
+
+string escape_url(string_view s, bool escape_slash) {
+  return escape_runs(s, EscapeURLClass{escape_slash});
 }
 
 uint8_t value_for_hex_char(char x) {
@@ -196,94 +635,618 @@ static const vector<char> log_level_chars({
     'E',
 });
 
-void print_log_prefix(FILE* stream, LogLevel level) {
-  char time_buffer[32];
-  time_t now_secs = time(nullptr);
-  struct tm now_tm;
+// Formats the log prefix for the given time and pid into buf (which must be
+// at least 64 bytes) and returns its length. The timestamp part of the prefix
+// is cached per thread and only regenerated when the second changes, since
+// localtime_r and strftime are relatively slow.
+static size_t format_log_prefix(char* buf, LogLevel level, time_t secs, pid_t pid) {
+  thread_local time_t cached_secs = -1;
+  thread_local pid_t cached_pid = -1;
+  thread_local char cached_prefix[56];
+  thread_local size_t cached_prefix_size = 0;
+
+  if ((secs != cached_secs) || (pid != cached_pid)) {
+    char time_buffer[32];
+    struct tm tm;
 #ifndef PHOSG_WINDOWS
-  localtime_r(&now_secs, &now_tm);
+    localtime_r(&secs, &tm);
 #else
-  localtime_s(&now_tm, &now_secs);
+    localtime_s(&tm, &secs);
 #endif
-  strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", &now_tm);
-  char level_char = log_level_chars.at(static_cast<int>(level));
-  fwrite_fmt(stream, "{:c} {} {} - ", level_char, getpid_cached(), &time_buffer[0]);
+    strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", &tm);
+    auto res = std::format_to_n(cached_prefix, sizeof(cached_prefix), " {} {} - ", pid, &time_buffer[0]);
+    cached_prefix_size = min<size_t>(res.size, sizeof(cached_prefix));
+    cached_secs = secs;
+    cached_pid = pid;
+  }
+
+  buf[0] = log_level_chars.at(static_cast<int>(level));
+  memcpy(buf + 1, cached_prefix, cached_prefix_size);
+  return cached_prefix_size + 1;
 }
 
-PrefixedLogger::PrefixedLogger(const string& prefix, LogLevel min_level)
-    : prefix(prefix),
-      min_level(min_level) {}
+static size_t format_log_prefix(char* buf, LogLevel level) {
+  return format_log_prefix(buf, level, time(nullptr), getpid_cached());
+}
 
-PrefixedLogger PrefixedLogger::sub(const std::string& prefix, LogLevel min_level) const {
-  return PrefixedLogger(this->prefix + prefix, min_level == LogLevel::L_USE_DEFAULT ? this->min_level : min_level);
+void print_log_prefix(FILE* stream, LogLevel level) {
+  char buf[64];
+  fwritex(stream, buf, format_log_prefix(buf, level));
 }
 
-vector<string> split(const string& s, char delim, size_t max_splits) {
-  vector<string> ret;
+// A decoded argument from a deferred log record. The formatter for this type
+// saves the format spec during parsing, then uses it to format the value with
+// the formatter for the value's actual type.
+struct DecodedLogArg {
+  variant<int64_t, uint64_t, float, double, bool, char, const void*, string_view> value;
+};
 
-  // Note: token_start_offset can be equal to s.size() if the string ends with
-  // the delimiter character; in that case, we need to ensure we correctly
-  // return an empty string at the end of ret.
-  size_t token_start_offset = 0;
-  while (token_start_offset <= s.size()) {
-    size_t delim_offset = (max_splits && (ret.size() == max_splits))
-        ? string::npos
-        : s.find(delim, token_start_offset);
-    if (delim_offset == string::npos) {
-      ret.emplace_back(s.substr(token_start_offset));
-      break;
-    } else {
-      ret.emplace_back(s.substr(token_start_offset, delim_offset - token_start_offset));
-      token_start_offset = delim_offset + 1;
+} // namespace phosg
+
+template <>
+struct std::formatter<phosg::DecodedLogArg> {
+  std::string_view spec;
+
+  constexpr auto parse(std::format_parse_context& ctx) {
+    auto it = ctx.begin();
+    size_t depth = 0;
+    while ((it != ctx.end()) && ((*it != '}') || (depth > 0))) {
+      if (*it == '{') {
+        depth++;
+      } else if (*it == '}') {
+        depth--;
+      }
+      it++;
     }
+    this->spec = std::string_view(ctx.begin(), it - ctx.begin());
+    return it;
   }
-  return ret;
+
+  auto format(const phosg::DecodedLogArg& arg, std::format_context& ctx) const {
+    return std::visit([&](auto v) {
+      std::formatter<decltype(v)> f;
+      std::format_parse_context parse_ctx(this->spec);
+      f.parse(parse_ctx);
+      return f.format(v, ctx);
+    },
+        arg.value);
+  }
+};
+
+namespace phosg {
+
+// Formats only the arguments that were decoded from the record, so a format
+// that refers to more arguments than the record contains fails instead of
+// printing default-constructed values
+template <size_t... Indexes>
+static void vformat_decoded_args(string& out, string_view fmt, DecodedLogArg* args, index_sequence<Indexes...>) {
+  std::vformat_to(back_inserter(out), fmt, std::make_format_args(args[Indexes]...));
 }
 
-vector<wstring> split(const wstring& s, wchar_t delim, size_t max_splits) {
-  vector<wstring> ret;
+template <size_t NumArgs>
+static void vformat_decoded_args(string& out, string_view fmt, DecodedLogArg* args) {
+  vformat_decoded_args(out, fmt, args, make_index_sequence<NumArgs>());
+}
 
-  // Note: token_start_offset can be equal to s.size() if the string ends with
-  // the delimiter character; in that case, we need to ensure we correctly
-  // return an empty string at the end of ret.
-  size_t token_start_offset = 0;
-  while (token_start_offset <= s.size()) {
-    size_t delim_offset = (max_splits && (ret.size() == max_splits))
-        ? string::npos
-        : s.find(delim, token_start_offset);
-    if (delim_offset == string::npos) {
-      ret.emplace_back(s.substr(token_start_offset));
-      break;
-    } else {
-      ret.emplace_back(s.substr(token_start_offset, delim_offset - token_start_offset));
-      token_start_offset = delim_offset + 1;
+using VFormatDecodedArgsFn = void (*)(string&, string_view, DecodedLogArg*);
+
+template <size_t... NumArgs>
+static constexpr array<VFormatDecodedArgsFn, sizeof...(NumArgs)> make_vformat_decoded_args_table(index_sequence<NumArgs...>) {
+  return {&vformat_decoded_args<NumArgs>...};
+}
+
+static constexpr auto vformat_decoded_args_table = make_vformat_decoded_args_table(
+    make_index_sequence<AsyncLog::MAX_DEFERRED_ARGS + 1>());
+
+// Appends the text for a DEFERRED record to out. payload is everything in the
+// record after the header.
+static void render_deferred_record(
+    string& out,
+    const AsyncLog::RecordHeader& header,
+    string_view fmt,
+    const void* payload,
+    size_t payload_size,
+    pid_t pid) {
+  using ArgType = AsyncLog::ArgType;
+
+  char prefix_buf[64];
+  out.append(prefix_buf, format_log_prefix(prefix_buf, header.level, header.timestamp_usecs / 1000000, pid));
+
+  StringReader r(payload, payload_size);
+  out += r.read(header.prefix_size);
+
+  DecodedLogArg args[AsyncLog::MAX_DEFERRED_ARGS];
+  if (header.num_args > AsyncLog::MAX_DEFERRED_ARGS) {
+    throw runtime_error("deferred log record has too many arguments");
+  }
+  for (size_t z = 0; z < header.num_args; z++) {
+    auto& arg = args[z];
+    switch (static_cast<ArgType>(r.get_u8())) {
+      case ArgType::INT:
+        arg.value = r.get<int64_t>();
+        break;
+      case ArgType::UINT:
+        arg.value = r.get<uint64_t>();
+        break;
+      case ArgType::FLOAT:
+        arg.value = r.get<float>();
+        break;
+      case ArgType::DOUBLE:
+        arg.value = r.get<double>();
+        break;
+      case ArgType::BOOL:
+        arg.value = (r.get_u8() != 0);
+        break;
+      case ArgType::CHAR:
+        arg.value = r.get<char>();
+        break;
+      case ArgType::POINTER:
+        arg.value = reinterpret_cast<const void*>(static_cast<uintptr_t>(r.get<uint64_t>()));
+        break;
+      case ArgType::STRING: {
+        uint32_t size = r.get<uint32_t>();
+        arg.value = string_view(reinterpret_cast<const char*>(r.getv(size)), size);
+        break;
+      }
+      default:
+        throw runtime_error("deferred log record has invalid argument type");
     }
   }
-  return ret;
+
+  size_t text_offset = out.size();
+  try {
+    vformat_decoded_args_table[header.num_args](out, fmt, args);
+  } catch (const std::format_error& e) {
+    out.resize(text_offset);
+    out += std::format("<format error: {}> {}", e.what(), fmt);
+  }
+  out.push_back('\n');
 }
 
-vector<string> split_context(const string& s, char delim, size_t max_splits) {
-  vector<string> ret;
-  vector<char> paren_stack;
-  bool char_is_escaped = false;
+static constexpr char BINARY_LOG_SIGNATURE[8] = {'P', 'H', 'O', 'S', 'G', 'L', 'O', 'G'};
 
-  size_t z, last_start = 0;
-  for (z = 0; z < s.size(); z++) {
-    if (!char_is_escaped && !paren_stack.empty() && (s[z] == paren_stack.back())) {
-      paren_stack.pop_back();
-      continue;
+struct BinaryLogFileHeader {
+  char signature[8];
+  uint32_t version;
+  uint32_t pid;
+} __attribute__((packed));
+
+namespace AsyncLog {
+
+atomic<bool> enabled(false);
+
+// Single-producer, single-consumer ring buffer of complete records. The
+// owning thread is the only producer; consumers (the writer thread and
+// flush_async_log) are serialized by State::drain_lock.
+struct ThreadBuffer {
+  string data;
+  size_t mask;
+  atomic<size_t> write_offset;
+  atomic<size_t> read_offset;
+  string scratch;
+
+  explicit ThreadBuffer(size_t size) : write_offset(0), read_offset(0) {
+    size_t capacity = 0x100;
+    while (capacity < size) {
+      capacity <<= 1;
     }
-    bool in_quoted_string = (!paren_stack.empty() && ((paren_stack.back() == '\'') || (paren_stack.back() == '\"')));
-    if (char_is_escaped) {
-      char_is_escaped = false;
-    } else if (in_quoted_string && s[z] == '\\') {
-      char_is_escaped = true;
+    this->data.resize(capacity);
+    this->mask = capacity - 1;
+  }
+
+  size_t capacity() const {
+    return this->data.size();
+  }
+
+  bool empty() const {
+    return this->read_offset.load(memory_order_acquire) == this->write_offset.load(memory_order_acquire);
+  }
+
+  bool try_push(const void* record, size_t size) {
+    size_t w = this->write_offset.load(memory_order_relaxed);
+    size_t r = this->read_offset.load(memory_order_acquire);
+    if (this->capacity() - (w - r) < size) {
+      return false;
     }
-    if (!in_quoted_string) {
-      if (s[z] == '(') {
-        paren_stack.push_back(')');
-      } else if (s[z] == '[') {
-        paren_stack.push_back(']');
+    size_t start = w & this->mask;
+    size_t first_size = min<size_t>(size, this->capacity() - start);
+    memcpy(this->data.data() + start, record, first_size);
+    memcpy(this->data.data(), reinterpret_cast<const char*>(record) + first_size, size - first_size);
+    this->write_offset.store(w + size, memory_order_release);
+    return true;
+  }
+
+  void copy_out(size_t offset, void* dest, size_t size) const {
+    size_t start = offset & this->mask;
+    size_t first_size = min<size_t>(size, this->capacity() - start);
+    memcpy(dest, this->data.data() + start, first_size);
+    memcpy(reinterpret_cast<char*>(dest) + first_size, this->data.data(), size - first_size);
+  }
+
+  // Calls fn(data, size) for each available record, then frees the space
+  template <typename FnT>
+  void drain(FnT&& fn) {
+    size_t r = this->read_offset.load(memory_order_relaxed);
+    size_t w = this->write_offset.load(memory_order_acquire);
+    while (r < w) {
+      uint32_t size;
+      this->copy_out(r, &size, sizeof(size));
+      size_t start = r & this->mask;
+      if (start + size <= this->capacity()) {
+        fn(this->data.data() + start, size);
+      } else {
+        this->scratch.resize(size);
+        this->copy_out(r, this->scratch.data(), size);
+        fn(this->scratch.data(), size);
+      }
+      r += size;
+    }
+    this->read_offset.store(r, memory_order_release);
+  }
+};
+
+struct State {
+  AsyncLogOptions options;
+
+  mutex buffers_lock;
+  vector<shared_ptr<ThreadBuffer>> buffers;
+
+  // Held while draining buffers and writing to the output stream
+  mutex drain_lock;
+  string batch;
+  // Format string pointer -> FORMAT record ID (only used for binary output)
+  unordered_map<uint64_t, uint64_t> format_ids;
+
+  mutex wake_lock;
+  condition_variable wake_cv;
+  bool should_exit = false;
+  thread writer_thread;
+
+  atomic<size_t> dropped_line_count{0};
+  bool atexit_registered = false;
+
+  // Appends the output for a record to this->batch. drain_lock must be held.
+  void process_record(const void* data, size_t size) {
+    RecordHeader header;
+    memcpy(&header, data, sizeof(header));
+    const char* payload = reinterpret_cast<const char*>(data) + sizeof(header);
+    size_t payload_size = size - sizeof(header);
+
+    if (header.type == RecordType::TEXT) {
+      if (this->options.binary_output) {
+        this->batch.append(reinterpret_cast<const char*>(data), size);
+      } else {
+        this->batch.append(payload, payload_size);
+      }
+
+    } else if (header.type == RecordType::DEFERRED) {
+      if (!this->options.binary_output) {
+        string_view fmt(reinterpret_cast<const char*>(header.format_key), header.format_size);
+        render_deferred_record(this->batch, header, fmt, payload, payload_size, getpid_cached());
+        return;
+      }
+
+      uint64_t format_key = header.format_key;
+      auto format_it = this->format_ids.find(format_key);
+      if (format_it == this->format_ids.end()) {
+        format_it = this->format_ids.emplace(format_key, this->format_ids.size()).first;
+        RecordHeader format_header{};
+        format_header.size = sizeof(format_header) + header.format_size;
+        format_header.type = RecordType::FORMAT;
+        format_header.format_key = format_it->second;
+        format_header.format_size = header.format_size;
+        this->batch.append(reinterpret_cast<const char*>(&format_header), sizeof(format_header));
+        this->batch.append(reinterpret_cast<const char*>(format_key), header.format_size);
+      }
+      header.format_key = format_it->second;
+      this->batch.append(reinterpret_cast<const char*>(&header), sizeof(header));
+      this->batch.append(payload, payload_size);
+
+    } else {
+      throw logic_error("invalid record type in log buffer");
+    }
+  }
+
+  void write_batch() {
+    if (!this->batch.empty()) {
+      fwrite(this->batch.data(), 1, this->batch.size(), this->options.stream);
+      fflush(this->options.stream);
+      this->batch.clear();
+    }
+  }
+
+  void drain_all() {
+    lock_guard<mutex> g(this->drain_lock);
+    vector<shared_ptr<ThreadBuffer>> buffers_to_drain;
+    {
+      lock_guard<mutex> buffers_g(this->buffers_lock);
+      // Remove buffers for threads that have exited and whose records have
+      // all been written
+      erase_if(this->buffers, [](const shared_ptr<ThreadBuffer>& buf) -> bool {
+        return (buf.use_count() == 1) && buf->empty();
+      });
+      buffers_to_drain = this->buffers;
+    }
+    for (auto& buf : buffers_to_drain) {
+      buf->drain([&](const void* data, size_t size) -> void {
+        this->process_record(data, size);
+      });
+    }
+    this->write_batch();
+  }
+
+  void writer_thread_fn() {
+    unique_lock<mutex> g(this->wake_lock);
+    while (!this->should_exit) {
+      g.unlock();
+      this->drain_all();
+      g.lock();
+      if (!this->should_exit) {
+        this->wake_cv.wait_for(g, chrono::microseconds(this->options.flush_interval_usecs));
+      }
+    }
+  }
+
+  void wake_writer() {
+    this->wake_cv.notify_one();
+  }
+};
+
+static State state;
+
+static ThreadBuffer& get_thread_buffer() {
+  thread_local shared_ptr<ThreadBuffer> buf;
+  if (!buf || (buf->capacity() < state.options.buffer_size)) {
+    buf = make_shared<ThreadBuffer>(state.options.buffer_size);
+    lock_guard<mutex> g(state.buffers_lock);
+    state.buffers.emplace_back(buf);
+  }
+  return *buf;
+}
+
+static string& begin_record(RecordType type, LogLevel level) {
+  thread_local string record;
+  record.resize(sizeof(RecordHeader));
+  auto* header = reinterpret_cast<RecordHeader*>(record.data());
+  memset(header, 0, sizeof(RecordHeader));
+  header->type = type;
+  header->level = level;
+  return record;
+}
+
+string& begin_line(LogLevel level, const string* prefix) {
+  string& record = begin_record(RecordType::TEXT, level);
+  char prefix_buf[64];
+  record.append(prefix_buf, format_log_prefix(prefix_buf, level));
+  if (prefix) {
+    record += *prefix;
+  }
+  return record;
+}
+
+void commit_line(string& line) {
+  line.push_back('\n');
+  commit_record(line);
+}
+
+string& begin_deferred(LogLevel level, string_view fmt, const string* prefix, size_t num_args) {
+  string& record = begin_record(RecordType::DEFERRED, level);
+  auto* header = reinterpret_cast<RecordHeader*>(record.data());
+  header->num_args = num_args;
+  header->timestamp_usecs = now();
+  header->format_key = reinterpret_cast<uintptr_t>(fmt.data());
+  header->format_size = fmt.size();
+  if (prefix) {
+    header->prefix_size = prefix->size();
+    record += *prefix;
+  }
+  return record;
+}
+
+void commit_record(string& record) {
+  reinterpret_cast<RecordHeader*>(record.data())->size = record.size();
+
+  ThreadBuffer& buf = get_thread_buffer();
+  if (buf.try_push(record.data(), record.size())) {
+    return;
+  }
+
+  if (state.options.overflow_policy == AsyncLogOverflowPolicy::DROP) {
+    state.dropped_line_count++;
+    return;
+  }
+
+  if (record.size() <= buf.capacity()) {
+    do {
+      state.wake_writer();
+      this_thread::yield();
+    } while (!buf.try_push(record.data(), record.size()));
+  } else {
+    // The record can never fit in the buffer, so write it directly after all
+    // previous records from this thread have been written
+    while (!buf.empty()) {
+      state.wake_writer();
+      this_thread::yield();
+    }
+    lock_guard<mutex> g(state.drain_lock);
+    state.process_record(record.data(), record.size());
+    state.write_batch();
+  }
+}
+
+} // namespace AsyncLog
+
+void enable_async_logging(const AsyncLogOptions& options) {
+  auto& state = AsyncLog::state;
+  if (AsyncLog::enabled.load()) {
+    return;
+  }
+  state.options = options;
+  state.should_exit = false;
+  state.format_ids.clear();
+  if (state.options.binary_output) {
+    BinaryLogFileHeader header;
+    memcpy(header.signature, BINARY_LOG_SIGNATURE, sizeof(header.signature));
+    header.version = 1;
+    header.pid = getpid_cached();
+    fwritex(state.options.stream, &header, sizeof(header));
+  }
+  state.writer_thread = thread(&AsyncLog::State::writer_thread_fn, &state);
+  if (!state.atexit_registered) {
+    atexit(disable_async_logging);
+    state.atexit_registered = true;
+  }
+  AsyncLog::enabled.store(true);
+}
+
+void disable_async_logging() {
+  auto& state = AsyncLog::state;
+  if (!AsyncLog::enabled.exchange(false)) {
+    return;
+  }
+  {
+    lock_guard<mutex> g(state.wake_lock);
+    state.should_exit = true;
+  }
+  state.wake_writer();
+  state.writer_thread.join();
+  state.drain_all();
+}
+
+void flush_async_log() {
+  AsyncLog::state.drain_all();
+}
+
+size_t async_log_dropped_line_count() {
+  return AsyncLog::state.dropped_line_count.load();
+}
+
+size_t BinaryLogDecoder::decode(const void* data, size_t size, string& out) {
+  StringReader r(data, size);
+  if (!this->header_parsed) {
+    if (r.remaining() < sizeof(BinaryLogFileHeader)) {
+      return 0;
+    }
+    const auto& header = r.get<BinaryLogFileHeader>();
+    if (memcmp(header.signature, BINARY_LOG_SIGNATURE, sizeof(header.signature))) {
+      throw runtime_error("data is not a binary log");
+    }
+    if (header.version != 1) {
+      throw runtime_error("unsupported binary log version");
+    }
+    this->pid = header.pid;
+    this->header_parsed = true;
+  }
+
+  while (r.remaining() >= sizeof(AsyncLog::RecordHeader)) {
+    size_t record_offset = r.where();
+    AsyncLog::RecordHeader header;
+    r.readx(&header, sizeof(header), false);
+    if (header.size < sizeof(header)) {
+      throw runtime_error("binary log record is too small");
+    }
+    if (r.remaining() < header.size) {
+      break;
+    }
+    r.skip(sizeof(header));
+    const void* payload = r.getv(header.size - sizeof(header));
+    size_t payload_size = header.size - sizeof(header);
+
+    switch (header.type) {
+      case AsyncLog::RecordType::TEXT:
+        out.append(reinterpret_cast<const char*>(payload), payload_size);
+        break;
+      case AsyncLog::RecordType::FORMAT:
+        this->formats[header.format_key].assign(reinterpret_cast<const char*>(payload), payload_size);
+        break;
+      case AsyncLog::RecordType::DEFERRED:
+        try {
+          render_deferred_record(out, header, this->formats.at(header.format_key), payload, payload_size, this->pid);
+        } catch (const out_of_range&) {
+          throw runtime_error(std::format("binary log record at offset {} is invalid", record_offset));
+        }
+        break;
+      default:
+        throw runtime_error(std::format("binary log record at offset {} has unknown type", record_offset));
+    }
+  }
+  return r.where();
+}
+
+PrefixedLogger::PrefixedLogger(const string& prefix, LogLevel min_level)
+    : prefix(prefix),
+      min_level(min_level) {}
+
+PrefixedLogger PrefixedLogger::sub(const std::string& prefix, LogLevel min_level) const {
+  return PrefixedLogger(this->prefix + prefix, min_level == LogLevel::L_USE_DEFAULT ? this->min_level : min_level);
+}
+
+vector<string> split(const string& s, char delim, size_t max_splits) {
+  vector<string> ret;
+
+  // Note: token_start_offset can be equal to s.size() if the string ends with
+  // the delimiter character; in that case, we need to ensure we correctly
+  // return an empty string at the end of ret.
+  size_t token_start_offset = 0;
+  while (token_start_offset <= s.size()) {
+    size_t delim_offset = (max_splits && (ret.size() == max_splits))
+        ? string::npos
+        : s.find(delim, token_start_offset);
+    if (delim_offset == string::npos) {
+      ret.emplace_back(s.substr(token_start_offset));
+      break;
+    } else {
+      ret.emplace_back(s.substr(token_start_offset, delim_offset - token_start_offset));
+      token_start_offset = delim_offset + 1;
+    }
+  }
+  return ret;
+}
+
+vector<wstring> split(const wstring& s, wchar_t delim, size_t max_splits) {
+  vector<wstring> ret;
+
+  // Note: token_start_offset can be equal to s.size() if the string ends with
+  // the delimiter character; in that case, we need to ensure we correctly
+  // return an empty string at the end of ret.
+  size_t token_start_offset = 0;
+  while (token_start_offset <= s.size()) {
+    size_t delim_offset = (max_splits && (ret.size() == max_splits))
+        ? string::npos
+        : s.find(delim, token_start_offset);
+    if (delim_offset == string::npos) {
+      ret.emplace_back(s.substr(token_start_offset));
+      break;
+    } else {
+      ret.emplace_back(s.substr(token_start_offset, delim_offset - token_start_offset));
+      token_start_offset = delim_offset + 1;
+    }
+  }
+  return ret;
+}
+
+vector<string> split_context(const string& s, char delim, size_t max_splits) {
+  vector<string> ret;
+  vector<char> paren_stack;
+  bool char_is_escaped = false;
+
+  size_t z, last_start = 0;
+  for (z = 0; z < s.size(); z++) {
+    if (!char_is_escaped && !paren_stack.empty() && (s[z] == paren_stack.back())) {
+      paren_stack.pop_back();
+      continue;
+    }
+    bool in_quoted_string = (!paren_stack.empty() && ((paren_stack.back() == '\'') || (paren_stack.back() == '\"')));
+    if (char_is_escaped) {
+      char_is_escaped = false;
+    } else if (in_quoted_string && s[z] == '\\') {
+      char_is_escaped = true;
+    }
+    if (!in_quoted_string) {
+      if (s[z] == '(') {
+        paren_stack.push_back(')');
+      } else if (s[z] == '[') {
+        paren_stack.push_back(']');
       } else if (s[z] == '{') {
         paren_stack.push_back('}');
       } else if (s[z] == '<') {
@@ -408,14 +1371,30 @@ size_t skip_word(const char* s, size_t offset) {
   return skip_whitespace(s, skip_non_whitespace(s, offset));
 }
 
-string string_for_error(int error) {
+// The XSI version of strerror_r returns an int and always writes to the
+// buffer; the GNU version returns a char* which may point to a static string
+// instead, leaving the buffer unmodified
+[[maybe_unused]] static inline const char* strerror_r_result(int, const char* buffer) {
+  return buffer;
+}
+[[maybe_unused]] static inline const char* strerror_r_result(const char* ret, const char*) {
+  return ret;
+}
+
+char* string_for_error_to(char* buf, int error) {
   char buffer[1024] = "Unknown error";
 #ifndef PHOSG_WINDOWS
-  strerror_r(error, buffer, sizeof(buffer));
+  const char* message = strerror_r_result(strerror_r(error, buffer, sizeof(buffer)), buffer);
 #else
   strerror_s(buffer, sizeof(buffer), error);
+  const char* message = buffer;
 #endif
-  return std::format("{} ({})", error, buffer);
+  return std::format_to_n(buf, STRING_FOR_ERROR_MAX_LENGTH, "{} ({})", error, message).out;
+}
+
+string string_for_error(int error) {
+  char buf[STRING_FOR_ERROR_MAX_LENGTH];
+  return string(buf, string_for_error_to(buf, error));
 }
 
 string vformat_color_escape(TerminalFormat color, va_list va) {
@@ -454,215 +1433,387 @@ void print_indent(FILE* stream, int indent_level) {
   }
 }
 
-// TODO: generalize these classes
-class RedBoldTerminalGuard {
-public:
-  RedBoldTerminalGuard(function<void(const void*, size_t)> write_data, bool active = true)
-      : write_data(write_data),
-        active(active) {
-    if (this->active) {
-      string e = format_color_escape(
-          TerminalFormat::BOLD, TerminalFormat::FG_RED, TerminalFormat::END);
-      this->write_data(e.data(), e.size());
+// Lookup table for the hex column: each entry is " XX" followed by a padding
+// byte, so each byte can be written with a single 4-byte store (the padding
+// byte is overwritten by the next field).
+struct HexFieldTable {
+  char fields[0x100][4];
+
+  constexpr HexFieldTable() : fields() {
+    const char* digits = "0123456789ABCDEF";
+    for (size_t z = 0; z < 0x100; z++) {
+      this->fields[z][0] = ' ';
+      this->fields[z][1] = digits[z >> 4];
+      this->fields[z][2] = digits[z & 0x0F];
+      this->fields[z][3] = ' ';
     }
   }
-  ~RedBoldTerminalGuard() {
-    if (this->active) {
-      string e = format_color_escape(TerminalFormat::NORMAL, TerminalFormat::END);
-      this->write_data(e.data(), e.size());
-    }
-  }
-
-private:
-  function<void(const void*, size_t)> write_data;
-  bool active;
 };
+static constexpr HexFieldTable hex_field_table;
 
-class InverseTerminalGuard {
-public:
-  InverseTerminalGuard(function<void(const void*, size_t)> write_data, bool active = true)
-      : write_data(write_data),
-        active(active) {
-    if (this->active) {
-      string e = format_color_escape(TerminalFormat::INVERSE, TerminalFormat::END);
-      this->write_data(e.data(), e.size());
-    }
-  }
-  ~InverseTerminalGuard() {
-    if (this->active) {
-      string e = format_color_escape(TerminalFormat::NORMAL, TerminalFormat::END);
-      this->write_data(e.data(), e.size());
-    }
-  }
+static inline uint64_t load_u64(const uint8_t* data) {
+  uint64_t ret;
+  memcpy(&ret, data, sizeof(ret));
+  return ret;
+}
 
-private:
-  function<void(const void*, size_t)> write_data;
-  bool active;
-};
+static inline bool line_is_zero(const uint8_t* data) {
+  return (load_u64(data) | load_u64(data + 8)) == 0;
+}
 
-void format_data(
-    function<void(const void*, size_t)> write_data,
-    const struct iovec* iovs,
-    size_t num_iovs,
-    uint64_t start_address,
-    const struct iovec* prev_iovs,
-    size_t num_prev_iovs,
-    uint64_t flags) {
-  if (num_iovs == 0) {
-    return;
+// Returns a bitmask with bit N set if data1[N] != data2[N]
+static inline uint16_t line_diff_mask(const uint8_t* data1, const uint8_t* data2) {
+  if (data1 == data2) {
+    return 0;
   }
-
-  size_t total_size = 0;
-  for (size_t x = 0; x < num_iovs; x++) {
-    total_size += iovs[x].iov_len;
+#if defined(__SSE2__)
+  __m128i eq = _mm_cmpeq_epi8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(data1)),
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(data2)));
+  return ~_mm_movemask_epi8(eq);
+#else
+  if ((load_u64(data1) == load_u64(data2)) && (load_u64(data1 + 8) == load_u64(data2 + 8))) {
+    return 0;
   }
-  if (total_size == 0) {
-    return;
+  uint16_t ret = 0;
+  for (size_t x = 0; x < 0x10; x++) {
+    ret |= (data1[x] != data2[x]) << x;
   }
+  return ret;
+#endif
+}
 
-  if (num_prev_iovs) {
-    size_t total_prev_size = 0;
-    for (size_t x = 0; x < num_prev_iovs; x++) {
-      total_prev_size += prev_iovs[x].iov_len;
-    }
-    if (total_prev_size != total_size) {
-      throw runtime_error("previous iovs given, but data size does not match");
-    }
+// Writes the ASCII view of a 16-byte line to out, replacing unprintable bytes
+// with spaces. Returns true if all bytes were printable.
+static inline bool write_ascii_line(char* out, const uint8_t* data) {
+#if defined(__SSE2__)
+  // Bytes >= 0x80 are negative in a signed comparison, so they fail the first
+  // test and are treated as unprintable, as expected
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+  __m128i printable = _mm_and_si128(
+      _mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F)),
+      _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F)));
+  __m128i result = _mm_or_si128(
+      _mm_and_si128(printable, v),
+      _mm_andnot_si128(printable, _mm_set1_epi8(' ')));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out), result);
+  return _mm_movemask_epi8(printable) == 0xFFFF;
+#elif defined(__ARM_NEON) && defined(__aarch64__) && defined(PHOSG_ENABLE_NEON)
+  uint8x16_t v = vld1q_u8(data);
+  uint8x16_t printable = vandq_u8(vcgeq_u8(v, vdupq_n_u8(0x20)), vcltq_u8(v, vdupq_n_u8(0x7F)));
+  vst1q_u8(reinterpret_cast<uint8_t*>(out), vbslq_u8(printable, v, vdupq_n_u8(' ')));
+  return vminvq_u8(printable) == 0xFF;
+#else
+  bool all_printable = true;
+  for (size_t x = 0; x < 0x10; x++) {
+    bool printable = (data[x] >= 0x20) && (data[x] < 0x7F);
+    out[x] = printable ? data[x] : ' ';
+    all_printable &= printable;
   }
+  return all_printable;
+#endif
+}
 
-  uint64_t end_address = start_address + total_size;
-
-  int width_digits;
+DataFormatter::DataFormatter(
+    function<void(const void*, size_t)> write_data,
+    uint64_t start_address,
+    uint64_t flags,
+    uint64_t expected_end_address)
+    : write_data(std::move(write_data)),
+      start_address(start_address),
+      line_address(start_address & (~0x0F)),
+      line_fill(start_address & 0x0F),
+      has_prev(false),
+      use_color(flags & PrintDataFlags::USE_COLOR),
+      print_ascii(flags & PrintDataFlags::PRINT_ASCII),
+      collapse_zero_lines(flags & PrintDataFlags::COLLAPSE_ZERO_LINES),
+      skip_separator(flags & PrintDataFlags::SKIP_SEPARATOR),
+      diff_escape(format_color_escape(TerminalFormat::BOLD, TerminalFormat::FG_RED, TerminalFormat::END)),
+      inverse_escape(format_color_escape(TerminalFormat::INVERSE, TerminalFormat::END)),
+      normal_escape(format_color_escape(TerminalFormat::NORMAL, TerminalFormat::END)),
+      output_buffer(OUTPUT_BUFFER_SIZE, '\0'),
+      output_size(0) {
+  memset(this->line_buf, 0, sizeof(this->line_buf));
+  memset(this->prev_line_buf, 0, sizeof(this->prev_line_buf));
+
+  uint64_t end_address = max<uint64_t>(start_address, expected_end_address);
   if (flags & PrintDataFlags::OFFSET_8_BITS) {
-    width_digits = 2;
+    this->width_digits = 2;
   } else if (flags & PrintDataFlags::OFFSET_16_BITS) {
-    width_digits = 4;
+    this->width_digits = 4;
   } else if (flags & PrintDataFlags::OFFSET_32_BITS) {
-    width_digits = 8;
+    this->width_digits = 8;
   } else if (flags & PrintDataFlags::OFFSET_64_BITS) {
-    width_digits = 16;
+    this->width_digits = 16;
   } else if (end_address > 0x100000000) {
-    width_digits = 16;
+    this->width_digits = 16;
   } else if (end_address > 0x10000) {
-    width_digits = 8;
+    this->width_digits = 8;
   } else if (end_address > 0x100) {
-    width_digits = 4;
+    this->width_digits = 4;
   } else {
-    width_digits = 2;
+    this->width_digits = 2;
   }
 
-  bool use_color = flags & PrintDataFlags::USE_COLOR;
-  bool print_ascii = flags & PrintDataFlags::PRINT_ASCII;
-  bool collapse_zero_lines = flags & PrintDataFlags::COLLAPSE_ZERO_LINES;
-  bool skip_separator = flags & PrintDataFlags::SKIP_SEPARATOR;
-
-  // Reserve space for the current/previous line data
-  uint8_t line_buf[0x10];
-  memset(line_buf, 0, sizeof(line_buf));
+  // No line can be longer than max_line_size. The longest line has a 16-digit
+  // offset, and every byte is highlighted and unprintable, so each byte's hex
+  // field is wrapped in diff and normal escapes, and its ASCII character is
+  // wrapped in diff, inverse, and two normal escapes. The extra byte at the
+  // end is because hex fields are copied 4 bytes at a time.
+  size_t max_byte_size = 3 + 1 + 2 * this->diff_escape.size() + this->inverse_escape.size() + 3 * this->normal_escape.size();
+  this->max_line_size = 16 + 2 + 0x10 * max_byte_size + 3 + 1 + 1;
+}
 
-  uint8_t prev_line_buf[0x10];
-  uint8_t* prev_line_data = prev_line_buf;
-  if (num_prev_iovs) {
-    memset(prev_line_buf, 0, sizeof(prev_line_buf));
-  } else {
-    prev_line_data = line_buf;
-  }
-
-  size_t current_iov_index = 0;
-  size_t current_iov_bytes = 0;
-  size_t prev_iov_index = 0;
-  size_t prev_iov_bytes = 0;
-  for (uint64_t line_start_address = start_address & (~0x0F);
-      line_start_address < end_address;
-      line_start_address += 0x10) {
-
-    // Figure out the boundaries of the current line
-    uint64_t line_end_address = line_start_address + 0x10;
-    uint8_t line_invalid_start_bytes = max<int64_t>(start_address - line_start_address, 0);
-    uint8_t line_invalid_end_bytes = max<int64_t>(line_end_address - end_address, 0);
-    uint8_t line_bytes = 0x10 - line_invalid_end_bytes - line_invalid_start_bytes;
-
-    // Read the current and previous data for this line
-    for (size_t x = 0; x < line_bytes; x++) {
-      while (current_iov_bytes >= iovs[current_iov_index].iov_len) {
-        current_iov_bytes = 0;
-        current_iov_index++;
-        if (current_iov_index >= num_iovs) {
-          throw logic_error("reads exceeded final iov");
-        }
-      }
-      line_buf[x + line_invalid_start_bytes] = reinterpret_cast<const uint8_t*>(
-          iovs[current_iov_index].iov_base)[current_iov_bytes];
-      current_iov_bytes++;
-    }
-    if (num_prev_iovs) {
-      for (size_t x = 0; x < line_bytes; x++) {
-        while (prev_iov_bytes >= prev_iovs[prev_iov_index].iov_len) {
-          prev_iov_bytes = 0;
-          prev_iov_index++;
-          if (prev_iov_index >= num_prev_iovs) {
-            throw logic_error("reads exceeded final prev iov");
-          }
-        }
-        prev_line_buf[x + line_invalid_start_bytes] = reinterpret_cast<const uint8_t*>(
-            prev_iovs[prev_iov_index].iov_base)[prev_iov_bytes];
-        prev_iov_bytes++;
-      }
-    }
+void DataFormatter::write(const void* vdata, size_t size, const void* vprev) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  const uint8_t* prev = reinterpret_cast<const uint8_t*>(vprev);
+  if (prev && !this->has_prev) {
+    // Bytes already in the current line have no previous data, so they
+    // shouldn't be highlighted
+    memcpy(this->prev_line_buf, this->line_buf, sizeof(this->prev_line_buf));
+    this->has_prev = true;
+  }
 
-    if (collapse_zero_lines && (line_start_address > start_address) && (line_end_address < end_address) &&
-        !memcmp(line_buf, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16) &&
-        !memcmp(prev_line_data, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16)) {
-      continue;
+  while (size > 0) {
+    // If the held line is full, there's more data after it, so it isn't the
+    // last line
+    if (this->line_fill == 0x10) {
+      this->write_line(this->line_buf, this->has_prev ? this->prev_line_buf : this->line_buf, 0x10, false);
+      this->line_address += 0x10;
+      this->line_fill = 0;
     }
 
-    string line = std::format("{:0>{}X}{}", line_start_address, width_digits, skip_separator ? "" : " |");
-    write_data(line.data(), line.size());
-
-    {
-      size_t x = 0;
-      for (; x < line_invalid_start_bytes; x++) {
-        write_data("   ", 3);
+    // Format complete lines directly from the input, except the last one,
+    // which might be the last line of the entire input
+    if (this->line_fill == 0) {
+      for (; size > 0x10; data += 0x10, prev = prev ? (prev + 0x10) : nullptr, size -= 0x10) {
+        this->write_line(data, prev ? prev : data, 0x10, false);
+        this->line_address += 0x10;
       }
-      for (; x < static_cast<size_t>(0x10 - line_invalid_end_bytes); x++) {
-        uint8_t current_value = line_buf[x];
-        uint8_t previous_value = prev_line_data[x];
+    }
 
-        RedBoldTerminalGuard g(write_data, use_color && (previous_value != current_value));
-        string field = std::format(" {:02X}", current_value);
-        write_data(field.data(), field.size());
-      }
-      for (; x < 0x10; x++) {
-        write_data("   ", 3);
+    size_t bytes = min<size_t>(0x10 - this->line_fill, size);
+    memcpy(this->line_buf + this->line_fill, data, bytes);
+    if (this->has_prev) {
+      if (prev) {
+        memcpy(this->prev_line_buf + this->line_fill, prev, bytes);
+        prev += bytes;
+      } else {
+        memcpy(this->prev_line_buf + this->line_fill, data, bytes);
       }
     }
+    this->line_fill += bytes;
+    data += bytes;
+    size -= bytes;
+  }
+}
 
-    if (print_ascii) {
-      write_data(" | ", skip_separator ? 1 : 3);
+void DataFormatter::write(const string& data) {
+  this->write(data.data(), data.size());
+}
 
-      size_t x = 0;
-      for (; x < line_invalid_start_bytes; x++) {
-        write_data(" ", 1);
-      }
-      for (; x < static_cast<size_t>(0x10 - line_invalid_end_bytes); x++) {
-        uint8_t current_value = line_buf[x];
-        uint8_t previous_value = prev_line_data[x];
+void DataFormatter::finish() {
+  uint64_t line_start_valid = max<uint64_t>(this->start_address, this->line_address) - this->line_address;
+  if (this->line_fill > line_start_valid) {
+    this->write_line(this->line_buf, this->has_prev ? this->prev_line_buf : this->line_buf, this->line_fill, true);
+    this->line_address += 0x10;
+    this->line_fill = 0;
+  }
+  this->flush();
+}
 
-        RedBoldTerminalGuard g1(write_data, use_color && (previous_value != current_value));
-        if ((current_value < 0x20) || (current_value >= 0x7F)) {
-          InverseTerminalGuard g2(write_data, use_color);
-          write_data(" ", 1);
-        } else {
-          write_data(&current_value, 1);
-        }
+void DataFormatter::flush() {
+  if (this->output_size) {
+    this->write_data(this->output_buffer.data(), this->output_size);
+    this->output_size = 0;
+  }
+}
+
+void DataFormatter::write_line(const uint8_t* line_data, const uint8_t* prev_line_data, size_t valid_end, bool is_last_line) {
+  uint64_t line_start_address = this->line_address;
+  size_t line_invalid_start_bytes = (this->start_address > line_start_address) ? (this->start_address - line_start_address) : 0;
+  size_t line_bytes = valid_end - line_invalid_start_bytes;
+
+  if (this->collapse_zero_lines && (line_start_address > this->start_address) && !is_last_line &&
+      line_is_zero(line_data) && line_is_zero(prev_line_data)) {
+    return;
+  }
+
+  if (OUTPUT_BUFFER_SIZE - this->output_size < this->max_line_size) {
+    this->flush();
+  }
+
+  char* output_end = this->output_buffer.data() + this->output_size;
+  auto write_str = [&](const string& s) -> void {
+    memcpy(output_end, s.data(), s.size());
+    output_end += s.size();
+  };
+
+  // Offset column. This is equivalent to std::format("{:0>{}X}", ...) but
+  // much faster, since it runs for every line.
+  {
+    size_t num_digits = this->width_digits;
+    while ((num_digits < 16) && (line_start_address >> (num_digits * 4))) {
+      num_digits++;
+    }
+    for (size_t z = 0; z < num_digits; z++) {
+      output_end[z] = "0123456789ABCDEF"[(line_start_address >> ((num_digits - z - 1) * 4)) & 0x0F];
+    }
+    output_end += num_digits;
+    if (!this->skip_separator) {
+      memcpy(output_end, " |", 2);
+      output_end += 2;
+    }
+  }
+
+  uint16_t diff_mask = this->use_color ? line_diff_mask(line_data, prev_line_data) : 0;
+  if ((line_bytes == 0x10) && (diff_mask == 0)) {
+    // Fast path: full line with no highlighted bytes
+    for (size_t x = 0; x < 0x10; x++) {
+      memcpy(output_end + x * 3, hex_field_table.fields[line_data[x]], 4);
+    }
+    output_end += 0x30;
+
+    if (this->print_ascii) {
+      memcpy(output_end, " | ", 3);
+      output_end += (this->skip_separator ? 1 : 3);
+      char* ascii_start = output_end;
+      output_end += 0x10;
+      // If color is enabled and any bytes are unprintable, they need to be
+      // highlighted, so redo the ASCII view with the slow path below
+      if (!write_ascii_line(ascii_start, line_data) && this->use_color) {
+        output_end = ascii_start;
+        for (size_t x = 0; x < 0x10; x++) {
+          uint8_t current_value = line_data[x];
+          if ((current_value < 0x20) || (current_value >= 0x7F)) {
+            write_str(this->inverse_escape);
+            *(output_end++) = ' ';
+            write_str(this->normal_escape);
+          } else {
+            *(output_end++) = current_value;
+          }
+        }
+      }
+    }
+
+  } else {
+    // Slow path: partial line and/or some bytes need to be highlighted
+    size_t x = 0;
+    for (; x < line_invalid_start_bytes; x++) {
+      memcpy(output_end, "   ", 3);
+      output_end += 3;
+    }
+    for (; x < valid_end; x++) {
+      bool highlight = (diff_mask >> x) & 1;
+      if (highlight) {
+        write_str(this->diff_escape);
+      }
+      memcpy(output_end, hex_field_table.fields[line_data[x]], 3);
+      output_end += 3;
+      if (highlight) {
+        write_str(this->normal_escape);
+      }
+    }
+    for (; x < 0x10; x++) {
+      memcpy(output_end, "   ", 3);
+      output_end += 3;
+    }
+
+    if (this->print_ascii) {
+      memcpy(output_end, " | ", 3);
+      output_end += (this->skip_separator ? 1 : 3);
+
+      x = 0;
+      for (; x < line_invalid_start_bytes; x++) {
+        *(output_end++) = ' ';
+      }
+      for (; x < valid_end; x++) {
+        uint8_t current_value = line_data[x];
+        bool highlight = (diff_mask >> x) & 1;
+        if (highlight) {
+          write_str(this->diff_escape);
+        }
+        if ((current_value < 0x20) || (current_value >= 0x7F)) {
+          if (this->use_color) {
+            write_str(this->inverse_escape);
+          }
+          *(output_end++) = ' ';
+          if (this->use_color) {
+            write_str(this->normal_escape);
+          }
+        } else {
+          *(output_end++) = current_value;
+        }
+        if (highlight) {
+          write_str(this->normal_escape);
+        }
       }
       for (; x < 0x10; x++) {
-        write_data(" ", 1);
+        *(output_end++) = ' ';
       }
     }
+  }
+
+  *(output_end++) = '\n';
+  this->output_size = output_end - this->output_buffer.data();
+}
+
+void format_data(
+    function<void(const void*, size_t)> write_data,
+    const struct iovec* iovs,
+    size_t num_iovs,
+    uint64_t start_address,
+    const struct iovec* prev_iovs,
+    size_t num_prev_iovs,
+    uint64_t flags) {
+  size_t total_size = 0;
+  for (size_t x = 0; x < num_iovs; x++) {
+    total_size += iovs[x].iov_len;
+  }
+  if (total_size == 0) {
+    return;
+  }
+
+  if (num_prev_iovs) {
+    size_t total_prev_size = 0;
+    for (size_t x = 0; x < num_prev_iovs; x++) {
+      total_prev_size += prev_iovs[x].iov_len;
+    }
+    if (total_prev_size != total_size) {
+      throw runtime_error("previous iovs given, but data size does not match");
+    }
+  }
 
-    write_data("\n", 1);
+  DataFormatter formatter(std::move(write_data), start_address, flags, start_address + total_size);
+  if (!num_prev_iovs) {
+    for (size_t x = 0; x < num_iovs; x++) {
+      formatter.write(iovs[x].iov_base, iovs[x].iov_len);
+    }
+  } else {
+    // Write the largest pieces that are contiguous in both the current and
+    // previous iovs
+    size_t iov_index = 0, iov_bytes = 0, prev_iov_index = 0, prev_iov_bytes = 0;
+    for (size_t remaining = total_size; remaining > 0;) {
+      while (iov_bytes >= iovs[iov_index].iov_len) {
+        iov_index++;
+        iov_bytes = 0;
+      }
+      while (prev_iov_bytes >= prev_iovs[prev_iov_index].iov_len) {
+        prev_iov_index++;
+        prev_iov_bytes = 0;
+      }
+      size_t bytes = min<size_t>(
+          iovs[iov_index].iov_len - iov_bytes, prev_iovs[prev_iov_index].iov_len - prev_iov_bytes);
+      formatter.write(
+          reinterpret_cast<const uint8_t*>(iovs[iov_index].iov_base) + iov_bytes,
+          bytes,
+          reinterpret_cast<const uint8_t*>(prev_iovs[prev_iov_index].iov_base) + prev_iov_bytes);
+      iov_bytes += bytes;
+      prev_iov_bytes += bytes;
+      remaining -= bytes;
+    }
   }
+  formatter.finish();
 }
 
 void print_data(
@@ -729,10 +1880,34 @@ bool print_binary_diff(
     size_t size2,
     bool use_color,
     size_t context_lines,
-    uint64_t base_offset) {
+    uint64_t base_offset,
+    size_t num_threads) {
   const uint8_t* data1 = reinterpret_cast<const uint8_t*>(data1v);
   const uint8_t* data2 = reinterpret_cast<const uint8_t*>(data2v);
 
+  // Find which chunks of the common range of the data contain any differences.
+  // Lines in chunks that are identical (and aren't within context of a
+  // differing line) can be skipped without being compared byte by byte.
+  static constexpr size_t prepass_chunk_size = 0x100000;
+  static constexpr size_t parallel_prepass_min_size = 0x1000000;
+  size_t common_size = std::min<size_t>(size1, size2);
+  size_t num_chunks = (common_size + prepass_chunk_size - 1) / prepass_chunk_size;
+  vector<uint8_t> chunk_differs(num_chunks, 0);
+  auto check_chunk = [&](size_t chunk_index, size_t) -> bool {
+    size_t chunk_start = chunk_index * prepass_chunk_size;
+    size_t chunk_size = std::min<size_t>(prepass_chunk_size, common_size - chunk_start);
+    chunk_differs[chunk_index] = (memcmp(data1 + chunk_start, data2 + chunk_start, chunk_size) != 0);
+    return false;
+  };
+  if (common_size >= parallel_prepass_min_size && num_threads != 1) {
+    parallel_range<size_t>(check_chunk, 0, num_chunks, num_threads, nullptr);
+  } else {
+    for (size_t z = 0; z < num_chunks; z++) {
+      check_chunk(z, 0);
+    }
+  }
+  size_t next_differing_chunk_index = 0;
+
   size_t max_data_size = std::max<size_t>(size1, size2);
   int offset_width_digits;
   if (base_offset + max_data_size > 0x100000000) {
@@ -815,6 +1990,26 @@ bool print_binary_diff(
   ssize_t last_different_line_index = -(context_lines + 1);
   size_t num_lines = ((max_data_size + 0x0F) >> 4);
   for (size_t line_index = 0; line_index < num_lines; line_index++) {
+    // If there are no trailing context lines left to print and this line is
+    // in an identical chunk, skip ahead to the next chunk that has any
+    // differences (or the end of the common range, if there are none)
+    size_t line_start_offset = line_index * 0x10;
+    if ((static_cast<ssize_t>(line_index) > last_different_line_index + static_cast<ssize_t>(context_lines)) &&
+        (line_start_offset < common_size)) {
+      next_differing_chunk_index = std::max<size_t>(next_differing_chunk_index, line_start_offset / prepass_chunk_size);
+      while ((next_differing_chunk_index < num_chunks) && !chunk_differs[next_differing_chunk_index]) {
+        next_differing_chunk_index++;
+      }
+      size_t skip_to_offset = (next_differing_chunk_index < num_chunks)
+          ? (next_differing_chunk_index * prepass_chunk_size)
+          : common_size;
+      size_t skip_to_line_index = skip_to_offset / 0x10;
+      if (skip_to_line_index > line_index) {
+        line_index = skip_to_line_index - 1;
+        continue;
+      }
+    }
+
     uint16_t diff_flags = 0;
     for (size_t within_line_offset = 0; within_line_offset < 0x10; within_line_offset++) {
       size_t offset = (line_index * 0x10) + within_line_offset;
@@ -861,6 +2056,341 @@ bool print_binary_diff(
   return is_identical;
 }
 
+// Returns the number of bytes at the beginning of data1 and data2 (up to
+// max_size) that are identical
+static size_t common_prefix_size(const uint8_t* data1, const uint8_t* data2, size_t max_size) {
+  static constexpr size_t chunk_size = 0x1000;
+  size_t ret = 0;
+  while ((max_size - ret >= chunk_size) && !memcmp(data1 + ret, data2 + ret, chunk_size)) {
+    ret += chunk_size;
+  }
+  while ((ret < max_size) && (data1[ret] == data2[ret])) {
+    ret++;
+  }
+  return ret;
+}
+
+vector<BinaryDiffRegion> compute_aligned_binary_diff(
+    const void* data1v,
+    size_t size1,
+    const void* data2v,
+    size_t size2,
+    size_t block_size) {
+  if (block_size == 0) {
+    throw invalid_argument("block size must be nonzero");
+  }
+  const uint8_t* data1 = reinterpret_cast<const uint8_t*>(data1v);
+  const uint8_t* data2 = reinterpret_cast<const uint8_t*>(data2v);
+
+  // The rolling hash is a polynomial hash modulo 2^64. Its low bits are
+  // weak, so it's mixed before being used as a hash table index.
+  static constexpr uint64_t multiplier = 0x00000100000001B3;
+  uint64_t high_power = 1; // multiplier ** (block_size - 1)
+  for (size_t z = 1; z < block_size; z++) {
+    high_power *= multiplier;
+  }
+  auto hash_block = [&](const uint8_t* data) -> uint64_t {
+    uint64_t h = 0;
+    for (size_t z = 0; z < block_size; z++) {
+      h = h * multiplier + data[z];
+    }
+    return h;
+  };
+  auto mix = [](uint64_t h) -> uint64_t {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCD;
+    h ^= h >> 33;
+    return h;
+  };
+
+  // Index the aligned blocks in data1. This is an open-addressed table
+  // instead of an unordered_map because it can have hundreds of millions of
+  // entries for large inputs. If a block appears multiple times, only its
+  // first occurrence is indexed; runs of identical blocks are handled by the
+  // in-order check in the scan loop below instead.
+  struct IndexEntry {
+    uint64_t hash;
+    size_t offset_plus_1; // 0 = empty slot
+  };
+  size_t num_blocks = size1 / block_size;
+  size_t index_mask = 0x0F;
+  while (index_mask < num_blocks * 2) {
+    index_mask = (index_mask << 1) | 1;
+  }
+  vector<IndexEntry> index(num_blocks ? (index_mask + 1) : 0, IndexEntry{0, 0});
+  for (size_t block_offset = 0; block_offset + block_size <= size1; block_offset += block_size) {
+    uint64_t h = hash_block(data1 + block_offset);
+    for (size_t slot = mix(h) & index_mask;; slot = (slot + 1) & index_mask) {
+      auto& entry = index[slot];
+      if (entry.offset_plus_1 == 0) {
+        entry.hash = h;
+        entry.offset_plus_1 = block_offset + 1;
+        break;
+      } else if (entry.hash == h) {
+        break;
+      }
+    }
+  }
+  auto find_block = [&](uint64_t h) -> size_t {
+    if (index.empty()) {
+      return string::npos;
+    }
+    for (size_t slot = mix(h) & index_mask;; slot = (slot + 1) & index_mask) {
+      const auto& entry = index[slot];
+      if (entry.offset_plus_1 == 0) {
+        return string::npos;
+      } else if (entry.hash == h) {
+        return entry.offset_plus_1 - 1;
+      }
+    }
+  };
+
+  // Scan data2, looking for blocks that exist in data1
+  struct Match {
+    size_t offset1;
+    size_t offset2;
+    size_t size;
+  };
+  vector<Match> matches;
+  size_t unmatched_start2 = 0;
+  size_t last_match_end1 = 0;
+  uint64_t h = 0;
+  bool hash_valid = false;
+  for (size_t offset2 = 0; offset2 + block_size <= size2;) {
+    if (!hash_valid) {
+      h = hash_block(data2 + offset2);
+      hash_valid = true;
+    }
+
+    // Prefer the offset in data1 that would make this an in-place change
+    // relative to the previous match; if that doesn't match, look up the
+    // block in the index
+    size_t offset1 = last_match_end1 + (offset2 - unmatched_start2);
+    if ((size1 < block_size) || (offset1 > size1 - block_size) ||
+        memcmp(data1 + offset1, data2 + offset2, block_size)) {
+      offset1 = find_block(h);
+      if ((offset1 != string::npos) && memcmp(data1 + offset1, data2 + offset2, block_size)) {
+        offset1 = string::npos;
+      }
+    }
+
+    if (offset1 == string::npos) {
+      if (offset2 + block_size < size2) {
+        h = (h - data2[offset2] * high_power) * multiplier + data2[offset2 + block_size];
+      }
+      offset2++;
+      continue;
+    }
+
+    // Extend the match backward into the unmatched region, then forward
+    size_t back_size = 0;
+    while ((offset2 - back_size > unmatched_start2) && (offset1 - back_size > 0) &&
+        (data1[offset1 - back_size - 1] == data2[offset2 - back_size - 1])) {
+      back_size++;
+    }
+    offset1 -= back_size;
+    offset2 -= back_size;
+    size_t match_size = block_size + back_size;
+    match_size += common_prefix_size(
+        data1 + offset1 + match_size,
+        data2 + offset2 + match_size,
+        min(size1 - offset1, size2 - offset2) - match_size);
+
+    matches.emplace_back(Match{offset1, offset2, match_size});
+    offset2 += match_size;
+    unmatched_start2 = offset2;
+    last_match_end1 = offset1 + match_size;
+    hash_valid = false;
+  }
+
+  // Convert the matches into a list of regions covering all of data2
+  vector<BinaryDiffRegion> ret;
+  using Type = BinaryDiffRegion::Type;
+  auto add_unmatched_region = [&](size_t offset1, size_t size1, size_t offset2, size_t size2) -> void {
+    if (size1 && size2) {
+      ret.emplace_back(BinaryDiffRegion{Type::CHANGED, offset1, size1, offset2, size2});
+    } else if (size1) {
+      ret.emplace_back(BinaryDiffRegion{Type::DELETED, offset1, size1, offset2, 0});
+    } else if (size2) {
+      ret.emplace_back(BinaryDiffRegion{Type::INSERTED, offset1, 0, offset2, size2});
+    }
+  };
+  size_t cursor1 = 0;
+  size_t cursor2 = 0;
+  for (const auto& m : matches) {
+    if (m.offset1 >= cursor1) {
+      add_unmatched_region(cursor1, m.offset1 - cursor1, cursor2, m.offset2 - cursor2);
+      ret.emplace_back(BinaryDiffRegion{Type::MATCH, m.offset1, m.size, m.offset2, m.size});
+      cursor1 = m.offset1 + m.size;
+    } else {
+      add_unmatched_region(cursor1, 0, cursor2, m.offset2 - cursor2);
+      ret.emplace_back(BinaryDiffRegion{Type::MOVED, m.offset1, m.size, m.offset2, m.size});
+    }
+    cursor2 = m.offset2 + m.size;
+  }
+  add_unmatched_region(cursor1, size1 - cursor1, cursor2, size2 - cursor2);
+
+  // If data was moved backward, the range it was moved from was skipped over
+  // by an earlier match, so it appears as a deletion. Remove these deletions,
+  // since the data wasn't actually deleted.
+  vector<pair<size_t, size_t>> moved_ranges;
+  for (const auto& r : ret) {
+    if (r.type == Type::MOVED) {
+      moved_ranges.emplace_back(r.offset1, r.offset1 + r.size1);
+    }
+  }
+  if (!moved_ranges.empty()) {
+    sort(moved_ranges.begin(), moved_ranges.end());
+    // Merge overlapping and adjacent ranges so each deletion only needs to be
+    // checked against a single range
+    vector<pair<size_t, size_t>> merged_ranges;
+    for (const auto& range : moved_ranges) {
+      if (!merged_ranges.empty() && (range.first <= merged_ranges.back().second)) {
+        merged_ranges.back().second = max(merged_ranges.back().second, range.second);
+      } else {
+        merged_ranges.emplace_back(range);
+      }
+    }
+    auto is_moved = [&](const BinaryDiffRegion& r) -> bool {
+      if (r.type != Type::DELETED) {
+        return false;
+      }
+      auto it = upper_bound(merged_ranges.begin(), merged_ranges.end(), make_pair(r.offset1, SIZE_MAX));
+      if (it == merged_ranges.begin()) {
+        return false;
+      }
+      it--;
+      return (it->first <= r.offset1) && (r.offset1 + r.size1 <= it->second);
+    };
+    ret.erase(remove_if(ret.begin(), ret.end(), is_moved), ret.end());
+  }
+
+  return ret;
+}
+
+bool print_aligned_binary_diff(
+    FILE* stream,
+    const void* data1v,
+    size_t size1,
+    const void* data2v,
+    size_t size2,
+    bool use_color,
+    size_t context_lines,
+    uint64_t base_offset,
+    size_t block_size) {
+  const uint8_t* data1 = reinterpret_cast<const uint8_t*>(data1v);
+  const uint8_t* data2 = reinterpret_cast<const uint8_t*>(data2v);
+  using Type = BinaryDiffRegion::Type;
+
+  auto regions = compute_aligned_binary_diff(data1, size1, data2, size2, block_size);
+
+  uint64_t max_address = base_offset + std::max<size_t>(size1, size2);
+  uint64_t data_flags = PrintDataFlags::PRINT_ASCII | PrintDataFlags::DISABLE_COLOR;
+  if (max_address > 0x100000000) {
+    data_flags |= PrintDataFlags::OFFSET_64_BITS;
+  } else if (max_address > 0x10000) {
+    data_flags |= PrintDataFlags::OFFSET_32_BITS;
+  } else if (max_address > 0x100) {
+    data_flags |= PrintDataFlags::OFFSET_16_BITS;
+  } else {
+    data_flags |= PrintDataFlags::OFFSET_8_BITS;
+  }
+
+  auto print_lines = [&](char left_ch, const uint8_t* data, size_t offset, size_t size, TerminalFormat color) -> void {
+    if (size == 0) {
+      return;
+    }
+    string formatted = format_data(data + offset, size, base_offset + offset, nullptr, data_flags);
+    for (size_t line_start = 0; line_start < formatted.size();) {
+      size_t line_end = formatted.find('\n', line_start);
+      if (line_end == string::npos) {
+        line_end = formatted.size();
+      }
+      if (use_color) {
+        print_color_escape(stream, color, TerminalFormat::END);
+      }
+      fputc(left_ch, stream);
+      fputc(' ', stream);
+      fwrite(formatted.data() + line_start, 1, line_end - line_start, stream);
+      if (use_color) {
+        print_color_escape(stream, TerminalFormat::NORMAL, TerminalFormat::END);
+      }
+      fputc('\n', stream);
+      line_start = line_end + 1;
+    }
+  };
+
+  auto type_name = [](Type type) -> const char* {
+    switch (type) {
+      case Type::MATCH:
+        return "matched";
+      case Type::MOVED:
+        return "moved";
+      case Type::INSERTED:
+        return "inserted";
+      case Type::DELETED:
+        return "deleted";
+      case Type::CHANGED:
+        return "changed";
+    }
+    throw logic_error("invalid region type");
+  };
+
+  bool is_identical = true;
+  uint64_t context_bytes = context_lines * 0x10;
+  // End of the data2 bytes already printed, as either a region or context
+  uint64_t printed_end2 = 0;
+  for (size_t z = 0; z < regions.size(); z++) {
+    const auto& r = regions[z];
+    if (r.type == Type::MATCH && r.offset1 == r.offset2) {
+      continue;
+    }
+    is_identical = false;
+    if (r.type == Type::MATCH) {
+      continue; // Shifted, but otherwise unchanged
+    }
+
+    if (use_color) {
+      print_color_escape(stream, TerminalFormat::BOLD, TerminalFormat::END);
+    }
+    fwrite_fmt(stream, "@@ {} {:X}:{:X} => {:X}:{:X}",
+        type_name(r.type), base_offset + r.offset1, r.size1, base_offset + r.offset2, r.size2);
+    if (use_color) {
+      print_color_escape(stream, TerminalFormat::NORMAL, TerminalFormat::END);
+    }
+    fputc('\n', stream);
+    if (r.type == Type::MOVED) {
+      continue;
+    }
+
+    // Context lines are aligned to line boundaries, so the partial line
+    // containing the edge of the region is shown in addition to
+    // context_lines full lines. Context never includes data that was already
+    // printed for the previous region, nor data in the next changed region.
+    if (z > 0) {
+      uint64_t context_start = ((base_offset + r.offset2) & (~0x0F)) - base_offset;
+      context_start = (context_start > context_bytes) ? (context_start - context_bytes) : 0;
+      context_start = max<uint64_t>(context_start, printed_end2);
+      print_lines(' ', data2, context_start, r.offset2 - context_start, TerminalFormat::NORMAL);
+    }
+    print_lines('-', data1, r.offset1, r.size1, TerminalFormat::FG_RED);
+    print_lines('+', data2, r.offset2, r.size2, TerminalFormat::FG_GREEN);
+    printed_end2 = r.offset2 + r.size2;
+    if (z + 1 < regions.size()) {
+      const auto& next = regions[z + 1];
+      bool next_unchanged = (next.type == Type::MATCH) || (next.type == Type::MOVED);
+      uint64_t context_end = ((base_offset + printed_end2 + 0x0F) & (~0x0F)) - base_offset + context_bytes;
+      context_end = min<uint64_t>(context_end, next_unchanged ? (next.offset2 + next.size2) : next.offset2);
+      if (context_end > printed_end2) {
+        print_lines(' ', data2, printed_end2, context_end - printed_end2, TerminalFormat::NORMAL);
+        printed_end2 = context_end;
+      }
+    }
+  }
+
+  return is_identical;
+}
+
 string format_data(
     const struct iovec* iovs,
     size_t num_iovs,
@@ -915,252 +2445,481 @@ static inline void add_mask_bits(string* mask, bool mask_enabled, size_t num_byt
   mask->append(num_bytes, mask_enabled ? '\xFF' : '\x00');
 }
 
-string parse_data_string(const string& s, string* mask, uint64_t flags) {
-  bool allow_files = flags & ParseDataFlags::ALLOW_FILES;
+// Appends the low size bytes of value (1, 2, 4, or 8) to data, byteswapping
+// them if byteswap is true
+static void append_data_int(string& data, uint64_t value, size_t size, bool byteswap) {
+  switch (size) {
+    case 1:
+      data.push_back(static_cast<char>(value));
+      break;
+    case 2: {
+      uint16_t v = byteswap ? bswap16(value) : value;
+      data.append(reinterpret_cast<const char*>(&v), 2);
+      break;
+    }
+    case 4: {
+      uint32_t v = byteswap ? bswap32(value) : value;
+      data.append(reinterpret_cast<const char*>(&v), 4);
+      break;
+    }
+    case 8: {
+      uint64_t v = byteswap ? bswap64(value) : value;
+      data.append(reinterpret_cast<const char*>(&v), 8);
+      break;
+    }
+    default:
+      throw logic_error("invalid integer size");
+  }
+}
+
+// Appends a float (if size is 4) or double (if size is 8) to data
+static void append_data_float(string& data, double value, size_t size, bool byteswap) {
+  if (size == 4) {
+    float f = value;
+    uint32_t v;
+    memcpy(&v, &f, sizeof(v));
+    append_data_int(data, v, 4, byteswap);
+  } else {
+    uint64_t v;
+    memcpy(&v, &value, sizeof(v));
+    append_data_int(data, v, 8, byteswap);
+  }
+}
+
+struct DataStringParser::Placeholder {
+  string name;
+  DataStringTemplate::PlaceholderType type;
+  uint8_t size;
+  bool byteswap;
+  bool mask_enabled;
+  size_t data_offset;
+};
 
-  const char* in = s.c_str();
+DataStringParser::DataStringParser(uint64_t flags)
+    : allow_files(flags & ParseDataFlags::ALLOW_FILES) {}
+
+string DataStringParser::parse(string_view chunk, string* mask) {
+  string data;
+  if (mask) {
+    mask->clear();
+  }
+  if (this->pending.empty()) {
+    const char* chunk_end = chunk.data() + chunk.size();
+    const char* stop = this->parse_buffer(chunk.data(), chunk_end, false, data, mask);
+    this->pending.assign(stop, chunk_end - stop);
+  } else {
+    this->pending.append(chunk);
+    const char* stop = this->parse_buffer(this->pending.data(), this->pending.data() + this->pending.size(), false, data, mask);
+    this->pending.erase(0, stop - this->pending.data());
+  }
+  if (this->pending.size() > MAX_PENDING_SIZE) {
+    throw invalid_argument("data string contains a token that is too long");
+  }
+  return data;
+}
 
+string DataStringParser::finish(string* mask) {
   string data;
   if (mask) {
     mask->clear();
   }
+  this->parse_buffer(this->pending.data(), this->pending.data() + this->pending.size(), true, data, mask);
+  this->pending.clear();
+  this->done = true;
+  return data;
+}
 
+static inline bool is_number_char(char ch) {
+  // These are all the characters that can appear in a number accepted by
+  // strtoull or strtod, including hex, exponents, inf, and nan(...)
+  return ((ch >= '0') && (ch <= '9')) || ((ch >= 'A') && (ch <= 'Z')) || ((ch >= 'a') && (ch <= 'z')) ||
+      (ch == '.') || (ch == '+') || (ch == '-') || (ch == '_') || (ch == '(') || (ch == ')');
+}
+
+static inline bool is_strtod_space(char ch) {
+  return (ch == ' ') || (ch == '\t') || (ch == '\n') || (ch == '\v') || (ch == '\f') || (ch == '\r');
+}
+
+const char* DataStringParser::parse_buffer(const char* in, const char* end, bool is_final, string& data, string* mask) {
 #ifdef PHOSG_BIG_ENDIAN
   constexpr bool host_big_endian = true;
 #else
   constexpr bool host_big_endian = false;
 #endif
 
-  uint8_t chr = 0;
-  bool reading_string = false;
-  bool reading_unicode_string = false;
-  bool reading_comment = false;
-  bool reading_multiline_comment = false;
-  bool reading_high_nybble = true;
-  bool reading_filename = false;
-  bool big_endian = false;
-  bool mask_enabled = true;
-  string filename;
-  while (in[0]) {
+  // In the final buffer, reading past the end gives '\0', as it would for a
+  // C string. Otherwise, a construct that needs a character past the end is
+  // left unparsed (by returning its start) until more input is available.
+  auto at = [&](size_t offset) -> char {
+    return (in + offset < end) ? in[offset] : '\0';
+  };
+  auto available = [&](size_t offset) -> bool {
+    return is_final || (in + offset < end);
+  };
+
+  // Numbers are parsed with strtoull/strtod, which need a terminating
+  // character that can't be part of the number; returns false if the number
+  // beginning at in + offset might continue past the end of the buffer.
+  auto number_available = [&](size_t offset) -> bool {
+    if (is_final) {
+      return true;
+    }
+    const char* p = in + offset;
+    for (; (p < end) && is_strtod_space(*p); p++) {
+    }
+    for (; (p < end) && is_number_char(*p); p++) {
+    }
+    return p < end;
+  };
+
+  // Returns false if the placeholder's closing brace isn't in the buffer
+  auto parse_placeholder = [&](size_t offset, DataStringTemplate::PlaceholderType type, uint8_t size) -> bool {
+    const char* name_start = in + offset + 1;
+    const char* name_end = reinterpret_cast<const char*>(memchr(name_start, '}', end - name_start));
+    if (!name_end) {
+      if (!is_final) {
+        return false;
+      }
+      throw invalid_argument("unterminated placeholder");
+    }
+    if (name_end == name_start) {
+      throw invalid_argument("placeholder name is empty");
+    }
+    this->placeholders->emplace_back(Placeholder{
+        string(name_start, name_end - name_start), type, size,
+        (type != DataStringTemplate::PlaceholderType::BYTES) && (this->big_endian != host_big_endian),
+        this->mask_enabled, data.size()});
+    in = name_end + 1;
+    return true;
+  };
+
+  while ((in < end) && !this->done) {
     bool read_nybble = 0;
 
-    // if between // and a newline, don't write to output buffer
-    if (reading_comment) {
+    // The input ends at the first null byte, as if it were a C string
+    if (in[0] == '\0') {
+      this->done = true;
+      return end;
+
+      // if between // and a newline, don't write to output buffer
+    } else if (this->reading_comment) {
       if (in[0] == '\n') {
-        reading_comment = false;
+        this->reading_comment = false;
       }
       in++;
 
       // if between /* and */, don't write to output buffer
-    } else if (reading_multiline_comment) {
-      if ((in[0] == '*') && (in[1] == '/')) {
-        reading_multiline_comment = 0;
-        in += 2;
+    } else if (this->reading_multiline_comment) {
+      if (in[0] == '*') {
+        if (!available(1)) {
+          return in;
+        }
+        if (at(1) == '/') {
+          this->reading_multiline_comment = false;
+          in += 2;
+        } else {
+          in++;
+        }
       } else {
         in++;
       }
 
       // if between quotes, read bytes to output buffer, unescaping where needed
-    } else if (reading_string) {
+    } else if (this->reading_string) {
       if (in[0] == '\"') {
-        reading_string = 0;
+        this->reading_string = false;
         in++;
 
       } else if (in[0] == '\\') { // unescape char after a backslash
-        if (!in[1]) {
-          return data;
-        } else if (in[1] == 'n') {
+        if (!available(1)) {
+          return in;
+        }
+        char ch = at(1);
+        if (!ch) {
+          this->done = true;
+          return end;
+        } else if (ch == 'n') {
           data += '\n';
-        } else if (in[1] == 'r') {
+        } else if (ch == 'r') {
           data += '\r';
-        } else if (in[1] == 't') {
+        } else if (ch == 't') {
           data += '\t';
-        } else if (in[1] == '\"') {
-          data += '\"';
-        } else if (in[1] == '\'') {
-          data += '\'';
         } else {
-          data += in[1];
+          data += ch;
         }
-        add_mask_bits(mask, mask_enabled, 1);
+        add_mask_bits(mask, this->mask_enabled, 1);
         in += 2;
 
       } else {
         data += in[0];
-        add_mask_bits(mask, mask_enabled, 1);
+        add_mask_bits(mask, this->mask_enabled, 1);
         in++;
       }
 
       // if between single quotes, word-expand bytes to output buffer, unescaping
-    } else if (reading_unicode_string) {
+    } else if (this->reading_unicode_string) {
       if (in[0] == '\'') {
-        reading_unicode_string = 0;
+        this->reading_unicode_string = false;
         in++;
 
-      } else if (in[0] == '\\') { // unescape char after a backslash
+      } else {
         int16_t value;
-        if (!in[1]) {
-          return data;
-        } else if (in[1] == 'n') {
-          value = '\n';
-        } else if (in[1] == 'r') {
-          value = '\r';
-        } else if (in[1] == 't') {
-          value = '\t';
+        if (in[0] == '\\') { // unescape char after a backslash
+          if (!available(1)) {
+            return in;
+          }
+          char ch = at(1);
+          if (!ch) {
+            this->done = true;
+            return end;
+          } else if (ch == 'n') {
+            value = '\n';
+          } else if (ch == 'r') {
+            value = '\r';
+          } else if (ch == 't') {
+            value = '\t';
+          } else {
+            value = ch;
+          }
+          in += 2;
         } else {
-          value = in[1];
-        }
-        if (big_endian != host_big_endian) {
-          value = bswap16(value);
-        }
-        data.append((const char*)&value, 2);
-        add_mask_bits(mask, mask_enabled, 2);
-        in += 2;
-
-      } else {
-        int16_t value = in[0];
-        if (big_endian != host_big_endian) {
-          value = bswap16(value);
+          value = in[0];
+          in++;
         }
-        data.append((const char*)&value, 2);
-        add_mask_bits(mask, mask_enabled, 2);
-        in++;
+        append_data_int(data, value, 2, this->big_endian != host_big_endian);
+        add_mask_bits(mask, this->mask_enabled, 2);
       }
 
       // if between <>, read a file name, then stick that file into the buffer
-    } else if (reading_filename) {
+    } else if (this->reading_filename) {
       if (in[0] == '>') {
         // TODO: support <filename@offset:size> syntax
-        reading_filename = 0;
+        this->reading_filename = false;
         size_t pre_size = data.size();
-        data += load_file(filename);
-        add_mask_bits(mask, mask_enabled, data.size() - pre_size);
+        data += load_file(this->filename);
+        add_mask_bits(mask, this->mask_enabled, data.size() - pre_size);
 
       } else {
-        filename.append(1, in[0]);
+        this->filename.append(1, in[0]);
       }
       in++;
 
       // ? inverts mask_enabled
     } else if (in[0] == '?') {
-      mask_enabled = !mask_enabled;
+      this->mask_enabled = !this->mask_enabled;
       in++;
 
       // $ changes the endianness
     } else if (in[0] == '$') {
-      big_endian = !big_endian;
+      this->big_endian = !this->big_endian;
       in++;
 
       // # signifies a decimal number
-    } else if (in[0] == '#') { // 8-bit
-      in++;
-      if (in[0] == '#') { // 16-bit
-        in++;
-        if (in[0] == '#') { // 32-bit
-          in++;
-          if (in[0] == '#') { // 64-bit
-            in++;
-            uint64_t value = strtoull(in, const_cast<char**>(&in), 0);
-            if (big_endian != host_big_endian) {
-              value = bswap64(value);
-            }
-            data.append((const char*)&value, 8);
-            add_mask_bits(mask, mask_enabled, 8);
-
-          } else {
-            uint32_t value = strtoull(in, const_cast<char**>(&in), 0);
-            if (big_endian != host_big_endian) {
-              value = bswap32(value);
-            }
-            data.append((const char*)&value, 4);
-            add_mask_bits(mask, mask_enabled, 4);
-          }
-
-        } else {
-          uint16_t value = strtoull(in, const_cast<char**>(&in), 0);
-          if (big_endian != host_big_endian) {
-            value = bswap16(value);
-          }
-          data.append((const char*)&value, 2);
-          add_mask_bits(mask, mask_enabled, 2);
+    } else if (in[0] == '#') {
+      // # is an 8-bit value; each additional # doubles the size, up to 64 bits
+      size_t size = 1;
+      size_t offset = 1;
+      for (; size < 8; size <<= 1, offset++) {
+        if (!available(offset)) {
+          return in;
+        }
+        if (at(offset) != '#') {
+          break;
+        }
+      }
+      if (this->placeholders && available(offset) && (at(offset) == '{')) {
+        if (!parse_placeholder(offset, DataStringTemplate::PlaceholderType::INT, size)) {
+          return in;
         }
-
       } else {
-        data.append(1, (char)strtoull(in, const_cast<char**>(&in), 0));
-        add_mask_bits(mask, mask_enabled, 1);
+        if (!number_available(offset)) {
+          return in;
+        }
+        in += offset;
+        append_data_int(data, strtoull(in, const_cast<char**>(&in), 0), size, this->big_endian != host_big_endian);
+        add_mask_bits(mask, this->mask_enabled, size);
       }
 
       // % is a float, %% is a double
     } else if (in[0] == '%') {
-      in++;
-      if (in[0] == '%') {
-        in++;
-
-        uint64_t value;
-        *(double*)&value = strtod(in, const_cast<char**>(&in));
-        if (big_endian != host_big_endian) {
-          value = bswap64(value);
+      if (!available(1)) {
+        return in;
+      }
+      size_t size = (at(1) == '%') ? 8 : 4;
+      size_t offset = (size == 8) ? 2 : 1;
+      if (this->placeholders && available(offset) && (at(offset) == '{')) {
+        if (!parse_placeholder(offset, DataStringTemplate::PlaceholderType::FLOAT, size)) {
+          return in;
         }
-        data.append((const char*)&value, 8);
-        add_mask_bits(mask, mask_enabled, 8);
-
       } else {
-        uint32_t value;
-        *(float*)&value = strtof(in, const_cast<char**>(&in));
-        if (big_endian != host_big_endian) {
-          value = bswap32(value);
+        if (!number_available(offset)) {
+          return in;
         }
-        data.append((const char*)&value, 4);
-        add_mask_bits(mask, mask_enabled, 4);
+        in += offset;
+        // strtof rounds directly to float precision; rounding the result of
+        // strtod to a float could give a different value
+        double value = (size == 4) ? strtof(in, const_cast<char**>(&in)) : strtod(in, const_cast<char**>(&in));
+        append_data_float(data, value, size, this->big_endian != host_big_endian);
+        add_mask_bits(mask, this->mask_enabled, size);
+      }
+
+      // { begins a placeholder for arbitrary bytes
+    } else if (this->placeholders && (in[0] == '{')) {
+      if (!parse_placeholder(0, DataStringTemplate::PlaceholderType::BYTES, 0)) {
+        return in;
       }
 
       // anything else is a hex digit
     } else {
       if ((in[0] >= '0') && (in[0] <= '9')) {
         read_nybble = true;
-        chr |= (in[0] - '0');
+        this->chr |= (in[0] - '0');
 
       } else if ((in[0] >= 'A') && (in[0] <= 'F')) {
         read_nybble = true;
-        chr |= (in[0] - 'A' + 0x0A);
+        this->chr |= (in[0] - 'A' + 0x0A);
 
       } else if ((in[0] >= 'a') && (in[0] <= 'f')) {
         read_nybble = true;
-        chr |= (in[0] - 'a' + 0x0A);
+        this->chr |= (in[0] - 'a' + 0x0A);
 
       } else if (in[0] == '\"') {
-        reading_string = true;
+        this->reading_string = true;
 
       } else if (in[0] == '\'') {
-        reading_unicode_string = 1;
-
-      } else if ((in[0] == '/') && (in[1] == '/')) {
-        reading_comment = 1;
+        this->reading_unicode_string = true;
 
-      } else if ((in[0] == '/') && (in[1] == '*')) {
-        reading_multiline_comment = 1;
+      } else if (in[0] == '/') {
+        if (!available(1)) {
+          return in;
+        }
+        if (at(1) == '/') {
+          this->reading_comment = true;
+        } else if (at(1) == '*') {
+          this->reading_multiline_comment = true;
+        }
 
-      } else if (in[0] == '<' && allow_files) {
-        reading_filename = 1;
-        filename.clear();
+      } else if (in[0] == '<' && this->allow_files) {
+        this->reading_filename = true;
+        this->filename.clear();
       }
       in++;
     }
 
     if (read_nybble) {
-      if (reading_high_nybble) {
-        chr = chr << 4;
+      if (this->reading_high_nybble) {
+        this->chr = this->chr << 4;
       } else {
-        data += (char)chr;
-        add_mask_bits(mask, mask_enabled, 1);
-        chr = 0;
+        data += static_cast<char>(this->chr);
+        add_mask_bits(mask, this->mask_enabled, 1);
+        this->chr = 0;
       }
-      reading_high_nybble = !reading_high_nybble;
+      this->reading_high_nybble = !this->reading_high_nybble;
     }
   }
+  return in;
+}
+
+string parse_data_string(const string& s, string* mask, uint64_t flags) {
+  string data;
+  if (mask) {
+    mask->clear();
+  }
+  DataStringParser(flags).parse_buffer(s.data(), s.data() + s.size(), true, data, mask);
+  return data;
+}
+
+DataStringTemplate::DataStringTemplate(const string& s, uint64_t flags) {
+  vector<DataStringParser::Placeholder> placeholders;
+  DataStringParser parser(flags);
+  parser.placeholders = &placeholders;
+  parser.parse_buffer(s.data(), s.data() + s.size(), true, this->literal_data, &this->literal_mask);
+
+  size_t literal_offset = 0;
+  this->fixed_size = this->literal_data.size();
+  for (auto& placeholder : placeholders) {
+    auto [it, inserted] = this->name_to_index.emplace(placeholder.name, this->names.size());
+    if (inserted) {
+      this->names.emplace_back(std::move(placeholder.name));
+    }
+    this->segments.emplace_back(Segment{
+        placeholder.data_offset - literal_offset,
+        it->second,
+        placeholder.type,
+        placeholder.size,
+        placeholder.byteswap,
+        placeholder.mask_enabled});
+    literal_offset = placeholder.data_offset;
+    this->fixed_size += placeholder.size;
+  }
+  this->trailing_literal_size = this->literal_data.size() - literal_offset;
+}
+
+size_t DataStringTemplate::placeholder_index(const string& name) const {
+  try {
+    return this->name_to_index.at(name);
+  } catch (const out_of_range&) {
+    throw out_of_range("no such placeholder: " + name);
+  }
+}
+
+string DataStringTemplate::render(const vector<Value>& values, string* mask) const {
+  string data;
+  if (mask) {
+    mask->clear();
+  }
+  this->render_into(data, values, mask);
   return data;
 }
 
+void DataStringTemplate::render_into(string& data, const vector<Value>& values, string* mask) const {
+  if (values.size() != this->names.size()) {
+    throw invalid_argument("incorrect number of values");
+  }
+
+  size_t size = this->fixed_size;
+  for (const auto& segment : this->segments) {
+    if (segment.type == PlaceholderType::BYTES) {
+      size += values[segment.value_index].bytes_value.size();
+    }
+  }
+  data.reserve(data.size() + size);
+  if (mask) {
+    mask->reserve(mask->size() + size);
+  }
+
+  size_t literal_offset = 0;
+  for (const auto& segment : this->segments) {
+    data.append(this->literal_data.data() + literal_offset, segment.literal_size);
+    if (mask) {
+      mask->append(this->literal_mask.data() + literal_offset, segment.literal_size);
+    }
+    literal_offset += segment.literal_size;
+
+    const auto& value = values[segment.value_index];
+    if (value.type != segment.type) {
+      throw invalid_argument("incorrect value type for placeholder: " + this->names[segment.value_index]);
+    }
+    size_t pre_size = data.size();
+    switch (segment.type) {
+      case PlaceholderType::INT:
+        append_data_int(data, value.int_value, segment.size, segment.byteswap);
+        break;
+      case PlaceholderType::FLOAT:
+        append_data_float(data, value.float_value, segment.size, segment.byteswap);
+        break;
+      case PlaceholderType::BYTES:
+        data.append(value.bytes_value);
+        break;
+    }
+    add_mask_bits(mask, segment.mask_enabled, data.size() - pre_size);
+  }
+  data.append(this->literal_data.data() + literal_offset, this->trailing_literal_size);
+  if (mask) {
+    mask->append(this->literal_mask.data() + literal_offset, this->trailing_literal_size);
+  }
+}
+
 string format_data_string(const string& data, const string* mask, uint64_t flags) {
   if (mask && (mask->size() != data.size())) {
     throw logic_error("data and mask sizes do not match");
@@ -1207,12 +2966,24 @@ string format_data_string(const void* vdata, size_t size, const void* vmask, uin
     }
     ret += '\"';
   } else {
-    for (size_t x = 0; x < size; x++) {
-      if (mask && ((bool)mask[x] != mask_enabled)) {
-        mask_enabled = !mask_enabled;
-        ret += '?';
+    // Encode each run of bytes with the same mask state all at once
+    ret.reserve(size * 2);
+    for (size_t run_start = 0; run_start < size;) {
+      size_t run_end = size;
+      if (mask) {
+        if ((bool)mask[run_start] != mask_enabled) {
+          mask_enabled = !mask_enabled;
+          ret += '?';
+        }
+        run_end = run_start + 1;
+        while ((run_end < size) && ((bool)mask[run_end] == mask_enabled)) {
+          run_end++;
+        }
       }
-      ret += std::format("{:02X}", data[x]);
+      size_t ret_offset = ret.size();
+      ret.resize(ret_offset + (run_end - run_start) * 2);
+      hex_encode_into(ret.data() + ret_offset, data + run_start, run_end - run_start);
+      run_start = run_end;
     }
   }
   return ret;
@@ -1228,95 +2999,36 @@ string format_data_string(const void* vdata, size_t size, const void* vmask, uin
 #define YB_SIZE (ZB_SIZE * 1024ULL)
 #define HB_SIZE (YB_SIZE * 1024ULL)
 
-#if (SIZE_T_BITS == 8)
-
-string format_size(size_t size, bool include_bytes) {
-  return std::format("{} bytes", size);
-}
-
-#elif (SIZE_T_BITS == 16)
-
-string format_size(size_t size, bool include_bytes) {
+char* format_size_to(char* buf, size_t size, bool include_bytes) {
   if (size < KB_SIZE) {
-    return std::format("{} bytes", size);
+    return std::format_to(buf, "{} bytes", size);
   }
   if (include_bytes) {
-    return std::format("{} bytes ({:.02f} KB)", size, (float)size / KB_SIZE);
-  } else {
-    return std::format("{:.02f} KB", (float)size / KB_SIZE);
+    buf = std::format_to(buf, "{} bytes (", size);
   }
-}
-
-#elif (SIZE_T_BITS == 32)
 
-string format_size(size_t size, bool include_bytes) {
-  if (size < KB_SIZE) {
-    return std::format("{} bytes", size);
+  // Sizes of EB_SIZE or more are still formatted in EB, since a 64-bit size_t
+  // can't reach ZB_SIZE
+  static const char* unit_names[] = {"KB", "MB", "GB", "TB", "PB", "EB"};
+  size_t unit_index = 0;
+  uint64_t unit_size = KB_SIZE;
+  while ((unit_index < 5) && (size / unit_size >= 1024)) {
+    unit_size *= 1024;
+    unit_index++;
   }
+  buf = std::format_to(buf, "{:.02f} {}", (float)size / unit_size, unit_names[unit_index]);
+
   if (include_bytes) {
-    if (size < MB_SIZE) {
-      return std::format("{} bytes ({:.02f} KB)", size, (float)size / KB_SIZE);
-    }
-    if (size < GB_SIZE) {
-      return std::format("{} bytes ({:.02f} MB)", size, (float)size / MB_SIZE);
-    }
-    return std::format("{} bytes ({:.02f} GB)", size, (float)size / GB_SIZE);
-  } else {
-    if (size < MB_SIZE) {
-      return std::format("{:.02f} KB", (float)size / KB_SIZE);
-    }
-    if (size < GB_SIZE) {
-      return std::format("{:.02f} MB", (float)size / MB_SIZE);
-    }
-    return std::format("{:.02f} GB", (float)size / GB_SIZE);
+    *(buf++) = ')';
   }
+  return buf;
 }
 
-#elif (SIZE_T_BITS == 64)
-
 string format_size(size_t size, bool include_bytes) {
-  if (size < KB_SIZE) {
-    return std::format("{} bytes", size);
-  }
-  if (include_bytes) {
-    if (size < MB_SIZE) {
-      return std::format("{} bytes ({:.02f} KB)", size, (float)size / KB_SIZE);
-    }
-    if (size < GB_SIZE) {
-      return std::format("{} bytes ({:.02f} MB)", size, (float)size / MB_SIZE);
-    }
-    if (size < TB_SIZE) {
-      return std::format("{} bytes ({:.02f} GB)", size, (float)size / GB_SIZE);
-    }
-    if (size < PB_SIZE) {
-      return std::format("{} bytes ({:.02f} TB)", size, (float)size / TB_SIZE);
-    }
-    if (size < EB_SIZE) {
-      return std::format("{} bytes ({:.02f} PB)", size, (float)size / PB_SIZE);
-    }
-    return std::format("{} bytes ({:.02f} EB)", size, (float)size / EB_SIZE);
-  } else {
-    if (size < MB_SIZE) {
-      return std::format("{:.02f} KB", (float)size / KB_SIZE);
-    }
-    if (size < GB_SIZE) {
-      return std::format("{:.02f} MB", (float)size / MB_SIZE);
-    }
-    if (size < TB_SIZE) {
-      return std::format("{:.02f} GB", (float)size / GB_SIZE);
-    }
-    if (size < PB_SIZE) {
-      return std::format("{:.02f} TB", (float)size / TB_SIZE);
-    }
-    if (size < EB_SIZE) {
-      return std::format("{:.02f} PB", (float)size / PB_SIZE);
-    }
-    return std::format("{:.02f} EB", (float)size / EB_SIZE);
-  }
+  char buf[FORMAT_SIZE_MAX_LENGTH];
+  return string(buf, format_size_to(buf, size, include_bytes));
 }
 
-#endif
-
 size_t parse_size(const char* str) {
   // input is like [0-9](\.[0-9]+)? *[KkMmGgTtPpEe]?[Bb]?
   // fortunately this can just be parsed left-to-right
@@ -1467,58 +3179,424 @@ void BitWriter::write(bool v) {
   }
 }
 
-StringReader::StringReader()
-    : owned_data(nullptr),
-      data(nullptr),
+StringReader::StringReader()
+    : owned_data(nullptr),
+      data(nullptr),
+      length(0),
+      offset(0) {}
+
+StringReader::StringReader(shared_ptr<string> data, size_t offset)
+    : owned_data(data),
+      data(reinterpret_cast<const uint8_t*>(data->data())),
+      length(data->size()),
+      offset(offset) {}
+
+#ifndef PHOSG_WINDOWS
+StringReader::StringReader(shared_ptr<const MappedFile> file, size_t offset)
+    : owned_data(file),
+      data(reinterpret_cast<const uint8_t*>(file->data())),
+      length(file->size()),
+      offset(offset) {}
+#endif
+
+StringReader::StringReader(const void* data, size_t size, size_t offset)
+    : data(reinterpret_cast<const uint8_t*>(data)),
+      length(size),
+      offset(offset) {}
+
+StringReader::StringReader(const string& data, size_t offset)
+    : StringReader(data.data(), data.size(), offset) {}
+
+size_t StringReader::where() const {
+  return this->offset;
+}
+
+size_t StringReader::size() const {
+  return this->length;
+}
+
+size_t StringReader::remaining() const {
+  return this->length - this->offset;
+}
+
+void StringReader::truncate(size_t new_size) {
+  if (this->length < new_size) {
+    throw invalid_argument("StringReader contents cannot be extended");
+  }
+  this->length = new_size;
+}
+
+void StringReader::go(size_t offset) {
+  this->offset = offset;
+}
+
+void StringReader::skip(size_t bytes) {
+  this->offset += bytes;
+  if (this->offset > this->length) {
+    this->offset = this->length;
+    throw out_of_range("skip beyond end of string");
+  }
+}
+
+bool StringReader::skip_if(const void* data, size_t size) {
+  if ((this->remaining() < size) || memcmp(this->peek(size), data, size)) {
+    return false;
+  } else {
+    this->skip(size);
+    return true;
+  }
+}
+
+bool StringReader::eof() const {
+  return (this->offset >= this->length);
+}
+
+string StringReader::all() const {
+  return string(reinterpret_cast<const char*>(this->data), this->length);
+}
+
+StringReader StringReader::sub(size_t offset) const {
+  if (offset > this->length) {
+    return StringReader();
+  }
+  return StringReader(
+      reinterpret_cast<const char*>(this->data) + offset,
+      this->length - offset);
+}
+
+StringReader StringReader::sub(size_t offset, size_t size) const {
+  if (offset >= this->length) {
+    return StringReader();
+  }
+  if (offset + size > this->length) {
+    return StringReader(
+        reinterpret_cast<const char*>(this->data) + offset,
+        this->length - offset);
+  }
+  return StringReader(reinterpret_cast<const char*>(this->data) + offset, size);
+}
+
+StringReader StringReader::subx(size_t offset) const {
+  if (offset > this->length) {
+    throw out_of_range("sub-reader begins beyond end of data");
+  }
+  return StringReader(
+      reinterpret_cast<const char*>(this->data) + offset,
+      this->length - offset);
+}
+
+StringReader StringReader::subx(size_t offset, size_t size) const {
+  if (offset + size > this->length) {
+    throw out_of_range("sub-reader begins or extends beyond end of data");
+  }
+  return StringReader(reinterpret_cast<const char*>(this->data) + offset, size);
+}
+
+BitReader StringReader::sub_bits(size_t offset) const {
+  if (offset > this->length) {
+    return BitReader();
+  }
+  return BitReader(
+      reinterpret_cast<const char*>(this->data) + offset,
+      (this->length - offset) * 8);
+}
+
+BitReader StringReader::sub_bits(size_t offset, size_t size) const {
+  if (offset >= this->length) {
+    return BitReader();
+  }
+  if (offset + size > this->length) {
+    return BitReader(
+        reinterpret_cast<const char*>(this->data) + offset,
+        (this->length - offset) * 8);
+  }
+  return BitReader(reinterpret_cast<const char*>(this->data) + offset, size * 8);
+}
+
+BitReader StringReader::subx_bits(size_t offset) const {
+  if (offset > this->length) {
+    throw out_of_range("sub-reader begins beyond end of data");
+  }
+  return BitReader(
+      reinterpret_cast<const char*>(this->data) + offset,
+      (this->length - offset) * 8);
+}
+
+BitReader StringReader::subx_bits(size_t offset, size_t size) const {
+  if (offset + size > this->length) {
+    throw out_of_range("sub-reader begins or extends beyond end of data");
+  }
+  return BitReader(reinterpret_cast<const char*>(this->data) + offset, size * 8);
+}
+
+const char* StringReader::peek(size_t size) {
+  if (this->offset + size <= this->length) {
+    return reinterpret_cast<const char*>(this->data + this->offset);
+  }
+  throw out_of_range("not enough data to read");
+}
+
+string StringReader::read(size_t size, bool advance) {
+  string ret = this->pread(this->offset, size);
+  if (ret.size() && advance) {
+    this->offset += ret.size();
+  }
+  return ret;
+}
+
+string StringReader::readx(size_t size, bool advance) {
+  string ret = this->preadx(this->offset, size);
+  if (advance) {
+    this->offset += ret.size();
+  }
+  return ret;
+}
+
+size_t StringReader::read(void* data, size_t size, bool advance) {
+  size_t ret = this->pread(this->offset, data, size);
+  if (ret && advance) {
+    this->offset += ret;
+  }
+  return ret;
+}
+
+void StringReader::readx(void* data, size_t size, bool advance) {
+  this->preadx(this->offset, data, size);
+  if (advance) {
+    this->offset += size;
+  }
+}
+
+string StringReader::pread(size_t offset, size_t size) const {
+  if (offset >= this->length) {
+    return string();
+  }
+  if (offset + size > this->length) {
+    return string(reinterpret_cast<const char*>(this->data + offset), this->length - offset);
+  }
+  return string(reinterpret_cast<const char*>(this->data + offset), size);
+}
+
+string StringReader::preadx(size_t offset, size_t size) const {
+  if (offset + size > this->length) {
+    throw out_of_range("not enough data to read");
+  }
+  return string(reinterpret_cast<const char*>(this->data + offset), size);
+}
+
+size_t StringReader::pread(size_t offset, void* data, size_t size) const {
+  if (offset >= this->length) {
+    return 0;
+  }
+
+  size_t ret;
+  if (offset + size > this->length) {
+    memcpy(data, this->data + offset, this->length - offset);
+    ret = this->length - offset;
+  } else {
+    memcpy(data, this->data + offset, size);
+    ret = size;
+  }
+  return ret;
+}
+
+void StringReader::preadx(size_t offset, void* data, size_t size) const {
+  if ((offset >= this->length) || (offset + size > this->length)) {
+    throw out_of_range("not enough data to read");
+  }
+  memcpy(data, this->data + offset, size);
+}
+
+uint64_t StringReader::get_uleb128(bool advance) {
+  size_t size;
+  uint64_t ret = this->pget_uleb128(this->offset, &size);
+  if (advance) {
+    this->offset += size;
+  }
+  return ret;
+}
+
+uint64_t StringReader::pget_uleb128(size_t offset, size_t* size) const {
+  if (offset >= this->length) {
+    throw out_of_range("end of string");
+  }
+  uint64_t ret;
+  size_t bytes = decode_uleb128(&ret, this->data + offset, this->length - offset);
+  if (size) {
+    *size = bytes;
+  }
+  return ret;
+}
+
+uint64_t StringReader::get_prefix_varint(bool advance) {
+  size_t size;
+  uint64_t ret = this->pget_prefix_varint(this->offset, &size);
+  if (advance) {
+    this->offset += size;
+  }
+  return ret;
+}
+
+uint64_t StringReader::pget_prefix_varint(size_t offset, size_t* size) const {
+  if (offset >= this->length) {
+    throw out_of_range("end of string");
+  }
+  uint64_t ret;
+  size_t bytes = decode_prefix_varint(&ret, this->data + offset, this->length - offset);
+  if (size) {
+    *size = bytes;
+  }
+  return ret;
+}
+
+void StringReader::get_uleb128_array(uint64_t* dest, size_t count, bool advance) {
+  if (count == 0) {
+    return;
+  }
+  if (this->offset >= this->length) {
+    throw out_of_range("end of string");
+  }
+  size_t size = decode_uleb128_array(dest, count, this->data + this->offset, this->length - this->offset);
+  if (advance) {
+    this->offset += size;
+  }
+}
+
+void StringReader::get_prefix_varint_array(uint64_t* dest, size_t count, bool advance) {
+  if (count == 0) {
+    return;
+  }
+  if (this->offset >= this->length) {
+    throw out_of_range("end of string");
+  }
+  size_t size = decode_prefix_varint_array(dest, count, this->data + this->offset, this->length - this->offset);
+  if (advance) {
+    this->offset += size;
+  }
+}
+
+string StringReader::get_line(bool advance) {
+  if (this->eof()) {
+    throw out_of_range("end of string");
+  }
+
+  string ret;
+  for (;;) {
+    size_t ch_offset = this->offset + ret.size();
+    if (ch_offset >= this->length) {
+      break;
+    }
+    uint8_t ch = this->pget_s8(ch_offset);
+    if (ch != '\n') {
+      ret += ch;
+    } else {
+      break;
+    }
+  }
+  if (advance) {
+    this->offset += (ret.size() + 1);
+  }
+  if (ret.ends_with("\r")) {
+    ret.pop_back();
+  }
+  return ret;
+}
+
+string StringReader::get_cstr(bool advance) {
+  string ret = this->pget_cstr(this->offset);
+  if (advance) {
+    this->offset += (ret.size() + 1);
+  }
+  return ret;
+}
+
+string StringReader::pget_cstr(size_t offset) const {
+  string ret;
+  for (;;) {
+    uint8_t ch = this->pget_s8(offset + ret.size());
+    if (ch != 0) {
+      ret += ch;
+    } else {
+      break;
+    }
+  }
+  return ret;
+}
+
+StreamReader::StreamReader(const string& filename, size_t window_size)
+    : StreamReader(fopen_shared(filename, "rb"), window_size) {}
+
+StreamReader::StreamReader(shared_ptr<FILE> f, size_t window_size)
+    : file(f),
+      fd(-1),
+      length(0),
+      offset(0),
+      window_size(max<size_t>(window_size, 0x10)),
+      window_offset(0) {
+  if (fseek64(this->file.get(), 0, SEEK_END)) {
+    throw runtime_error("StreamReader requires a seekable file");
+  }
+  int64_t end_offset = ftell64(this->file.get());
+  if (end_offset < 0) {
+    throw runtime_error("StreamReader requires a seekable file");
+  }
+  if (static_cast<uint64_t>(end_offset) > SIZE_MAX) {
+    throw runtime_error("file is too large to be addressed on this platform");
+  }
+  this->length = end_offset;
+}
+
+#ifndef PHOSG_WINDOWS
+StreamReader::StreamReader(int fd, size_t window_size)
+    : file(nullptr),
+      fd(fd),
       length(0),
-      offset(0) {}
-
-StringReader::StringReader(shared_ptr<string> data, size_t offset)
-    : owned_data(data),
-      data(reinterpret_cast<const uint8_t*>(data->data())),
-      length(data->size()),
-      offset(offset) {}
-
-StringReader::StringReader(const void* data, size_t size, size_t offset)
-    : data(reinterpret_cast<const uint8_t*>(data)),
-      length(size),
-      offset(offset) {}
-
-StringReader::StringReader(const string& data, size_t offset)
-    : StringReader(data.data(), data.size(), offset) {}
+      offset(0),
+      window_size(max<size_t>(window_size, 0x10)),
+      window_offset(0) {
+  uint64_t file_size = fstat(fd).st_size;
+  if (file_size > SIZE_MAX) {
+    throw runtime_error("file is too large to be addressed on this platform");
+  }
+  this->length = file_size;
+}
+#endif
 
-size_t StringReader::where() const {
+size_t StreamReader::where() const {
   return this->offset;
 }
 
-size_t StringReader::size() const {
+size_t StreamReader::size() const {
   return this->length;
 }
 
-size_t StringReader::remaining() const {
+size_t StreamReader::remaining() const {
   return this->length - this->offset;
 }
 
-void StringReader::truncate(size_t new_size) {
+void StreamReader::truncate(size_t new_size) {
   if (this->length < new_size) {
-    throw invalid_argument("StringReader contents cannot be extended");
+    throw invalid_argument("StreamReader contents cannot be extended");
   }
   this->length = new_size;
+  if (this->window_offset + this->window.size() > this->length) {
+    this->window.resize((this->window_offset < this->length) ? (this->length - this->window_offset) : 0);
+  }
 }
 
-void StringReader::go(size_t offset) {
+void StreamReader::go(size_t offset) {
   this->offset = offset;
 }
 
-void StringReader::skip(size_t bytes) {
+void StreamReader::skip(size_t bytes) {
   this->offset += bytes;
   if (this->offset > this->length) {
     this->offset = this->length;
-    throw out_of_range("skip beyond end of string");
+    throw out_of_range("skip beyond end of file");
   }
 }
 
-bool StringReader::skip_if(const void* data, size_t size) {
+bool StreamReader::skip_if(const void* data, size_t size) {
   if ((this->remaining() < size) || memcmp(this->peek(size), data, size)) {
     return false;
   } else {
@@ -1527,96 +3605,73 @@ bool StringReader::skip_if(const void* data, size_t size) {
   }
 }
 
-bool StringReader::eof() const {
+bool StreamReader::eof() const {
   return (this->offset >= this->length);
 }
 
-string StringReader::all() const {
-  return string(reinterpret_cast<const char*>(this->data), this->length);
-}
-
-StringReader StringReader::sub(size_t offset) const {
-  if (offset > this->length) {
-    return StringReader();
-  }
-  return StringReader(
-      reinterpret_cast<const char*>(this->data) + offset,
-      this->length - offset);
-}
-
-StringReader StringReader::sub(size_t offset, size_t size) const {
+StringReader StreamReader::sub(size_t offset, size_t size) {
   if (offset >= this->length) {
     return StringReader();
   }
-  if (offset + size > this->length) {
-    return StringReader(
-        reinterpret_cast<const char*>(this->data) + offset,
-        this->length - offset);
-  }
-  return StringReader(reinterpret_cast<const char*>(this->data) + offset, size);
-}
-
-StringReader StringReader::subx(size_t offset) const {
-  if (offset > this->length) {
-    throw out_of_range("sub-reader begins beyond end of data");
-  }
-  return StringReader(
-      reinterpret_cast<const char*>(this->data) + offset,
-      this->length - offset);
+  return StringReader(make_shared<string>(this->pread(offset, size)));
 }
 
-StringReader StringReader::subx(size_t offset, size_t size) const {
+StringReader StreamReader::subx(size_t offset, size_t size) {
   if (offset + size > this->length) {
     throw out_of_range("sub-reader begins or extends beyond end of data");
   }
-  return StringReader(reinterpret_cast<const char*>(this->data) + offset, size);
+  return StringReader(make_shared<string>(this->preadx(offset, size)));
 }
 
-BitReader StringReader::sub_bits(size_t offset) const {
-  if (offset > this->length) {
-    return BitReader();
+void StreamReader::read_from_file(size_t offset, void* data, size_t size) {
+#ifndef PHOSG_WINDOWS
+  if (this->fd >= 0) {
+    phosg::preadx(this->fd, data, size, offset);
+    return;
   }
-  return BitReader(
-      reinterpret_cast<const char*>(this->data) + offset,
-      (this->length - offset) * 8);
+#endif
+  if (fseek64(this->file.get(), offset, SEEK_SET)) {
+    throw io_error(fileno(this->file.get()));
+  }
+  freadx(this->file.get(), data, size);
 }
 
-BitReader StringReader::sub_bits(size_t offset, size_t size) const {
-  if (offset >= this->length) {
-    return BitReader();
+const uint8_t* StreamReader::window_for(size_t offset, size_t size) {
+  if ((offset > this->length) || (size > this->length - offset)) {
+    throw out_of_range("not enough data to read");
   }
-  if (offset + size > this->length) {
-    return BitReader(
-        reinterpret_cast<const char*>(this->data) + offset,
-        (this->length - offset) * 8);
+  if ((offset >= this->window_offset) &&
+      (offset + size <= this->window_offset + this->window.size())) {
+    return reinterpret_cast<const uint8_t*>(this->window.data()) + (offset - this->window_offset);
   }
-  return BitReader(reinterpret_cast<const char*>(this->data) + offset, size * 8);
-}
 
-BitReader StringReader::subx_bits(size_t offset) const {
-  if (offset > this->length) {
-    throw out_of_range("sub-reader begins beyond end of data");
+  // Refill the window starting at the requested offset. If the request is
+  // larger than the window size, the window grows to fit it; it will be
+  // shrunk again on the next refill.
+  size_t new_size = min<size_t>(max<size_t>(size, this->window_size), this->length - offset);
+  this->window.resize(new_size);
+  this->window_offset = offset;
+  try {
+    this->read_from_file(offset, this->window.data(), new_size);
+  } catch (...) {
+    this->window.clear();
+    throw;
   }
-  return BitReader(
-      reinterpret_cast<const char*>(this->data) + offset,
-      (this->length - offset) * 8);
+  if (this->window.capacity() > 2 * this->window_size && new_size <= this->window_size) {
+    this->window.shrink_to_fit();
+  }
+  return reinterpret_cast<const uint8_t*>(this->window.data());
 }
 
-BitReader StringReader::subx_bits(size_t offset, size_t size) const {
-  if (offset + size > this->length) {
-    throw out_of_range("sub-reader begins or extends beyond end of data");
-  }
-  return BitReader(reinterpret_cast<const char*>(this->data) + offset, size * 8);
+const void* StreamReader::pgetv(size_t offset, size_t size) {
+  return this->window_for(offset, size);
 }
 
-const char* StringReader::peek(size_t size) {
-  if (this->offset + size <= this->length) {
-    return reinterpret_cast<const char*>(this->data + this->offset);
-  }
-  throw out_of_range("not enough data to read");
+const char* StreamReader::peek(size_t size) {
+  return reinterpret_cast<const char*>(this->window_for(this->offset, size));
 }
 
-string StringReader::read(size_t size, bool advance) {
+string StreamReader::read(size_t size, bool advance) {
   string ret = this->pread(this->offset, size);
   if (ret.size() && advance) {
     this->offset += ret.size();
@@ -1624,7 +3679,7 @@ string StringReader::read(size_t size, bool advance) {
   return ret;
 }
 
-string StringReader::readx(size_t size, bool advance) {
+string StreamReader::readx(size_t size, bool advance) {
   string ret = this->preadx(this->offset, size);
   if (advance) {
     this->offset += ret.size();
@@ -1632,7 +3687,7 @@ string StringReader::readx(size_t size, bool advance) {
   return ret;
 }
 
-size_t StringReader::read(void* data, size_t size, bool advance) {
+size_t StreamReader::read(void* data, size_t size, bool advance) {
   size_t ret = this->pread(this->offset, data, size);
   if (ret && advance) {
     this->offset += ret;
@@ -1640,56 +3695,98 @@ size_t StringReader::read(void* data, size_t size, bool advance) {
   return ret;
 }
 
-void StringReader::readx(void* data, size_t size, bool advance) {
+void StreamReader::readx(void* data, size_t size, bool advance) {
   this->preadx(this->offset, data, size);
   if (advance) {
     this->offset += size;
   }
 }
 
-string StringReader::pread(size_t offset, size_t size) const {
+string StreamReader::pread(size_t offset, size_t size) {
   if (offset >= this->length) {
     return string();
   }
-  if (offset + size > this->length) {
-    return string(reinterpret_cast<const char*>(this->data + offset), this->length - offset);
+  string ret(min<size_t>(size, this->length - offset), '\0');
+  this->preadx(offset, ret.data(), ret.size());
+  return ret;
+}
+
+string StreamReader::preadx(size_t offset, size_t size) {
+  string ret(size, '\0');
+  this->preadx(offset, ret.data(), size);
+  return ret;
+}
+
+size_t StreamReader::pread(size_t offset, void* data, size_t size) {
+  if (offset >= this->length) {
+    return 0;
   }
-  return string(reinterpret_cast<const char*>(this->data + offset), size);
+  size_t ret = min<size_t>(size, this->length - offset);
+  this->preadx(offset, data, ret);
+  return ret;
 }
 
-string StringReader::preadx(size_t offset, size_t size) const {
-  if (offset + size > this->length) {
+void StreamReader::preadx(size_t offset, void* data, size_t size) {
+  if ((offset > this->length) || (size > this->length - offset)) {
     throw out_of_range("not enough data to read");
   }
-  return string(reinterpret_cast<const char*>(this->data + offset), size);
+  // Large reads bypass the window entirely so they don't evict it
+  if (size >= this->window_size) {
+    this->read_from_file(offset, data, size);
+  } else {
+    memcpy(data, this->window_for(offset, size), size);
+  }
 }
 
-size_t StringReader::pread(size_t offset, void* data, size_t size) const {
+uint64_t StreamReader::get_uleb128(bool advance) {
+  size_t size;
+  uint64_t ret = this->pget_uleb128(this->offset, &size);
+  if (advance) {
+    this->offset += size;
+  }
+  return ret;
+}
+
+uint64_t StreamReader::pget_uleb128(size_t offset, size_t* size) {
   if (offset >= this->length) {
-    return 0;
+    throw out_of_range("end of file");
   }
+  // Only ask for as much data as the longest possible value, so this doesn't
+  // refill the window more often than necessary
+  size_t available = min<size_t>(MAX_ULEB128_SIZE, this->length - offset);
+  uint64_t ret;
+  size_t bytes = decode_uleb128(&ret, this->window_for(offset, available), available);
+  if (size) {
+    *size = bytes;
+  }
+  return ret;
+}
 
-  size_t ret;
-  if (offset + size > this->length) {
-    memcpy(data, this->data + offset, this->length - offset);
-    ret = this->length - offset;
-  } else {
-    memcpy(data, this->data + offset, size);
-    ret = size;
+uint64_t StreamReader::get_prefix_varint(bool advance) {
+  size_t size;
+  uint64_t ret = this->pget_prefix_varint(this->offset, &size);
+  if (advance) {
+    this->offset += size;
   }
   return ret;
 }
 
-void StringReader::preadx(size_t offset, void* data, size_t size) const {
-  if ((offset >= this->length) || (offset + size > this->length)) {
-    throw out_of_range("not enough data to read");
+uint64_t StreamReader::pget_prefix_varint(size_t offset, size_t* size) {
+  if (offset >= this->length) {
+    throw out_of_range("end of file");
   }
-  memcpy(data, this->data + offset, size);
+  size_t available = min<size_t>(MAX_PREFIX_VARINT_SIZE, this->length - offset);
+  uint64_t ret;
+  size_t bytes = decode_prefix_varint(&ret, this->window_for(offset, available), available);
+  if (size) {
+    *size = bytes;
+  }
+  return ret;
 }
 
-string StringReader::get_line(bool advance) {
+string StreamReader::get_line(bool advance) {
   if (this->eof()) {
-    throw out_of_range("end of string");
+    throw out_of_range("end of file");
   }
 
   string ret;
@@ -1698,7 +3795,7 @@ string StringReader::get_line(bool advance) {
     if (ch_offset >= this->length) {
       break;
     }
-    uint8_t ch = this->pget_s8(ch_offset);
+    uint8_t ch = this->pget_u8(ch_offset);
     if (ch != '\n') {
       ret += ch;
     } else {
@@ -1714,7 +3811,7 @@ string StringReader::get_line(bool advance) {
   return ret;
 }
 
-string StringReader::get_cstr(bool advance) {
+string StreamReader::get_cstr(bool advance) {
   string ret = this->pget_cstr(this->offset);
   if (advance) {
     this->offset += (ret.size() + 1);
@@ -1722,10 +3819,10 @@ string StringReader::get_cstr(bool advance) {
   return ret;
 }
 
-string StringReader::pget_cstr(size_t offset) const {
+string StreamReader::pget_cstr(size_t offset) {
   string ret;
   for (;;) {
-    uint8_t ch = this->pget_s8(offset + ret.size());
+    uint8_t ch = this->pget_u8(offset + ret.size());
     if (ch != 0) {
       ret += ch;
     } else {
@@ -1747,10 +3844,54 @@ void StringWriter::write(const string& data) {
   this->contents.append(data);
 }
 
+// For each stride that count_zeroes handles in blocks, 0xFF in each byte
+// whose offset is a multiple of the stride, and 0 in all other bytes
+static const uint8_t count_zeroes_lane_masks[4][0x10] = {
+    {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
+    {0xFF, 0x00, 0xFF, 0x00, 0xFF, 0x00, 0xFF, 0x00, 0xFF, 0x00, 0xFF, 0x00, 0xFF, 0x00, 0xFF, 0x00},
+    {0xFF, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0x00},
+    {0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+};
+
+// Returns a word with the high bit of each byte set if that byte is zero
+static inline uint64_t zero_byte_high_bits(uint64_t v) {
+  return ~(((v & 0x7F7F7F7F7F7F7F7F) + 0x7F7F7F7F7F7F7F7F) | v) & 0x8080808080808080;
+}
+
 size_t count_zeroes(const void* vdata, size_t size, size_t stride) {
   const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
   size_t zero_count = 0;
-  for (size_t z = 0; z < size; z += stride) {
+  size_t z = 0;
+
+  // For strides of 1, 2, 4, and 8, the counted bytes are at the same offsets
+  // in every 16-byte block, so we can check entire blocks at once and ignore
+  // the bytes that aren't counted
+  int lane_mask_index = (stride == 1) ? 0 : (stride == 2) ? 1 : (stride == 4) ? 2 : (stride == 8) ? 3 : -1;
+  if (lane_mask_index >= 0) {
+    const uint8_t* lane_mask_data = count_zeroes_lane_masks[lane_mask_index];
+    size_t blocks_end = size & ~static_cast<size_t>(0x0F);
+#ifdef PHOSG_HAVE_BYTE_VEC
+    ByteVec lane_mask = byte_vec_load(lane_mask_data);
+    while (z < blocks_end) {
+      // Each byte of counts counts the zeroes in its lane, so it has to be
+      // added to the total before it can overflow
+      size_t batch_end = min<size_t>(blocks_end, z + 0xFF * 0x10);
+      ByteVec counts = byte_vec_zero();
+      for (; z < batch_end; z += 0x10) {
+        // Zero bytes compare as 0xFF (-1), so subtracting adds 1 to the count
+        counts = byte_vec_sub(counts, byte_vec_eq(byte_vec_load(data + z), 0));
+      }
+      zero_count += byte_vec_sum(byte_vec_and(counts, lane_mask));
+    }
+#else
+    uint64_t lane_mask = load_u64(lane_mask_data) & 0x8080808080808080;
+    for (; z < blocks_end; z += 8) {
+      zero_count += popcount(zero_byte_high_bits(load_u64(data + z)) & lane_mask);
+    }
+#endif
+  }
+
+  for (; z < size; z += stride) {
     if (data[z] == 0) {
       zero_count++;
     }
@@ -1758,6 +3899,130 @@ size_t count_zeroes(const void* vdata, size_t size, size_t stride) {
   return zero_count;
 }
 
+size_t find_first_nonzero(const void* vdata, size_t size) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  size_t z = 0;
+#ifdef PHOSG_HAVE_BYTE_VEC
+  // Skip zero data 64 bytes at a time, then find the nonzero byte within the
+  // 64-byte block that contains it
+  for (; z + 0x40 <= size; z += 0x40) {
+    ByteVec any = byte_vec_or(
+        byte_vec_or(byte_vec_load(data + z), byte_vec_load(data + z + 0x10)),
+        byte_vec_or(byte_vec_load(data + z + 0x20), byte_vec_load(data + z + 0x30)));
+    if (byte_vec_mask(byte_vec_eq(any, 0)) != 0xFFFF) {
+      break;
+    }
+  }
+  for (; z + 0x10 <= size; z += 0x10) {
+    uint16_t nonzero = ~byte_vec_mask(byte_vec_eq(byte_vec_load(data + z), 0));
+    if (nonzero) {
+      return z + countr_zero(nonzero);
+    }
+  }
+#else
+  for (; (z + 8 <= size) && (load_u64(data + z) == 0); z += 8) {
+  }
+#endif
+  for (; z < size; z++) {
+    if (data[z]) {
+      return z;
+    }
+  }
+  return size;
+}
+
+array<uint64_t, 0x100> byte_histogram(const void* vdata, size_t size) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+
+  // Incrementing the same counter for consecutive bytes serializes the
+  // increments (each must wait for the previous store), which is slow for
+  // runs of the same value, so we spread the bytes across four tables. The
+  // 32-bit counters are added to the result before they can overflow. (With
+  // a 32-bit size_t, they can't overflow at all.)
+  static constexpr size_t MAX_BATCH_SIZE = static_cast<size_t>(min<uint64_t>(0x100000000, SIZE_MAX));
+  array<uint64_t, 0x100> ret{};
+  uint32_t counts[4][0x100];
+  for (size_t z = 0; z < size;) {
+    memset(counts, 0, sizeof(counts));
+    size_t batch_end = z + min<size_t>(size - z, MAX_BATCH_SIZE);
+    for (; z + 8 <= batch_end; z += 8) {
+      uint64_t v = load_u64(data + z);
+      counts[0][v & 0xFF]++;
+      counts[1][(v >> 8) & 0xFF]++;
+      counts[2][(v >> 16) & 0xFF]++;
+      counts[3][(v >> 24) & 0xFF]++;
+      counts[0][(v >> 32) & 0xFF]++;
+      counts[1][(v >> 40) & 0xFF]++;
+      counts[2][(v >> 48) & 0xFF]++;
+      counts[3][v >> 56]++;
+    }
+    for (; z < batch_end; z++) {
+      counts[0][data[z]]++;
+    }
+    for (size_t x = 0; x < 0x100; x++) {
+      ret[x] += static_cast<uint64_t>(counts[0][x]) + counts[1][x] + counts[2][x] + counts[3][x];
+    }
+  }
+  return ret;
+}
+
+double shannon_entropy(const array<uint64_t, 0x100>& histogram) {
+  uint64_t total = 0;
+  for (uint64_t count : histogram) {
+    total += count;
+  }
+  if (total == 0) {
+    return 0.0;
+  }
+  double ret = 0.0;
+  for (uint64_t count : histogram) {
+    if (count) {
+      double p = static_cast<double>(count) / total;
+      ret -= p * log2(p);
+    }
+  }
+  return ret;
+}
+
+double shannon_entropy(const void* data, size_t size) {
+  return shannon_entropy(byte_histogram(data, size));
+}
+
+vector<double> windowed_shannon_entropy(const void* vdata, size_t size, size_t window_size) {
+  if (window_size == 0) {
+    throw invalid_argument("window size must be nonzero");
+  }
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+
+  // For a window of N bytes in which byte value i appears c[i] times, the
+  // entropy is log2(N) - (sum of c[i] * log2(c[i])) / N, so we precompute
+  // c * log2(c) for all possible counts instead of calling log2 for each value
+  // in each window. No count can be larger than the data, even if the window
+  // is.
+  size_t max_count = min<size_t>(window_size, size);
+  vector<double> c_log_c(max_count + 1, 0.0);
+  for (size_t c = 2; c <= max_count; c++) {
+    c_log_c[c] = c * log2(static_cast<double>(c));
+  }
+
+  vector<double> ret;
+  ret.reserve((size + window_size - 1) / window_size);
+  vector<uint32_t> counts(0x100);
+  for (size_t offset = 0; offset < size; offset += window_size) {
+    size_t n = min<size_t>(window_size, size - offset);
+    fill(counts.begin(), counts.end(), 0);
+    for (size_t z = 0; z < n; z++) {
+      counts[data[offset + z]]++;
+    }
+    double sum = 0.0;
+    for (uint32_t count : counts) {
+      sum += c_log_c[count];
+    }
+    ret.emplace_back(log2(static_cast<double>(n)) - sum / n);
+  }
+  return ret;
+}
+
 void BlockStringWriter::write(const void* data, size_t size) {
   this->blocks.emplace_back(reinterpret_cast<const char*>(data), size);
 }
@@ -1774,4 +4039,124 @@ string BlockStringWriter::close(const char* separator) {
   return join(this->blocks, separator);
 }
 
+// Copied writes smaller than this are coalesced into shared owned blocks
+static constexpr size_t IOVEC_WRITER_MIN_BLOCK_SIZE = 0x1000;
+
+void IovecWriter::reset() {
+  this->blocks.clear();
+  this->total_size = 0;
+}
+
+void IovecWriter::write(const void* data, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  // Append to the last block only if it's owned and has enough spare capacity
+  // for the new data; we never reallocate an existing block, since it may be
+  // large (e.g. if it was moved in by the caller)
+  if (this->blocks.empty() || this->blocks.back().ref_data ||
+      (this->blocks.back().owned.capacity() - this->blocks.back().owned.size() < size)) {
+    auto& block = this->blocks.emplace_back();
+    block.owned.reserve(max<size_t>(size, IOVEC_WRITER_MIN_BLOCK_SIZE));
+  }
+  this->blocks.back().owned.append(reinterpret_cast<const char*>(data), size);
+  this->total_size += size;
+}
+
+void IovecWriter::write(const string& data) {
+  this->write(data.data(), data.size());
+}
+
+void IovecWriter::write(string&& data) {
+  if (data.size() < IOVEC_WRITER_MIN_BLOCK_SIZE) {
+    this->write(data.data(), data.size());
+  } else {
+    this->total_size += data.size();
+    this->blocks.emplace_back().owned = std::move(data);
+  }
+}
+
+void IovecWriter::write_ref(const void* data, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  auto& block = this->blocks.emplace_back();
+  block.ref_data = data;
+  block.ref_size = size;
+  this->total_size += size;
+}
+
+void IovecWriter::write_ref(const string& data) {
+  this->write_ref(data.data(), data.size());
+}
+
+vector<struct iovec> IovecWriter::iovs() const {
+  vector<struct iovec> ret;
+  ret.reserve(this->blocks.size());
+  for (const auto& block : this->blocks) {
+    auto& iov = ret.emplace_back();
+    if (block.ref_data) {
+      iov.iov_base = const_cast<void*>(block.ref_data);
+      iov.iov_len = block.ref_size;
+    } else {
+      iov.iov_base = const_cast<char*>(block.owned.data());
+      iov.iov_len = block.owned.size();
+    }
+  }
+  return ret;
+}
+
+string IovecWriter::str() const {
+  string ret;
+  ret.reserve(this->total_size);
+  for (const auto& block : this->blocks) {
+    if (block.ref_data) {
+      ret.append(reinterpret_cast<const char*>(block.ref_data), block.ref_size);
+    } else {
+      ret.append(block.owned);
+    }
+  }
+  return ret;
+}
+
+void IovecWriter::write_to(FILE* f) const {
+  for (const auto& iov : this->iovs()) {
+    fwritex(f, iov.iov_base, iov.iov_len);
+  }
+}
+
+#ifndef PHOSG_WINDOWS
+void IovecWriter::write_to(int fd) const {
+  static const size_t max_iovs_per_call = []() -> size_t {
+    long ret = sysconf(_SC_IOV_MAX);
+    return (ret > 0) ? ret : 16;
+  }();
+
+  auto iovs = this->iovs();
+  size_t index = 0;
+  while (index < iovs.size()) {
+    size_t count = min<size_t>(iovs.size() - index, max_iovs_per_call);
+    ssize_t bytes_written = ::writev(fd, &iovs[index], count);
+    if (bytes_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw io_error(fd);
+    }
+
+    // Skip the iovecs that were completely written, and adjust the first one
+    // that wasn't (if any) so we'll write only its remaining data next time
+    size_t remaining_bytes = bytes_written;
+    while ((index < iovs.size()) && (remaining_bytes >= iovs[index].iov_len)) {
+      remaining_bytes -= iovs[index].iov_len;
+      index++;
+    }
+    if (remaining_bytes) {
+      iovs[index].iov_base = reinterpret_cast<uint8_t*>(iovs[index].iov_base) + remaining_bytes;
+      iovs[index].iov_len -= remaining_bytes;
+    }
+  }
+}
+#endif
+
 } // namespace phosg
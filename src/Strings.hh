@@ -5,10 +5,18 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include <array>
+#include <atomic>
 #include <deque>
+#include <format>
+#include <iterator>
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "Encoding.hh"
@@ -34,11 +42,99 @@ void fwrite_fmt(FILE* f, std::format_string<ArgTs...> fmt, ArgTs&&... args) {
 
 std::unique_ptr<void, void (*)(void*)> malloc_unique(size_t size);
 
-std::string toupper(const std::string& s);
-std::string tolower(const std::string& s);
+// These only convert ASCII letters; all other bytes are unchanged
+std::string toupper(std::string_view s);
+std::string tolower(std::string_view s);
+void toupper_inplace(std::string& s);
+void tolower_inplace(std::string& s);
 
 std::string str_replace_all(const std::string& s, const char* target, const char* replacement);
 
+// Finds occurrences of any of a set of patterns in a single pass over the
+// input, using an Aho-Corasick automaton. Building the automaton takes time
+// proportional to the total length of the patterns; after that, each search
+// takes time proportional to the length of the input (plus the number of
+// matches, for find_all), regardless of how many patterns there are. Build a
+// matcher once and reuse it for many inputs; a matcher is immutable after
+// construction, so it can be used from multiple threads at once.
+//
+// find and replace_all use leftmost-longest semantics: they choose the match
+// that begins earliest in the input, and among matches that begin at the same
+// offset, the longest one. If the same pattern appears more than once in the
+// list, matches refer to its first occurrence. Patterns may not be empty.
+class MultiStringMatcher {
+public:
+  struct Match {
+    size_t offset;
+    size_t size;
+    size_t pattern_index;
+  };
+
+  explicit MultiStringMatcher(const std::vector<std::string>& patterns);
+  MultiStringMatcher(const MultiStringMatcher&) = default;
+  MultiStringMatcher(MultiStringMatcher&&) = default;
+  MultiStringMatcher& operator=(const MultiStringMatcher&) = default;
+  MultiStringMatcher& operator=(MultiStringMatcher&&) = default;
+  ~MultiStringMatcher() = default;
+
+  inline size_t num_patterns() const {
+    return this->patterns.size();
+  }
+  inline const std::string& pattern(size_t index) const {
+    return this->patterns.at(index);
+  }
+
+  // Returns the leftmost-longest match that begins at or after start_offset.
+  // If there is no match, the returned Match's offset is std::string::npos.
+  Match find(std::string_view s, size_t start_offset = 0) const;
+  // Returns true if any pattern occurs anywhere in s
+  bool contains_any(std::string_view s) const;
+  // Returns all matches of all patterns, including overlapping ones, ordered
+  // by end offset (and by decreasing size for matches with the same end)
+  std::vector<Match> find_all(std::string_view s) const;
+  // Returns non-overlapping leftmost-longest matches in order; these are the
+  // matches that replace_all replaces
+  std::vector<Match> find_all_non_overlapping(std::string_view s) const;
+
+  // Replaces each non-overlapping match with the corresponding entry in
+  // replacements, which must have the same length as the pattern list.
+  // Replacement text is not rescanned for further matches.
+  std::string replace_all(std::string_view s, const std::vector<std::string>& replacements) const;
+
+private:
+  std::vector<std::string> patterns;
+  // Bytes that don't appear in any pattern all map to class 0, so the
+  // transition table only needs one column per distinct pattern byte
+  uint16_t byte_class[0x100];
+  size_t num_classes;
+  // Full DFA transition table (num_nodes * num_classes entries); node 0 is the
+  // root of the trie
+  std::vector<uint32_t> transitions;
+  struct Node {
+    uint32_t depth;
+    // Nearest proper suffix node (via failure links) that is the end of a
+    // pattern, or 0 if there is none
+    uint32_t output_link;
+    // Index of the pattern that ends at this node, or SIZE_MAX if none does
+    size_t pattern_index;
+  };
+  std::vector<Node> nodes;
+
+  inline uint32_t next_node(uint32_t node, uint8_t ch) const {
+    return this->transitions[node * this->num_classes + this->byte_class[ch]];
+  }
+  // Returns the node of the longest pattern that ends at node, or 0
+  inline uint32_t longest_output(uint32_t node) const {
+    return (this->nodes[node].pattern_index != SIZE_MAX) ? node : this->nodes[node].output_link;
+  }
+};
+
+// Replaces all occurrences of each target with its replacement in a single
+// pass (with the same semantics as MultiStringMatcher::replace_all). This
+// builds a new matcher on each call; for repeated replacements with the same
+// targets, construct a MultiStringMatcher once and use it instead.
+std::string str_replace_all(const std::string& s, const std::vector<std::pair<std::string, std::string>>& replacements);
+
 template <typename StrT>
 void strip_trailing_zeroes(StrT& s) {
   size_t index = s.find_last_not_of('\0');
@@ -49,42 +145,37 @@ void strip_trailing_zeroes(StrT& s) {
   }
 }
 
+// Return the number of spaces, tabs, CRs, and LFs at the beginning or end of
+// the given data
+size_t count_leading_whitespace(const char* data, size_t size);
+size_t count_trailing_whitespace(const char* data, size_t size);
+
+// These work on std::string (in place, without reallocating) and on
+// std::string_view (by shrinking the view)
 template <typename StrT>
 void strip_trailing_whitespace(StrT& s) {
-  size_t index = s.find_last_not_of(" \t\r\n");
-  if (index != StrT::npos) {
-    s.resize(index + 1);
-  } else if (!s.empty() &&
-      ((s[0] == ' ') || (s[0] == '\t') || (s[0] == '\r') || (s[0] == '\n'))) {
-    s.resize(0); // String is entirely whitespace
+  size_t count = count_trailing_whitespace(s.data(), s.size());
+  if constexpr (std::is_same_v<StrT, std::string_view>) {
+    s.remove_suffix(count);
+  } else {
+    s.resize(s.size() - count);
   }
 }
 
 template <typename StrT>
 void strip_leading_whitespace(StrT& s) {
-  size_t index = s.find_first_not_of(" \t\r\n");
-  if (index != StrT::npos) {
-    s = s.substr(index);
-  } else if (!s.empty() &&
-      ((s[0] == ' ') || (s[0] == '\t') || (s[0] == '\r') || (s[0] == '\n'))) {
-    s.resize(0); // String is entirely whitespace
+  size_t count = count_leading_whitespace(s.data(), s.size());
+  if constexpr (std::is_same_v<StrT, std::string_view>) {
+    s.remove_prefix(count);
+  } else {
+    s.erase(0, count);
   }
 }
 
 template <typename StrT>
 void strip_whitespace(StrT& s) {
-  size_t start_index = s.find_first_not_of(" \t\r\n");
-  size_t end_index = s.find_last_not_of(" \t\r\n");
-  if (start_index != StrT::npos && end_index != StrT::npos) {
-    if (start_index) {
-      s = s.substr(start_index, end_index - start_index + 1);
-    } else {
-      s.resize(end_index + 1);
-    }
-  } else if (!s.empty() &&
-      ((s[0] == ' ') || (s[0] == '\t') || (s[0] == '\r') || (s[0] == '\n'))) {
-    s.resize(0); // String is entirely whitespace
-  }
+  strip_trailing_whitespace(s);
+  strip_leading_whitespace(s);
 }
 
 enum StripCommentsFlag : uint8_t {
@@ -171,14 +262,14 @@ void strip_comments_inplace(StrT& s, uint8_t flags = StripCommentsFlag::DEFAULT)
   s.resize(write_offset);
 }
 
-std::string escape_quotes(const std::string& s);
-std::string escape_controls(const std::string& s, bool escape_non_ascii);
-std::string escape_url(const std::string& s, bool escape_slash = false);
+std::string escape_quotes(std::string_view s);
+std::string escape_controls(std::string_view s, bool escape_non_ascii);
+std::string escape_url(std::string_view s, bool escape_slash = false);
 
-inline std::string escape_controls_ascii(const std::string& s) {
+inline std::string escape_controls_ascii(std::string_view s) {
   return escape_controls(s, true);
 }
-inline std::string escape_controls_utf8(const std::string& s) {
+inline std::string escape_controls_utf8(std::string_view s) {
   return escape_controls(s, false);
 }
 
@@ -212,17 +303,210 @@ inline bool should_log(LogLevel incoming_level) {
 
 void print_log_prefix(FILE* stream, LogLevel level);
 
+// Asynchronous logging. When enabled, log_f and PrefixedLogger::log_f format
+// each line into a thread-local buffer and append it to a per-thread
+// lock-free ring buffer instead of writing it to stderr. A background thread
+// collects lines from all threads' buffers and writes them to the output
+// stream in large batches. Lines from the same thread are always written in
+// order, but lines from different threads logged at about the same time may
+// be written in a different order than they were logged.
+enum class AsyncLogOverflowPolicy {
+  // If a thread's buffer is full, wait for the writer thread to make space
+  BLOCK = 0,
+  // If a thread's buffer is full, discard the line (the number of discarded
+  // lines can be retrieved with async_log_dropped_line_count)
+  DROP,
+};
+
+struct AsyncLogOptions {
+  FILE* stream = stderr;
+  // Size of each thread's buffer; rounded up to a power of two. Lines longer
+  // than this are written synchronously (in BLOCK mode) or dropped (in DROP
+  // mode).
+  size_t buffer_size = 0x10000;
+  AsyncLogOverflowPolicy overflow_policy = AsyncLogOverflowPolicy::BLOCK;
+  // Maximum time a line may wait in a buffer before being written
+  uint64_t flush_interval_usecs = 10000;
+  // If true, the log is written in a binary format instead of as text, and
+  // deferred log lines (see log_deferred_f) are not formatted at all. Use
+  // BinaryLogDecoder or the decode-log tool to convert the log to text.
+  bool binary_output = false;
+};
+
+// Starts the writer thread; has no effect if async logging is already enabled.
+// disable_async_logging is called automatically at exit, but it's best to call
+// it explicitly when no other threads are logging, since lines logged during
+// or after it is called may not be written.
+void enable_async_logging(const AsyncLogOptions& options = AsyncLogOptions());
+void disable_async_logging();
+// Writes all lines currently buffered by all threads, and returns when they
+// have been written.
+void flush_async_log();
+size_t async_log_dropped_line_count();
+
+namespace AsyncLog {
+extern std::atomic<bool> enabled;
+
+// Each thread's buffer contains a sequence of records, each of which begins
+// with a RecordHeader. TEXT records contain a complete formatted line;
+// DEFERRED records contain the log prefix string (from PrefixedLogger)
+// followed by the encoded arguments (see encode_arg). In binary output,
+// format_key in DEFERRED records refers to a previous FORMAT record, which
+// contains the format string; in memory, format_key is a pointer to the
+// format string.
+enum class RecordType : uint8_t {
+  TEXT = 1,
+  FORMAT = 2,
+  DEFERRED = 3,
+};
+
+enum class ArgType : uint8_t {
+  INT = 1, // int64_t
+  UINT = 2, // uint64_t
+  FLOAT = 3, // float
+  DOUBLE = 4, // double
+  BOOL = 5, // uint8_t
+  CHAR = 6, // char
+  POINTER = 7, // uint64_t
+  STRING = 8, // uint32_t size, then data
+};
+
+struct RecordHeader {
+  uint32_t size; // Including this header
+  RecordType type;
+  LogLevel level;
+  uint8_t num_args;
+  uint8_t unused;
+  uint64_t timestamp_usecs;
+  uint64_t format_key;
+  uint32_t format_size;
+  uint32_t prefix_size;
+} __attribute__((packed));
+
+static constexpr size_t MAX_DEFERRED_ARGS = 16;
+
+// Returns the calling thread's record buffer, containing a TEXT record header
+// and the log prefix for level followed by prefix (if given)
+std::string& begin_line(LogLevel level, const std::string* prefix = nullptr);
+// Appends a newline to the line and submits it to the writer thread
+void commit_line(std::string& line);
+// Returns the calling thread's record buffer, containing a DEFERRED record
+// header and prefix (if given). The caller must append exactly num_args
+// arguments with encode_arg, then call commit_record.
+std::string& begin_deferred(LogLevel level, std::string_view fmt, const std::string* prefix, size_t num_args);
+// Submits a record to the writer thread
+void commit_record(std::string& record);
+
+template <typename T>
+void encode_arg(std::string& record, const T& value) {
+  using U = std::remove_cvref_t<T>;
+  auto put = [&](ArgType type, const void* data, size_t size) -> void {
+    record.push_back(static_cast<char>(type));
+    record.append(reinterpret_cast<const char*>(data), size);
+  };
+  if constexpr (std::is_same_v<U, bool>) {
+    uint8_t v = value;
+    put(ArgType::BOOL, &v, sizeof(v));
+  } else if constexpr (std::is_same_v<U, char>) {
+    put(ArgType::CHAR, &value, sizeof(value));
+  } else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+    int64_t v = value;
+    put(ArgType::INT, &v, sizeof(v));
+  } else if constexpr (std::is_integral_v<U>) {
+    uint64_t v = value;
+    put(ArgType::UINT, &v, sizeof(v));
+  } else if constexpr (std::is_same_v<U, float>) {
+    put(ArgType::FLOAT, &value, sizeof(value));
+  } else if constexpr (std::is_floating_point_v<U>) {
+    double v = value;
+    put(ArgType::DOUBLE, &v, sizeof(v));
+  } else if constexpr (std::is_convertible_v<const U&, std::string_view>) {
+    std::string_view v = value;
+    uint32_t size = v.size();
+    put(ArgType::STRING, &size, sizeof(size));
+    record.append(v);
+  } else if constexpr (std::is_null_pointer_v<U>) {
+    uint64_t v = 0;
+    put(ArgType::POINTER, &v, sizeof(v));
+  } else if constexpr (std::is_pointer_v<U>) {
+    uint64_t v = reinterpret_cast<uintptr_t>(value);
+    put(ArgType::POINTER, &v, sizeof(v));
+  } else {
+    static_assert(std::is_void_v<T>, "this argument type is not supported by deferred logging; use log_f instead");
+  }
+}
+
+// fmt must have static storage duration (which it does if it came from a
+// std::format_string)
+template <typename... ArgTs>
+void write_deferred(LogLevel level, const std::string* prefix, std::string_view fmt, const ArgTs&... args) {
+  static_assert(sizeof...(ArgTs) <= MAX_DEFERRED_ARGS, "too many arguments for deferred logging");
+  std::string& record = begin_deferred(level, fmt, prefix, sizeof...(ArgTs));
+  (encode_arg(record, args), ...);
+  commit_record(record);
+}
+} // namespace AsyncLog
+
+inline bool async_logging_enabled() {
+  return AsyncLog::enabled.load(std::memory_order_acquire);
+}
+
 template <LogLevel Level, typename... ArgTs>
 bool log_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) {
   if (!should_log(Level, log_level())) {
     return false;
   }
+  if (async_logging_enabled()) {
+    std::string& line = AsyncLog::begin_line(Level);
+    std::format_to(std::back_inserter(line), fmt, std::forward<ArgTs>(args)...);
+    AsyncLog::commit_line(line);
+    return true;
+  }
   print_log_prefix(stderr, Level);
   fwrite_fmt(stderr, fmt, std::forward<ArgTs>(args)...);
   fputc('\n', stderr);
   return true;
 }
 
+// Like log_f, but when async logging is enabled, the arguments are copied into
+// the calling thread's log buffer in binary form, and formatting is done later
+// on the writer thread (or offline by decode-log, if binary_output is
+// enabled). Only arguments of basic types are supported: integers,
+// floating-point numbers, bools, chars, void pointers, and strings; there may
+// be at most 16 arguments. Format specs with dynamic width or precision (e.g.
+// "{:{}}") are not supported. When async logging is disabled, this behaves
+// exactly like log_f.
+template <LogLevel Level, typename... ArgTs>
+bool log_deferred_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) {
+  if (!should_log(Level, log_level())) {
+    return false;
+  }
+  if (async_logging_enabled()) {
+    AsyncLog::write_deferred(Level, nullptr, fmt.get(), args...);
+    return true;
+  }
+  return log_f<Level>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+}
+
+// Decodes logs written by the async logging backend with binary_output
+// enabled into the same text that would have been written without it.
+class BinaryLogDecoder {
+public:
+  BinaryLogDecoder() = default;
+  ~BinaryLogDecoder() = default;
+
+  // Decodes as many complete records as possible from the beginning of data,
+  // appends the resulting text to out, and returns the number of bytes
+  // consumed. To decode a stream in pieces, call this again with the
+  // unconsumed data followed by more data.
+  size_t decode(const void* data, size_t size, std::string& out);
+
+private:
+  bool header_parsed = false;
+  pid_t pid = 0;
+  std::unordered_map<uint64_t, std::string> formats;
+};
+
 template <typename... ArgTs>
 bool log_debug_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) {
   return log_f<LogLevel::L_DEBUG>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
@@ -239,6 +523,22 @@ template <typename... ArgTs>
 bool log_error_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) {
   return log_f<LogLevel::L_ERROR>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
 }
+template <typename... ArgTs>
+bool log_debug_deferred_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) {
+  return log_deferred_f<LogLevel::L_DEBUG>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+}
+template <typename... ArgTs>
+bool log_info_deferred_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) {
+  return log_deferred_f<LogLevel::L_INFO>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+}
+template <typename... ArgTs>
+bool log_warning_deferred_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) {
+  return log_deferred_f<LogLevel::L_WARNING>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+}
+template <typename... ArgTs>
+bool log_error_deferred_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) {
+  return log_deferred_f<LogLevel::L_ERROR>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+}
 
 struct PrefixedLogger {
   std::string prefix;
@@ -261,6 +561,12 @@ struct PrefixedLogger {
     if (!this->should_log(Level)) {
       return false;
     }
+    if (async_logging_enabled()) {
+      std::string& line = AsyncLog::begin_line(Level, &this->prefix);
+      std::format_to(std::back_inserter(line), fmt, std::forward<ArgTs>(args)...);
+      AsyncLog::commit_line(line);
+      return true;
+    }
     print_log_prefix(stderr, Level);
     fwritex(stderr, this->prefix);
     fwrite_fmt(stderr, fmt, std::forward<ArgTs>(args)...);
@@ -284,6 +590,35 @@ struct PrefixedLogger {
   bool error_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) const {
     return this->log_f<LogLevel::L_ERROR>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
   }
+
+  template <LogLevel Level, typename... ArgTs>
+  bool log_deferred_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) const {
+    if (!this->should_log(Level)) {
+      return false;
+    }
+    if (async_logging_enabled()) {
+      AsyncLog::write_deferred(Level, &this->prefix, fmt.get(), args...);
+      return true;
+    }
+    return this->log_f<Level>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+  }
+
+  template <typename... ArgTs>
+  bool debug_deferred_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) const {
+    return this->log_deferred_f<LogLevel::L_DEBUG>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+  }
+  template <typename... ArgTs>
+  bool info_deferred_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) const {
+    return this->log_deferred_f<LogLevel::L_INFO>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+  }
+  template <typename... ArgTs>
+  bool warning_deferred_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) const {
+    return this->log_deferred_f<LogLevel::L_WARNING>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+  }
+  template <typename... ArgTs>
+  bool error_deferred_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) const {
+    return this->log_deferred_f<LogLevel::L_ERROR>(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+  }
 };
 
 std::vector<std::string> split(const std::string& s, char delim, size_t max_splits = 0);
@@ -320,6 +655,11 @@ size_t skip_word(const std::string& s, size_t offset);
 size_t skip_word(const char* s, size_t offset);
 
 std::string string_for_error(int error);
+// Writes the same string as string_for_error to buf, which must have room for
+// at least STRING_FOR_ERROR_MAX_LENGTH bytes, and returns a pointer to the end
+// of the written string. The string is not null-terminated.
+constexpr size_t STRING_FOR_ERROR_MAX_LENGTH = 0x420;
+char* string_for_error_to(char* buf, int error);
 
 enum class TerminalFormat {
   END = -1,
@@ -371,6 +711,71 @@ enum FormatDataFlags {
   HEX_ONLY = 0x0001,
 };
 
+// Formats data in the same way as format_data, but incrementally: the data
+// may be given in pieces of any size, and lines are formatted as soon as it's
+// known how they should appear. Formatted text is passed to write_data in
+// large blocks, and always by the time finish returns. Because the total size
+// isn't known in advance, the width of the offset column is chosen based on
+// expected_end_address (if given) or start_address, and grows if needed.
+class DataFormatter {
+public:
+  explicit DataFormatter(
+      std::function<void(const void*, size_t)> write_data,
+      uint64_t start_address = 0,
+      uint64_t flags = PrintDataFlags::PRINT_ASCII,
+      uint64_t expected_end_address = 0);
+  DataFormatter(const DataFormatter&) = delete;
+  DataFormatter(DataFormatter&&) = default;
+  DataFormatter& operator=(const DataFormatter&) = delete;
+  DataFormatter& operator=(DataFormatter&&) = default;
+  ~DataFormatter() = default;
+
+  // If prev is given, it must point to size bytes of previous data, which are
+  // compared with data to decide which bytes to highlight (if color is
+  // enabled). If prev is given for any piece of data, it should be given for
+  // all of them; pieces for which it isn't given are not highlighted.
+  void write(const void* data, size_t size, const void* prev = nullptr);
+  void write(const std::string& data);
+  // Formats the last line and passes all remaining formatted text to
+  // write_data. The formatter should not be used after this.
+  void finish();
+
+private:
+  static constexpr size_t OUTPUT_BUFFER_SIZE = 0x10000;
+
+  std::function<void(const void*, size_t)> write_data;
+  uint64_t start_address;
+  // The address of the first byte in line_buf, and the number of bytes in
+  // line_buf that have been filled in (including any bytes before
+  // start_address, which aren't shown). The line in line_buf is only written
+  // when more data follows it or finish is called, since otherwise we don't
+  // know if it's the last line, which is never collapsed.
+  uint64_t line_address;
+  size_t line_fill;
+  uint8_t line_buf[0x10];
+  uint8_t prev_line_buf[0x10];
+  bool has_prev;
+
+  size_t width_digits;
+  bool use_color;
+  bool print_ascii;
+  bool collapse_zero_lines;
+  bool skip_separator;
+  std::string diff_escape;
+  std::string inverse_escape;
+  std::string normal_escape;
+  // The longest line write_line can produce (with every byte highlighted). If
+  // there's less space than this left in output_buffer, it's flushed before
+  // the next line is written.
+  size_t max_line_size;
+
+  std::string output_buffer;
+  size_t output_size;
+
+  void write_line(const uint8_t* line_data, const uint8_t* prev_line_data, size_t valid_end, bool is_last_line);
+  void flush();
+};
+
 void format_data(
     std::function<void(const void*, size_t)> write_data,
     const struct iovec* iovs,
@@ -408,7 +813,11 @@ void print_data(
     const void* prev = nullptr,
     uint64_t flags = PrintDataFlags::PRINT_ASCII);
 
-// Returns true if the data blocks are identical
+// Returns true if the data blocks are identical. Before formatting, the data
+// blocks are compared in large chunks (in parallel, if they're large enough),
+// and chunks that are identical are skipped entirely, so comparing large
+// mostly-identical inputs is fast. If num_threads is 0, the number of threads
+// used is the number of CPU cores in the system.
 bool print_binary_diff(
     FILE* stream,
     const void* data1v,
@@ -417,7 +826,60 @@ bool print_binary_diff(
     size_t size2,
     bool use_color,
     size_t context_lines,
-    uint64_t base_offset = 0);
+    uint64_t base_offset = 0,
+    size_t num_threads = 0);
+
+// An aligned binary diff describes data2 as a sequence of regions, each of
+// which is either copied from data1 (MATCH or MOVED), new in data2 (INSERTED),
+// a replacement for a range of data1 (CHANGED), or a range of data1 that was
+// removed (DELETED; size2 is zero). MOVED regions are matches that appear
+// earlier in data1 than the preceding matched region, so they are out of order
+// with respect to data1.
+struct BinaryDiffRegion {
+  enum class Type {
+    MATCH = 0,
+    MOVED,
+    INSERTED,
+    DELETED,
+    CHANGED,
+  };
+  Type type;
+  size_t offset1;
+  size_t size1;
+  size_t offset2;
+  size_t size2;
+};
+
+// Computes an aligned binary diff using rsync-style block matching: data1 is
+// indexed by the rolling hash of each block_size-aligned block, then data2 is
+// scanned with a rolling hash of the same width, and candidate matches are
+// verified and extended in both directions. This detects insertions and
+// deletions (which shift the remaining data) as well as in-place changes,
+// and runs in roughly linear time, so it's suitable for very large inputs.
+// Regions of data1 or data2 shorter than block_size that differ may not be
+// found as matches, even if they appear elsewhere in the other input.
+std::vector<BinaryDiffRegion> compute_aligned_binary_diff(
+    const void* data1,
+    size_t size1,
+    const void* data2,
+    size_t size2,
+    size_t block_size = 0x40);
+
+// Prints an aligned binary diff, as computed by compute_aligned_binary_diff.
+// Each non-matching region is printed as a header line followed by hex dumps
+// of the removed (-) and added (+) data. Matching regions are not printed,
+// except for up to context_lines lines before and after each differing
+// region. Returns true if the data blocks are identical.
+bool print_aligned_binary_diff(
+    FILE* stream,
+    const void* data1,
+    size_t size1,
+    const void* data2,
+    size_t size2,
+    bool use_color,
+    size_t context_lines,
+    uint64_t base_offset = 0,
+    size_t block_size = 0x40);
 
 std::string format_data(
     const struct iovec* iovs,
@@ -448,10 +910,156 @@ enum ParseDataFlags {
 };
 
 std::string parse_data_string(const std::string& s, std::string* mask = nullptr, uint64_t flags = 0);
+
+// Parses a data string incrementally, so inputs of any size can be parsed in
+// constant memory. The input may be split into chunks at any point (even in
+// the middle of a hex byte, string, comment, or number); the concatenation of
+// the data returned by all calls to parse and finish is the same as what
+// parse_data_string would return for the entire input. Input at the end of a
+// chunk that can't be parsed yet (e.g. a number that may continue in the next
+// chunk) is held until the next call.
+class DataStringParser {
+public:
+  explicit DataStringParser(uint64_t flags = 0);
+  DataStringParser(const DataStringParser&) = default;
+  DataStringParser(DataStringParser&&) = default;
+  DataStringParser& operator=(const DataStringParser&) = default;
+  DataStringParser& operator=(DataStringParser&&) = default;
+  ~DataStringParser() = default;
+
+  // Parses a chunk of input and returns the data produced from it. If mask is
+  // given, it is replaced with the mask for the returned data. A construct
+  // that continues past the end of the chunk (such as a number) is held until
+  // the next chunk; if more than MAX_PENDING_SIZE bytes of it are held, this
+  // throws invalid_argument.
+  std::string parse(std::string_view chunk, std::string* mask = nullptr);
+  // Parses any held input and returns the data produced from it. After this
+  // is called, the parser ignores all further input.
+  std::string finish(std::string* mask = nullptr);
+
+  static constexpr size_t MAX_PENDING_SIZE = 0x1000;
+
+private:
+  friend std::string parse_data_string(const std::string& s, std::string* mask, uint64_t flags);
+  friend class DataStringTemplate;
+
+  // If placeholders is not null, placeholders (see DataStringTemplate) are
+  // recorded there instead of being parsed as data
+  struct Placeholder;
+  std::vector<Placeholder>* placeholders = nullptr;
+
+  bool allow_files;
+  std::string pending;
+  std::string filename;
+  uint8_t chr = 0;
+  bool done = false;
+  bool reading_string = false;
+  bool reading_unicode_string = false;
+  bool reading_comment = false;
+  bool reading_multiline_comment = false;
+  bool reading_high_nybble = true;
+  bool reading_filename = false;
+  bool big_endian = false;
+  bool mask_enabled = true;
+
+  // Parses as much of [in, end) as possible, appending to data (and mask),
+  // and returns a pointer to the first byte that wasn't parsed. If is_final
+  // is true, the buffer must be followed by a null byte, and all of it is
+  // parsed.
+  const char* parse_buffer(const char* in, const char* end, bool is_final, std::string& data, std::string* mask);
+};
+
+// A data string compiled once for rendering many times with different values.
+// In addition to the parse_data_string syntax, the template may contain named
+// placeholders, whose values are given to render:
+//   #{name}, ##{name}, ###{name}, ####{name}: 8/16/32/64-bit integer
+//   %{name}, %%{name}: float or double
+//   {name}: arbitrary bytes (of any length)
+// Integer and floating-point placeholders use the endianness in effect at
+// their position in the template (as changed by $), and all placeholders use
+// the mask state in effect at their position (as changed by ?). The same name
+// may be used more than once. Files (with ALLOW_FILES) are read only once,
+// when the template is compiled. Note that parse_data_string itself does not
+// recognize placeholders.
+class DataStringTemplate {
+public:
+  enum class PlaceholderType {
+    INT = 0,
+    FLOAT,
+    BYTES,
+  };
+
+  // Integer values may be given for integer placeholders, floating-point
+  // values for float placeholders, and strings for byte placeholders. Strings
+  // are not copied, so they must remain valid until render returns.
+  struct Value {
+    template <typename T>
+      requires(std::is_integral_v<T>)
+    Value(T v) : type(PlaceholderType::INT), int_value(static_cast<uint64_t>(v)) {}
+    template <typename T>
+      requires(std::is_floating_point_v<T>)
+    Value(T v) : type(PlaceholderType::FLOAT), float_value(v) {}
+    Value(std::string_view v) : type(PlaceholderType::BYTES), bytes_value(v) {}
+    Value(const std::string& v) : type(PlaceholderType::BYTES), bytes_value(v) {}
+    Value(const char* v) : type(PlaceholderType::BYTES), bytes_value(v) {}
+
+    PlaceholderType type;
+    uint64_t int_value = 0;
+    double float_value = 0.0;
+    std::string_view bytes_value;
+  };
+
+  explicit DataStringTemplate(const std::string& s, uint64_t flags = 0);
+  DataStringTemplate(const DataStringTemplate&) = default;
+  DataStringTemplate(DataStringTemplate&&) = default;
+  DataStringTemplate& operator=(const DataStringTemplate&) = default;
+  DataStringTemplate& operator=(DataStringTemplate&&) = default;
+  ~DataStringTemplate() = default;
+
+  // Returns the placeholder names, in the order in which render expects their
+  // values (the order in which they first appear in the template)
+  inline const std::vector<std::string>& placeholder_names() const {
+    return this->names;
+  }
+  // Throws out_of_range if the name doesn't appear in the template
+  size_t placeholder_index(const std::string& name) const;
+
+  // values must contain one value for each placeholder name. The returned
+  // data (and mask, if given) are the same as what parse_data_string would
+  // return if the values were written literally in the template.
+  std::string render(const std::vector<Value>& values, std::string* mask = nullptr) const;
+  // Like render, but appends to data (and mask) instead of replacing them
+  void render_into(std::string& data, const std::vector<Value>& values, std::string* mask = nullptr) const;
+
+private:
+  // Each segment is a run of literal data followed by a placeholder; the
+  // literal data for all segments is stored contiguously in literal_data
+  struct Segment {
+    size_t literal_size;
+    size_t value_index;
+    PlaceholderType type;
+    uint8_t size; // 0 for BYTES
+    bool byteswap;
+    bool mask_enabled;
+  };
+  std::string literal_data;
+  std::string literal_mask;
+  size_t trailing_literal_size;
+  size_t fixed_size; // Total size excluding BYTES placeholders
+  std::vector<Segment> segments;
+  std::vector<std::string> names;
+  std::unordered_map<std::string, size_t> name_to_index;
+};
+
 std::string format_data_string(const std::string& data, const std::string* mask = nullptr, uint64_t flags = 0);
 std::string format_data_string(const void* data, size_t size, const void* mask = nullptr, uint64_t flags = 0);
 
 std::string format_size(size_t size, bool include_bytes = false);
+// Like format_size, but writes the result to buf (which must have room for at
+// least FORMAT_SIZE_MAX_LENGTH bytes) and returns a pointer to the end of the
+// written string. The string is not null-terminated.
+constexpr size_t FORMAT_SIZE_MAX_LENGTH = 0x40;
+char* format_size_to(char* buf, size_t size, bool include_bytes = false);
 size_t parse_size(const char* str);
 
 class BitReader {
@@ -508,6 +1116,9 @@ class StringReader {
 public:
   StringReader();
   explicit StringReader(std::shared_ptr<std::string> data, size_t offset = 0);
+#ifndef PHOSG_WINDOWS
+  explicit StringReader(std::shared_ptr<const MappedFile> file, size_t offset = 0);
+#endif
   StringReader(const void* data, size_t size, size_t offset = 0);
   StringReader(const std::string& data, size_t offset = 0);
   virtual ~StringReader() = default;
@@ -697,18 +1308,238 @@ public:
   inline int64_t pget_s48b(size_t offset) const { return ext48(this->pget_u48b(offset)); }
   inline int64_t pget_s48l(size_t offset) const { return ext48(this->pget_u48l(offset)); }
 
+  // Variable-length integers (see encode_uleb128 and encode_prefix_varint in
+  // Encoding.hh). The pget functions also return the encoded size of the value
+  // in *size, if size is not null. The array functions read count consecutive
+  // values into dest; when most values are less than 0x80, they're much faster
+  // than calling get_uleb128 or get_prefix_varint in a loop.
+  uint64_t get_uleb128(bool advance = true);
+  uint64_t pget_uleb128(size_t offset, size_t* size = nullptr) const;
+  inline int64_t get_zigzag_leb128(bool advance = true) { return zigzag_decode(this->get_uleb128(advance)); }
+  inline int64_t pget_zigzag_leb128(size_t offset, size_t* size = nullptr) const { return zigzag_decode(this->pget_uleb128(offset, size)); }
+  uint64_t get_prefix_varint(bool advance = true);
+  uint64_t pget_prefix_varint(size_t offset, size_t* size = nullptr) const;
+  void get_uleb128_array(uint64_t* dest, size_t count, bool advance = true);
+  void get_prefix_varint_array(uint64_t* dest, size_t count, bool advance = true);
+
   std::string get_line(bool advance = true);
 
   std::string get_cstr(bool advance = true);
   std::string pget_cstr(size_t offset) const;
 
 private:
-  std::shared_ptr<std::string> owned_data;
+  // This is only used to keep the underlying data alive (it may be a string
+  // or a MappedFile, for example)
+  std::shared_ptr<const void> owned_data;
   const uint8_t* data;
   size_t length;
   size_t offset;
 };
 
+// Like StringReader, but reads from a file on demand instead of requiring the
+// entire input to be in memory. Only a window of the file is buffered at a
+// time; the window is refilled whenever a read touches data outside of it, so
+// sequential reads are fast and random reads (pget_*, go) work anywhere in the
+// file. The file must be seekable, and must not change size while the reader
+// exists. Pointers returned by peek, pgetv, and getv are only valid until the
+// next read call. The get/pget functions return values instead of references
+// (unlike in StringReader) for the same reason.
+class StreamReader {
+public:
+  explicit StreamReader(const std::string& filename, size_t window_size = DEFAULT_WINDOW_SIZE);
+  explicit StreamReader(std::shared_ptr<FILE> f, size_t window_size = DEFAULT_WINDOW_SIZE);
+#ifndef PHOSG_WINDOWS
+  explicit StreamReader(int fd, size_t window_size = DEFAULT_WINDOW_SIZE);
+#endif
+  StreamReader(const StreamReader&) = delete;
+  StreamReader(StreamReader&&) = default;
+  StreamReader& operator=(const StreamReader&) = delete;
+  StreamReader& operator=(StreamReader&&) = default;
+  ~StreamReader() = default;
+
+  static constexpr size_t DEFAULT_WINDOW_SIZE = 0x100000;
+
+  size_t where() const;
+  size_t size() const;
+  size_t remaining() const;
+  void truncate(size_t new_size);
+  void go(size_t offset);
+  void skip(size_t bytes);
+  bool skip_if(const void* data, size_t size);
+  bool eof() const;
+
+  // Unlike StringReader, these return StringReaders that own a copy of the
+  // requested range of the file. Use them for reasonably-sized structures, not
+  // for huge ranges of the file.
+  StringReader sub(size_t offset, size_t size);
+  StringReader subx(size_t offset, size_t size);
+
+  const char* peek(size_t size);
+
+  std::string read(size_t size, bool advance = true);
+  std::string readx(size_t size, bool advance = true);
+  size_t read(void* data, size_t size, bool advance = true);
+  void readx(void* data, size_t size, bool advance = true);
+  std::string pread(size_t offset, size_t size);
+  std::string preadx(size_t offset, size_t size);
+  size_t pread(size_t offset, void* data, size_t size);
+  void preadx(size_t offset, void* data, size_t size);
+
+  const void* pgetv(size_t offset, size_t size);
+  inline const void* getv(size_t size, bool advance = true) {
+    const void* ret = this->pgetv(this->offset, size);
+    if (advance) {
+      this->offset += size;
+    }
+    return ret;
+  }
+  template <typename T>
+  T pget(size_t offset, size_t size = sizeof(T)) {
+    return *reinterpret_cast<const T*>(this->pgetv(offset, size));
+  }
+  template <typename T>
+  T get(bool advance = true, size_t size = sizeof(T)) {
+    T ret = this->pget<T>(this->offset, size);
+    if (advance) {
+      this->offset += size;
+    }
+    return ret;
+  }
+
+  inline uint8_t get_u8(bool advance = true) { return this->get<uint8_t>(advance); }
+  inline int8_t get_s8(bool advance = true) { return this->get<int8_t>(advance); }
+  inline uint8_t pget_u8(size_t offset) { return this->pget<uint8_t>(offset); }
+  inline int8_t pget_s8(size_t offset) { return this->pget<int8_t>(offset); }
+
+  inline uint16_t get_u16b(bool advance = true) { return this->get<be_uint16_t>(advance); }
+  inline uint16_t get_u16l(bool advance = true) { return this->get<le_uint16_t>(advance); }
+  inline int16_t get_s16b(bool advance = true) { return this->get<be_int16_t>(advance); }
+  inline int16_t get_s16l(bool advance = true) { return this->get<le_int16_t>(advance); }
+  inline uint16_t pget_u16b(size_t offset) { return this->pget<be_uint16_t>(offset); }
+  inline uint16_t pget_u16l(size_t offset) { return this->pget<le_uint16_t>(offset); }
+  inline int16_t pget_s16b(size_t offset) { return this->pget<be_int16_t>(offset); }
+  inline int16_t pget_s16l(size_t offset) { return this->pget<le_int16_t>(offset); }
+
+  inline uint32_t get_u32b(bool advance = true) { return this->get<be_uint32_t>(advance); }
+  inline uint32_t get_u32l(bool advance = true) { return this->get<le_uint32_t>(advance); }
+  inline int32_t get_s32b(bool advance = true) { return this->get<be_int32_t>(advance); }
+  inline int32_t get_s32l(bool advance = true) { return this->get<le_int32_t>(advance); }
+  inline uint32_t pget_u32b(size_t offset) { return this->pget<be_uint32_t>(offset); }
+  inline uint32_t pget_u32l(size_t offset) { return this->pget<le_uint32_t>(offset); }
+  inline int32_t pget_s32b(size_t offset) { return this->pget<be_int32_t>(offset); }
+  inline int32_t pget_s32l(size_t offset) { return this->pget<le_int32_t>(offset); }
+
+  inline uint64_t get_u64b(bool advance = true) { return this->get<be_uint64_t>(advance); }
+  inline uint64_t get_u64l(bool advance = true) { return this->get<le_uint64_t>(advance); }
+  inline int64_t get_s64b(bool advance = true) { return this->get<be_int64_t>(advance); }
+  inline int64_t get_s64l(bool advance = true) { return this->get<le_int64_t>(advance); }
+  inline uint64_t pget_u64b(size_t offset) { return this->pget<be_uint64_t>(offset); }
+  inline uint64_t pget_u64l(size_t offset) { return this->pget<le_uint64_t>(offset); }
+  inline int64_t pget_s64b(size_t offset) { return this->pget<be_int64_t>(offset); }
+  inline int64_t pget_s64l(size_t offset) { return this->pget<le_int64_t>(offset); }
+
+  inline float get_f32b(bool advance = true) { return this->get<be_float>(advance); }
+  inline float get_f32l(bool advance = true) { return this->get<le_float>(advance); }
+  inline float pget_f32b(size_t offset) { return this->pget<be_float>(offset); }
+  inline float pget_f32l(size_t offset) { return this->pget<le_float>(offset); }
+
+  inline double get_f64b(bool advance = true) { return this->get<be_double>(advance); }
+  inline double get_f64l(bool advance = true) { return this->get<le_double>(advance); }
+  inline double pget_f64b(size_t offset) { return this->pget<be_double>(offset); }
+  inline double pget_f64l(size_t offset) { return this->pget<le_double>(offset); }
+
+  inline uint32_t get_u24b(bool advance = true) {
+    uint32_t ret = this->pget_u24b(this->offset);
+    if (advance) {
+      this->offset += 3;
+    }
+    return ret;
+  }
+  inline uint32_t get_u24l(bool advance = true) {
+    uint32_t ret = this->pget_u24l(this->offset);
+    if (advance) {
+      this->offset += 3;
+    }
+    return ret;
+  }
+  inline int32_t get_s24b(bool advance = true) { return ext24(this->get_u24b(advance)); }
+  inline int32_t get_s24l(bool advance = true) { return ext24(this->get_u24l(advance)); }
+  inline uint32_t pget_u24b(size_t offset) {
+    const uint8_t* d = reinterpret_cast<const uint8_t*>(this->pgetv(offset, 3));
+    return (d[0] << 16) | (d[1] << 8) | d[2];
+  }
+  inline uint32_t pget_u24l(size_t offset) {
+    const uint8_t* d = reinterpret_cast<const uint8_t*>(this->pgetv(offset, 3));
+    return d[0] | (d[1] << 8) | (d[2] << 16);
+  }
+  inline int32_t pget_s24b(size_t offset) { return ext24(this->pget_u24b(offset)); }
+  inline int32_t pget_s24l(size_t offset) { return ext24(this->pget_u24l(offset)); }
+
+  inline uint64_t get_u48b(bool advance = true) {
+    uint64_t ret = this->pget_u48b(this->offset);
+    if (advance) {
+      this->offset += 6;
+    }
+    return ret;
+  }
+  inline uint64_t get_u48l(bool advance = true) {
+    uint64_t ret = this->pget_u48l(this->offset);
+    if (advance) {
+      this->offset += 6;
+    }
+    return ret;
+  }
+  inline int64_t get_s48b(bool advance = true) { return ext48(this->get_u48b(advance)); }
+  inline int64_t get_s48l(bool advance = true) { return ext48(this->get_u48l(advance)); }
+  inline uint64_t pget_u48b(size_t offset) {
+    const uint8_t* d = reinterpret_cast<const uint8_t*>(this->pgetv(offset, 6));
+    return (static_cast<uint64_t>(d[0]) << 40) |
+        (static_cast<uint64_t>(d[1]) << 32) |
+        (static_cast<uint64_t>(d[2]) << 24) |
+        (static_cast<uint64_t>(d[3]) << 16) |
+        (static_cast<uint64_t>(d[4]) << 8) |
+        (static_cast<uint64_t>(d[5]));
+  }
+  inline uint64_t pget_u48l(size_t offset) {
+    const uint8_t* d = reinterpret_cast<const uint8_t*>(this->pgetv(offset, 6));
+    return (static_cast<uint64_t>(d[0])) |
+        (static_cast<uint64_t>(d[1]) << 8) |
+        (static_cast<uint64_t>(d[2]) << 16) |
+        (static_cast<uint64_t>(d[3]) << 24) |
+        (static_cast<uint64_t>(d[4]) << 32) |
+        (static_cast<uint64_t>(d[5]) << 40);
+  }
+  inline int64_t pget_s48b(size_t offset) { return ext48(this->pget_u48b(offset)); }
+  inline int64_t pget_s48l(size_t offset) { return ext48(this->pget_u48l(offset)); }
+
+  uint64_t get_uleb128(bool advance = true);
+  uint64_t pget_uleb128(size_t offset, size_t* size = nullptr);
+  inline int64_t get_zigzag_leb128(bool advance = true) { return zigzag_decode(this->get_uleb128(advance)); }
+  inline int64_t pget_zigzag_leb128(size_t offset, size_t* size = nullptr) { return zigzag_decode(this->pget_uleb128(offset, size)); }
+  uint64_t get_prefix_varint(bool advance = true);
+  uint64_t pget_prefix_varint(size_t offset, size_t* size = nullptr);
+
+  std::string get_line(bool advance = true);
+
+  std::string get_cstr(bool advance = true);
+  std::string pget_cstr(size_t offset);
+
+private:
+  // Makes the window contain at least [offset, offset + size) and returns a
+  // pointer to the data at offset. Throws out_of_range if the requested range
+  // extends beyond the end of the file.
+  const uint8_t* window_for(size_t offset, size_t size);
+  void read_from_file(size_t offset, void* data, size_t size);
+
+  std::shared_ptr<FILE> file;
+  int fd;
+  size_t length;
+  size_t offset;
+  size_t window_size;
+  size_t window_offset;
+  std::string window;
+};
+
 class StringWriter {
 public:
   StringWriter() = default;
@@ -815,6 +1646,23 @@ public:
   inline void pput_f32l(size_t offset, float v) { this->pput<le_float>(offset, v); }
   inline void pput_f64l(size_t offset, double v) { this->pput<le_double>(offset, v); }
 
+  inline void put_uleb128(uint64_t v) {
+    char buf[MAX_ULEB128_SIZE];
+    this->contents.append(buf, encode_uleb128(buf, v));
+  }
+  inline void put_zigzag_leb128(int64_t v) { this->put_uleb128(zigzag_encode(v)); }
+  inline void put_prefix_varint(uint64_t v) {
+    char buf[MAX_PREFIX_VARINT_SIZE];
+    this->contents.append(buf, encode_prefix_varint(buf, v));
+  }
+
+  // Formats directly onto the end of the contents, without creating a
+  // temporary string
+  template <typename... ArgTs>
+  void write_fmt(std::format_string<ArgTs...> fmt, ArgTs&&... args) {
+    std::format_to(std::back_inserter(this->contents), fmt, std::forward<ArgTs>(args)...);
+  }
+
   inline size_t size() const {
     return this->contents.size();
   }
@@ -974,6 +1822,69 @@ private:
   std::deque<std::string> blocks;
 };
 
+// Like BlockStringWriter, but never joins the blocks together. Instead, the
+// blocks can be retrieved as a list of iovecs (e.g. for passing to writev) or
+// written directly to a file descriptor. Small writes are coalesced into owned
+// blocks; large existing buffers can be added by reference with write_ref, in
+// which case the caller must keep them alive and unmodified until the writer
+// is reset or destroyed.
+class IovecWriter {
+public:
+  IovecWriter() = default;
+  IovecWriter(const IovecWriter&) = delete;
+  IovecWriter(IovecWriter&&) = default;
+  IovecWriter& operator=(const IovecWriter&) = delete;
+  IovecWriter& operator=(IovecWriter&&) = default;
+  ~IovecWriter() = default;
+
+  void reset();
+
+  void write(const void* data, size_t size);
+  void write(const std::string& data);
+  void write(std::string&& data);
+  void write_ref(const void* data, size_t size);
+  void write_ref(const std::string& data);
+
+  template <typename T>
+  void put(const T& v) {
+    this->write(&v, sizeof(v));
+  }
+
+  template <typename... ArgTs>
+  void write_fmt(std::format_string<ArgTs...> fmt, ArgTs&&... args) {
+    this->write(std::format(fmt, std::forward<ArgTs>(args)...));
+  }
+
+  inline size_t size() const {
+    return this->total_size;
+  }
+  inline size_t num_blocks() const {
+    return this->blocks.size();
+  }
+
+  // The returned iovecs are valid until the next call to any non-const method
+  std::vector<struct iovec> iovs() const;
+  std::string str() const;
+
+  void write_to(FILE* f) const;
+#ifndef PHOSG_WINDOWS
+  // Writes all blocks to fd using as few writev calls as possible (retrying
+  // after short writes). Throws io_error on failure.
+  void write_to(int fd) const;
+#endif
+
+private:
+  struct Block {
+    std::string owned;
+    const void* ref_data = nullptr;
+    size_t ref_size = 0;
+  };
+  // This is a deque so that existing Blocks are never moved when new Blocks
+  // are added (which would invalidate SSO strings' data pointers)
+  std::deque<Block> blocks;
+  size_t total_size = 0;
+};
+
 template <typename T>
 class StringBuffer : std::string {
 public:
@@ -990,6 +1901,57 @@ T* data_at(std::string& s, size_t offset = 0) {
   return reinterpret_cast<T*>(s.data() + offset);
 }
 
+// Returns the number of zero bytes at offsets that are multiples of stride.
+// Strides of 1, 2, 4, and 8 are vectorized.
 size_t count_zeroes(const void* vdata, size_t size, size_t stride = 1);
+// Returns the offset of the first nonzero byte, or size if all bytes are zero
+size_t find_first_nonzero(const void* data, size_t size);
+// Returns the number of times each byte value appears in the data
+std::array<uint64_t, 0x100> byte_histogram(const void* data, size_t size);
+// Returns the Shannon entropy of the data (or of data with the given
+// histogram), in bits per byte (from 0 to 8)
+double shannon_entropy(const std::array<uint64_t, 0x100>& histogram);
+double shannon_entropy(const void* data, size_t size);
+// Returns the Shannon entropy of each consecutive window_size-byte window of
+// the data. If size isn't a multiple of window_size, the last window is
+// shorter than the others.
+std::vector<double> windowed_shannon_entropy(const void* data, size_t size, size_t window_size);
+
+// These wrap values so they can be passed directly to std::format (or
+// StringWriter::write_fmt, log_f, etc.), which formats them into a stack
+// buffer instead of creating a temporary string. For example:
+//   std::format("{} ({})", FormattedSize{size}, FormattedError{errno})
+// FixedBufferFormatter implements std::formatter for these types; it accepts
+// the same format specs as strings (e.g. "{:>12}").
+struct FormattedSize {
+  static constexpr size_t MAX_LENGTH = FORMAT_SIZE_MAX_LENGTH;
+  size_t size;
+  bool include_bytes = false;
+  inline char* write_to(char* buf) const {
+    return format_size_to(buf, this->size, this->include_bytes);
+  }
+};
+
+struct FormattedError {
+  static constexpr size_t MAX_LENGTH = STRING_FOR_ERROR_MAX_LENGTH;
+  int error;
+  inline char* write_to(char* buf) const {
+    return string_for_error_to(buf, this->error);
+  }
+};
+
+template <typename T>
+struct FixedBufferFormatter : std::formatter<std::string_view, char> {
+  template <typename ContextT>
+  auto format(const T& v, ContextT& ctx) const {
+    char buf[T::MAX_LENGTH];
+    return std::formatter<std::string_view, char>::format(std::string_view(buf, v.write_to(buf) - buf), ctx);
+  }
+};
 
 } // namespace phosg
+
+template <>
+struct std::formatter<phosg::FormattedSize, char> : phosg::FixedBufferFormatter<phosg::FormattedSize> {};
+template <>
+struct std::formatter<phosg::FormattedError, char> : phosg::FixedBufferFormatter<phosg::FormattedError> {};
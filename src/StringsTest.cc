@@ -1,8 +1,16 @@
 #define _STDC_FORMAT_MACROS
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <string.h>
 #include <sys/time.h>
 
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
 #include "Filesystem.hh"
 #include "Strings.hh"
 #include "UnitTest.hh"
@@ -10,6 +18,49 @@
 using namespace std;
 using namespace phosg;
 
+static constexpr uint64_t COLORED_DIFF_TEST_ADDRESS = 0xFEDCBA9876543210;
+
+// Fills in data and prev for a colored diff test, and returns the expected
+// output. Colored diff lines where every byte is changed and unprintable are
+// as long as lines can be. Each group of lines here has enough short
+// (unchanged, printable) lines to leave less than one long line's worth of
+// space in the formatter's output buffer, followed by a long line, and there
+// are enough groups to fill the buffer several times.
+string make_colored_diff_test_case(string& diff_data, string& diff_prev) {
+  for (size_t group = 0; group < 4; group++) {
+    for (size_t line = 0; line < 757; line++) {
+      bool is_changed = (line == 756);
+      for (size_t x = 0; x < 0x10; x++) {
+        if (is_changed) {
+          diff_data.push_back(0x80 + ((line + x) % 0x7F));
+          diff_prev.push_back(diff_data.back() ^ 0x01);
+        } else {
+          diff_data.push_back(0x41 + ((line + x) % 26));
+          diff_prev.push_back(diff_data.back());
+        }
+      }
+    }
+  }
+  string diff_escape = format_color_escape(TerminalFormat::BOLD, TerminalFormat::FG_RED, TerminalFormat::END);
+  string inverse_escape = format_color_escape(TerminalFormat::INVERSE, TerminalFormat::END);
+  string normal_escape = format_color_escape(TerminalFormat::NORMAL, TerminalFormat::END);
+  string expected;
+  for (size_t line_offset = 0; line_offset < diff_data.size(); line_offset += 0x10) {
+    bool is_changed = (diff_data[line_offset] != diff_prev[line_offset]);
+    expected += std::format("{:016X} |", COLORED_DIFF_TEST_ADDRESS + line_offset);
+    for (size_t x = 0; x < 0x10; x++) {
+      string field = std::format(" {:02X}", static_cast<uint8_t>(diff_data[line_offset + x]));
+      expected += is_changed ? (diff_escape + field + normal_escape) : field;
+    }
+    expected += " | ";
+    for (size_t x = 0; x < 0x10; x++) {
+      expected += is_changed ? (diff_escape + inverse_escape + " " + normal_escape + normal_escape) : string(1, diff_data[line_offset + x]);
+    }
+    expected += "\n";
+  }
+  return expected;
+}
+
 template <typename... ArgTs>
 void print_data_test_case(const string& expected_output, ArgTs... args) {
 
@@ -151,7 +202,12 @@ F0 | 00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F |                 \n",
 00 |             00 00 00 40 00 00 80 3F 00 00 00    |        @   ?    \n",
       iovs.data(), iovs.size(), 4, nullptr, 0, PrintDataFlags::PRINT_ASCII);
 
-  // TODO: test diffing
+  fwrite_fmt(stderr, "-- [print_data] colored diff with every byte changed\n");
+  {
+    string diff_data, diff_prev;
+    string expected = make_colored_diff_test_case(diff_data, diff_prev);
+    print_data_test_case(expected, diff_data, COLORED_DIFF_TEST_ADDRESS, diff_prev.data(), PrintDataFlags::USE_COLOR | PrintDataFlags::PRINT_ASCII);
+  }
 }
 
 void test_bit_reader() {
@@ -344,6 +400,698 @@ void test_string_reader() {
   expect_eq(r.pget_cstr(0x3A), "and this is a cstring");
 }
 
+void test_iovec_writer() {
+  fwrite_fmt(stderr, "-- IovecWriter\n");
+
+  string big_owned(0x2000, 'x');
+  string big_ref(0x3000, 'y');
+  IovecWriter w;
+  w.write("abc", 3);
+  w.put<be_uint32_t>(0x64656667);
+  w.write_fmt("{}", 123);
+  w.write_ref(big_ref);
+  w.write(string("def"));
+  w.write(std::move(big_owned));
+  w.write_ref("", 0);
+
+  string expected = "abcdefg123" + string(0x3000, 'y') + "def" + string(0x2000, 'x');
+  expect_eq(w.size(), expected.size());
+  // The small writes before and after the reference should each be coalesced
+  // into one block
+  expect_eq(w.num_blocks(), 4);
+  auto iovs = w.iovs();
+  expect_eq(iovs.size(), 4);
+  expect_eq(iovs[1].iov_base, big_ref.data());
+  string joined;
+  for (const auto& iov : iovs) {
+    joined.append(reinterpret_cast<const char*>(iov.iov_base), iov.iov_len);
+  }
+  expect_eq(joined, expected);
+  expect_eq(w.str(), expected);
+
+  {
+    scoped_fd fd("StringsTest-data", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    w.write_to(fd);
+  }
+  expect_eq(load_file("StringsTest-data"), expected);
+
+  w.reset();
+  expect_eq(w.size(), 0);
+  expect(w.iovs().empty());
+}
+
+void test_varints() {
+  fwrite_fmt(stderr, "-- varints\n");
+
+  fwrite_fmt(stderr, "---- encodings\n");
+  auto encode = [](auto&& fn) -> string {
+    StringWriter w;
+    fn(w);
+    return w.str();
+  };
+  expect_eq(encode([](StringWriter& w) { w.put_uleb128(0); }), string("\x00", 1));
+  expect_eq(encode([](StringWriter& w) { w.put_uleb128(0x7F); }), "\x7F");
+  expect_eq(encode([](StringWriter& w) { w.put_uleb128(300); }), "\xAC\x02");
+  expect_eq(encode([](StringWriter& w) { w.put_uleb128(0xFFFFFFFFFFFFFFFF); }), "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01");
+  expect_eq(encode([](StringWriter& w) { w.put_zigzag_leb128(0); }), string("\x00", 1));
+  expect_eq(encode([](StringWriter& w) { w.put_zigzag_leb128(-1); }), "\x01");
+  expect_eq(encode([](StringWriter& w) { w.put_zigzag_leb128(1); }), "\x02");
+  expect_eq(encode([](StringWriter& w) { w.put_zigzag_leb128(-65); }), "\x81\x01");
+  expect_eq(encode([](StringWriter& w) { w.put_prefix_varint(0); }), "\x01");
+  expect_eq(encode([](StringWriter& w) { w.put_prefix_varint(0x7F); }), "\xFF");
+  expect_eq(encode([](StringWriter& w) { w.put_prefix_varint(0x80); }), "\x02\x02");
+  expect_eq(encode([](StringWriter& w) { w.put_prefix_varint(0xFFFFFFFFFFFFFFFF); }), string("\x00\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 9));
+  expect_eq(zigzag_encode(numeric_limits<int64_t>::min()), 0xFFFFFFFFFFFFFFFF);
+  expect_eq(zigzag_decode(0xFFFFFFFFFFFFFFFF), numeric_limits<int64_t>::min());
+  expect_eq(zigzag_decode(0xFFFFFFFFFFFFFFFE), numeric_limits<int64_t>::max());
+
+  // Mostly small values (so the bulk decoders' fast paths are used), with
+  // values of every length mixed in
+  vector<uint64_t> values;
+  for (size_t bits = 0; bits <= 64; bits++) {
+    uint64_t v = (bits == 64) ? 0xFFFFFFFFFFFFFFFF : ((1ULL << bits) - 1);
+    values.emplace_back(v);
+    values.emplace_back(v + 1);
+    for (size_t z = 0; z < 20; z++) {
+      values.emplace_back((z * 7 + bits) & 0x3F);
+    }
+  }
+
+  StringWriter leb_w, zigzag_w, prefix_w;
+  for (uint64_t v : values) {
+    leb_w.put_uleb128(v);
+    zigzag_w.put_zigzag_leb128(static_cast<int64_t>(v));
+    prefix_w.put_prefix_varint(v);
+  }
+
+  fwrite_fmt(stderr, "---- single values\n");
+  {
+    StringReader leb_r(leb_w.str()), zigzag_r(zigzag_w.str()), prefix_r(prefix_w.str());
+    for (uint64_t v : values) {
+      size_t leb_offset = leb_r.where();
+      size_t size;
+      expect_eq(leb_r.pget_uleb128(leb_offset, &size), v);
+      expect_eq(size, uleb128_size(v));
+      expect_eq(leb_r.get_uleb128(false), v);
+      expect_eq(leb_r.get_uleb128(), v);
+      expect_eq(leb_r.where(), leb_offset + size);
+      expect_eq(zigzag_r.get_zigzag_leb128(), static_cast<int64_t>(v));
+      expect_eq(prefix_r.pget_prefix_varint(prefix_r.where(), &size), v);
+      expect_eq(size, prefix_varint_size(v));
+      expect_eq(prefix_r.get_prefix_varint(), v);
+    }
+    expect(leb_r.eof());
+    expect(zigzag_r.eof());
+    expect(prefix_r.eof());
+  }
+
+  fwrite_fmt(stderr, "---- arrays\n");
+  for (size_t start = 0; start < 40; start++) {
+    StringReader leb_r(leb_w.str()), prefix_r(prefix_w.str());
+    for (size_t z = 0; z < start; z++) {
+      leb_r.get_uleb128();
+      prefix_r.get_prefix_varint();
+    }
+    vector<uint64_t> decoded(values.size() - start);
+    leb_r.get_uleb128_array(decoded.data(), decoded.size());
+    expect(leb_r.eof());
+    expect(equal(decoded.begin(), decoded.end(), values.begin() + start));
+    fill(decoded.begin(), decoded.end(), 0);
+    prefix_r.get_prefix_varint_array(decoded.data(), decoded.size());
+    expect(prefix_r.eof());
+    expect(equal(decoded.begin(), decoded.end(), values.begin() + start));
+  }
+  {
+    StringReader r(leb_w.str());
+    uint64_t decoded[3];
+    r.get_uleb128_array(decoded, 3, false);
+    expect_eq(r.where(), 0);
+    expect(equal(decoded, decoded + 3, values.begin()));
+  }
+
+  fwrite_fmt(stderr, "---- errors\n");
+  {
+    StringReader r("\x80\x80", 2);
+    expect_raises(out_of_range, [&]() {
+      r.get_uleb128();
+    });
+    StringReader r2("\x80\x80\x80\x80\x80\x80\x80\x80\x80\x02", 10);
+    expect_raises(invalid_argument, [&]() {
+      r2.get_uleb128();
+    });
+    StringReader r3("\x80\x80\x80\x80\x80\x80\x80\x80\x80\x80\x00", 11);
+    expect_raises(invalid_argument, [&]() {
+      r3.get_uleb128();
+    });
+    StringReader r4("\x04\x00", 2);
+    expect_raises(out_of_range, [&]() {
+      r4.get_prefix_varint();
+    });
+    StringReader r5("\x01\x01\x80", 3);
+    uint64_t decoded[3];
+    expect_raises(out_of_range, [&]() {
+      r5.get_uleb128_array(decoded, 3);
+    });
+    expect_eq(r5.where(), 0);
+    expect_raises(out_of_range, [&]() {
+      r5.pget_uleb128(3);
+    });
+  }
+
+  fwrite_fmt(stderr, "---- StreamReader\n");
+  save_file("StringsTest-data", leb_w.str() + prefix_w.str());
+  {
+    StreamReader r("StringsTest-data", 0x10);
+    for (uint64_t v : values) {
+      expect_eq(r.get_uleb128(), v);
+    }
+    for (uint64_t v : values) {
+      expect_eq(r.get_prefix_varint(), v);
+    }
+    expect(r.eof());
+    expect_eq(r.pget_zigzag_leb128(1), -1);
+    expect_raises(out_of_range, [&]() {
+      r.get_uleb128();
+    });
+  }
+}
+
+void test_stream_reader() {
+  fwrite_fmt(stderr, "-- StreamReader\n");
+
+  StringWriter w;
+  for (size_t z = 0; z < 0x100; z++) {
+    w.put_u32b(z);
+  }
+  w.write("line one\r\nline two\n");
+  w.write("cstr", 5);
+  w.put_u16l(0x1234);
+  save_file("StringsTest-data", w.str());
+
+  auto check = [&](StreamReader& r) {
+    expect_eq(r.size(), w.size());
+    for (size_t z = 0; z < 0x100; z++) {
+      expect_eq(r.get_u32b(), z);
+    }
+    expect_eq(r.get_line(), "line one");
+    expect_eq(r.get_line(), "line two");
+    expect_eq(r.get_cstr(), "cstr");
+    expect_eq(r.get_u16l(false), 0x1234);
+    expect_eq(r.remaining(), 2);
+    // Random access behind the window, and reads larger than the window
+    expect_eq(r.pget_u32b(0x10), 4);
+    expect_eq(r.pget_u24b(0x1D), 0x000007);
+    expect_eq(r.preadx(0, 0x40), w.str().substr(0, 0x40));
+    expect_eq(r.pread(w.size() - 4, 0x100), w.str().substr(w.size() - 4));
+    expect_eq(r.subx(4, 8).get_u32b(), 1);
+    expect_eq(r.get_u16l(), 0x1234);
+    expect(r.eof());
+    expect_raises(out_of_range, [&]() {
+      r.get_u8();
+    });
+    expect_raises(out_of_range, [&]() {
+      r.pget_u32l(w.size() - 2);
+    });
+    r.go(0);
+    expect(r.skip_if("\0\0\0\0", 4));
+    expect(!r.skip_if("\0\0\0\0", 4));
+    expect_eq(r.where(), 4);
+  };
+
+  {
+    StreamReader r("StringsTest-data", 0x10);
+    check(r);
+  }
+#ifndef PHOSG_WINDOWS
+  {
+    scoped_fd fd("StringsTest-data", O_RDONLY);
+    StreamReader r(fd, 0x10);
+    check(r);
+  }
+  {
+    StringReader r(make_shared<MappedFile>("StringsTest-data"));
+    expect_eq(r.all(), w.str());
+    expect_eq(r.pget_u32b(0x10), 4);
+  }
+#endif
+}
+
+void test_binary_diff() {
+  fwrite_fmt(stderr, "-- print_binary_diff\n");
+
+  // Large enough to use the parallel pre-pass, with differences in two chunks
+  string data1(0x1000020, '\0');
+  string data2 = data1;
+  data2[0x200000] = 0x01;
+  data2[0x1000018] = 'A';
+
+  string zero_line = " 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n";
+  string expected = "  ...\n";
+  expected += "  001FFFF0 |" + zero_line;
+  expected += "- 00200000 |" + zero_line;
+  expected += "+ 00200000 | 01 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n";
+  expected += "  00200010 |" + zero_line;
+  expected += "  ...\n";
+  expected += "  01000000 |" + zero_line;
+  expected += "- 01000010 |" + zero_line;
+  expected += "+ 01000010 | 00 00 00 00 00 00 00 00 41 00 00 00 00 00 00 00 |         A       \n";
+
+  for (size_t num_threads : {1, 4}) {
+    {
+      auto f = fopen_unique("StringsTest-data", "w");
+      expect(print_binary_diff(f.get(), data1.data(), data1.size(), data1.data(), data1.size(), false, 1, 0, num_threads));
+      expect(!print_binary_diff(f.get(), data1.data(), data1.size(), data2.data(), data2.size(), false, 1, 0, num_threads));
+    }
+    expect_eq(expected, load_file("StringsTest-data"));
+  }
+}
+
+void test_async_logging() {
+  fwrite_fmt(stderr, "-- async logging\n");
+
+  static constexpr size_t num_threads = 4;
+  static constexpr size_t lines_per_thread = 2000;
+
+  auto run_threads = [&]() -> void {
+    vector<thread> threads;
+    for (size_t thread_num = 0; thread_num < num_threads; thread_num++) {
+      threads.emplace_back([thread_num]() -> void {
+        PrefixedLogger log(std::format("[T{}] ", thread_num));
+        for (size_t z = 0; z < lines_per_thread; z++) {
+          if (z & 1) {
+            log.info_f("line {}", z);
+          } else {
+            log_info_f("[T{}] line {}", thread_num, z);
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+  };
+
+  {
+    auto f = fopen_unique("StringsTest-data", "w");
+    AsyncLogOptions options;
+    options.stream = f.get();
+    options.buffer_size = 0x200;
+    enable_async_logging(options);
+    expect(async_logging_enabled());
+    run_threads();
+    // Lines too long to fit in the buffer are written synchronously
+    log_info_f("{}", string(0x400, 'x'));
+    disable_async_logging();
+    expect(!async_logging_enabled());
+    expect_eq(async_log_dropped_line_count(), 0);
+  }
+
+  // All lines should be present, and lines from each thread should be in order
+  auto lines = split(load_file("StringsTest-data"), '\n');
+  expect_eq(lines.size(), num_threads * lines_per_thread + 2);
+  expect_eq(lines.back(), "");
+  vector<size_t> next_line_index(num_threads, 0);
+  size_t num_long_lines = 0;
+  for (size_t z = 0; z < lines.size() - 1; z++) {
+    const auto& line = lines[z];
+    expect(line.starts_with("I "));
+    if (line.ends_with(" - " + string(0x400, 'x'))) {
+      num_long_lines++;
+      continue;
+    }
+    size_t prefix_end = line.find(" - [T");
+    expect_ne(prefix_end, string::npos);
+    size_t thread_num = stoul(line.substr(prefix_end + 5));
+    expect_lt(thread_num, num_threads);
+    expect_eq(line.substr(prefix_end + 3), std::format("[T{}] line {}", thread_num, next_line_index[thread_num]++));
+  }
+  expect_eq(num_long_lines, 1);
+
+  // With the DROP policy, every line is either written or counted as dropped
+  {
+    auto f = fopen_unique("StringsTest-data", "w");
+    AsyncLogOptions options;
+    options.stream = f.get();
+    options.buffer_size = 0x100;
+    options.overflow_policy = AsyncLogOverflowPolicy::DROP;
+    options.flush_interval_usecs = 1000000;
+    enable_async_logging(options);
+    run_threads();
+    disable_async_logging();
+  }
+  lines = split(load_file("StringsTest-data"), '\n');
+  expect_eq(lines.size() - 1 + async_log_dropped_line_count(), num_threads * lines_per_thread);
+}
+
+void test_deferred_logging() {
+  fwrite_fmt(stderr, "-- deferred logging\n");
+
+  auto log_lines = [](const string& prefix) -> void {
+    PrefixedLogger log(prefix);
+    for (size_t z = 0; z < 3; z++) {
+      log_info_deferred_f("line {} {:08X} {:.2f} {:c} {} {}", z, 0xC0DEu + z, 1.5 * z, 'a' + static_cast<char>(z), "str", true);
+      log.warning_deferred_f("prefixed {:>5} {}", string("ab"), -static_cast<int64_t>(z));
+    }
+    log_error_f("text {}", 7);
+  };
+  static const vector<string> expected_lines = {
+      " - line 0 0000C0DE 0.00 a str true",
+      " - [P] prefixed    ab 0",
+      " - line 1 0000C0DF 1.50 b str true",
+      " - [P] prefixed    ab -1",
+      " - line 2 0000C0E0 3.00 c str true",
+      " - [P] prefixed    ab -2",
+      " - text 7",
+  };
+  static const string expected_level_chars = "IWIWIWE";
+  auto check_lines = [](const string& data) -> void {
+    auto lines = split(data, '\n');
+    expect_eq(lines.size(), expected_lines.size() + 1);
+    expect_eq(lines.back(), "");
+    for (size_t z = 0; z < expected_lines.size(); z++) {
+      expect_eq(lines[z][0], expected_level_chars[z]);
+      expect(lines[z].ends_with(expected_lines[z]));
+      expect(lines[z].starts_with(std::format("{} {} ", expected_level_chars[z], getpid())));
+    }
+  };
+
+  // In text mode, deferred lines are formatted by the writer thread
+  {
+    auto f = fopen_unique("StringsTest-data", "w");
+    AsyncLogOptions options;
+    options.stream = f.get();
+    enable_async_logging(options);
+    log_lines("[P] ");
+    disable_async_logging();
+  }
+  check_lines(load_file("StringsTest-data"));
+
+  // In binary mode, the decoder produces the same text, even if the data is
+  // given to it in small pieces
+  {
+    auto f = fopen_unique("StringsTest-data", "w");
+    AsyncLogOptions options;
+    options.stream = f.get();
+    options.binary_output = true;
+    enable_async_logging(options);
+    log_lines("[P] ");
+    disable_async_logging();
+  }
+  string data = load_file("StringsTest-data");
+  expect(data.starts_with("PHOSGLOG"));
+  {
+    BinaryLogDecoder decoder;
+    string decoded;
+    expect_eq(decoder.decode(data.data(), data.size(), decoded), data.size());
+    check_lines(decoded);
+  }
+  {
+    BinaryLogDecoder decoder;
+    string decoded;
+    string pending;
+    for (size_t offset = 0; offset < data.size(); offset += 7) {
+      pending += data.substr(offset, 7);
+      pending.erase(0, decoder.decode(pending.data(), pending.size(), decoded));
+    }
+    expect_eq(pending, "");
+    check_lines(decoded);
+  }
+  {
+    BinaryLogDecoder decoder;
+    string decoded;
+    expect_raises(runtime_error, [&]() {
+      decoder.decode("NOTALOG\0\1\0\0\0\0\0\0\0", 16, decoded);
+    });
+  }
+
+  // A format that refers to more arguments than the record contains produces
+  // a format error instead of printing default values for the missing ones
+  {
+    auto f = fopen_unique("StringsTest-data", "w");
+    AsyncLogOptions options;
+    options.stream = f.get();
+    enable_async_logging(options);
+    AsyncLog::write_deferred(LogLevel::L_INFO, nullptr, "{} {}", 5);
+    disable_async_logging();
+  }
+  string error_line = load_file("StringsTest-data");
+  expect(error_line.find(" - <format error: ") != string::npos);
+  expect(error_line.ends_with("> {} {}\n"));
+}
+
+void test_aligned_binary_diff() {
+  fwrite_fmt(stderr, "-- compute_aligned_binary_diff\n");
+
+  using Type = BinaryDiffRegion::Type;
+  auto expect_regions = [](
+                            const string& data1,
+                            const string& data2,
+                            const vector<BinaryDiffRegion>& expected) -> void {
+    auto regions = compute_aligned_binary_diff(data1.data(), data1.size(), data2.data(), data2.size(), 0x20);
+    expect_eq(regions.size(), expected.size());
+    for (size_t z = 0; z < expected.size(); z++) {
+      expect_eq(static_cast<int>(regions[z].type), static_cast<int>(expected[z].type));
+      expect_eq(regions[z].offset1, expected[z].offset1);
+      expect_eq(regions[z].size1, expected[z].size1);
+      expect_eq(regions[z].offset2, expected[z].offset2);
+      expect_eq(regions[z].size2, expected[z].size2);
+    }
+  };
+
+  // Pseudorandom data with no repeated blocks
+  string data;
+  uint32_t state = 0x12345678;
+  for (size_t z = 0; z < 0x1000; z++) {
+    state = state * 1103515245 + 12345;
+    data.push_back(state >> 24);
+  }
+  string inserted(0x25, 'X');
+
+  expect_regions("", "", {});
+  expect_regions(data, data, {{Type::MATCH, 0, 0x1000, 0, 0x1000}});
+  expect_regions(data, data.substr(0, 0x3E8) + inserted + data.substr(0x3E8), {
+                                                                                  {Type::MATCH, 0, 0x3E8, 0, 0x3E8},
+                                                                                  {Type::INSERTED, 0x3E8, 0, 0x3E8, 0x25},
+                                                                                  {Type::MATCH, 0x3E8, 0xC18, 0x40D, 0xC18},
+                                                                              });
+  expect_regions(data, data.substr(0, 0x3E8) + data.substr(0x40D), {
+                                                                       {Type::MATCH, 0, 0x3E8, 0, 0x3E8},
+                                                                       {Type::DELETED, 0x3E8, 0x25, 0x3E8, 0},
+                                                                       {Type::MATCH, 0x40D, 0xBF3, 0x3E8, 0xBF3},
+                                                                   });
+  expect_regions(data, data.substr(0, 0x3E8) + inserted + data.substr(0x40D), {
+                                                                                  {Type::MATCH, 0, 0x3E8, 0, 0x3E8},
+                                                                                  {Type::CHANGED, 0x3E8, 0x25, 0x3E8, 0x25},
+                                                                                  {Type::MATCH, 0x40D, 0xBF3, 0x40D, 0xBF3},
+                                                                              });
+  // Swapping the halves produces one in-order match and one moved match
+  expect_regions(data, data.substr(0x800) + data.substr(0, 0x800), {
+                                                                       {Type::MATCH, 0x800, 0x800, 0, 0x800},
+                                                                       {Type::MOVED, 0, 0x800, 0x800, 0x800},
+                                                                   });
+
+  fwrite_fmt(stderr, "-- print_aligned_binary_diff\n");
+  string data2 = data.substr(0, 0x3E8) + inserted + data.substr(0x3E8);
+  {
+    auto f = fopen_unique("StringsTest-data", "w");
+    expect(print_aligned_binary_diff(f.get(), data.data(), data.size(), data.data(), data.size(), false, 1));
+    expect(!print_aligned_binary_diff(f.get(), data.data(), data.size(), data2.data(), data2.size(), false, 1));
+  }
+  string output = load_file("StringsTest-data");
+  expect(output.starts_with("@@ inserted 3E8:0 => 3E8:25\n  03D0 | "));
+  expect(output.find("\n+ 03E0 |                         58 58 58 58 58 58 58 58 |         XXXXXXXX\n") != string::npos);
+
+  // When two changed regions are close together, the context between them is
+  // only printed once
+  string data3 = data.substr(0, 0x3E8) + inserted + data.substr(0x3E8, 0x80) + string(0x25, 'Y') + data.substr(0x468);
+  {
+    auto f = fopen_unique("StringsTest-data", "w");
+    expect(!print_aligned_binary_diff(f.get(), data.data(), data.size(), data3.data(), data3.size(), false, 4));
+  }
+  output = load_file("StringsTest-data");
+  expect(output.find("@@ inserted 468:0 => 48D:25\n  0450 | ") != string::npos);
+  unordered_set<string> context_lines;
+  for (const auto& line : split(output, '\n')) {
+    if (line.starts_with("  ")) {
+      expect(context_lines.emplace(line).second);
+    }
+  }
+}
+
+void test_data_string_parser() {
+  fwrite_fmt(stderr, "-- DataStringParser\n");
+  string input = "01 02 /* comment */ \"str\\\"ing\" $ ##0x1234 %%-2.5e3 'ab' // comment\n ?#255? ####12345678 fe\"x\"";
+  string expected_mask;
+  string expected = parse_data_string(input, &expected_mask);
+
+  // Splitting the input at every possible pair of offsets (including in the
+  // middle of bytes, strings, comments, and numbers) gives the same result
+  for (size_t split1 = 0; split1 <= input.size(); split1++) {
+    for (size_t split2 = split1; split2 <= input.size(); split2++) {
+      DataStringParser parser;
+      string mask, chunk_mask;
+      string data = parser.parse(string_view(input).substr(0, split1), &chunk_mask);
+      mask += chunk_mask;
+      data += parser.parse(string_view(input).substr(split1, split2 - split1), &chunk_mask);
+      mask += chunk_mask;
+      data += parser.parse(string_view(input).substr(split2), &chunk_mask);
+      mask += chunk_mask;
+      data += parser.finish(&chunk_mask);
+      mask += chunk_mask;
+      expect_eq(expected, data);
+      expect_eq(expected_mask, mask);
+    }
+  }
+
+  // A number at the end of a chunk isn't parsed until it's known to be
+  // complete
+  DataStringParser parser;
+  expect_eq("", parser.parse("##123"));
+  expect_eq("", parser.parse("4"));
+  expect_eq(string("\xD2\x04\x05", 3), parser.parse(" 05 ##1"));
+  expect_eq(string("\x01\x00", 2), parser.finish());
+
+  // A token that continues across chunks can't grow without bound, but long
+  // tokens that end within a chunk are fine
+  DataStringParser long_parser;
+  expect_eq("\x01", long_parser.parse("01 ##" + string(0x800, '0')));
+  expect_raises(invalid_argument, [&]() {
+    long_parser.parse(string(0x1000, '0'));
+  });
+  DataStringParser long_chunk_parser;
+  expect_eq(string("\x07\x00\x01", 3), long_chunk_parser.parse("##" + string(0x2000, '0') + "7 01"));
+  expect_eq("", long_chunk_parser.finish());
+}
+
+void test_data_formatter() {
+  fwrite_fmt(stderr, "-- DataFormatter\n");
+  string data = "0123456789ABCDEF" + string(0x30, '\0') + "ghijklmnopqrstuv";
+  struct TestCase {
+    uint64_t flags;
+    uint64_t start_address;
+    const char* expected;
+  };
+  static const vector<TestCase> cases = {
+      {PrintDataFlags::PRINT_ASCII, 0x0, "\
+00 | 30 31 32 33 34 35 36 37 38 39 41 42 43 44 45 46 | 0123456789ABCDEF\n\
+10 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n\
+20 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n\
+30 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n\
+40 | 67 68 69 6A 6B 6C 6D 6E 6F 70 71 72 73 74 75 76 | ghijklmnopqrstuv\n"},
+      {PrintDataFlags::PRINT_ASCII, 0x3, "\
+00 |          30 31 32 33 34 35 36 37 38 39 41 42 43 |    0123456789ABC\n\
+10 | 44 45 46 00 00 00 00 00 00 00 00 00 00 00 00 00 | DEF             \n\
+20 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n\
+30 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n\
+40 | 00 00 00 67 68 69 6A 6B 6C 6D 6E 6F 70 71 72 73 |    ghijklmnopqrs\n\
+50 | 74 75 76                                        | tuv             \n"},
+      {PrintDataFlags::PRINT_ASCII | PrintDataFlags::COLLAPSE_ZERO_LINES, 0x0, "\
+00 | 30 31 32 33 34 35 36 37 38 39 41 42 43 44 45 46 | 0123456789ABCDEF\n\
+40 | 67 68 69 6A 6B 6C 6D 6E 6F 70 71 72 73 74 75 76 | ghijklmnopqrstuv\n"},
+      {PrintDataFlags::PRINT_ASCII | PrintDataFlags::COLLAPSE_ZERO_LINES, 0x3, "\
+00 |          30 31 32 33 34 35 36 37 38 39 41 42 43 |    0123456789ABC\n\
+10 | 44 45 46 00 00 00 00 00 00 00 00 00 00 00 00 00 | DEF             \n\
+40 | 00 00 00 67 68 69 6A 6B 6C 6D 6E 6F 70 71 72 73 |    ghijklmnopqrs\n\
+50 | 74 75 76                                        | tuv             \n"},
+  };
+  for (const auto& c : cases) {
+    // The output doesn't depend on how the data is split into writes
+    for (size_t piece_size : {1, 7, 0x10, 0x11, 0x100}) {
+      string output;
+      auto write_data = [&](const void* output_data, size_t size) -> void {
+        output.append(reinterpret_cast<const char*>(output_data), size);
+      };
+      DataFormatter formatter(write_data, c.start_address, c.flags, c.start_address + data.size());
+      for (size_t offset = 0; offset < data.size(); offset += piece_size) {
+        formatter.write(data.data() + offset, min<size_t>(piece_size, data.size() - offset));
+      }
+      formatter.finish();
+      expect_eq(c.expected, output);
+    }
+  }
+
+  // Colored diffs with the longest possible lines don't overflow the output
+  // buffer, regardless of how the data is split into writes
+  string diff_data, diff_prev;
+  string expected = make_colored_diff_test_case(diff_data, diff_prev);
+  for (size_t piece_size : {1, 0x1F, 0x1000}) {
+    string output;
+    auto write_data = [&](const void* output_data, size_t size) -> void {
+      output.append(reinterpret_cast<const char*>(output_data), size);
+    };
+    DataFormatter formatter(
+        write_data,
+        COLORED_DIFF_TEST_ADDRESS,
+        PrintDataFlags::USE_COLOR | PrintDataFlags::PRINT_ASCII,
+        COLORED_DIFF_TEST_ADDRESS + diff_data.size());
+    for (size_t offset = 0; offset < diff_data.size(); offset += piece_size) {
+      size_t size = min<size_t>(piece_size, diff_data.size() - offset);
+      formatter.write(diff_data.data() + offset, size, diff_prev.data() + offset);
+    }
+    formatter.finish();
+    expect_eq(expected, output);
+  }
+}
+
+void test_byte_scans() {
+  fwrite_fmt(stderr, "-- count_zeroes\n");
+  // Long enough to cover the vector loop, with an unaligned tail
+  string data;
+  for (size_t z = 0; z < 0x1003; z++) {
+    data.push_back((z % 3) ? (z & 0xFF) : 0);
+  }
+  for (size_t stride : {1, 2, 3, 4, 8, 16}) {
+    size_t expected = 0;
+    for (size_t z = 0; z < data.size(); z += stride) {
+      expected += (data[z] == 0);
+    }
+    expect_eq(expected, count_zeroes(data.data(), data.size(), stride));
+  }
+  expect_eq(0, count_zeroes(data.data(), 0));
+
+  fwrite_fmt(stderr, "-- find_first_nonzero\n");
+  string zeroes(0x203, '\0');
+  expect_eq(zeroes.size(), find_first_nonzero(zeroes.data(), zeroes.size()));
+  expect_eq(0, find_first_nonzero(zeroes.data(), 0));
+  for (size_t offset : {0, 1, 0x0F, 0x10, 0x3F, 0x40, 0x41, 0x1FF, 0x202}) {
+    zeroes[offset] = 0x80;
+    expect_eq(offset, find_first_nonzero(zeroes.data(), zeroes.size()));
+    zeroes[offset] = 0;
+  }
+
+  fwrite_fmt(stderr, "-- byte_histogram\n");
+  auto histogram = byte_histogram(data.data(), data.size());
+  array<uint64_t, 0x100> expected_histogram{};
+  for (char ch : data) {
+    expected_histogram[static_cast<uint8_t>(ch)]++;
+  }
+  expect_eq(expected_histogram, histogram);
+
+  fwrite_fmt(stderr, "-- shannon_entropy\n");
+  string all_bytes;
+  for (size_t z = 0; z < 0x100; z++) {
+    all_bytes.push_back(z);
+  }
+  expect_eq(8.0, shannon_entropy(all_bytes.data(), all_bytes.size()));
+  expect_eq(0.0, shannon_entropy(zeroes.data(), zeroes.size()));
+  expect_eq(0.0, shannon_entropy(zeroes.data(), 0));
+  expect_eq(1.0, shannon_entropy("ABABABAB", 8));
+
+  string windows = zeroes.substr(0, 0x100) + all_bytes + "ABAB";
+  auto entropies = windowed_shannon_entropy(windows.data(), windows.size(), 0x100);
+  expect_eq(3, entropies.size());
+  expect_eq(0.0, entropies[0]);
+  expect_eq(8.0, entropies[1]);
+  expect_eq(1.0, entropies[2]);
+  // A window larger than the data shouldn't allocate a table for the window
+  entropies = windowed_shannon_entropy("ABABABAB", 8, 0x40000000);
+  expect_eq(1, entropies.size());
+  expect_eq(1.0, entropies[0]);
+  expect_raises(invalid_argument, [&]() {
+    windowed_shannon_entropy(data.data(), data.size(), 0);
+  });
+}
+
 int main(int, char**) {
   {
     fwrite_fmt(stderr, "-- str_replace_all\n");
@@ -356,6 +1104,47 @@ int main(int, char**) {
     expect_eq("xyzabcxyzabcxyzabc", str_replace_all(string("defabcdefabcdefabc"), "def", "xyz"));
   }
 
+  {
+    fwrite_fmt(stderr, "-- MultiStringMatcher\n");
+    MultiStringMatcher m({"he", "she", "his", "hers"});
+    expect_eq(4, m.num_patterns());
+    expect_eq("his", m.pattern(2));
+
+    auto all = m.find_all("ushers");
+    expect_eq(3, all.size());
+    expect_eq(1, all[0].offset); // she
+    expect_eq(3, all[0].size);
+    expect_eq(1, all[0].pattern_index);
+    expect_eq(2, all[1].offset); // he
+    expect_eq(0, all[1].pattern_index);
+    expect_eq(2, all[2].offset); // hers
+    expect_eq(3, all[2].pattern_index);
+
+    auto first = m.find("ushers");
+    expect_eq(1, first.offset);
+    expect_eq(1, first.pattern_index);
+    expect_eq(string::npos, m.find("ushers", 3).offset);
+    expect_eq(string::npos, m.find("").offset);
+    expect(m.contains_any("this"));
+    expect(!m.contains_any("abcdef"));
+
+    // Leftmost match wins, then longest match at the same offset
+    expect_eq("u2rs 3 2 4", m.replace_all("ushers his she hers", {"1", "2", "3", "4"}));
+    expect_eq("", m.replace_all("", {"1", "2", "3", "4"}));
+    expect_eq(4, m.find_all_non_overlapping("ushers his she hers").size());
+    expect_raises(invalid_argument, [&]() {
+      m.replace_all("ushers", {"1"});
+    });
+    expect_raises(invalid_argument, [&]() {
+      MultiStringMatcher({"abc", ""});
+    });
+
+    expect_eq("Y X ZX", str_replace_all(string("abcd bc abc"), {{"bc", "X"}, {"abcd", "Y"}, {"a", "Z"}}));
+    expect_eq("xyzabcxyzabc", str_replace_all(string("defabcdefabc"), {{"def", "xyz"}}));
+    // Replacement text is not rescanned
+    expect_eq("ba", str_replace_all(string("ab"), {{"a", "b"}, {"b", "a"}}));
+  }
+
   {
     fwrite_fmt(stderr, "-- strip_trailing_zeroes\n");
     string s1("abcdef", 6);
@@ -394,6 +1183,19 @@ int main(int, char**) {
     expect_eq(s5, "");
   }
 
+  {
+    fwrite_fmt(stderr, "-- strip_leading_whitespace\n");
+    string s1 = " \t\r\n \t\r\n \t\r\n \t\r\n abc def ";
+    strip_leading_whitespace(s1);
+    expect_eq(s1, "abc def ");
+    string s2 = "abc";
+    strip_leading_whitespace(s2);
+    expect_eq(s2, "abc");
+    string s3 = "                    ";
+    strip_leading_whitespace(s3);
+    expect_eq(s3, "");
+  }
+
   {
     fwrite_fmt(stderr, "-- strip_whitespace\n");
 
@@ -420,6 +1222,29 @@ int main(int, char**) {
     s = "   \t\r\n  ";
     strip_whitespace(s);
     expect_eq(s, "");
+
+    s = "                  abc\t\tdef                   \r\n";
+    strip_whitespace(s);
+    expect_eq(s, "abc\t\tdef");
+
+    string_view sv = "  \nabc\tdef                   \r\n";
+    strip_whitespace(sv);
+    expect_eq(sv, "abc\tdef");
+    sv = "                    ";
+    strip_whitespace(sv);
+    expect_eq(sv, "");
+  }
+
+  {
+    fwrite_fmt(stderr, "-- toupper/tolower\n");
+    expect_eq("", toupper(""));
+    expect_eq("ABC-XYZ 0123456789 [@`{] ABCDEF\xE9", toupper("abc-XYZ 0123456789 [@`{] abcDEF\xE9"));
+    expect_eq("abc-xyz 0123456789 [@`{] abcdef\xC9", tolower("abc-XYZ 0123456789 [@`{] abcDEF\xC9"));
+    string s = "Mixed Case String With More Than 16 Bytes";
+    toupper_inplace(s);
+    expect_eq(s, "MIXED CASE STRING WITH MORE THAN 16 BYTES");
+    tolower_inplace(s);
+    expect_eq(s, "mixed case string with more than 16 bytes");
   }
 
   {
@@ -611,6 +1436,42 @@ int main(int, char**) {
     expect_eq(input, parse_data_string(formatted));
   }
 
+  fwrite_fmt(stderr, "-- DataStringTemplate\n");
+  {
+    DataStringTemplate t("01 02 $ ##{a} ?#{b}? \"str\" %%{c} {d} 'x' ##{a} FF");
+    expect_eq(4, t.placeholder_names().size());
+    expect_eq(0, t.placeholder_index("a"));
+    expect_eq(3, t.placeholder_index("d"));
+    expect_raises(out_of_range, [&]() {
+      t.placeholder_index("e");
+    });
+
+    string mask, expected_mask;
+    string data = t.render({0x1234, -1, 2.5, "hello"}, &mask);
+    expect_eq(parse_data_string("01 02 $ ##0x1234 ?#255? \"str\" %%2.5 \"hello\" 'x' ##0x1234 FF", &expected_mask), data);
+    expect_eq(expected_mask, mask);
+
+    string appended = "prefix";
+    t.render_into(appended, {0x5678, 7, -1.0, ""});
+    expect_eq("prefix" + parse_data_string("01 02 $ ##0x5678 #7 \"str\" %%-1 'x' ##0x5678 FF"), appended);
+
+    expect_eq(parse_data_string("%1.1 ###7"), DataStringTemplate("%{f} ###{x}").render({1.1f, 7}));
+    expect_eq(parse_data_string("AA BB"), DataStringTemplate("AA BB").render({}));
+
+    expect_raises(invalid_argument, [&]() {
+      t.render({1, 2, 3});
+    });
+    expect_raises(invalid_argument, [&]() {
+      t.render({1, 2, 3, "x"});
+    });
+    expect_raises(invalid_argument, [&]() {
+      DataStringTemplate("#{abc");
+    });
+    expect_raises(invalid_argument, [&]() {
+      DataStringTemplate("{}");
+    });
+  }
+
   fwrite_fmt(stderr, "-- format_size\n");
   {
     expect_eq("0 bytes", format_size(0));
@@ -619,6 +1480,23 @@ int main(int, char**) {
     expect_eq("1536 bytes (1.50 KB)", format_size(1536, true));
     expect_eq("1.00 GB", format_size(1073741824));
     expect_eq("1073741824 bytes (1.00 GB)", format_size(1073741824, true));
+    expect_eq("16.00 EB", format_size(0xFFFFFFFFFFFFFFFF));
+
+    char buf[FORMAT_SIZE_MAX_LENGTH];
+    expect_eq("1536 bytes (1.50 KB)", string(buf, format_size_to(buf, 1536, true)));
+    expect_eq("[   1.50 MB] [0 bytes]", std::format("[{:>10}] [{}]", FormattedSize{1572864}, FormattedSize{0}));
+
+    StringWriter w;
+    w.write("size: ");
+    w.write_fmt("{} ({})", FormattedSize{1536}, 3);
+    expect_eq("size: 1.50 KB (3)", w.str());
+  }
+
+  fwrite_fmt(stderr, "-- string_for_error\n");
+  {
+    string expected = std::format("{} ({})", ENOENT, strerror(ENOENT));
+    expect_eq(expected, string_for_error(ENOENT));
+    expect_eq(expected, std::format("{}", FormattedError{ENOENT}));
   }
 
   fwrite_fmt(stderr, "-- parse_size\n");
@@ -637,6 +1515,18 @@ int main(int, char**) {
     expect_eq("", escape_quotes(""));
     expect_eq("omg hax", escape_quotes("omg hax"));
     expect_eq("\'omg\' \\\"hax\\\"", escape_quotes("\'omg\' \"hax\""));
+    // Long enough to cover both the 16-byte blocks and the remainder
+    expect_eq("this string is long enough \\\"quotes\\\" \\x0A\\xFF\\x7F",
+        escape_quotes("this string is long enough \"quotes\" \n\xFF\x7F"));
+  }
+
+  fwrite_fmt(stderr, "-- escape_controls\n");
+  {
+    expect_eq("", escape_controls_ascii(""));
+    expect_eq("a\\tb\\r\\n\\\\ \\\'x\\\" \\x01\\x7F\\xC3\\xA9 and more text here",
+        escape_controls_ascii("a\tb\r\n\\ \'x\" \x01\x7F\xC3\xA9 and more text here"));
+    expect_eq("a\\tb\\r\\n\\\\ \\\'x\\\" \\x01\\x7F\xC3\xA9 and more text here",
+        escape_controls_utf8("a\tb\r\n\\ \'x\" \x01\x7F\xC3\xA9 and more text here"));
   }
 
   fwrite_fmt(stderr, "-- escape_url\n");
@@ -645,6 +1535,8 @@ int main(int, char**) {
     expect_eq("omg%20hax", escape_url("omg hax"));
     expect_eq("slash/es", escape_url("slash/es"));
     expect_eq("slash%2Fes", escape_url("slash/es", true));
+    expect_eq("a-b_c.d~e=f&g%2B%25%C3%A9%00/0123456789ABCXYZabcxyz",
+        escape_url(string_view("a-b_c.d~e=f&g+%\xC3\xA9\0/0123456789ABCXYZabcxyz", 41)));
   }
 
   print_data_test();
@@ -653,9 +1545,19 @@ int main(int, char**) {
 
   test_string_reader();
 
+  test_iovec_writer();
+  test_stream_reader();
+  test_varints();
+  test_binary_diff();
+  test_aligned_binary_diff();
+  test_data_string_parser();
+  test_data_formatter();
+  test_byte_scans();
+  test_async_logging();
+  test_deferred_logging();
+
   // TODO: test log_level, set_log_level, log
   // TODO: test get_time_string
-  // TODO: test string_for_error
 
   unlink("StringsTest-data");
 
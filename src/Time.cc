@@ -1,5 +1,6 @@
 #include "Time.hh"
 
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -19,7 +20,7 @@ uint64_t now() {
   return (uint64_t)t.tv_sec * 1000000 + (uint64_t)t.tv_usec;
 }
 
-string format_time(uint64_t t) {
+char* format_time_to(char* buf, uint64_t t) {
   time_t t_secs = t / 1000000;
   struct tm t_parsed;
 #ifndef PHOSG_WINDOWS
@@ -28,17 +29,16 @@ string format_time(uint64_t t) {
   gmtime_s(&t_parsed, &t_secs);
 #endif
 
-  string ret(128, 0);
-  size_t len = strftime(ret.data(), ret.size(), "%Y-%m-%d %H:%M:%S", &t_parsed);
+  size_t len = strftime(buf, FORMAT_TIME_MAX_LENGTH, "%Y-%m-%d %H:%M:%S", &t_parsed);
   if (len == 0) {
     throw runtime_error("format_time buffer too short");
   }
-  int usecs_ret = snprintf(ret.data() + len, ret.size() - len, ".%06" PRIu32, static_cast<uint32_t>(t % 1000000));
-  if (usecs_ret < 0) {
-    throw runtime_error("cannot add microsecond field");
-  }
-  ret.resize(min<size_t>(len + usecs_ret, ret.size()));
-  return ret;
+  return std::format_to_n(buf + len, FORMAT_TIME_MAX_LENGTH - len, ".{:06}", static_cast<uint32_t>(t % 1000000)).out;
+}
+
+string format_time(uint64_t t) {
+  char buf[FORMAT_TIME_MAX_LENGTH];
+  return string(buf, format_time_to(buf, t));
 }
 
 string format_time_natural(uint64_t t) {
@@ -70,18 +70,24 @@ string format_time_natural(struct timeval* tv) {
       static_cast<uint16_t>(tv->tv_usec / 1000));
 }
 
-string format_duration(uint64_t usecs, int8_t subsecond_precision) {
-  if (usecs < 1000000ULL) {
-    if (subsecond_precision < 0) {
-      subsecond_precision = 6;
-    }
-    return std::format("{:.{}f}", static_cast<double>(usecs) / 1000000ULL, subsecond_precision);
+// Writes the seconds part of a duration, with at least two digits before the
+// decimal point
+static char* format_duration_seconds_to(char* buf, uint64_t usecs_part, int8_t subsecond_precision) {
+  char* end = std::format_to(buf + 1, "{:.{}f}", static_cast<double>(usecs_part) / 1000000ULL, subsecond_precision);
+  if ((end - buf == 2) || (buf[2] == '.')) {
+    buf[0] = '0';
+    return end;
+  }
+  memmove(buf, buf + 1, end - buf - 1);
+  return end - 1;
+}
 
-  } else if (usecs < 60 * 1000000ULL) {
+char* format_duration_to(char* buf, uint64_t usecs, int8_t subsecond_precision) {
+  if (usecs < 60 * 1000000ULL) {
     if (subsecond_precision < 0) {
       subsecond_precision = 6;
     }
-    return std::format("{:.{}f}", static_cast<double>(usecs) / 1000000ULL, subsecond_precision);
+    return std::format_to(buf, "{:.{}f}", static_cast<double>(usecs) / 1000000ULL, subsecond_precision);
 
   } else if (usecs < 60 * 60 * 1000000ULL) {
     if (subsecond_precision < 0) {
@@ -89,8 +95,8 @@ string format_duration(uint64_t usecs, int8_t subsecond_precision) {
     }
     uint64_t minutes = usecs / (60 * 1000000ULL);
     uint64_t usecs_part = usecs - (minutes * 60 * 1000000ULL);
-    string seconds_str = std::format("{:.{}f}", static_cast<double>(usecs_part) / 1000000ULL, subsecond_precision);
-    return std::format("{}:{}", minutes, ((seconds_str.at(1) == '.') ? "0" : "")) + seconds_str;
+    buf = std::format_to(buf, "{}:", minutes);
+    return format_duration_seconds_to(buf, usecs_part, subsecond_precision);
 
   } else if (usecs < 24 * 60 * 60 * 1000000ULL) {
     if (subsecond_precision < 0) {
@@ -99,8 +105,8 @@ string format_duration(uint64_t usecs, int8_t subsecond_precision) {
     uint64_t hours = usecs / (60 * 60 * 1000000ULL);
     uint64_t minutes = (usecs / (60 * 1000000ULL)) % 60;
     uint64_t usecs_part = usecs - (hours * 60 * 60 * 1000000ULL) - (minutes * 60 * 1000000ULL);
-    string seconds_str = std::format("{:.{}f}", static_cast<double>(usecs_part) / 1000000ULL, subsecond_precision);
-    return std::format("{}:{:02}:{}", hours, minutes, ((seconds_str.size() == 1 || seconds_str.at(1) == '.') ? "0" : "")) + seconds_str;
+    buf = std::format_to(buf, "{}:{:02}:", hours, minutes);
+    return format_duration_seconds_to(buf, usecs_part, subsecond_precision);
 
   } else {
     if (subsecond_precision < 0) {
@@ -110,11 +116,16 @@ string format_duration(uint64_t usecs, int8_t subsecond_precision) {
     uint64_t hours = (usecs / (60 * 60 * 1000000ULL)) % 24;
     uint64_t minutes = (usecs / (60 * 1000000ULL)) % 60;
     uint64_t usecs_part = usecs - (days * 24 * 60 * 60 * 1000000ULL) - (hours * 60 * 60 * 1000000ULL) - (minutes * 60 * 1000000ULL);
-    string seconds_str = std::format("{:.{}f}", static_cast<double>(usecs_part) / 1000000ULL, subsecond_precision);
-    return std::format("{}:{:02}:{:02}:{}", days, hours, minutes, ((seconds_str.size() == 1 || seconds_str.at(1) == '.') ? "0" : "")) + seconds_str;
+    buf = std::format_to(buf, "{}:{:02}:{:02}:", days, hours, minutes);
+    return format_duration_seconds_to(buf, usecs_part, subsecond_precision);
   }
 }
 
+string format_duration(uint64_t usecs, int8_t subsecond_precision) {
+  char buf[FORMAT_DURATION_MAX_LENGTH];
+  return string(buf, format_duration_to(buf, usecs, subsecond_precision));
+}
+
 struct timeval usecs_to_timeval(uint64_t usecs) {
   struct timeval tv;
   tv.tv_sec = usecs / 1000000;
@@ -3,8 +3,11 @@
 #include <stdint.h>
 #include <sys/time.h>
 
+#include <format>
 #include <string>
 
+#include "Strings.hh"
+
 namespace phosg {
 
 uint64_t now();
@@ -14,7 +17,40 @@ std::string format_time_natural(uint64_t t);
 std::string format_time_natural(struct timeval* tv = nullptr);
 std::string format_duration(uint64_t usecs, int8_t subsecond_precision = -1);
 
+// Like format_time and format_duration, but these write the result to buf
+// (which must have room for at least FORMAT_TIME_MAX_LENGTH or
+// FORMAT_DURATION_MAX_LENGTH bytes) and return a pointer to the end of the
+// written string. The string is not null-terminated.
+constexpr size_t FORMAT_TIME_MAX_LENGTH = 0x40;
+constexpr size_t FORMAT_DURATION_MAX_LENGTH = 0xA0;
+char* format_time_to(char* buf, uint64_t t);
+char* format_duration_to(char* buf, uint64_t usecs, int8_t subsecond_precision = -1);
+
 struct timeval usecs_to_timeval(uint64_t usecs);
 uint64_t timeval_to_usecs(struct timeval& tv);
 
+// These can be passed directly to std::format; see FormattedSize in
+// Strings.hh for details
+struct FormattedTime {
+  static constexpr size_t MAX_LENGTH = FORMAT_TIME_MAX_LENGTH;
+  uint64_t t;
+  inline char* write_to(char* buf) const {
+    return format_time_to(buf, this->t);
+  }
+};
+
+struct FormattedDuration {
+  static constexpr size_t MAX_LENGTH = FORMAT_DURATION_MAX_LENGTH;
+  uint64_t usecs;
+  int8_t subsecond_precision = -1;
+  inline char* write_to(char* buf) const {
+    return format_duration_to(buf, this->usecs, this->subsecond_precision);
+  }
+};
+
 } // namespace phosg
+
+template <>
+struct std::formatter<phosg::FormattedTime, char> : phosg::FixedBufferFormatter<phosg::FormattedTime> {};
+template <>
+struct std::formatter<phosg::FormattedDuration, char> : phosg::FixedBufferFormatter<phosg::FormattedDuration> {};
@@ -42,6 +42,18 @@ int main(int, char**) {
     expect_eq("0.4383", format_duration(438294, 4));
     expect_eq("0.43829", format_duration(438294, 5));
     expect_eq("0.438294", format_duration(438294, 6));
+    expect_eq("1:05", format_duration(65000000, 0));
+
+    char buf[FORMAT_DURATION_MAX_LENGTH];
+    expect_eq("5:11:11:12", string(buf, format_duration_to(buf, 472272222222)));
+    expect_eq("[  1:02.22]", std::format("[{:>9}]", FormattedDuration{62222222, 2}));
+  }
+
+  fwrite_fmt(stderr, "-- FormattedTime\n");
+  {
+    char buf[FORMAT_TIME_MAX_LENGTH];
+    expect_eq("2016-11-12 01:55:49.908529", string(buf, format_time_to(buf, 1478915749908529)));
+    expect_eq("at 2016-11-12 01:55:49.908529", std::format("at {}", FormattedTime{1478915749908529}));
   }
 
   fwrite_fmt(stdout, "TimeTest: all tests passed\n");
@@ -33,18 +33,13 @@ inline CallOnDestroy on_close_scope(std::function<void()> f) {
 template <typename IntT>
 void parallel_range_default_progress_fn(IntT start_value, IntT end_value, IntT current_value, uint64_t start_time) {
   uint64_t elapsed_time = now() - start_time;
-  std::string elapsed_str = format_duration(elapsed_time);
-
-  std::string remaining_str;
   if (current_value) {
     uint64_t total_time = (elapsed_time * (end_value - start_value)) / (current_value - start_value);
     uint64_t remaining_time = total_time - elapsed_time;
-    remaining_str = format_duration(remaining_time);
+    fwrite_fmt(stderr, "... {:08X} ({} / {})\r", current_value, FormattedDuration{elapsed_time}, FormattedDuration{remaining_time});
   } else {
-    remaining_str = "...";
+    fwrite_fmt(stderr, "... {:08X} ({} / ...)\r", current_value, FormattedDuration{elapsed_time});
   }
-
-  fwritex(stderr, std::format("... {:08X} ({} / {})\r", current_value, elapsed_str, remaining_str));
 }
 
 template <typename IntT>